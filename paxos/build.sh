@@ -1,7 +1,12 @@
 #!/bin/bash
 
 CC=gcc
-CCOPTS="-Wall"
+CCOPTS="-Wall -pthread"
 
-$CC $CCOPTS paxos-server.c paxos.c net.c -o paxos-server
-$CC $CCOPTS paxos-client.c paxos.c net.c -o paxos-client
+$CC $CCOPTS paxos-server.c paxos.c message.c value.c log.c wal.c net.c clock.c timer.c eloop.c membership.c kv.c pending.c snapshot.c stats.c histogram.c trace.c -o paxos-server
+$CC $CCOPTS paxos-client.c client.c message.c value.c net.c clock.c timer.c eloop.c kv.c -o paxos-client
+$CC $CCOPTS -O2 paxos-bench.c client.c histogram.c message.c value.c net.c clock.c timer.c eloop.c kv.c -o paxos-bench
+$CC $CCOPTS -O2 message-bench.c message.c value.c -o message-bench
+$CC $CCOPTS -O2 paxos-sim.c paxos.c message.c value.c log.c wal.c clock.c timer.c snapshot.c stats.c histogram.c trace.c -o paxos-sim
+$CC $CCOPTS paxos-trace.c message.c value.c -o paxos-trace
+$CC $CCOPTS wal-test.c wal.c value.c -o wal-test
@@ -0,0 +1,257 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <sys/random.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "client.h"
+
+/* The server is the only peer of the transport */
+#define __SERVER_PEER             (0)
+
+#define __request_slot(self, id)  ((id) & ((self)->capacity - 1))
+
+/*
+ * The server remembers the results by (address, port, request id) for a
+ * while: a new client on a recycled port must not reuse the ids of the
+ * previous one. Random high bits, the low bits are the slot.
+ */
+static uint64_t __request_id_base (uint32_t capacity) {
+  uint64_t base;
+
+  if (getrandom(&base, sizeof(base), 0) != sizeof(base)) {
+    base = paxos_clock_update() ^ ((uint64_t)getpid() << 32) ^ (uintptr_t)&base;
+    base ^= base >> 33;
+    base *= 0xff51afd7ed558ccdull;
+    base ^= base >> 33;
+  }
+  return(base & ~((uint64_t)capacity - 1));
+}
+
+static int __request_send (paxos_client_t *self, paxos_client_request_t *request) {
+  paxos_message_t message;
+  const uint8_t *frame;
+  uint32_t size;
+
+  memset(&message, 0, sizeof(paxos_message_t));
+  message.type = request->type;
+  message.group_id = self->group_id;
+  message.request_id = request->request_id;
+  paxos_value_ref(&(message.value), &(request->command));
+
+  /* The command has headroom, the header goes right in front of it */
+  if ((frame = paxos_message_frame(&message, self->send_buffer, &size)) == NULL)
+    return(-1);
+
+  paxos_timeout_start(&(request->timeout));
+  return(udp_transport_send(&(self->transport), __SERVER_PEER, frame, size));
+}
+
+/* The slot goes back in the free list, with the id of its next use */
+static void __request_release (paxos_client_t *self, paxos_client_request_t *request) {
+  paxos_timeout_stop(&(request->timeout));
+  paxos_value_clear(&(request->command));
+  request->in_use = 0;
+  request->request_id += self->capacity;
+  request->next_free = self->free_head;
+  self->free_head = __request_slot(self, request->request_id);
+  self->num_pending--;
+}
+
+static void __on_request_timeout (void *arg) {
+  paxos_client_request_t *request = (paxos_client_request_t *)arg;
+  paxos_client_t *self = request->client;
+
+  if (request->retries < self->max_retries) {
+    request->retries++;
+    self->stats.retries++;
+    __request_send(self, request);
+    return;
+  }
+
+  self->stats.timeouts++;
+  self->callback(self->arg, request, PAXOS_CLIENT_TIMEOUT, NULL);
+  __request_release(self, request);
+}
+
+/* Match the replies to their requests, a callback may submit again */
+static void __on_net_ready (void *arg) {
+  paxos_client_t *self = (paxos_client_t *)arg;
+  paxos_client_request_t *request;
+  paxos_message_t message;
+  udp_client_t sender;
+  const uint8_t *frame;
+  uint32_t size;
+  int i, n;
+
+  n = udp_transport_recv(&(self->transport));
+  for (i = 0; i < n; ++i) {
+    frame = udp_transport_datagram(&(self->transport), i, &sender, &size);
+    if (paxos_message_decode(&message, frame, size) ||
+        (message.type != PAXOS_USER_LEARN_VALUE &&
+         message.type != PAXOS_USER_STATS))
+    {
+      continue;
+    }
+
+    request = &(self->requests[__request_slot(self, message.request_id)]);
+    if (!request->in_use || request->request_id != message.request_id ||
+        (request->type == PAXOS_USER_STATS) != (message.type == PAXOS_USER_STATS))
+    {
+      self->stats.stale_replies++;
+      continue;
+    }
+
+    self->stats.completed++;
+    self->callback(self->arg, request, PAXOS_CLIENT_OK, &message);
+    __request_release(self, request);
+  }
+}
+
+int paxos_client_open (paxos_client_t *self,
+                       paxos_eloop_t *eloop,
+                       const char *host,
+                       unsigned short port,
+                       uint16_t group_id,
+                       uint32_t capacity,
+                       paxos_client_callback_t callback,
+                       void *arg)
+{
+  paxos_client_request_t *request;
+  uint64_t base;
+  uint32_t i;
+
+  memset(self, 0, sizeof(paxos_client_t));
+
+  /* Round up, the slot is the low bits of the request id */
+  self->capacity = 1;
+  while (self->capacity < capacity)
+    self->capacity <<= 1;
+
+  self->requests = (paxos_client_request_t *) calloc(self->capacity,
+                                                     sizeof(paxos_client_request_t));
+  if (self->requests == NULL)
+    return(-1);
+
+  if (udp_transport_open(&(self->transport), 0, UDP_TRANSPORT_BATCHING)) {
+    free(self->requests);
+    return(-2);
+  }
+
+  if (udp_transport_add_peer(&(self->transport), __SERVER_PEER, host, port)) {
+    paxos_client_close(self);
+    return(-3);
+  }
+
+  base = __request_id_base(self->capacity);
+  for (i = 0; i < self->capacity; ++i) {
+    request = &(self->requests[i]);
+    request->client = self;
+    request->request_id = base + i;
+    request->next_free = i + 1;
+    paxos_value_init(&(request->command));
+    paxos_timeout_init(&(request->timeout), PAXOS_CLIENT_DEFAULT_TIMEOUT,
+                       __on_request_timeout, request);
+    paxos_timeout_attach(&(request->timeout), paxos_eloop_timers(eloop));
+  }
+
+  self->eloop = eloop;
+  self->group_id = group_id;
+  self->timeout = PAXOS_CLIENT_DEFAULT_TIMEOUT;
+  self->max_retries = PAXOS_CLIENT_MAX_RETRIES;
+  self->callback = callback;
+  self->arg = arg;
+
+  self->handler.fd = udp_transport_fd(&(self->transport));
+  self->handler.callback = __on_net_ready;
+  self->handler.arg = self;
+  if (paxos_eloop_add(eloop, &(self->handler))) {
+    paxos_client_close(self);
+    return(-4);
+  }
+  return(0);
+}
+
+/* The requests still out are dropped, without calling back */
+void paxos_client_close (paxos_client_t *self) {
+  uint32_t i;
+
+  if (self->eloop != NULL)
+    paxos_eloop_del(self->eloop, &(self->handler));
+
+  if (self->requests != NULL) {
+    for (i = 0; i < self->capacity; ++i) {
+      paxos_timeout_stop(&(self->requests[i].timeout));
+      paxos_value_free(&(self->requests[i].command));
+    }
+    free(self->requests);
+    self->requests = NULL;
+  }
+
+  udp_transport_close(&(self->transport));
+  self->eloop = NULL;
+}
+
+static paxos_client_request_t *__request_submit (paxos_client_t *self,
+                                                 uint8_t type,
+                                                 const paxos_value_t *command,
+                                                 void *arg)
+{
+  paxos_client_request_t *request;
+
+  if (paxos_client_is_full(self))
+    return(NULL);
+
+  request = &(self->requests[self->free_head]);
+  if (paxos_value_copy(&(request->command), command))
+    return(NULL);
+
+  self->free_head = request->next_free;
+  self->num_pending++;
+  self->stats.submitted++;
+
+  request->in_use = 1;
+  request->type = type;
+  request->retries = 0;
+  request->start_time = paxos_time_now_usec();
+  request->arg = arg;
+  request->timeout.timeout = self->timeout;
+  __request_send(self, request);
+  return(request);
+}
+
+/* Send a command (an encoded kv command), NULL if the table is full */
+paxos_client_request_t *paxos_client_submit (paxos_client_t *self,
+                                             const paxos_value_t *command,
+                                             void *arg)
+{
+  return(__request_submit(self, PAXOS_USER_PROPOSE_VALUE, command, arg));
+}
+
+/* Ask the server the stats of the group, the reply value is the text */
+paxos_client_request_t *paxos_client_submit_stats (paxos_client_t *self, void *arg) {
+  paxos_value_t empty;
+
+  paxos_value_init(&empty);
+  return(__request_submit(self, PAXOS_USER_STATS, &empty, arg));
+}
+
+int paxos_client_flush (paxos_client_t *self) {
+  return(udp_transport_flush(&(self->transport)));
+}
@@ -0,0 +1,124 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef _PAXOS_CLIENT_H_
+#define _PAXOS_CLIENT_H_
+
+#include <stdint.h>
+
+#include "message.h"
+#include "eloop.h"
+#include "net.h"
+
+/*
+ * Asynchronous client: many requests out on a single socket, each one
+ * with its own request id, the server echoes it in the reply.
+ *
+ * The requests live in a table of capacity slots (a power of 2), the low
+ * bits of the request id are the slot and the high bits count the reuses
+ * of the slot, from a random start per client: a reply is matched in O(1),
+ * a late reply of a request already gone doesn't match anymore. A request
+ * not answered within timeout msec is sent again, with the same id, up to
+ * max_retries times.
+ *
+ * The client runs in the caller event loop. The replies and the timeouts
+ * call the callback from there, the sends are queued until
+ * paxos_client_flush(): once per loop iteration, like the server.
+ */
+#define PAXOS_CLIENT_DEFAULT_TIMEOUT  (1000)  /* msec */
+#define PAXOS_CLIENT_MAX_RETRIES      (3)
+
+typedef struct paxos_client_request paxos_client_request_t;
+typedef struct paxos_client_stats paxos_client_stats_t;
+typedef struct paxos_client paxos_client_t;
+
+enum paxos_client_status {
+  PAXOS_CLIENT_OK       = 0,
+  PAXOS_CLIENT_TIMEOUT  = 1,            /* No reply after max_retries */
+};
+
+/* reply is NULL on timeout, its value is valid only during the call */
+typedef void (*paxos_client_callback_t) (void *arg,
+                                         paxos_client_request_t *request,
+                                         int status,
+                                         const paxos_message_t *reply);
+
+struct paxos_client_request {
+  paxos_client_t *client;
+  paxos_value_t command;              /* Kept for the retries */
+  paxos_timeout_t timeout;
+  uint64_t request_id;
+  uint64_t start_time;                /* usec, of the submit. Can be moved back */
+  uint32_t retries;
+  uint32_t next_free;
+  uint8_t type;                       /* PAXOS_USER_PROPOSE_VALUE or PAXOS_USER_STATS */
+  uint8_t in_use;
+  void *arg;
+};
+
+struct paxos_client_stats {
+  uint64_t submitted;
+  uint64_t completed;
+  uint64_t retries;
+  uint64_t timeouts;
+  uint64_t stale_replies;             /* Late, duplicated or unknown */
+};
+
+struct paxos_client {
+  udp_transport_t transport;
+  paxos_eloop_t *eloop;
+  paxos_eloop_handler_t handler;
+  paxos_client_request_t *requests;
+  uint32_t capacity;
+  uint32_t free_head;
+  uint32_t num_pending;
+  uint32_t timeout;                   /* msec */
+  uint32_t max_retries;
+  uint16_t group_id;
+  paxos_client_callback_t callback;
+  void *arg;
+  paxos_client_stats_t stats;
+  uint8_t send_buffer[PAXOS_MESSAGE_MAX_SIZE];
+};
+
+#define paxos_client_pending(self)      ((self)->num_pending)
+#define paxos_client_is_full(self)      ((self)->num_pending == (self)->capacity)
+
+#define paxos_client_set_timeout(self, msec, retries)                       \
+  do {                                                                      \
+    (self)->timeout = (msec);                                               \
+    (self)->max_retries = (retries);                                        \
+  } while (0)
+
+int   paxos_client_open   (paxos_client_t *self,
+                           paxos_eloop_t *eloop,
+                           const char *host,
+                           unsigned short port,
+                           uint16_t group_id,
+                           uint32_t capacity,
+                           paxos_client_callback_t callback,
+                           void *arg);
+void  paxos_client_close  (paxos_client_t *self);
+paxos_client_request_t *
+      paxos_client_submit (paxos_client_t *self,
+                           const paxos_value_t *command,
+                           void *arg);
+paxos_client_request_t *
+      paxos_client_submit_stats (paxos_client_t *self,
+                                 void *arg);
+int   paxos_client_flush  (paxos_client_t *self);
+
+#endif /* !_PAXOS_CLIENT_H_ */
@@ -0,0 +1,45 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include "clock.h"
+
+static __thread uint64_t __clock_usec = 0;
+static __thread uint8_t __clock_is_virtual = 0;
+
+/* Read the clock (vDSO, no syscall) and cache it, returns usec */
+uint64_t paxos_clock_update (void) {
+  struct timespec ts;
+
+  if (__clock_is_virtual)
+    return(__clock_usec);
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  __clock_usec = ts.tv_sec * 1000000ull + (ts.tv_nsec / 1000);
+  return(__clock_usec);
+}
+
+uint64_t paxos_time_now_usec (void) {
+  return(__clock_usec ? __clock_usec : paxos_clock_update());
+}
+
+/* From now on the time of this thread moves only when set, e.g. a simulation */
+void paxos_clock_set (uint64_t usec) {
+  __clock_usec = usec;
+  __clock_is_virtual = 1;
+}
@@ -0,0 +1,37 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef _PAXOS_CLOCK_H_
+#define _PAXOS_CLOCK_H_
+
+#include <stdint.h>
+
+/*
+ * Monotonic clock, cached per thread. The event loop updates it once per
+ * iteration, everything running in that iteration (handlers, timeouts)
+ * sees the same "now" without reading the clock again.
+ * Code that polls without a loop calls paxos_clock_update() itself.
+ *
+ * paxos_clock_set() replaces the clock of the thread with a virtual one,
+ * only the caller moves it: the simulator runs a cluster on it.
+ */
+uint64_t  paxos_clock_update    (void);
+uint64_t  paxos_time_now_usec   (void);
+void      paxos_clock_set       (uint64_t usec);
+
+#define paxos_time_now()        (paxos_time_now_usec() / 1000)
+
+#endif /* !_PAXOS_CLOCK_H_ */
@@ -0,0 +1,86 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "eloop.h"
+
+int paxos_eloop_open (paxos_eloop_t *self) {
+  if ((self->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    return(-1);
+
+  paxos_timer_wheel_init(&(self->timers), paxos_clock_update() / 1000);
+  return(0);
+}
+
+void paxos_eloop_close (paxos_eloop_t *self) {
+  if (self->epfd >= 0) {
+    close(self->epfd);
+    self->epfd = -1;
+  }
+}
+
+/* The handler is owned by the caller, and must stay alive until removed */
+int paxos_eloop_add (paxos_eloop_t *self, paxos_eloop_handler_t *handler) {
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(struct epoll_event));
+  event.events = EPOLLIN;
+  event.data.ptr = handler;
+  return(epoll_ctl(self->epfd, EPOLL_CTL_ADD, handler->fd, &event));
+}
+
+int paxos_eloop_del (paxos_eloop_t *self, paxos_eloop_handler_t *handler) {
+  struct epoll_event event;
+  return(epoll_ctl(self->epfd, EPOLL_CTL_DEL, handler->fd, &event));
+}
+
+/*
+ * Wait for the ready fds (at most max_wait msec, or until the next timeout),
+ * run their callbacks, then fire the expired timeouts. The clock is read
+ * once on wakeup, callbacks and timeouts share that time.
+ * Returns the number of ready fds, or -1 on error.
+ */
+int paxos_eloop_run_once (paxos_eloop_t *self, int max_wait) {
+  struct epoll_event events[PAXOS_ELOOP_MAX_EVENTS];
+  paxos_eloop_handler_t *handler;
+  int wait;
+  int i, n;
+
+  wait = paxos_timer_wheel_next(&(self->timers), paxos_time_now());
+  if (wait < 0 || (max_wait >= 0 && max_wait < wait))
+    wait = max_wait;
+
+  if ((n = epoll_wait(self->epfd, events, PAXOS_ELOOP_MAX_EVENTS, wait)) < 0) {
+    if (errno != EINTR)
+      return(-1);
+    n = 0;
+  }
+
+  /* The only clock read of the iteration */
+  paxos_clock_update();
+
+  for (i = 0; i < n; ++i) {
+    handler = (paxos_eloop_handler_t *)events[i].data.ptr;
+    handler->callback(handler->arg);
+  }
+
+  paxos_timer_wheel_advance(&(self->timers), paxos_time_now());
+  return(n);
+}
@@ -0,0 +1,54 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef _PAXOS_ELOOP_H_
+#define _PAXOS_ELOOP_H_
+
+#include "timer.h"
+
+/*
+ * epoll() based event loop: a callback per readable fd, and a timer wheel
+ * for the timeouts. The wait lasts until the next timeout of the wheel,
+ * so no timeout has to be polled.
+ */
+typedef struct paxos_eloop_handler paxos_eloop_handler_t;
+typedef struct paxos_eloop paxos_eloop_t;
+
+#define PAXOS_ELOOP_MAX_EVENTS      (64)
+
+struct paxos_eloop_handler {
+  int fd;
+  paxos_callback_t callback;          /* Called when fd is readable */
+  void *arg;
+};
+
+struct paxos_eloop {
+  int epfd;
+  paxos_timer_wheel_t timers;
+};
+
+#define paxos_eloop_timers(self)        (&((self)->timers))
+
+int   paxos_eloop_open      (paxos_eloop_t *self);
+void  paxos_eloop_close     (paxos_eloop_t *self);
+int   paxos_eloop_add       (paxos_eloop_t *self,
+                             paxos_eloop_handler_t *handler);
+int   paxos_eloop_del       (paxos_eloop_t *self,
+                             paxos_eloop_handler_t *handler);
+int   paxos_eloop_run_once  (paxos_eloop_t *self,
+                             int max_wait);
+
+#endif /* !_PAXOS_ELOOP_H_ */
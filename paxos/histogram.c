@@ -0,0 +1,103 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <string.h>
+
+#include "histogram.h"
+
+#define __SUB_MASK      (PAXOS_HISTOGRAM_SUB_BUCKETS - 1)
+
+/* The exponent picks the group, the bits after the msb the bucket in it */
+static uint32_t __bucket_index (uint64_t value) {
+  uint32_t shift;
+  uint32_t index;
+
+  if (value < PAXOS_HISTOGRAM_SUB_BUCKETS)
+    return((uint32_t)value);
+
+  shift = (63 - __builtin_clzll(value)) - PAXOS_HISTOGRAM_SUB_BITS;
+  index = ((shift + 1) << PAXOS_HISTOGRAM_SUB_BITS) + ((value >> shift) & __SUB_MASK);
+  return(index < PAXOS_HISTOGRAM_BUCKETS ? index : PAXOS_HISTOGRAM_BUCKETS - 1);
+}
+
+/* The highest value that falls in the bucket */
+static uint64_t __bucket_value (uint32_t index) {
+  uint32_t shift;
+
+  if (index < PAXOS_HISTOGRAM_SUB_BUCKETS)
+    return(index);
+
+  shift = (index >> PAXOS_HISTOGRAM_SUB_BITS) - 1;
+  return(((uint64_t)(PAXOS_HISTOGRAM_SUB_BUCKETS + (index & __SUB_MASK)) << shift) +
+         ((1ull << shift) - 1));
+}
+
+void paxos_histogram_reset (paxos_histogram_t *self) {
+  memset(self, 0, sizeof(paxos_histogram_t));
+  self->min = UINT64_MAX;
+}
+
+void paxos_histogram_add (paxos_histogram_t *self, uint64_t value) {
+  self->buckets[__bucket_index(value)]++;
+  self->count++;
+  self->sum += value;
+  if (value < self->min) self->min = value;
+  if (value > self->max) self->max = value;
+}
+
+void paxos_histogram_merge (paxos_histogram_t *self, const paxos_histogram_t *other) {
+  uint32_t i;
+
+  for (i = 0; i < PAXOS_HISTOGRAM_BUCKETS; ++i)
+    self->buckets[i] += other->buckets[i];
+  self->count += other->count;
+  self->sum += other->sum;
+  if (other->min < self->min) self->min = other->min;
+  if (other->max > self->max) self->max = other->max;
+}
+
+/* The value below which percentile% of the samples fall (0 < percentile <= 100) */
+uint64_t paxos_histogram_percentile (const paxos_histogram_t *self, double percentile) {
+  uint64_t target;
+  uint64_t seen;
+  uint32_t i;
+
+  if (self->count == 0)
+    return(0);
+
+  target = (uint64_t)(self->count * (percentile / 100.0) + 0.5);
+  if (target == 0)
+    target = 1;
+
+  seen = 0;
+  for (i = 0; i < PAXOS_HISTOGRAM_BUCKETS; ++i) {
+    seen += self->buckets[i];
+    if (seen >= target) {
+      uint64_t value = __bucket_value(i);
+      return(value < self->max ? value : self->max);
+    }
+  }
+  return(self->max);
+}
+
+void paxos_histogram_dump (const paxos_histogram_t *self, FILE *stream, const char *name) {
+  fprintf(stream, "%s: count %lu min %lu mean %.1f p50 %lu p99 %lu p999 %lu max %lu\n",
+          name, self->count, self->count ? self->min : 0, paxos_histogram_mean(self),
+          paxos_histogram_percentile(self, 50.0),
+          paxos_histogram_percentile(self, 99.0),
+          paxos_histogram_percentile(self, 99.9),
+          self->max);
+}
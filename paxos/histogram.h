@@ -0,0 +1,62 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef _PAXOS_HISTOGRAM_H_
+#define _PAXOS_HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * HDR-style histogram: log-linear buckets with a fixed relative error.
+ * The values below PAXOS_HISTOGRAM_SUB_BUCKETS have a bucket each, then
+ * every power of two is split in PAXOS_HISTOGRAM_SUB_BUCKETS buckets
+ * (~3% error). Recording is a couple of instructions, no allocation.
+ *
+ * Values past PAXOS_HISTOGRAM_MAX_BITS (usec: ~12 days) go in the last bucket.
+ */
+#define PAXOS_HISTOGRAM_SUB_BITS      (5)
+#define PAXOS_HISTOGRAM_SUB_BUCKETS   (1 << PAXOS_HISTOGRAM_SUB_BITS)
+#define PAXOS_HISTOGRAM_MAX_BITS      (40)
+#define PAXOS_HISTOGRAM_BUCKETS       ((PAXOS_HISTOGRAM_MAX_BITS -              \
+                                        PAXOS_HISTOGRAM_SUB_BITS + 1) *         \
+                                       PAXOS_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct paxos_histogram paxos_histogram_t;
+
+struct paxos_histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[PAXOS_HISTOGRAM_BUCKETS];
+};
+
+void      paxos_histogram_reset       (paxos_histogram_t *self);
+void      paxos_histogram_add         (paxos_histogram_t *self,
+                                       uint64_t value);
+void      paxos_histogram_merge       (paxos_histogram_t *self,
+                                       const paxos_histogram_t *other);
+uint64_t  paxos_histogram_percentile  (const paxos_histogram_t *self,
+                                       double percentile);
+void      paxos_histogram_dump        (const paxos_histogram_t *self,
+                                       FILE *stream,
+                                       const char *name);
+
+#define paxos_histogram_mean(self)                                          \
+  ((self)->count ? (double)(self)->sum / (self)->count : 0.0)
+
+#endif /* !_PAXOS_HISTOGRAM_H_ */
@@ -0,0 +1,444 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "kv.h"
+
+#define KV_ENTRY_EMPTY        (0)
+#define KV_ENTRY_USED         (1)
+#define KV_ENTRY_DELETED      (2)
+
+#define KV_MIN_CAPACITY       (64)
+
+/* Grow before the probe sequences get long: 3/4 of the slots, tombstones too */
+#define __kv_needs_grow(self)   (((self)->used + 1) * 4 > (self)->capacity * 3)
+
+#define __entry_key(entry)      ((entry)->data)
+#define __entry_value(entry)    ((entry)->data + (entry)->key_size)
+
+/* ============================================================================
+ *  Encoding
+ */
+static inline uint8_t *__put_u16 (uint8_t *p, uint16_t v) {
+  p[0] = v & 0xff;
+  p[1] = v >> 8;
+  return(p + 2);
+}
+
+static inline uint8_t *__put_u32 (uint8_t *p, uint32_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = v >> 24;
+  return(p + 4);
+}
+
+static inline uint16_t __get_u16 (const uint8_t *p) {
+  return(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t __get_u32 (const uint8_t *p) {
+  return(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+int paxos_kv_command_encode (const paxos_kv_command_t *command, paxos_value_t *value) {
+  uint64_t size;
+  uint8_t *p;
+
+  size = PAXOS_KV_COMMAND_HEADER_SIZE + (uint64_t)command->key_size +
+         command->value_size + command->expected_size;
+  if (size > PAXOS_VALUE_MAX_SIZE || paxos_value_reserve(value, size))
+    return(-1);
+
+  p = value->data;
+  *p++ = command->op;
+  p = __put_u16(p, command->key_size);
+  p = __put_u32(p, command->value_size);
+  p = __put_u32(p, command->expected_size);
+  memcpy(p, command->key, command->key_size);
+  p += command->key_size;
+  if (command->value_size > 0)
+    memcpy(p, command->value, command->value_size);
+  p += command->value_size;
+  if (command->expected_size > 0)
+    memcpy(p, command->expected, command->expected_size);
+  value->size = size;
+  return(0);
+}
+
+/* The command points into buffer, returns -1 if it is malformed */
+int paxos_kv_command_decode (paxos_kv_command_t *command,
+                             const uint8_t *buffer,
+                             uint32_t size)
+{
+  if (size < PAXOS_KV_COMMAND_HEADER_SIZE)
+    return(-1);
+
+  command->op = buffer[0];
+  command->key_size = __get_u16(buffer + 1);
+  command->value_size = __get_u32(buffer + 3);
+  command->expected_size = __get_u32(buffer + 7);
+  if ((uint64_t)command->key_size + command->value_size + command->expected_size !=
+      size - PAXOS_KV_COMMAND_HEADER_SIZE)
+  {
+    return(-1);
+  }
+
+  command->key = buffer + PAXOS_KV_COMMAND_HEADER_SIZE;
+  command->value = command->key + command->key_size;
+  command->expected = command->value + command->value_size;
+  return(0);
+}
+
+static int __result_set (paxos_value_t *result,
+                         uint8_t status,
+                         const uint8_t *value,
+                         uint32_t size)
+{
+  uint8_t *p;
+
+  if (paxos_value_reserve(result, PAXOS_KV_RESULT_HEADER_SIZE + size))
+    return(-1);
+
+  p = result->data;
+  *p++ = status;
+  p = __put_u32(p, size);
+  if (size > 0)
+    memcpy(p, value, size);
+  result->size = PAXOS_KV_RESULT_HEADER_SIZE + size;
+  return(0);
+}
+
+/* The value is a view into result */
+int paxos_kv_result_decode (const paxos_value_t *result,
+                            uint8_t *status,
+                            paxos_value_t *value)
+{
+  uint32_t size;
+
+  if (result->size < PAXOS_KV_RESULT_HEADER_SIZE)
+    return(-1);
+
+  size = __get_u32(result->data + 1);
+  if (size != result->size - PAXOS_KV_RESULT_HEADER_SIZE)
+    return(-1);
+
+  *status = result->data[0];
+  paxos_value_wrap(value, result->data + PAXOS_KV_RESULT_HEADER_SIZE, size);
+  return(0);
+}
+
+/* ============================================================================
+ *  Hash Table
+ */
+static uint32_t __kv_hash (const uint8_t *key, uint16_t size) {
+  uint32_t hash = 2166136261u;
+  while (size--) {
+    hash ^= *key++;
+    hash *= 16777619u;
+  }
+  return(hash);
+}
+
+/*
+ * Returns the entry of key, or the slot to insert it at (the first
+ * tombstone on the way, or the empty slot ending the probe sequence).
+ */
+static paxos_kv_entry_t *__kv_lookup (const paxos_kv_t *self,
+                                      const uint8_t *key,
+                                      uint16_t key_size,
+                                      uint32_t hash)
+{
+  paxos_kv_entry_t *tombstone = NULL;
+  paxos_kv_entry_t *entry;
+  uint32_t mask = self->capacity - 1;
+  uint32_t i;
+
+  for (i = hash & mask; ; i = (i + 1) & mask) {
+    entry = &(self->entries[i]);
+    if (entry->state == KV_ENTRY_EMPTY)
+      return(tombstone != NULL ? tombstone : entry);
+
+    if (entry->state == KV_ENTRY_DELETED) {
+      if (tombstone == NULL)
+        tombstone = entry;
+    } else if (entry->hash == hash && entry->key_size == key_size &&
+               !memcmp(__entry_key(entry), key, key_size))
+    {
+      return(entry);
+    }
+  }
+}
+
+/* Rehash the live keys in a table sized for them, tombstones are dropped */
+static int __kv_resize (paxos_kv_t *self) {
+  paxos_kv_entry_t *entries = self->entries;
+  uint32_t capacity = self->capacity;
+  paxos_kv_entry_t *entry;
+  uint32_t i;
+
+  self->capacity = KV_MIN_CAPACITY;
+  while ((self->count + 1) * 2 > self->capacity)
+    self->capacity <<= 1;
+
+  self->entries = (paxos_kv_entry_t *) calloc(self->capacity, sizeof(paxos_kv_entry_t));
+  if (self->entries == NULL) {
+    self->entries = entries;
+    self->capacity = capacity;
+    return(-1);
+  }
+
+  for (i = 0; i < capacity; ++i) {
+    if (entries[i].state != KV_ENTRY_USED)
+      continue;
+    entry = __kv_lookup(self, __entry_key(&(entries[i])), entries[i].key_size,
+                        entries[i].hash);
+    memcpy(entry, &(entries[i]), sizeof(paxos_kv_entry_t));
+  }
+  self->used = self->count;
+  free(entries);
+  return(0);
+}
+
+int paxos_kv_open (paxos_kv_t *self, uint32_t capacity) {
+  memset(self, 0, sizeof(paxos_kv_t));
+  self->capacity = KV_MIN_CAPACITY;
+  while (self->capacity < capacity)
+    self->capacity <<= 1;
+
+  self->entries = (paxos_kv_entry_t *) calloc(self->capacity, sizeof(paxos_kv_entry_t));
+  return(self->entries != NULL ? 0 : -1);
+}
+
+void paxos_kv_close (paxos_kv_t *self) {
+  uint32_t i;
+  for (i = 0; i < self->capacity; ++i) {
+    if (self->entries[i].state == KV_ENTRY_USED)
+      free(self->entries[i].data);
+  }
+  free(self->entries);
+  memset(self, 0, sizeof(paxos_kv_t));
+}
+
+const uint8_t *paxos_kv_get (const paxos_kv_t *self,
+                             const uint8_t *key,
+                             uint16_t key_size,
+                             uint32_t *value_size)
+{
+  paxos_kv_entry_t *entry;
+
+  entry = __kv_lookup(self, key, key_size, __kv_hash(key, key_size));
+  if (entry->state != KV_ENTRY_USED)
+    return(NULL);
+
+  *value_size = entry->value_size;
+  return(__entry_value(entry));
+}
+
+static int __kv_put (paxos_kv_t *self,
+                     paxos_kv_entry_t *entry,
+                     uint32_t hash,
+                     const paxos_kv_command_t *command)
+{
+  uint8_t *data;
+
+  data = (uint8_t *) malloc(command->key_size + command->value_size);
+  if (data == NULL)
+    return(-1);
+
+  memcpy(data, command->key, command->key_size);
+  if (command->value_size > 0)
+    memcpy(data + command->key_size, command->value, command->value_size);
+
+  if (entry->state == KV_ENTRY_USED) {
+    free(entry->data);
+  } else {
+    if (entry->state == KV_ENTRY_EMPTY)
+      self->used++;
+    self->count++;
+  }
+
+  entry->data = data;
+  entry->hash = hash;
+  entry->key_size = command->key_size;
+  entry->value_size = command->value_size;
+  entry->state = KV_ENTRY_USED;
+  return(0);
+}
+
+static void __kv_delete (paxos_kv_t *self, paxos_kv_entry_t *entry) {
+  free(entry->data);
+  entry->data = NULL;
+  entry->state = KV_ENTRY_DELETED;
+  self->count--;
+}
+
+/* Apply the command, the result is written in result. Returns the status */
+int paxos_kv_apply (paxos_kv_t *self,
+                    const paxos_kv_command_t *command,
+                    paxos_value_t *result)
+{
+  paxos_kv_entry_t *entry;
+  uint8_t status;
+  uint32_t hash;
+
+  if (command->op == PAXOS_KV_PUT || command->op == PAXOS_KV_CAS) {
+    if (__kv_needs_grow(self) && __kv_resize(self)) {
+      __result_set(result, PAXOS_KV_NO_MEMORY, NULL, 0);
+      return(PAXOS_KV_NO_MEMORY);
+    }
+  }
+
+  hash = __kv_hash(command->key, command->key_size);
+  entry = __kv_lookup(self, command->key, command->key_size, hash);
+
+  status = PAXOS_KV_OK;
+  switch (command->op) {
+    case PAXOS_KV_GET:
+      if (entry->state != KV_ENTRY_USED) {
+        status = PAXOS_KV_NOT_FOUND;
+        break;
+      }
+      __result_set(result, status, __entry_value(entry), entry->value_size);
+      return(status);
+    case PAXOS_KV_CAS:
+      if (entry->state != KV_ENTRY_USED) {
+        status = PAXOS_KV_NOT_FOUND;
+        break;
+      }
+      if (entry->value_size != command->expected_size ||
+          memcmp(__entry_value(entry), command->expected, command->expected_size))
+      {
+        status = PAXOS_KV_CAS_FAILED;
+        __result_set(result, status, __entry_value(entry), entry->value_size);
+        return(status);
+      }
+      /* Fall through */
+    case PAXOS_KV_PUT:
+      if (__kv_put(self, entry, hash, command))
+        status = PAXOS_KV_NO_MEMORY;
+      break;
+    case PAXOS_KV_DELETE:
+      if (entry->state != KV_ENTRY_USED) {
+        status = PAXOS_KV_NOT_FOUND;
+        break;
+      }
+      __kv_delete(self, entry);
+      break;
+    default:
+      status = PAXOS_KV_INVALID;
+      break;
+  }
+
+  __result_set(result, status, NULL, 0);
+  return(status);
+}
+
+/* ============================================================================
+ *  Dump
+ */
+#define KV_DUMP_HEADER_SIZE       (4)
+#define KV_DUMP_ENTRY_SIZE        (2 + 4)
+
+uint64_t paxos_kv_dump_size (const paxos_kv_t *self) {
+  const paxos_kv_entry_t *entry;
+  uint64_t size = KV_DUMP_HEADER_SIZE;
+  uint32_t i;
+
+  for (i = 0; i < self->capacity; ++i) {
+    entry = &(self->entries[i]);
+    if (entry->state == KV_ENTRY_USED)
+      size += KV_DUMP_ENTRY_SIZE + entry->key_size + entry->value_size;
+  }
+  return(size);
+}
+
+/* buffer has room for paxos_kv_dump_size() bytes */
+void paxos_kv_dump (const paxos_kv_t *self, uint8_t *buffer) {
+  const paxos_kv_entry_t *entry;
+  uint8_t *p = buffer;
+  uint32_t i;
+
+  p = __put_u32(p, self->count);
+  for (i = 0; i < self->capacity; ++i) {
+    entry = &(self->entries[i]);
+    if (entry->state != KV_ENTRY_USED)
+      continue;
+
+    p = __put_u16(p, entry->key_size);
+    p = __put_u32(p, entry->value_size);
+    memcpy(p, entry->data, entry->key_size + entry->value_size);
+    p += entry->key_size + entry->value_size;
+  }
+}
+
+static int __kv_load_entries (paxos_kv_t *self,
+                              const uint8_t *p,
+                              const uint8_t *end,
+                              uint32_t count)
+{
+  paxos_kv_command_t command;
+  paxos_kv_entry_t *entry;
+  uint32_t hash;
+
+  memset(&command, 0, sizeof(paxos_kv_command_t));
+  command.op = PAXOS_KV_PUT;
+  while (count--) {
+    if ((uint64_t)(end - p) < KV_DUMP_ENTRY_SIZE)
+      return(-1);
+
+    command.key_size = __get_u16(p);
+    command.value_size = __get_u32(p + 2);
+    command.key = p + KV_DUMP_ENTRY_SIZE;
+    command.value = command.key + command.key_size;
+    p += KV_DUMP_ENTRY_SIZE;
+    if ((uint64_t)(end - p) < (uint64_t)command.key_size + command.value_size)
+      return(-1);
+    p += command.key_size + command.value_size;
+
+    hash = __kv_hash(command.key, command.key_size);
+    entry = __kv_lookup(self, command.key, command.key_size, hash);
+    if (__kv_put(self, entry, hash, &command))
+      return(-2);
+  }
+  return((p == end) ? 0 : -1);
+}
+
+/* Replace the table with the dump, left untouched if the dump is broken */
+int paxos_kv_load (paxos_kv_t *self, const uint8_t *buffer, uint64_t size) {
+  paxos_kv_t table;
+  uint32_t count;
+
+  if (size < KV_DUMP_HEADER_SIZE)
+    return(-1);
+
+  count = __get_u32(buffer);
+  if (count > size / KV_DUMP_ENTRY_SIZE || paxos_kv_open(&table, count * 2))
+    return(-2);
+
+  if (__kv_load_entries(&table, buffer + KV_DUMP_HEADER_SIZE, buffer + size, count)) {
+    paxos_kv_close(&table);
+    return(-3);
+  }
+
+  table.applied_id = self->applied_id;
+  paxos_kv_close(self);
+  memcpy(self, &table, sizeof(paxos_kv_t));
+  return(0);
+}
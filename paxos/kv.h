@@ -0,0 +1,114 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef _PAXOS_KV_H_
+#define _PAXOS_KV_H_
+
+#include <stdint.h>
+
+#include "value.h"
+
+/*
+ * Replicated key-value state machine: the commands are the items of the
+ * learned values, every replica applies them in paxos_id order and ends
+ * up with the same table.
+ *
+ * A command is encoded as (integers little-endian)
+ *    op:8 | key_size:16 | value_size:32 | expected_size:32 | key | value | expected
+ * and its result as
+ *    status:8 | value_size:32 | value
+ *
+ * The table is open addressing with linear probing, entries own a single
+ * buffer with the key followed by the value.
+ *
+ * A dump of the table (the snapshot of the state machine) is
+ *    count:32 | count * (key_size:16 | value_size:32 | key | value)
+ */
+typedef struct paxos_kv_command paxos_kv_command_t;
+typedef struct paxos_kv_entry paxos_kv_entry_t;
+typedef struct paxos_kv paxos_kv_t;
+
+enum paxos_kv_op {
+  PAXOS_KV_GET          = 1,
+  PAXOS_KV_PUT          = 2,
+  PAXOS_KV_DELETE       = 3,
+  PAXOS_KV_CAS          = 4,          /* PUT if the value is the expected one */
+};
+
+enum paxos_kv_status {
+  PAXOS_KV_OK           = 0,
+  PAXOS_KV_NOT_FOUND    = 1,
+  PAXOS_KV_CAS_FAILED   = 2,          /* The result has the current value */
+  PAXOS_KV_INVALID      = 3,
+  PAXOS_KV_NO_MEMORY    = 4,
+};
+
+#define PAXOS_KV_COMMAND_HEADER_SIZE    (1 + 2 + 4 + 4)
+#define PAXOS_KV_RESULT_HEADER_SIZE     (1 + 4)
+
+struct paxos_kv_command {
+  uint8_t op;
+  uint16_t key_size;
+  uint32_t value_size;
+  uint32_t expected_size;
+  const uint8_t *key;
+  const uint8_t *value;
+  const uint8_t *expected;
+};
+
+struct paxos_kv_entry {
+  uint8_t *data;                      /* key + value */
+  uint32_t hash;
+  uint32_t value_size;
+  uint16_t key_size;
+  uint8_t  state;
+};
+
+struct paxos_kv {
+  paxos_kv_entry_t *entries;
+  uint32_t capacity;                  /* Power of 2 */
+  uint32_t count;                     /* Live keys */
+  uint32_t used;                      /* Live keys + tombstones */
+  uint64_t applied_id;                /* paxos_id of the last command applied */
+};
+
+int         paxos_kv_command_encode (const paxos_kv_command_t *command,
+                                     paxos_value_t *value);
+int         paxos_kv_command_decode (paxos_kv_command_t *command,
+                                     const uint8_t *buffer,
+                                     uint32_t size);
+int         paxos_kv_result_decode  (const paxos_value_t *result,
+                                     uint8_t *status,
+                                     paxos_value_t *value);
+
+int         paxos_kv_open           (paxos_kv_t *self, uint32_t capacity);
+void        paxos_kv_close          (paxos_kv_t *self);
+int         paxos_kv_apply          (paxos_kv_t *self,
+                                     const paxos_kv_command_t *command,
+                                     paxos_value_t *result);
+const uint8_t * paxos_kv_get        (const paxos_kv_t *self,
+                                     const uint8_t *key,
+                                     uint16_t key_size,
+                                     uint32_t *value_size);
+
+uint64_t    paxos_kv_dump_size      (const paxos_kv_t *self);
+void        paxos_kv_dump           (const paxos_kv_t *self,
+                                     uint8_t *buffer);
+int         paxos_kv_load           (paxos_kv_t *self,
+                                     const uint8_t *buffer,
+                                     uint64_t size);
+
+#endif /* !_PAXOS_KV_H_ */
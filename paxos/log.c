@@ -0,0 +1,161 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+static void __free_segments (paxos_log_t *self) {
+  uint32_t i, j;
+  for (i = 0; i < self->num_segments; ++i) {
+    for (j = 0; j < PAXOS_LOG_SEGMENT_SIZE; ++j)
+      paxos_value_free(&(self->segments[i][j].value));
+    free(self->segments[i]);
+  }
+  self->num_segments = 0;
+}
+
+static int __add_segment (paxos_log_t *self) {
+  paxos_log_entry_t *segment;
+
+  if (self->num_segments == self->max_segments) {
+    paxos_log_entry_t **segments;
+    uint32_t max_segments;
+
+    max_segments = (self->max_segments > 0) ? self->max_segments << 1 : 16;
+    segments = (paxos_log_entry_t **) realloc(self->segments,
+                                      max_segments * sizeof(paxos_log_entry_t *));
+    if (segments == NULL)
+      return(-1);
+
+    self->segments = segments;
+    self->max_segments = max_segments;
+  }
+
+  segment = (paxos_log_entry_t *) calloc(PAXOS_LOG_SEGMENT_SIZE,
+                                         sizeof(paxos_log_entry_t));
+  if (segment == NULL)
+    return(-1);
+
+  self->segments[self->num_segments++] = segment;
+  return(0);
+}
+
+void paxos_log_open (paxos_log_t *self) {
+  self->segments = NULL;
+  self->num_segments = 0;
+  self->max_segments = 0;
+  self->base_paxos_id = 0;
+  self->first_paxos_id = 0;
+  self->next_paxos_id = 0;
+}
+
+void paxos_log_close (paxos_log_t *self) {
+  __free_segments(self);
+  free(self->segments);
+  self->segments = NULL;
+  self->max_segments = 0;
+}
+
+/* Drop everything, the next append will be paxos_id */
+void paxos_log_reset (paxos_log_t *self, uint64_t paxos_id) {
+  __free_segments(self);
+  self->base_paxos_id = paxos_id & ~((uint64_t)PAXOS_LOG_SEGMENT_MASK);
+  self->first_paxos_id = paxos_id;
+  self->next_paxos_id = paxos_id;
+}
+
+/* Drop the entries before paxos_id, the whole segments are released */
+void paxos_log_truncate (paxos_log_t *self, uint64_t paxos_id) {
+  uint64_t id, index;
+  uint32_t nfree, i;
+
+  if (paxos_id <= self->first_paxos_id)
+    return;
+
+  if (paxos_id >= self->next_paxos_id) {
+    paxos_log_reset(self, self->next_paxos_id);
+    return;
+  }
+
+  /* The entries left in the first segment */
+  for (id = self->first_paxos_id; id < paxos_id; ++id) {
+    index = id - self->base_paxos_id;
+    paxos_value_free(&(self->segments[index >> PAXOS_LOG_SEGMENT_SHIFT]
+                                     [index & PAXOS_LOG_SEGMENT_MASK].value));
+  }
+  self->first_paxos_id = paxos_id;
+
+  nfree = (paxos_id - self->base_paxos_id) >> PAXOS_LOG_SEGMENT_SHIFT;
+  if (nfree == 0)
+    return;
+
+  for (i = 0; i < nfree; ++i)
+    free(self->segments[i]);
+  memmove(self->segments, self->segments + nfree,
+          (self->num_segments - nfree) * sizeof(paxos_log_entry_t *));
+  self->num_segments -= nfree;
+  self->base_paxos_id += (uint64_t)nfree << PAXOS_LOG_SEGMENT_SHIFT;
+}
+
+int paxos_log_append (paxos_log_t *self,
+                      uint64_t paxos_id,
+                      paxos_value_t *value,
+                      uint32_t flags)
+{
+  paxos_log_entry_t *entry;
+  uint64_t index;
+
+  /* We've jumped ahead (catch-up), the old history is no longer contiguous */
+  if (paxos_id != self->next_paxos_id) {
+    if (paxos_id < self->next_paxos_id)
+      return(-1);
+    paxos_log_reset(self, paxos_id);
+  }
+
+  index = paxos_id - self->base_paxos_id;
+  if ((index >> PAXOS_LOG_SEGMENT_SHIFT) >= self->num_segments) {
+    if (__add_segment(self))
+      return(-2);
+  }
+
+  entry = &(self->segments[index >> PAXOS_LOG_SEGMENT_SHIFT]
+                          [index & PAXOS_LOG_SEGMENT_MASK]);
+  if (paxos_value_has_headroom(value)) {
+    paxos_value_swap(&(entry->value), value);
+    paxos_value_clear(value);
+  } else if (paxos_value_copy(&(entry->value), value)) {
+    return(-3);
+  }
+  entry->flags = flags;
+  self->next_paxos_id++;
+  return(0);
+}
+
+const paxos_log_entry_t *paxos_log_get (const paxos_log_t *self,
+                                        uint64_t paxos_id)
+{
+  uint64_t index;
+
+  if (!paxos_log_contains(self, paxos_id))
+    return(NULL);
+
+  index = paxos_id - self->base_paxos_id;
+  return(&(self->segments[index >> PAXOS_LOG_SEGMENT_SHIFT]
+                         [index & PAXOS_LOG_SEGMENT_MASK]));
+}
@@ -0,0 +1,73 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef _PAXOS_LOG_H_
+#define _PAXOS_LOG_H_
+
+#include <stdint.h>
+
+#include "value.h"
+
+/*
+ * Append-only log of the chosen values, keyed by paxos_id.
+ * Entries live in fixed-size segments, the segment table is the only thing
+ * that grows, so a lookup is just a shift and a mask away.
+ * Appending an owned value moves its buffer into the log, views are copied.
+ * Once a snapshot covers them, the old entries are truncated away a segment
+ * at a time, so the memory follows the distance from the last snapshot.
+ */
+#define PAXOS_LOG_SEGMENT_SHIFT     (12)
+#define PAXOS_LOG_SEGMENT_SIZE      (1 << PAXOS_LOG_SEGMENT_SHIFT)
+#define PAXOS_LOG_SEGMENT_MASK      (PAXOS_LOG_SEGMENT_SIZE - 1)
+
+typedef struct paxos_log_entry paxos_log_entry_t;
+typedef struct paxos_log paxos_log_t;
+
+struct paxos_log_entry {
+  paxos_value_t value;
+  uint32_t flags;
+  uint32_t __pad;
+};
+
+struct paxos_log {
+  paxos_log_entry_t **segments;
+  uint32_t num_segments;
+  uint32_t max_segments;
+  uint64_t base_paxos_id;             /* paxos_id of segments[0][0] */
+  uint64_t first_paxos_id;            /* First paxos_id stored */
+  uint64_t next_paxos_id;             /* Next paxos_id to append */
+};
+
+#define paxos_log_is_empty(self)                                            \
+  ((self)->first_paxos_id == (self)->next_paxos_id)
+
+#define paxos_log_contains(self, paxos_id)                                  \
+  ((paxos_id) >= (self)->first_paxos_id && (paxos_id) < (self)->next_paxos_id)
+
+void                paxos_log_open      (paxos_log_t *self);
+void                paxos_log_close     (paxos_log_t *self);
+void                paxos_log_reset     (paxos_log_t *self,
+                                         uint64_t paxos_id);
+void                paxos_log_truncate  (paxos_log_t *self,
+                                         uint64_t paxos_id);
+int                 paxos_log_append    (paxos_log_t *self,
+                                         uint64_t paxos_id,
+                                         paxos_value_t *value,
+                                         uint32_t flags);
+const paxos_log_entry_t *paxos_log_get  (const paxos_log_t *self,
+                                         uint64_t paxos_id);
+
+#endif /* !_PAXOS_LOG_H_ */
@@ -0,0 +1,88 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "membership.h"
+
+/* Returns 1 if the line has a member, 0 if it's blank, -1 if it's malformed */
+static int __parse_member (paxos_member_t *member, const char *line) {
+  unsigned long long node_id;
+  unsigned int port;
+  char extra;
+
+  while (*line == ' ' || *line == '\t')
+    line++;
+  if (*line == '\0' || *line == '\n' || *line == '#')
+    return(0);
+
+  if (sscanf(line, "%llu %255s %u %c", &node_id, member->host, &port, &extra) != 3)
+    return(-1);
+
+  if (node_id >= PAXOS_MAX_NODES || port == 0 || port > 0xffff)
+    return(-1);
+
+  member->node_id = node_id;
+  member->port = (unsigned short)port;
+  return(1);
+}
+
+/* Returns 0 on success, -1 if the file can't be read, -2 if it's invalid */
+int paxos_membership_load (paxos_membership_t *self, const char *path) {
+  paxos_member_t member;
+  char line[512];
+  unsigned int lineno;
+  FILE *fp;
+  int ret;
+
+  if ((fp = fopen(path, "r")) == NULL)
+    return(-1);
+
+  memset(self, 0, sizeof(paxos_membership_t));
+  lineno = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    lineno++;
+    if ((ret = __parse_member(&member, line)) == 0)
+      continue;
+
+    if (ret < 0 || paxos_membership_get(self, member.node_id) != NULL ||
+        self->num_members == PAXOS_MAX_NODES)
+    {
+      fprintf(stderr, "%s:%u: invalid or duplicate member\n", path, lineno);
+      fclose(fp);
+      return(-2);
+    }
+
+    memcpy(&(self->members[self->num_members++]), &member, sizeof(paxos_member_t));
+  }
+
+  fclose(fp);
+  return(self->num_members > 0 ? 0 : -2);
+}
+
+const paxos_member_t *paxos_membership_get (const paxos_membership_t *self,
+                                            uint64_t node_id)
+{
+  uint32_t i;
+  for (i = 0; i < self->num_members; ++i) {
+    if (self->members[i].node_id == node_id)
+      return(&(self->members[i]));
+  }
+  return(NULL);
+}
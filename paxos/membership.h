@@ -0,0 +1,51 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef _PAXOS_MEMBERSHIP_H_
+#define _PAXOS_MEMBERSHIP_H_
+
+#include <stdint.h>
+
+#include "paxos.h"
+
+/*
+ * The nodes of the cluster, loaded from a file with one node per line:
+ *    <node_id> <host> <port>
+ * Empty lines and lines starting with '#' are skipped.
+ * Node ids go from 0 to PAXOS_MAX_NODES - 1.
+ */
+typedef struct paxos_membership paxos_membership_t;
+typedef struct paxos_member paxos_member_t;
+
+#define PAXOS_MEMBER_HOST_SIZE      (256)
+
+struct paxos_member {
+  uint64_t node_id;
+  char host[PAXOS_MEMBER_HOST_SIZE];
+  unsigned short port;
+};
+
+struct paxos_membership {
+  paxos_member_t members[PAXOS_MAX_NODES];
+  uint32_t num_members;
+};
+
+int                     paxos_membership_load (paxos_membership_t *self,
+                                               const char *path);
+const paxos_member_t *  paxos_membership_get  (const paxos_membership_t *self,
+                                               uint64_t node_id);
+
+#endif /* !_PAXOS_MEMBERSHIP_H_ */
@@ -0,0 +1,108 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Encode + decode of the common messages, compared with the raw struct copy
+ * that used to go on the wire.
+ *   usage: message-bench [iterations]
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "message.h"
+
+static uint64_t __time_nsec (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+static void __message_init (paxos_message_t *message, uint8_t type, uint64_t i) {
+  memset(message, 0, sizeof(paxos_message_t));
+  message->type = type;
+  message->paxos_id = 1000000 + i;
+  message->node_id = 3;
+  message->proposal_id = (42 << 16) | 3;
+  message->accepted_proposal_id = (41 << 16) | 2;
+  message->promised_proposal_id = (43 << 16) | 1;
+}
+
+static void __bench (const char *name, uint8_t type, const paxos_value_t *value,
+                     unsigned long iterations)
+{
+  uint8_t buffer[PAXOS_MESSAGE_HEADER_MAX_SIZE + 256];
+  paxos_message_t message;
+  paxos_message_t decoded;
+  uint64_t raw_nsec, enc_nsec;
+  uint64_t checksum = 0;
+  uint32_t size = 0;
+  unsigned long i;
+  uint64_t t0;
+
+  /* Raw: the whole struct out and back in, in host order */
+  t0 = __time_nsec();
+  for (i = 0; i < iterations; ++i) {
+    __message_init(&message, type, i);
+    memcpy(buffer, &message, sizeof(paxos_message_t));
+    memcpy(buffer + sizeof(paxos_message_t), value->data, value->size);
+    memcpy(&decoded, buffer, sizeof(paxos_message_t));
+    checksum += decoded.paxos_id;
+  }
+  raw_nsec = __time_nsec() - t0;
+
+  /* Varint: only the fields of the type */
+  t0 = __time_nsec();
+  for (i = 0; i < iterations; ++i) {
+    __message_init(&message, type, i);
+    paxos_value_ref(&(message.value), value);
+    size = paxos_message_encode(&message, buffer, sizeof(buffer));
+    if (paxos_message_decode(&decoded, buffer, size)) {
+      fprintf(stderr, "%s: decode failed\n", name);
+      return;
+    }
+    checksum += decoded.paxos_id;
+  }
+  enc_nsec = __time_nsec() - t0;
+
+  printf("%-18s raw %3zu bytes %6.2fns/msg | varint %3u bytes %6.2fns/msg (%lx)\n",
+         name, sizeof(paxos_message_t), (double)raw_nsec / iterations,
+         size - value->size, (double)enc_nsec / iterations,
+         (unsigned long)(checksum & 0xf));
+}
+
+int main (int argc, char **argv) {
+  unsigned long iterations;
+  paxos_value_t empty;
+  paxos_value_t value;
+  uint8_t data[64];
+
+  iterations = (argc > 1) ? strtoul(argv[1], NULL, 10) : 10000000;
+  memset(data, 'x', sizeof(data));
+  paxos_value_init(&empty);
+  paxos_value_wrap(&value, data, sizeof(data));
+
+  __bench("bootstrap", PAXOS_BOOTSTRAP, &empty, iterations);
+  __bench("prepare-request", PAXOS_PREPARE_REQUEST, &empty, iterations);
+  __bench("propose-accepted", PAXOS_PROPOSE_ACCEPTED, &empty, iterations);
+  __bench("learn-proposal", PAXOS_LEARN_PROPOSAL, &empty, iterations);
+  __bench("propose-request", PAXOS_PROPOSE_REQUEST, &value, iterations);
+  __bench("prev-accepted", PAXOS_PREPARE_PREVIOUSLY_ACCEPTED, &value, iterations);
+  return(0);
+}
@@ -0,0 +1,304 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "message.h"
+
+const char *paxos_message_to_string (const paxos_message_t *message) {
+  switch (message->type) {
+    case PAXOS_PREPARE_REQUEST: return("prepare-request");
+    case PAXOS_PREPARE_REJECTED: return("prepare-rejected");
+    case PAXOS_PREPARE_PREVIOUSLY_ACCEPTED: return("prepared-previously-accepted");
+    case PAXOS_PREPARE_CURRENTLY_OPEN: return("prepare-currently-open");
+    case PAXOS_PROPOSE_REQUEST: return("propose-request");
+    case PAXOS_PROPOSE_REJECTED: return("propose-rejected");
+    case PAXOS_PROPOSE_ACCEPTED: return("propose-accepted");
+    case PAXOS_LEARN_PROPOSAL: return("learn-proposal");
+    case PAXOS_LEARN_VALUE: return("learn-value");
+    case PAXOS_REQUEST_CHOSEN: return("request-chosen");
+    case PAXOS_LEASE_RENEW: return("lease-renew");
+    case PAXOS_LEASE_GRANTED: return("lease-granted");
+    case PAXOS_FORWARD_VALUE: return("forward-value");
+    case PAXOS_READ_INDEX: return("read-index");
+    case PAXOS_READ_INDEX_REPLY: return("read-index-reply");
+    case PAXOS_BOOTSTRAP: return("bootstrap");
+    case PAXOS_CATCHUP_START: return("start-catchup");
+    case PAXOS_CATCHUP_REQUEST: return("catchup-request");
+    case PAXOS_CATCHUP_RESPONSE: return("catchup-response");
+    case PAXOS_SNAPSHOT_REQUEST: return("snapshot-request");
+    case PAXOS_SNAPSHOT_CHUNK: return("snapshot-chunk");
+    case PAXOS_USER_PROPOSE_VALUE: return("user-propoe-value");
+    case PAXOS_USER_LEARN_VALUE: return("user-learn-value");
+    case PAXOS_USER_STATS: return("user-stats");
+  }
+  return("");
+}
+
+/* ============================================================================
+ *  Wire format
+ */
+#define FIELD_PAXOS_ID          (1 << 0)
+#define FIELD_NODE_ID           (1 << 1)
+#define FIELD_PROPOSAL_ID       (1 << 2)
+#define FIELD_ACCEPTED_ID       (1 << 3)
+#define FIELD_PROMISED_ID       (1 << 4)
+#define FIELD_COUNT             (1 << 5)
+#define FIELD_VALUE             (1 << 6)
+#define FIELD_OFFSET            (1 << 7)
+#define FIELD_REQUEST_ID        (1 << 8)
+
+#define FIELDS_PAXOS            (FIELD_PAXOS_ID | FIELD_NODE_ID)
+#define FIELDS_PROPOSAL         (FIELDS_PAXOS | FIELD_PROPOSAL_ID)
+
+/* The fields carried by each message type, 0 is an unknown type */
+static uint16_t __message_fields (uint8_t type) {
+  switch (type) {
+    case PAXOS_PREPARE_REQUEST:             return(FIELDS_PROPOSAL);
+    case PAXOS_PREPARE_REJECTED:            return(FIELDS_PROPOSAL | FIELD_PROMISED_ID);
+    case PAXOS_PREPARE_PREVIOUSLY_ACCEPTED: return(FIELDS_PROPOSAL | FIELD_ACCEPTED_ID |
+                                                   FIELD_COUNT | FIELD_VALUE);
+    case PAXOS_PREPARE_CURRENTLY_OPEN:      return(FIELDS_PROPOSAL | FIELD_COUNT);
+    case PAXOS_PROPOSE_REQUEST:             return(FIELDS_PROPOSAL | FIELD_VALUE);
+    case PAXOS_PROPOSE_REJECTED:            return(FIELDS_PROPOSAL);
+    case PAXOS_PROPOSE_ACCEPTED:            return(FIELDS_PROPOSAL);
+    case PAXOS_LEARN_PROPOSAL:              return(FIELDS_PROPOSAL);
+    case PAXOS_LEARN_VALUE:                 return(FIELDS_PAXOS | FIELD_VALUE);
+    case PAXOS_REQUEST_CHOSEN:              return(FIELDS_PAXOS);
+    case PAXOS_LEASE_RENEW:                 return(FIELDS_PROPOSAL);
+    case PAXOS_LEASE_GRANTED:               return(FIELDS_PROPOSAL);
+    case PAXOS_FORWARD_VALUE:               return(FIELD_NODE_ID | FIELD_VALUE);
+    case PAXOS_READ_INDEX:                  return(FIELDS_PAXOS);
+    case PAXOS_READ_INDEX_REPLY:            return(FIELDS_PAXOS | FIELD_OFFSET);
+    case PAXOS_BOOTSTRAP:                   return(FIELD_NODE_ID);
+    case PAXOS_CATCHUP_START:               return(FIELDS_PAXOS);
+    case PAXOS_CATCHUP_REQUEST:             return(FIELDS_PAXOS | FIELD_COUNT);
+    case PAXOS_CATCHUP_RESPONSE:            return(FIELDS_PAXOS | FIELD_COUNT | FIELD_VALUE);
+    case PAXOS_SNAPSHOT_REQUEST:            return(FIELDS_PAXOS | FIELD_OFFSET);
+    case PAXOS_SNAPSHOT_CHUNK:              return(FIELDS_PAXOS | FIELD_OFFSET | FIELD_VALUE);
+    case PAXOS_USER_PROPOSE_VALUE:          return(FIELD_PAXOS_ID | FIELD_REQUEST_ID | FIELD_VALUE);
+    case PAXOS_USER_LEARN_VALUE:            return(FIELD_PAXOS_ID | FIELD_REQUEST_ID | FIELD_VALUE);
+    case PAXOS_USER_STATS:                  return(FIELD_REQUEST_ID | FIELD_VALUE);
+  }
+  return(0);
+}
+
+static inline uint8_t *__varint_encode (uint8_t *buf, uint64_t value) {
+  while (value >= 0x80) {
+    *buf++ = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  *buf++ = (uint8_t)value;
+  return(buf);
+}
+
+/* Returns NULL if the varint is truncated or longer than 64bit */
+static inline const uint8_t *__varint_decode (const uint8_t *buf,
+                                              const uint8_t *end,
+                                              uint64_t *value)
+{
+  uint64_t result = 0;
+  unsigned int shift;
+
+  /* Small ids and sizes are the common case */
+  if (buf < end && *buf < 0x80) {
+    *value = *buf;
+    return(buf + 1);
+  }
+
+  for (shift = 0; shift < 64 && buf < end; shift += 7) {
+    uint64_t byte = *buf++;
+    result |= (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return(buf);
+    }
+  }
+  return(NULL);
+}
+
+/* Returns the header size, or 0 if the message type is unknown */
+uint32_t paxos_message_encode_header (const paxos_message_t *message,
+                                      uint8_t *buffer)
+{
+  uint16_t fields;
+  uint8_t *p;
+
+  if (!(fields = __message_fields(message->type)))
+    return(0);
+
+  p = buffer;
+  *p++ = PAXOS_MESSAGE_VERSION;
+  *p++ = message->type;
+  *p++ = message->flags;
+  *p++ = (uint8_t)(message->group_id >> 8);
+  *p++ = (uint8_t)(message->group_id & 0xff);
+  if (fields & FIELD_PAXOS_ID)    p = __varint_encode(p, message->paxos_id);
+  if (fields & FIELD_NODE_ID)     p = __varint_encode(p, message->node_id);
+  if (fields & FIELD_PROPOSAL_ID) p = __varint_encode(p, message->proposal_id);
+  if (fields & FIELD_ACCEPTED_ID) p = __varint_encode(p, message->accepted_proposal_id);
+  if (fields & FIELD_PROMISED_ID) p = __varint_encode(p, message->promised_proposal_id);
+  if (fields & FIELD_COUNT)       p = __varint_encode(p, message->count);
+  if (fields & FIELD_OFFSET)      p = __varint_encode(p, message->offset);
+  if (fields & FIELD_REQUEST_ID)  p = __varint_encode(p, message->request_id);
+  if (fields & FIELD_VALUE)       p = __varint_encode(p, message->value.size);
+  return(p - buffer);
+}
+
+/* Header and value in one contiguous buffer, returns 0 if it doesn't fit */
+uint32_t paxos_message_encode (const paxos_message_t *message,
+                               uint8_t *buffer,
+                               uint32_t size)
+{
+  uint32_t hsize;
+
+  if (PAXOS_MESSAGE_HEADER_MAX_SIZE + message->value.size > size)
+    return(0);
+
+  if (!(hsize = paxos_message_encode_header(message, buffer)))
+    return(0);
+
+  if (message->value.size > 0)
+    memcpy(buffer + hsize, message->value.data, message->value.size);
+  return(hsize + message->value.size);
+}
+
+/*
+ * Build the frame to send. If the value has headroom the header is written
+ * right in front of the payload and the frame is the value buffer itself,
+ * otherwise everything is encoded in the given buffer
+ * (of at least PAXOS_MESSAGE_MAX_SIZE bytes).
+ */
+const uint8_t *paxos_message_frame (const paxos_message_t *message,
+                                    uint8_t *buffer,
+                                    uint32_t *size)
+{
+  uint8_t header[PAXOS_MESSAGE_HEADER_MAX_SIZE];
+  uint32_t hsize;
+  uint8_t *frame;
+
+  if (!paxos_value_has_headroom(&(message->value))) {
+    *size = paxos_message_encode(message, buffer, PAXOS_MESSAGE_MAX_SIZE);
+    return(*size > 0 ? buffer : NULL);
+  }
+
+  if (!(hsize = paxos_message_encode_header(message, header)))
+    return(NULL);
+
+  frame = message->value.data - hsize;
+  memcpy(frame, header, hsize);
+  *size = hsize + message->value.size;
+  return(frame);
+}
+
+/* Parse a frame, the message value points into buffer */
+int paxos_message_decode (paxos_message_t *message,
+                          const uint8_t *buffer,
+                          uint32_t size)
+{
+  const uint8_t *end = buffer + size;
+  const uint8_t *p = buffer;
+  uint64_t value_size;
+  uint64_t count;
+  uint16_t fields;
+
+  #define __decode_field(field, dst)                                        \
+    *(dst) = 0;                                                             \
+    if ((fields & (field)) && (p = __varint_decode(p, end, dst)) == NULL)   \
+      return(-3);
+
+  if (size < 5 || buffer[0] != PAXOS_MESSAGE_VERSION)
+    return(-1);
+
+  if (!(fields = __message_fields(buffer[1])))
+    return(-2);
+
+  message->type = buffer[1];
+  message->flags = buffer[2];
+  message->group_id = paxos_message_group(buffer);
+  p += 5;
+
+  __decode_field(FIELD_PAXOS_ID, &(message->paxos_id));
+  __decode_field(FIELD_NODE_ID, &(message->node_id));
+  __decode_field(FIELD_PROPOSAL_ID, &(message->proposal_id));
+  __decode_field(FIELD_ACCEPTED_ID, &(message->accepted_proposal_id));
+  __decode_field(FIELD_PROMISED_ID, &(message->promised_proposal_id));
+  __decode_field(FIELD_COUNT, &count);
+  __decode_field(FIELD_OFFSET, &(message->offset));
+  __decode_field(FIELD_REQUEST_ID, &(message->request_id));
+  __decode_field(FIELD_VALUE, &value_size);
+  #undef __decode_field
+
+  if (count > 0xffff || value_size > (uint64_t)(end - p))
+    return(-4);
+
+  message->count = (uint16_t)count;
+  paxos_value_wrap(&(message->value), p, (uint32_t)value_size);
+  return(0);
+}
+
+/* ============================================================================
+ *  Catch-up entries
+ */
+/* Append a chosen value to the batch, -1 if it would grow past max_size */
+int paxos_message_entry_add (paxos_value_t *batch,
+                             uint8_t flags,
+                             const paxos_value_t *value,
+                             uint32_t max_size)
+{
+  uint8_t header[PAXOS_MESSAGE_ENTRY_HEADER_MAX_SIZE];
+  uint32_t hsize;
+  uint64_t size;
+
+  header[0] = flags;
+  hsize = __varint_encode(header + 1, value->size) - header;
+  size = (uint64_t)batch->size + hsize + value->size;
+  if (size > max_size || paxos_value_reserve(batch, (uint32_t)size))
+    return(-1);
+
+  memcpy(batch->data + batch->size, header, hsize);
+  if (value->size > 0)
+    memcpy(batch->data + batch->size + hsize, value->data, value->size);
+  batch->size = (uint32_t)size;
+  return(0);
+}
+
+/*
+ * Walk the entries of a batch: returns 1 and the next one in flags and value
+ * (a view on the batch), 0 at the end and -1 if the framing is broken.
+ */
+int paxos_message_entry_next (const paxos_value_t *batch,
+                              uint32_t *offset,
+                              uint8_t *flags,
+                              paxos_value_t *value)
+{
+  const uint8_t *end = batch->data + batch->size;
+  const uint8_t *p;
+  uint64_t size;
+
+  if (*offset >= batch->size)
+    return(0);
+
+  p = batch->data + *offset;
+  *flags = *p++;
+  if ((p = __varint_decode(p, end, &size)) == NULL || size > (uint64_t)(end - p))
+    return(-1);
+
+  paxos_value_wrap(value, p, (uint32_t)size);
+  *offset = (p - batch->data) + (uint32_t)size;
+  return(1);
+}
@@ -0,0 +1,135 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef _PAXOS_MESSAGE_H_
+#define _PAXOS_MESSAGE_H_
+
+#include <stdint.h>
+
+#include "value.h"
+
+/*
+ * On the wire a message is a header followed by value_size bytes of value.
+ * A frame is decoded in place: the message value points straight into the
+ * receive buffer.
+ *
+ * The header starts with the version, the type and the flags (one byte
+ * each) and the paxos group (2 bytes, big-endian: always at the same offset,
+ * so a datagram can be steered by group before being parsed). Then only the
+ * fields used by that type follow, as varints (little-endian base 128, so
+ * the byte order of the host doesn't matter).
+ *
+ * The user messages carry the client request id, the reply has the same
+ * one: a client can keep many requests out on a single socket.
+ *
+ * A catch-up response packs count chosen values, from paxos_id on, in its
+ * value: each entry is flags:8 | size:varint | value.
+ */
+typedef struct paxos_message paxos_message_t;
+
+enum paxos_message_type {
+  /* Paxos */
+  PAXOS_PREPARE_REQUEST             =  1,
+  PAXOS_PREPARE_REJECTED            =  2,
+  PAXOS_PREPARE_PREVIOUSLY_ACCEPTED =  3,
+  PAXOS_PREPARE_CURRENTLY_OPEN      =  4,
+  PAXOS_PROPOSE_REQUEST             =  5,
+  PAXOS_PROPOSE_REJECTED            =  6,
+  PAXOS_PROPOSE_ACCEPTED            =  7,
+  PAXOS_LEARN_PROPOSAL              =  8,
+  PAXOS_LEARN_VALUE                 =  9,
+  PAXOS_REQUEST_CHOSEN              = 10,
+  PAXOS_LEASE_RENEW                 = 11,
+  PAXOS_LEASE_GRANTED               = 12,
+  PAXOS_FORWARD_VALUE               = 13,
+  PAXOS_READ_INDEX                  = 14,
+  PAXOS_READ_INDEX_REPLY            = 15,
+  /* System */
+  PAXOS_BOOTSTRAP                   = 21,
+  PAXOS_CATCHUP_START               = 22,
+  PAXOS_CATCHUP_REQUEST             = 23,
+  PAXOS_CATCHUP_RESPONSE            = 24,
+  PAXOS_SNAPSHOT_REQUEST            = 25,
+  PAXOS_SNAPSHOT_CHUNK              = 26,
+  /* User */
+  PAXOS_USER_PROPOSE_VALUE          = 31,
+  PAXOS_USER_LEARN_VALUE            = 32,
+  PAXOS_USER_STATS                  = 33,   /* The reply value is the stats text */
+};
+
+enum paxos_message_flags {
+  PAXOS_MESSAGE_NOOP                = 1,
+  PAXOS_MESSAGE_LAST_CHUNK          = 2,    /* Of a snapshot or a catch-up */
+};
+
+#define PAXOS_MESSAGE_VERSION           (3)
+#define PAXOS_MESSAGE_GROUP_OFFSET      (3)
+
+/* The widest header is 5 bytes + 4 ids + count + value size */
+#define PAXOS_MESSAGE_HEADER_MAX_SIZE   (5 + 4 * 10 + 3 + 5)
+#define PAXOS_MESSAGE_MAX_SIZE          (PAXOS_MESSAGE_HEADER_MAX_SIZE + \
+                                         PAXOS_VALUE_MAX_SIZE)
+
+#define PAXOS_MESSAGE_ENTRY_HEADER_MAX_SIZE   (1 + 5)
+
+#if PAXOS_MESSAGE_HEADER_MAX_SIZE > PAXOS_VALUE_HEADROOM
+  #error "the value headroom must fit a message header"
+#endif
+
+struct paxos_message {
+    uint8_t  type;
+    uint8_t  flags;
+    uint16_t count;                     /* Values, of a catch-up */
+    uint16_t group_id;
+    uint64_t paxos_id;
+    uint64_t node_id;
+    uint64_t proposal_id;
+    uint64_t accepted_proposal_id;
+    uint64_t promised_proposal_id;
+    uint64_t offset;                    /* Snapshot chunks, read index */
+    uint64_t request_id;                /* Of a client, echoed in the reply */
+    paxos_value_t value;                /* A view, never owned */
+};
+
+/* The group of a frame, without decoding it */
+#define paxos_message_group(frame)                                        \
+  (((uint16_t)(frame)[PAXOS_MESSAGE_GROUP_OFFSET] << 8) |                 \
+   (frame)[PAXOS_MESSAGE_GROUP_OFFSET + 1])
+
+const char *    paxos_message_to_string     (const paxos_message_t *message);
+
+uint32_t        paxos_message_encode_header (const paxos_message_t *message,
+                                             uint8_t *buffer);
+uint32_t        paxos_message_encode        (const paxos_message_t *message,
+                                             uint8_t *buffer,
+                                             uint32_t size);
+const uint8_t * paxos_message_frame         (const paxos_message_t *message,
+                                             uint8_t *buffer,
+                                             uint32_t *size);
+int             paxos_message_decode        (paxos_message_t *message,
+                                             const uint8_t *buffer,
+                                             uint32_t size);
+
+int             paxos_message_entry_add     (paxos_value_t *batch,
+                                             uint8_t flags,
+                                             const paxos_value_t *value,
+                                             uint32_t max_size);
+int             paxos_message_entry_next    (const paxos_value_t *batch,
+                                             uint32_t *offset,
+                                             uint8_t *flags,
+                                             paxos_value_t *value);
+
+#endif /* !_PAXOS_MESSAGE_H_ */
@@ -14,6 +14,7 @@
  *   limitations under the License.
  */
 
+#define _GNU_SOURCE
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -24,12 +25,14 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <linux/filter.h>
 #include <netdb.h>
+#include <errno.h>
 
 #include "paxos.h"
 #include "net.h"
 
-int udp_bind (unsigned short port) {
+static int __udp_bind (unsigned short port, int reuseport) {
   struct sockaddr_in addr;
   int sock;
   int yep;
@@ -39,21 +42,370 @@ int udp_bind (unsigned short port) {
 
   yep = 1;
   setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yep, sizeof(int));
+  if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yep, sizeof(int)) < 0) {
+    close(sock);
+    return(-1);
+  }
 
   memset(&addr, 0, sizeof(struct sockaddr_in));
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = htonl(INADDR_ANY);
   addr.sin_port = htons(port);
 
-  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(sock);
     return(-2);
+  }
 
   return(sock);
 }
 
+int udp_bind (unsigned short port) {
+  return(__udp_bind(port, 0));
+}
+
+/* ============================================================================
+ *  UDP Transport
+ */
+struct udp_batch {
+  /* Receive side, one full-size buffer per datagram */
+  struct mmsghdr rx_msgs[UDP_BATCH_SIZE];
+  struct iovec rx_iov[UDP_BATCH_SIZE];
+  struct sockaddr_in rx_addr[UDP_BATCH_SIZE];
+  uint8_t *rx_buffers;
+  uint32_t rx_count;
+
+  /* Send side, frames are copied once in the arena, fan-out shares it */
+  struct mmsghdr tx_msgs[UDP_TX_QUEUE_SIZE];
+  struct iovec tx_iov[UDP_TX_QUEUE_SIZE];
+  struct sockaddr_in tx_addr[UDP_TX_QUEUE_SIZE];
+  uint8_t tx_arena[UDP_TX_ARENA_SIZE];
+  uint32_t tx_used;
+  uint32_t tx_count;
+};
+
+#define __rx_buffer(batch, i)   ((batch)->rx_buffers + (i) * PAXOS_MESSAGE_MAX_SIZE)
+
+int udp_transport_open (udp_transport_t *self, unsigned short port, int flags) {
+  memset(self, 0, sizeof(udp_transport_t));
+
+  self->batch = (struct udp_batch *) calloc(1, sizeof(struct udp_batch));
+  if (self->batch == NULL)
+    return(-1);
+
+  self->batch->rx_buffers = (uint8_t *) malloc(UDP_BATCH_SIZE * PAXOS_MESSAGE_MAX_SIZE);
+  if (self->batch->rx_buffers == NULL) {
+    free(self->batch);
+    return(-1);
+  }
+
+  if ((self->sock = __udp_bind(port, flags & UDP_TRANSPORT_REUSEPORT)) < 0) {
+    free(self->batch->rx_buffers);
+    free(self->batch);
+    return(-1);
+  }
+
+  self->batching = !!(flags & UDP_TRANSPORT_BATCHING);
+  return(0);
+}
+
+/*
+ * The sockets sharing the port (UDP_TRANSPORT_REUSEPORT) get the datagrams
+ * of the paxos group "group % num_sockets", in the order they were bound.
+ * The group is read straight from the frame by a classic BPF program.
+ */
+int udp_transport_steer_by_group (udp_transport_t *self, unsigned int num_sockets) {
+  struct sock_filter code[] = {
+    /* A = group, a short frame ends here with 0: the first socket */
+    { BPF_LD  | BPF_H   | BPF_ABS, 0, 0, PAXOS_MESSAGE_GROUP_OFFSET },
+    { BPF_ALU | BPF_MOD | BPF_K,   0, 0, num_sockets },
+    { BPF_RET | BPF_A,             0, 0, 0 },
+  };
+  struct sock_fprog prog;
+
+  if (num_sockets == 0)
+    return(-1);
+
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+  return(setsockopt(self->sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                    &prog, sizeof(prog)));
+}
+
+void udp_transport_close (udp_transport_t *self) {
+  if (self->sock >= 0) {
+    udp_transport_flush(self);
+    close(self->sock);
+  }
+  if (self->batch != NULL) {
+    free(self->batch->rx_buffers);
+    free(self->batch);
+  }
+  self->batch = NULL;
+  self->sock = -1;
+}
+
+int udp_transport_add_peer (udp_transport_t *self,
+                            uint64_t node_id,
+                            const char *host,
+                            unsigned short port)
+{
+  struct sockaddr_in *addr;
+
+  if (node_id >= UDP_TRANSPORT_MAX_PEERS)
+    return(-1);
+
+  addr = &(self->peers[node_id]);
+  memset(addr, 0, sizeof(struct sockaddr_in));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &(addr->sin_addr)) != 1) {
+    /* Not an address, resolve it (once, here) */
+    struct addrinfo hints, *info;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, NULL, &hints, &info))
+      return(-2);
+    addr->sin_addr = ((struct sockaddr_in *)info->ai_addr)->sin_addr;
+    freeaddrinfo(info);
+  }
+
+  if (!self->has_peer[node_id]) {
+    self->has_peer[node_id] = 1;
+    self->num_peers++;
+  }
+  return(0);
+}
+
+static int __send_direct (udp_transport_t *self,
+                          const struct sockaddr_in *addr,
+                          const void *buffer,
+                          unsigned int size)
+{
+  self->stats.send_calls++;
+  if (sendto(self->sock, buffer, size, 0,
+             (const struct sockaddr *)addr, sizeof(struct sockaddr_in)) != size)
+  {
+    self->num_send_errors++;
+    return(-1);
+  }
+  self->stats.send_datagrams++;
+  return(0);
+}
+
+/* Copy the frame in the arena, flushing the queue if there's no room */
+static const uint8_t *__queue_frame (udp_transport_t *self,
+                                     const void *buffer,
+                                     unsigned int size,
+                                     uint32_t ndest)
+{
+  struct udp_batch *batch = self->batch;
+  uint8_t *frame;
+
+  if (batch->tx_used + size > UDP_TX_ARENA_SIZE ||
+      batch->tx_count + ndest > UDP_TX_QUEUE_SIZE)
+  {
+    udp_transport_flush(self);
+  }
+
+  frame = batch->tx_arena + batch->tx_used;
+  memcpy(frame, buffer, size);
+  batch->tx_used += (size + 7) & ~7;
+  return(frame);
+}
+
+static void __queue_dest (udp_transport_t *self,
+                          const struct sockaddr_in *addr,
+                          const uint8_t *frame,
+                          unsigned int size)
+{
+  struct udp_batch *batch = self->batch;
+  uint32_t i = batch->tx_count++;
+
+  memcpy(&(batch->tx_addr[i]), addr, sizeof(struct sockaddr_in));
+  batch->tx_iov[i].iov_base = (void *)frame;
+  batch->tx_iov[i].iov_len = size;
+  memset(&(batch->tx_msgs[i]), 0, sizeof(struct mmsghdr));
+  batch->tx_msgs[i].msg_hdr.msg_name = &(batch->tx_addr[i]);
+  batch->tx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  batch->tx_msgs[i].msg_hdr.msg_iov = &(batch->tx_iov[i]);
+  batch->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+}
+
+int udp_transport_send_to (udp_transport_t *self,
+                           const udp_client_t *client,
+                           const void *buffer,
+                           unsigned int size)
+{
+  const uint8_t *frame;
+
+  if (!self->batching || size > UDP_TX_ARENA_SIZE)
+    return(__send_direct(self, &(client->addr), buffer, size));
+
+  frame = __queue_frame(self, buffer, size, 1);
+  __queue_dest(self, &(client->addr), frame, size);
+  return(0);
+}
+
+int udp_transport_send (udp_transport_t *self,
+                        uint64_t node_id,
+                        const void *buffer,
+                        unsigned int size)
+{
+  const uint8_t *frame;
+
+  if (node_id >= UDP_TRANSPORT_MAX_PEERS || !self->has_peer[node_id])
+    return(-1);
+
+  if (!self->batching || size > UDP_TX_ARENA_SIZE)
+    return(__send_direct(self, &(self->peers[node_id]), buffer, size));
+
+  frame = __queue_frame(self, buffer, size, 1);
+  __queue_dest(self, &(self->peers[node_id]), frame, size);
+  return(0);
+}
+
+/* Send the frame to every peer, ourselves included */
+int udp_transport_broadcast (udp_transport_t *self,
+                             const void *buffer,
+                             unsigned int size)
+{
+  const uint8_t *frame;
+  uint32_t i;
+  int ret = 0;
+
+  if (!self->batching || size > UDP_TX_ARENA_SIZE) {
+    for (i = 0; i < UDP_TRANSPORT_MAX_PEERS; ++i) {
+      if (self->has_peer[i] && __send_direct(self, &(self->peers[i]), buffer, size))
+        ret = -1;
+    }
+    return(ret);
+  }
+
+  frame = __queue_frame(self, buffer, size, self->num_peers);
+  for (i = 0; i < UDP_TRANSPORT_MAX_PEERS; ++i) {
+    if (self->has_peer[i])
+      __queue_dest(self, &(self->peers[i]), frame, size);
+  }
+  return(0);
+}
+
+/* Push everything queued since the last flush, with as few syscalls as we can */
+int udp_transport_flush (udp_transport_t *self) {
+  struct udp_batch *batch = self->batch;
+  uint32_t sent = 0;
+  int ret = 0;
+  int n;
+
+  while (sent < batch->tx_count) {
+    n = sendmmsg(self->sock, batch->tx_msgs + sent, batch->tx_count - sent, 0);
+    self->stats.send_calls++;
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      /* Drop the datagram at the head, like a failed sendto() */
+      self->num_send_errors++;
+      sent++;
+      ret = -1;
+      continue;
+    }
+
+    sent += n;
+    self->stats.send_datagrams += n;
+    if ((uint32_t)n > self->stats.max_send_batch)
+      self->stats.max_send_batch = n;
+  }
+
+  batch->tx_count = 0;
+  batch->tx_used = 0;
+  return(ret);
+}
+
+/*
+ * Drain up to UDP_BATCH_SIZE datagrams (one without batching), the socket
+ * is expected to be readable. Returns the number of datagrams received.
+ */
+int udp_transport_recv (udp_transport_t *self) {
+  struct udp_batch *batch = self->batch;
+  socklen_t addrlen;
+  uint32_t i;
+  int n;
+
+  batch->rx_count = 0;
+  if (!self->batching) {
+    addrlen = sizeof(struct sockaddr_in);
+    n = recvfrom(self->sock, __rx_buffer(batch, 0), PAXOS_MESSAGE_MAX_SIZE,
+                 MSG_DONTWAIT, (struct sockaddr *)&(batch->rx_addr[0]), &addrlen);
+    self->stats.recv_calls++;
+    if (n < 0)
+      return(-1);
+    batch->rx_msgs[0].msg_len = n;
+    self->stats.recv_datagrams++;
+    batch->rx_count = 1;
+    return(1);
+  }
+
+  for (i = 0; i < UDP_BATCH_SIZE; ++i) {
+    batch->rx_iov[i].iov_base = __rx_buffer(batch, i);
+    batch->rx_iov[i].iov_len = PAXOS_MESSAGE_MAX_SIZE;
+    memset(&(batch->rx_msgs[i]), 0, sizeof(struct mmsghdr));
+    batch->rx_msgs[i].msg_hdr.msg_name = &(batch->rx_addr[i]);
+    batch->rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    batch->rx_msgs[i].msg_hdr.msg_iov = &(batch->rx_iov[i]);
+    batch->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  n = recvmmsg(self->sock, batch->rx_msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+  self->stats.recv_calls++;
+  if (n < 0)
+    return(-1);
+
+  batch->rx_count = n;
+  self->stats.recv_datagrams += n;
+  if ((uint32_t)n > self->stats.max_recv_batch)
+    self->stats.max_recv_batch = n;
+  return(n);
+}
+
+/* The i-th datagram of the last udp_transport_recv(), valid until the next */
+const uint8_t *udp_transport_datagram (udp_transport_t *self,
+                                       uint32_t index,
+                                       udp_client_t *client,
+                                       uint32_t *size)
+{
+  struct udp_batch *batch = self->batch;
+
+  if (index >= batch->rx_count)
+    return(NULL);
+
+  memcpy(&(client->addr), &(batch->rx_addr[index]), sizeof(struct sockaddr_in));
+  client->addrlen = sizeof(struct sockaddr_in);
+  *size = batch->rx_msgs[index].msg_len;
+  return(__rx_buffer(batch, index));
+}
+
+void udp_transport_dump_stats (const udp_transport_t *self, FILE *stream) {
+  const udp_transport_stats_t *stats = &(self->stats);
+  fprintf(stream, "transport: recv %lu datagrams in %lu calls (%.2f/call, max %u)"
+                  " send %lu datagrams in %lu calls (%.2f/call, max %u)"
+                  " errors %lu\n",
+          stats->recv_datagrams, stats->recv_calls,
+          stats->recv_calls ? (double)stats->recv_datagrams / stats->recv_calls : 0.0,
+          stats->max_recv_batch,
+          stats->send_datagrams, stats->send_calls,
+          stats->send_calls ? (double)stats->send_datagrams / stats->send_calls : 0.0,
+          stats->max_send_batch, self->num_send_errors);
+}
+
+/* ============================================================================
+ *  UDP Helpers
+ */
 int udp_recv (int sock,
               udp_client_t *client,
-              paxos_message_t *message,
+              void *buffer,
+              unsigned int size,
               unsigned int msec)
 {
   struct timeval tv;
@@ -71,21 +423,23 @@ int udp_recv (int sock,
   }
 
   client->addrlen = sizeof(struct sockaddr_in);
-  return(recvfrom(sock, message, sizeof(paxos_message_t), 0,
+  return(recvfrom(sock, buffer, size, 0,
                   (struct sockaddr *)&(client->addr), &(client->addrlen)));
 }
 
 int udp_send (int sock,
               const udp_client_t *client,
-              const paxos_message_t *message)
+              const void *buffer,
+              unsigned int size)
 {
-  return(sendto(sock, message, sizeof(paxos_message_t), 0,
+  return(sendto(sock, buffer, size, 0,
                 (struct sockaddr *)&(client->addr), client->addrlen));
 }
 
 int udp_send_to (const char *host,
                  unsigned int port,
-                 const paxos_message_t *message)
+                 const void *buffer,
+                 unsigned int size)
 {
   udp_client_t client;
   int sock;
@@ -100,15 +454,16 @@ int udp_send_to (const char *host,
   client.addr.sin_port = htons(port);
 
   client.addrlen = sizeof(struct sockaddr_in);
-  ret = udp_send(sock, &client, message);
+  ret = udp_send(sock, &client, buffer, size);
 
   close(sock);
-  return(ret != sizeof(paxos_message_t));
+  return(ret != size);
 }
 
 int udp_broadcast (const char *address,
                    unsigned int port,
-                   const paxos_message_t *message)
+                   const void *buffer,
+                   unsigned int size)
 {
   udp_client_t client;
   int sock;
@@ -131,10 +486,10 @@ int udp_broadcast (const char *address,
   client.addr.sin_port = htons(port);
 
   client.addrlen = sizeof(struct sockaddr_in);
-  ret = udp_send(sock, &client, message);
+  ret = udp_send(sock, &client, buffer, size);
 
   close(sock);
-  return(ret != sizeof(paxos_message_t));
+  return(ret != size);
 }
 
 int udp_client (const char *host,
@@ -154,23 +509,60 @@ int udp_client (const char *host,
   return(sock);
 }
 
+/* Encode the message in a scratch buffer, for the paths off the replication */
+int udp_send_message (int sock,
+                      const udp_client_t *client,
+                      const paxos_message_t *message)
+{
+  uint8_t buffer[PAXOS_MESSAGE_HEADER_MAX_SIZE + 256];
+  const uint8_t *frame;
+  uint8_t *scratch;
+  uint32_t size;
+  int ret;
+
+  scratch = buffer;
+  if (PAXOS_MESSAGE_HEADER_MAX_SIZE + message->value.size > sizeof(buffer) &&
+      !paxos_value_has_headroom(&(message->value)))
+  {
+    if ((scratch = (uint8_t *) malloc(PAXOS_MESSAGE_MAX_SIZE)) == NULL)
+      return(-1);
+  }
+
+  ret = -1;
+  if ((frame = paxos_message_frame(message, scratch, &size)) != NULL)
+    ret = udp_send(sock, client, frame, size);
+
+  if (scratch != buffer)
+    free(scratch);
+  return(ret);
+}
+
+/*
+ * Send the message and wait for the response, decoded in buffer
+ * (of at least PAXOS_MESSAGE_MAX_SIZE bytes).
+ */
 int udp_send_and_recv (int sock,
                        udp_client_t *client,
-                       paxos_message_t *message)
+                       paxos_message_t *message,
+                       uint8_t *buffer)
 {
+  int size;
+
   /* send the message to the server */
   client->addrlen = sizeof(struct sockaddr_in);
-  if (udp_send(sock, client, message) < 0) {
+  if (udp_send_message(sock, client, message) < 0) {
     perror("sendto()");
     return(-1);
   }
 
   /* wait the server response */
-  if (udp_recv(sock, client, message, 0) != sizeof(paxos_message_t)) {
+  if ((size = udp_recv(sock, client, buffer, PAXOS_MESSAGE_MAX_SIZE, 0)) < 0) {
     perror("recvfrom()");
     return(-2);
   }
 
+  if (paxos_message_decode(message, buffer, size))
+    return(-3);
   return(0);
 }
 
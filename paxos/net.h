@@ -21,6 +21,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <stdio.h>
 
 #include "paxos.h"
 
@@ -29,26 +30,107 @@ typedef struct udp_client {
   socklen_t addrlen;
 } udp_client_t;
 
+/*
+ * The transport owns the bound socket, used to send too, and the addresses
+ * of the peers resolved once: sending a frame is a single sendto().
+ *
+ * In batching mode up to UDP_BATCH_SIZE datagrams are drained with one
+ * recvmmsg(), and the frames sent are queued (copied once, a broadcast
+ * shares the copy) until udp_transport_flush() hands them all to sendmmsg().
+ * The event loop flushes once per iteration.
+ *
+ * With UDP_TRANSPORT_REUSEPORT more transports (one per thread) can be
+ * bound to the same port, see udp_transport_steer_by_group().
+ */
+#define UDP_TRANSPORT_MAX_PEERS     PAXOS_MAX_NODES
+#define UDP_BATCH_SIZE              (16)
+#define UDP_TX_QUEUE_SIZE           (256)
+#define UDP_TX_ARENA_SIZE           (256 << 10)
+
+enum udp_transport_flags {
+  UDP_TRANSPORT_BATCHING    = 1,        /* recvmmsg()/sendmmsg() */
+  UDP_TRANSPORT_REUSEPORT   = 2,        /* SO_REUSEPORT */
+};
+
+typedef struct udp_transport_stats {
+  uint64_t recv_calls;
+  uint64_t recv_datagrams;
+  uint64_t send_calls;
+  uint64_t send_datagrams;
+  uint32_t max_recv_batch;
+  uint32_t max_send_batch;
+} udp_transport_stats_t;
+
+typedef struct udp_transport {
+  struct sockaddr_in peers[UDP_TRANSPORT_MAX_PEERS];   /* By node_id */
+  uint8_t has_peer[UDP_TRANSPORT_MAX_PEERS];
+  uint32_t num_peers;
+  uint64_t num_send_errors;
+  udp_transport_stats_t stats;
+  struct udp_batch *batch;
+  uint8_t batching;
+  int sock;
+} udp_transport_t;
+
+#define udp_transport_fd(self)      ((self)->sock)
+
+int udp_transport_open      (udp_transport_t *self,
+                             unsigned short port,
+                             int flags);
+void udp_transport_close    (udp_transport_t *self);
+int udp_transport_add_peer  (udp_transport_t *self,
+                             uint64_t node_id,
+                             const char *host,
+                             unsigned short port);
+int udp_transport_send      (udp_transport_t *self,
+                             uint64_t node_id,
+                             const void *buffer,
+                             unsigned int size);
+int udp_transport_send_to   (udp_transport_t *self,
+                             const udp_client_t *client,
+                             const void *buffer,
+                             unsigned int size);
+int udp_transport_broadcast (udp_transport_t *self,
+                             const void *buffer,
+                             unsigned int size);
+int udp_transport_flush     (udp_transport_t *self);
+int udp_transport_steer_by_group (udp_transport_t *self,
+                                  unsigned int num_sockets);
+int udp_transport_recv      (udp_transport_t *self);
+const uint8_t *udp_transport_datagram (udp_transport_t *self,
+                                       uint32_t index,
+                                       udp_client_t *client,
+                                       uint32_t *size);
+void udp_transport_dump_stats (const udp_transport_t *self, FILE *stream);
+
 int udp_bind            (unsigned short port);
 int udp_recv            (int sock,
                          udp_client_t *client,
-                         paxos_message_t *message,
+                         void *buffer,
+                         unsigned int size,
                          unsigned int msec);
 int udp_send            (int sock,
                          const udp_client_t *client,
-                         const paxos_message_t *message);
+                         const void *buffer,
+                         unsigned int size);
 int udp_send_to         (const char *host,
                          unsigned int port,
-                         const paxos_message_t *message);
+                         const void *buffer,
+                         unsigned int size);
 int udp_broadcast       (const char *address,
                          unsigned int port,
-                         const paxos_message_t *message);
+                         const void *buffer,
+                         unsigned int size);
 int udp_client          (const char *host,
                          unsigned int port,
                          udp_client_t *client);
+int udp_send_message    (int sock,
+                         const udp_client_t *client,
+                         const paxos_message_t *message);
 int udp_send_and_recv   (int sock,
                          udp_client_t *client,
-                         paxos_message_t *message);
+                         paxos_message_t *message,
+                         uint8_t *buffer);
 
 #endif
 
@@ -0,0 +1,359 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Load generator for the key-value store.
+ *
+ * Closed loop (default): each connection keeps -n requests out, a reply
+ * sends the next one. Open loop (-r): requests go out at a fixed rate
+ * whatever the replies do, the latency is measured from the time a request
+ * was due, so a stalled server is not hidden by a stalled generator.
+ *
+ *   usage: paxos-bench [options] <host> <port>
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "histogram.h"
+#include "client.h"
+#include "kv.h"
+
+#define BENCH_MAX_CONNECTIONS     (64)
+#define BENCH_TICK                (1)       /* msec, of the open loop */
+#define BENCH_REPORT_INTERVAL     (1000)    /* msec */
+
+static volatile int __is_running = 1;
+static void __signal_handler (int signum) {
+  __is_running = 0;
+}
+
+struct bench {
+  paxos_client_t clients[BENCH_MAX_CONNECTIONS];
+  paxos_eloop_t eloop;
+  paxos_timeout_t tick_timeout;
+  paxos_timeout_t report_timeout;
+  paxos_value_t command;
+  uint8_t *payload;
+  uint64_t seed;
+
+  /* Options */
+  const char *host;
+  unsigned short port;
+  uint16_t group_id;
+  uint32_t num_clients;
+  uint32_t outstanding;                 /* Per connection, closed loop */
+  uint64_t rate;                        /* ops/sec, 0 is closed loop */
+  uint32_t duration;                    /* sec */
+  uint32_t write_ratio;                 /* % */
+  uint32_t num_keys;
+  uint32_t value_size;
+  uint32_t timeout;                     /* msec */
+
+  /* Open loop schedule */
+  uint64_t start_time;                  /* usec */
+  uint64_t end_time;
+  uint64_t issued;
+  uint64_t next_client;
+  uint64_t num_full;                    /* Due but no room on the connection */
+
+  /* Results */
+  paxos_histogram_t latency[2];         /* Reads, writes */
+  uint64_t num_errors;
+  uint64_t num_timeouts;
+  uint64_t last_completed;
+};
+
+static uint64_t __random (struct bench *bench) {
+  /* xorshift64*, reproducible runs */
+  bench->seed ^= bench->seed >> 12;
+  bench->seed ^= bench->seed << 25;
+  bench->seed ^= bench->seed >> 27;
+  return(bench->seed * 2685821657736338717ull);
+}
+
+/* A get or a put of a random key, the request arg tells which one */
+static int __submit (struct bench *bench, paxos_client_t *client, uint64_t due_time) {
+  paxos_client_request_t *request;
+  paxos_kv_command_t command;
+  char key[24];
+  int is_write;
+
+  is_write = (__random(bench) % 100) < bench->write_ratio;
+
+  memset(&command, 0, sizeof(paxos_kv_command_t));
+  command.op = is_write ? PAXOS_KV_PUT : PAXOS_KV_GET;
+  command.key_size = snprintf(key, sizeof(key), "key-%lu",
+                              (unsigned long)(__random(bench) % bench->num_keys));
+  command.key = (const uint8_t *)key;
+  if (is_write) {
+    command.value = bench->payload;
+    command.value_size = bench->value_size;
+  }
+
+  if (paxos_kv_command_encode(&command, &(bench->command)))
+    return(-1);
+
+  request = paxos_client_submit(client, &(bench->command), (void *)(uintptr_t)is_write);
+  if (request == NULL)
+    return(-1);
+
+  if (due_time > 0)
+    request->start_time = due_time;
+  return(0);
+}
+
+static void __on_reply (void *arg,
+                        paxos_client_request_t *request,
+                        int status,
+                        const paxos_message_t *reply)
+{
+  struct bench *bench = (struct bench *)arg;
+  int is_write = (int)(uintptr_t)request->arg;
+  paxos_value_t value;
+  uint8_t kv_status;
+
+  if (status != PAXOS_CLIENT_OK) {
+    bench->num_timeouts++;
+  } else if (paxos_kv_result_decode(&(reply->value), &kv_status, &value) ||
+             (kv_status != PAXOS_KV_OK && kv_status != PAXOS_KV_NOT_FOUND))
+  {
+    bench->num_errors++;
+  } else {
+    paxos_histogram_add(&(bench->latency[is_write]),
+                        paxos_time_now_usec() - request->start_time);
+  }
+
+  /* Closed loop: the slot just freed goes to the next request */
+  if (bench->rate == 0 && __is_running && paxos_time_now_usec() < bench->end_time)
+    __submit(bench, request->client, 0);
+}
+
+/* Open loop: send everything due by now, round-robin on the connections */
+static void __on_tick (void *arg) {
+  struct bench *bench = (struct bench *)arg;
+  uint64_t now = paxos_time_now_usec();
+  uint64_t due;
+  paxos_client_t *client;
+
+  while (now < bench->end_time) {
+    due = bench->start_time + (bench->issued * 1000000ull) / bench->rate;
+    if (due > now)
+      break;
+
+    client = &(bench->clients[bench->next_client++ % bench->num_clients]);
+    if (__submit(bench, client, due))
+      bench->num_full++;
+    bench->issued++;
+  }
+  paxos_timeout_start(&(bench->tick_timeout));
+}
+
+static uint64_t __completed (const struct bench *bench) {
+  return(bench->latency[0].count + bench->latency[1].count +
+         bench->num_errors + bench->num_timeouts);
+}
+
+static void __on_report (void *arg) {
+  struct bench *bench = (struct bench *)arg;
+  uint64_t completed = __completed(bench);
+  uint32_t pending = 0;
+  uint32_t i;
+
+  for (i = 0; i < bench->num_clients; ++i)
+    pending += paxos_client_pending(&(bench->clients[i]));
+
+  fprintf(stderr, "%lu ops/sec, %u pending, %lu errors %lu timeouts %lu full\n",
+          (completed - bench->last_completed) * 1000 / BENCH_REPORT_INTERVAL,
+          pending, bench->num_errors, bench->num_timeouts, bench->num_full);
+  bench->last_completed = completed;
+  paxos_timeout_start(&(bench->report_timeout));
+}
+
+static void __report (struct bench *bench, uint64_t elapsed) {
+  paxos_client_stats_t total;
+  paxos_histogram_t all;
+  uint32_t i;
+
+  memset(&total, 0, sizeof(paxos_client_stats_t));
+  for (i = 0; i < bench->num_clients; ++i) {
+    const paxos_client_stats_t *stats = &(bench->clients[i].stats);
+    total.submitted += stats->submitted;
+    total.retries += stats->retries;
+    total.stale_replies += stats->stale_replies;
+  }
+
+  paxos_histogram_reset(&all);
+  paxos_histogram_merge(&all, &(bench->latency[0]));
+  paxos_histogram_merge(&all, &(bench->latency[1]));
+
+  printf("%s, %u connections, %u%% writes, %u keys, %u bytes values\n",
+         bench->rate ? "open loop" : "closed loop", bench->num_clients,
+         bench->write_ratio, bench->num_keys, bench->value_size);
+  printf("throughput: %.1f ops/sec (%lu ops in %.3f sec)\n",
+         all.count * 1000000.0 / elapsed, all.count, elapsed / 1000000.0);
+  printf("requests: %lu submitted %lu retries %lu timeouts %lu errors "
+         "%lu stale replies %lu not sent (full)\n",
+         total.submitted, total.retries, bench->num_timeouts, bench->num_errors,
+         total.stale_replies, bench->num_full);
+  paxos_histogram_dump(&all, stdout, "latency usec");
+  paxos_histogram_dump(&(bench->latency[0]), stdout, "  get usec");
+  paxos_histogram_dump(&(bench->latency[1]), stdout, "  put usec");
+}
+
+static int __bench_run (struct bench *bench) {
+  uint64_t drain_time;
+  uint32_t i, j;
+  int pending;
+
+  if (paxos_eloop_open(&(bench->eloop))) {
+    perror("paxos_eloop_open()");
+    return(1);
+  }
+
+  for (i = 0; i < bench->num_clients; ++i) {
+    if (paxos_client_open(&(bench->clients[i]), &(bench->eloop), bench->host, bench->port,
+                          bench->group_id, bench->outstanding, __on_reply, bench))
+    {
+      fprintf(stderr, "unable to reach %s:%u\n", bench->host, bench->port);
+      return(1);
+    }
+    paxos_client_set_timeout(&(bench->clients[i]), bench->timeout, PAXOS_CLIENT_MAX_RETRIES);
+  }
+
+  paxos_timeout_init(&(bench->tick_timeout), BENCH_TICK, __on_tick, bench);
+  paxos_timeout_attach(&(bench->tick_timeout), paxos_eloop_timers(&(bench->eloop)));
+  paxos_timeout_init(&(bench->report_timeout), BENCH_REPORT_INTERVAL, __on_report, bench);
+  paxos_timeout_attach(&(bench->report_timeout), paxos_eloop_timers(&(bench->eloop)));
+
+  bench->start_time = paxos_clock_update();
+  bench->end_time = bench->start_time + bench->duration * 1000000ull;
+  paxos_timeout_start(&(bench->report_timeout));
+  if (bench->rate > 0) {
+    __on_tick(bench);
+  } else {
+    for (i = 0; i < bench->num_clients; ++i) {
+      for (j = 0; j < bench->outstanding; ++j)
+        __submit(bench, &(bench->clients[i]), 0);
+    }
+  }
+
+  /* Run for the duration, then wait for the replies still out */
+  drain_time = 0;
+  do {
+    for (i = 0; i < bench->num_clients; ++i)
+      paxos_client_flush(&(bench->clients[i]));
+
+    if (paxos_eloop_run_once(&(bench->eloop), BENCH_REPORT_INTERVAL) < 0)
+      break;
+
+    pending = 0;
+    for (i = 0; i < bench->num_clients; ++i)
+      pending += paxos_client_pending(&(bench->clients[i]));
+
+    if (drain_time == 0 && (!__is_running || paxos_time_now_usec() >= bench->end_time))
+      drain_time = paxos_time_now_usec();
+  } while (drain_time == 0 || (pending > 0 && __is_running &&
+           paxos_time_now_usec() - drain_time < bench->timeout * 1000ull));
+
+  paxos_timeout_stop(&(bench->tick_timeout));
+  paxos_timeout_stop(&(bench->report_timeout));
+  __report(bench, drain_time - bench->start_time);
+
+  for (i = 0; i < bench->num_clients; ++i)
+    paxos_client_close(&(bench->clients[i]));
+  paxos_eloop_close(&(bench->eloop));
+  return(0);
+}
+
+static void __usage (void) {
+  fprintf(stderr, "usage: paxos-bench [-g group] [-c connections] [-n outstanding] "
+                  "[-r ops/sec] [-d sec] [-w write %%] [-k keys] [-s value size] "
+                  "[-t timeout msec] <host> <port>\n");
+  fprintf(stderr, "  closed loop with -n requests out per connection, "
+                  "open loop at a fixed rate with -r\n");
+}
+
+int main (int argc, char **argv) {
+  struct bench *bench;
+  int ret;
+  int opt;
+
+  if ((bench = (struct bench *) calloc(1, sizeof(struct bench))) == NULL) {
+    perror("calloc()");
+    return(1);
+  }
+
+  bench->num_clients = 1;
+  bench->outstanding = 64;
+  bench->duration = 10;
+  bench->write_ratio = 50;
+  bench->num_keys = 1000;
+  bench->value_size = 16;
+  bench->timeout = PAXOS_CLIENT_DEFAULT_TIMEOUT;
+  bench->seed = 0x9e3779b97f4a7c15ull;
+  while ((opt = getopt(argc, argv, "g:c:n:r:d:w:k:s:t:")) != -1) {
+    switch (opt) {
+      case 'g': bench->group_id = strtoul(optarg, NULL, 10) & 0xffff; break;
+      case 'c': bench->num_clients = strtoul(optarg, NULL, 10); break;
+      case 'n': bench->outstanding = strtoul(optarg, NULL, 10); break;
+      case 'r': bench->rate = strtoull(optarg, NULL, 10); break;
+      case 'd': bench->duration = strtoul(optarg, NULL, 10); break;
+      case 'w': bench->write_ratio = strtoul(optarg, NULL, 10); break;
+      case 'k': bench->num_keys = strtoul(optarg, NULL, 10); break;
+      case 's': bench->value_size = strtoul(optarg, NULL, 10); break;
+      case 't': bench->timeout = strtoul(optarg, NULL, 10); break;
+      default: __usage(); return(1);
+    }
+  }
+
+  if (argc - optind != 2 || bench->num_clients == 0 ||
+      bench->num_clients > BENCH_MAX_CONNECTIONS || bench->outstanding == 0 ||
+      bench->write_ratio > 100 || bench->num_keys == 0 ||
+      bench->value_size > PAXOS_VALUE_MAX_SIZE / 2)
+  {
+    __usage();
+    return(1);
+  }
+
+  bench->host = argv[optind];
+  bench->port = strtoul(argv[optind + 1], NULL, 10) & 0xffff;
+
+  /* In open loop -n is only the room for the requests out */
+  if (bench->rate > 0 && bench->outstanding < 4096)
+    bench->outstanding = 4096;
+
+  if ((bench->payload = (uint8_t *) malloc(bench->value_size + 1)) == NULL) {
+    perror("malloc()");
+    return(1);
+  }
+  memset(bench->payload, 'v', bench->value_size);
+  paxos_value_init(&(bench->command));
+  paxos_histogram_reset(&(bench->latency[0]));
+  paxos_histogram_reset(&(bench->latency[1]));
+
+  signal(SIGINT, __signal_handler);
+  ret = __bench_run(bench);
+
+  paxos_value_free(&(bench->command));
+  free(bench->payload);
+  free(bench);
+  return(ret);
+}
@@ -20,70 +20,161 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "client.h"
 #include "paxos.h"
-#include "net.h"
+#include "kv.h"
 
-static int __paxos_get (const char *host, unsigned int port) {
-  paxos_message_t message;
-  udp_client_t client;
-  int sock;
+static uint16_t __group_id = 0;
 
-  memset(&message, 0, sizeof(paxos_message_t));
-  message.type = PAXOS_USER_LEARN_VALUE;
+static const char *__status_to_string (uint8_t status) {
+  switch (status) {
+    case PAXOS_KV_OK:         return("OK");
+    case PAXOS_KV_NOT_FOUND:  return("NOT_FOUND");
+    case PAXOS_KV_CAS_FAILED: return("CAS_FAILED");
+    case PAXOS_KV_INVALID:    return("INVALID");
+    case PAXOS_KV_NO_MEMORY:  return("NO_MEMORY");
+  }
+  return("UNKNOWN");
+}
 
-  if ((sock = udp_client(host, port, &client)) < 0)
-    return(1);
+struct command_reply {
+  int done;
+  int ret;
+};
+
+static void __on_reply (void *arg,
+                        paxos_client_request_t *request,
+                        int status,
+                        const paxos_message_t *reply)
+{
+  struct command_reply *result = (struct command_reply *)arg;
+  paxos_value_t value;
+  uint8_t kv_status;
+
+  result->done = 1;
+  result->ret = 1;
+  if (status != PAXOS_CLIENT_OK) {
+    fprintf(stderr, "no reply after %u retries\n", request->retries);
+    return;
+  }
 
-  if (udp_send_and_recv(sock, &client, &message))
-    return(1);
+  if (reply->type == PAXOS_USER_STATS) {
+    printf("%.*s", (int)reply->value.size, reply->value.data);
+    result->ret = 0;
+    return;
+  }
 
-  printf("paxos_id: %lu value: %lu\n", message.paxos_id, message.value);
-  close(sock);
-  return(0);
-}
+  if (paxos_kv_result_decode(&(reply->value), &kv_status, &value)) {
+    fprintf(stderr, "invalid result\n");
+    return;
+  }
 
-static int __paxos_set (const char *host, unsigned int port, uint64_t value) {
-  paxos_message_t message;
-  udp_client_t client;
-  int sock;
+  printf("paxos_id: %lu %s", reply->paxos_id, __status_to_string(kv_status));
+  if (value.size > 0)
+    printf(" %.*s", (int)value.size, value.data);
+  printf(" (%.3fms)\n", (paxos_time_now_usec() - request->start_time) / 1000.0);
+  result->ret = (kv_status != PAXOS_KV_OK);
+}
 
-  memset(&message, 0, sizeof(paxos_message_t));
-  message.type = PAXOS_USER_PROPOSE_VALUE;
-  message.value = value;
+/* A NULL command asks the stats of the group */
+static int __paxos_command (const char *host,
+                            unsigned int port,
+                            const paxos_kv_command_t *command)
+{
+  paxos_client_request_t *submitted;
+  struct command_reply result;
+  paxos_client_t client;
+  paxos_value_t request;
+  paxos_eloop_t eloop;
+
+  paxos_value_init(&request);
+  if (command != NULL && paxos_kv_command_encode(command, &request)) {
+    fprintf(stderr, "command too large\n");
+    return(1);
+  }
 
-  if ((sock = udp_client(host, port, &client)) < 0)
+  if (paxos_eloop_open(&eloop)) {
+    perror("paxos_eloop_open()");
     return(1);
+  }
 
-  if (udp_send_and_recv(sock, &client, &message))
+  memset(&result, 0, sizeof(struct command_reply));
+  if (paxos_client_open(&client, &eloop, host, port, __group_id, 1, __on_reply, &result)) {
+    fprintf(stderr, "unable to reach %s:%u\n", host, port);
     return(1);
+  }
+
+  /* Retried on timeout, with the same request id */
+  if (command != NULL)
+    submitted = paxos_client_submit(&client, &request, NULL);
+  else
+    submitted = paxos_client_submit_stats(&client, NULL);
 
-  printf("paxos_id: %lu value: %lu\n", message.paxos_id, message.value);
-  close(sock);
-  return(0);
+  if (submitted != NULL) {
+    paxos_client_flush(&client);
+    while (!result.done && paxos_eloop_run_once(&eloop, -1) >= 0)
+      paxos_client_flush(&client);
+  }
+
+  paxos_client_close(&client);
+  paxos_eloop_close(&eloop);
+  paxos_value_free(&request);
+  return(result.done ? result.ret : 1);
+}
+
+static void __usage (void) {
+  fprintf(stderr, "usage:\n");
+  fprintf(stderr, "  paxos-client [-g group] <host> <port> get <key>\n");
+  fprintf(stderr, "  paxos-client [-g group] <host> <port> put <key> <value>\n");
+  fprintf(stderr, "  paxos-client [-g group] <host> <port> delete <key>\n");
+  fprintf(stderr, "  paxos-client [-g group] <host> <port> cas <key> <expected> <value>\n");
+  fprintf(stderr, "  paxos-client [-g group] <host> <port> stats\n");
 }
 
 int main (int argc, char **argv) {
+  paxos_kv_command_t command;
   unsigned int port;
 
-  if (argc < 4 ||
-     (!strncmp(argv[3], "get", 3) && argc > 4) ||
-     (!strncmp(argv[3], "set", 3) && argc < 5))
-  {
-    fprintf(stderr, "usage:\n");
-    fprintf(stderr, "  paxos-client <host> <port> get\n");
-    fprintf(stderr, "  paxos-client <host> <port> set <value>\n");
+  /* -g <group>, the paxos group of a sharded server */
+  if (argc > 2 && !strcmp(argv[1], "-g")) {
+    __group_id = strtoul(argv[2], NULL, 10) & 0xffff;
+    argc -= 2;
+    argv += 2;
+  }
+
+  if (argc == 4 && !strcmp(argv[3], "stats")) {
+    port = strtoul(argv[2], NULL, 10) & 0xffff;
+    return(__paxos_command(argv[1], port, NULL));
+  }
+
+  if (argc < 5) {
+    __usage();
     return(1);
   }
 
-  port = strtoul(argv[2], NULL, 10) & 0xffff;
-  if (!strncmp(argv[3], "get", 3))
-    return(__paxos_get(argv[1], port));
+  memset(&command, 0, sizeof(paxos_kv_command_t));
+  command.key = (const uint8_t *)argv[4];
+  command.key_size = strlen(argv[4]);
+  if (!strcmp(argv[3], "get") && argc == 5) {
+    command.op = PAXOS_KV_GET;
+  } else if (!strcmp(argv[3], "put") && argc == 6) {
+    command.op = PAXOS_KV_PUT;
+  } else if (!strcmp(argv[3], "delete") && argc == 5) {
+    command.op = PAXOS_KV_DELETE;
+  } else if (!strcmp(argv[3], "cas") && argc == 7) {
+    command.op = PAXOS_KV_CAS;
+    command.expected = (const uint8_t *)argv[5];
+    command.expected_size = strlen(argv[5]);
+  } else {
+    __usage();
+    return(1);
+  }
 
-  if (!strncmp(argv[3], "set", 3)) {
-    uint64_t value = strtoul(argv[4], NULL, 10);
-    return(__paxos_set(argv[1], port, value));
+  if (command.op == PAXOS_KV_PUT || command.op == PAXOS_KV_CAS) {
+    command.value = (const uint8_t *)argv[argc - 1];
+    command.value_size = strlen(argv[argc - 1]);
   }
 
-  return(1);
+  port = strtoul(argv[2], NULL, 10) & 0xffff;
+  return(__paxos_command(argv[1], port, &command));
 }
-
@@ -14,150 +14,1167 @@
  *   limitations under the License.
  */
 
+#define _GNU_SOURCE
+#include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sched.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "paxos.h"
+#include "eloop.h"
+#include "membership.h"
+#include "kv.h"
 #include "net.h"
+#include "pending.h"
+#include "trace.h"
 
-static int __is_running = 1;
+static volatile int __is_running = 1;
 static void __signal_handler (int signum) {
     __is_running = 0;
 }
 
-#define NPENDING_CLIENTS     16
-struct server {
-  udp_client_t clients[NPENDING_CLIENTS];
-  unsigned int num_clients;
+#define PAXOS_DEFAULT_CONFIG     "paxos.conf"
+#define PAXOS_WAL_BATCH_DELAY    (1)     /* msec */
+#define SERVER_BATCH_IO          (1)     /* recvmmsg()/sendmmsg() */
+#define SERVER_STATS_INTERVAL    (10)    /* sec */
+#define SERVER_STOP_CHECK        (1000)  /* msec, how often workers look at __is_running */
+#define SERVER_MAX_GROUPS        (1024)
+#define PAXOS_BATCH_DELAY        (1)     /* msec */
+#define PAXOS_SNAPSHOT_INTERVAL  (1024)  /* learned values */
+#define PAXOS_LEASE_DURATION     (1000)  /* msec */
+#define SESSION_TTL              (5000)  /* msec, longer than the client retries */
+
+/* Who is waiting for a reply: the reply carries the same request id */
+struct request {
+  udp_client_t client;
+  uint64_t request_id;
+};
+
+/*
+ * A batch gathers the commands arriving within PAXOS_BATCH_DELAY (or until
+ * it is full) and proposes them as a single paxos instance. Its items are
+ * the entries of the requests in the pending table, in command order.
+ * With every batch in use the requests are queued in the table, and go
+ * in the batches freed by the next values learned.
+ *
+ * The value starts with the origin of the batch, the proposer finds its
+ * own batch in a learned value by it: two batches may carry the same
+ * commands. The seqids start from the wall clock (usec), a restarted
+ * node doesn't reuse the ones of a previous run still in the log.
+ * Each command comes after the request it answers, (client, request id).
+ *
+ * A batch whose instance is decided with another value (a leader change,
+ * or a forwarded batch chosen elsewhere or not at all) goes back in the
+ * queue: the same command may be learned more than once, it is applied
+ * once. The sessions table has the requests applied with their result,
+ * a command already there is skipped and answered with the first result.
+ * It expires by the time in the batch headers, the same on every replica.
+ */
+#define BATCH_MAX_ITEMS          (8)
+struct batch_header {
+  uint64_t node_id;
+  uint64_t seqid;
+  uint64_t time;                        /* msec, wall clock of the proposer */
+};
+#define BATCH_HEADER_SIZE        (sizeof(struct batch_header))
+
+struct batch_item {
+  uint64_t request_id;
+  uint32_t addr;                        /* Of the client, network order */
+  uint16_t port;
+  uint16_t __pad;
+};
+#define BATCH_ITEM_SIZE          (sizeof(struct batch_item))
+
+/* The state in the snapshot: the kv dump, then the sessions dump */
+struct snapshot_header {
+  uint64_t kv_size;
+  uint64_t session_time;
+};
+#define SNAPSHOT_HEADER_SIZE     (sizeof(struct snapshot_header))
+
+enum batch_state {
+  BATCH_FREE,
+  BATCH_OPEN,
+  BATCH_READY,                          /* Waiting for room in the window */
+  BATCH_PROPOSED,
+};
+
+struct batch {
+  paxos_value_t value;
+  uint32_t items[BATCH_MAX_ITEMS];      /* Pending entries */
+  uint32_t num_items;
+  uint64_t seqid;
+  uint64_t paxos_id;                    /* Instance it was proposed in */
+  uint8_t state;
+};
+
+/*
+ * A read without the lease waits for its ReadIndex round, the reads are
+ * answered in arrival order once their round is confirmed and learned.
+ */
+struct pending_read {
+  paxos_value_t command;
+  struct request request;
+  uint64_t seq;                         /* Of the read round */
+};
+
+/*
+ * Sharded mode: a node runs N independent paxos groups, each one with its
+ * own paxos_id space and WAL. Group g belongs to the worker g % workers,
+ * a thread with its own event loop and socket. All the sockets share the
+ * node port (SO_REUSEPORT), and the kernel steers each datagram to the
+ * owner of the group in its header: the workers share nothing.
+ */
+#define NPENDING_BATCHES     (2 * PAXOS_DEFAULT_WINDOW_SIZE)
+#define NPENDING_READS       (BATCH_MAX_ITEMS * NPENDING_BATCHES)
+struct server {                         /* A paxos group */
+  struct batch batches[NPENDING_BATCHES];
+  struct batch *open_batch;
+  paxos_timeout_t batch_timeout;
+  uint64_t batch_seqid;
+  paxos_pending_t pending;              /* Writes queued or proposed here */
+  paxos_pending_t sessions;             /* Writes applied, replicated */
+  uint64_t session_time;                /* msec, of the last batch learned */
+  uint64_t num_duplicates;              /* Retries of a pending or done write */
+  uint64_t num_reapplied;               /* Commands learned again, skipped */
+  struct pending_read reads[NPENDING_READS];
+  uint32_t read_head;
+  uint32_t num_reads;
   uint64_t num_broadcast;
   uint64_t num_send;
   paxos_t paxos;
-  int sock;
+  paxos_kv_t kv;                        /* The replicated state */
+  paxos_value_t result;                 /* Of the last command applied */
+  paxos_value_t item;                   /* A write, with its request */
+  paxos_context_t context;
+  paxos_eloop_handler_t storage_handler;
+  struct worker *worker;
+};
+
+struct worker {
+  pthread_t thread;
+  unsigned int id;
+  uint8_t send_buffer[PAXOS_MESSAGE_MAX_SIZE];
+  udp_transport_t transport;
+  paxos_eloop_t eloop;
+  paxos_eloop_handler_t net_handler;
+  struct node *node;
+};
+
+struct node {
+  paxos_membership_t membership;
+  uint64_t node_id;
+  uint32_t snapshot_interval;
+  uint32_t lease_duration;
+  uint32_t trace_events;                /* Per worker, 0 without tracing */
+  uint32_t num_groups;
+  uint32_t num_workers;
+  struct server *groups;                /* By group id */
+  struct worker *workers;
 };
 
-static void __send_learned_value (struct server *server, const udp_client_t *client) {
+static void __send_value (struct server *server,
+                          const struct request *request,
+                          uint64_t paxos_id,
+                          const paxos_value_t *value)
+{
   paxos_message_t message;
-  message.paxos_id = server->paxos.learner.paxos_id;
-  message.value = server->paxos.learner.learned_value;
-  udp_send(server->sock, client, &message);
+  const uint8_t *frame;
+  uint32_t size;
+
+  memset(&message, 0, sizeof(paxos_message_t));
+  message.type = PAXOS_USER_LEARN_VALUE;
+  message.group_id = server->paxos.group_id;
+  message.paxos_id = paxos_id;
+  message.request_id = request->request_id;
+  paxos_value_ref(&(message.value), value);
+  frame = paxos_message_frame(&message, server->worker->send_buffer, &size);
+  if (frame != NULL)
+    udp_transport_send_to(&(server->worker->transport), &(request->client), frame, size);
 }
 
-static void __wait_proposed (struct server *server, const udp_client_t *client) {
-  /* Silent drop notification if we've too many pending requests */
-  if (server->num_clients >= NPENDING_CLIENTS)
-    return;
+static void __send_result (struct server *server,
+                           const struct request *request,
+                           uint64_t paxos_id,
+                           uint8_t status)
+{
+  paxos_value_t result;
+  uint8_t header[PAXOS_KV_RESULT_HEADER_SIZE];
 
-  /* Add client to the pending queue */
-  memcpy(&(server->clients[server->num_clients++]), client, sizeof(udp_client_t));
+  memset(header, 0, sizeof(header));
+  header[0] = status;
+  paxos_value_wrap(&result, header, sizeof(header));
+  __send_value(server, request, paxos_id, &result);
 }
 
-static void __send_proposed (struct server *server, const udp_client_t *client) {
-  if (server->paxos.learner.has_learned_value) {
-    __send_learned_value(server, client);
-  } else {
-    __wait_proposed(server, client);
+/* The group counters and latencies, then the ones of the server and its worker */
+#define SERVER_STATS_MAX_SIZE     (4 << 10)
+static void __send_stats (struct server *server, const struct request *request) {
+  const udp_transport_stats_t *transport = &(server->worker->transport.stats);
+  char buffer[SERVER_STATS_MAX_SIZE];
+  paxos_message_t message;
+  const uint8_t *frame;
+  uint32_t length;
+  uint32_t size;
+
+  length = paxos_stats_format(&(server->paxos.stats), buffer, sizeof(buffer));
+
+#define __format_counter(name, value)                                       \
+  length += paxos_stats_format_counter(buffer + length, sizeof(buffer) - length, \
+                                       name, value)
+
+  __format_counter("applied_id", server->kv.applied_id);
+  __format_counter("num_send", server->num_send);
+  __format_counter("num_broadcast", server->num_broadcast);
+  __format_counter("pending_reads", server->num_reads);
+  __format_counter("pending_writes", server->pending.count);
+  __format_counter("queued_writes", server->pending.queued.count);
+  __format_counter("duplicate_writes", server->num_duplicates);
+  __format_counter("duplicate_applies", server->num_reapplied);
+  __format_counter("sessions", server->sessions.count);
+  __format_counter("worker_recv_calls", transport->recv_calls);
+  __format_counter("worker_recv_datagrams", transport->recv_datagrams);
+  __format_counter("worker_send_calls", transport->send_calls);
+  __format_counter("worker_send_datagrams", transport->send_datagrams);
+  __format_counter("worker_send_errors", server->worker->transport.num_send_errors);
+
+#undef __format_counter
+
+  memset(&message, 0, sizeof(paxos_message_t));
+  message.type = PAXOS_USER_STATS;
+  message.group_id = server->paxos.group_id;
+  message.request_id = request->request_id;
+  paxos_value_wrap(&(message.value), buffer, length);
+  frame = paxos_message_frame(&message, server->worker->send_buffer, &size);
+  if (frame != NULL)
+    udp_transport_send_to(&(server->worker->transport), &(request->client), frame, size);
+}
+
+/* ============================================================================
+ *  Proposal batching
+ */
+static uint64_t __wall_time (void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return(now.tv_sec * 1000ull + now.tv_nsec / 1000000);
+}
+
+static struct batch *__batch_alloc (struct server *server) {
+  struct batch_header header;
+  int i;
+  for (i = 0; i < NPENDING_BATCHES; ++i) {
+    struct batch *batch = &(server->batches[i]);
+    if (batch->state == BATCH_FREE) {
+      header.node_id = server->paxos.node_id;
+      header.seqid = server->batch_seqid;
+      header.time = __wall_time();
+      if (paxos_value_set(&(batch->value), &header, BATCH_HEADER_SIZE))
+        return(NULL);
+      batch->num_items = 0;
+      batch->seqid = server->batch_seqid++;
+      batch->state = BATCH_OPEN;
+      return(batch);
+    }
   }
+  return(NULL);
 }
 
-static void __paxos_send (void *arg, uint64_t node_id, const paxos_message_t *message) {
+/* Propose the closed batches, oldest first, as long as the window has room */
+static void __batch_propose_ready (struct server *server) {
+  struct batch *oldest;
+  int i;
+
+  while (1) {
+    oldest = NULL;
+    for (i = 0; i < NPENDING_BATCHES; ++i) {
+      struct batch *batch = &(server->batches[i]);
+      if (batch->state == BATCH_READY && (oldest == NULL || batch->seqid < oldest->seqid))
+        oldest = batch;
+    }
+
+    if (oldest == NULL)
+      break;
+
+    oldest->paxos_id = server->paxos.proposer.next_paxos_id;
+    if (paxos_propose(&(server->paxos), &(oldest->value)) < 0)
+      break;
+    oldest->state = BATCH_PROPOSED;
+  }
+}
+
+static void __batch_close (struct server *server) {
+  paxos_timeout_stop(&(server->batch_timeout));
+  if (server->open_batch != NULL) {
+    server->open_batch->state = BATCH_READY;
+    server->open_batch = NULL;
+  }
+  __batch_propose_ready(server);
+}
+
+static void __on_batch_timeout (void *arg) {
+  __batch_close((struct server *)arg);
+}
+
+/* -1 if there's no batch for it, the request stays queued */
+static int __batch_add (struct server *server,
+                        uint32_t index,
+                        const paxos_value_t *item)
+{
+  struct batch *batch;
+
+  /* No room for the item, propose what we have and start a new batch */
+  batch = server->open_batch;
+  if (batch != NULL && batch->value.size + sizeof(uint32_t) + item->size >
+                                                      PAXOS_VALUE_MAX_SIZE)
+  {
+    __batch_close(server);
+    batch = NULL;
+  }
+
+  if (batch == NULL) {
+    if ((batch = __batch_alloc(server)) == NULL)
+      return(-1);
+    server->open_batch = batch;
+    paxos_timeout_start(&(server->batch_timeout));
+  }
+
+  if (paxos_value_add_item(&(batch->value), item->data, item->size))
+    return(-1);
+  batch->items[batch->num_items++] = index;
+  paxos_pending_propose(&(server->pending), index);
+
+  if (batch->num_items == BATCH_MAX_ITEMS)
+    __batch_close(server);
+  return(0);
+}
+
+/* Move the queued requests in the batches, oldest first */
+static void __batch_drain (struct server *server) {
+  paxos_pending_entry_t *entry;
+  uint32_t index;
+
+  while (paxos_pending_has_queued(&(server->pending))) {
+    index = paxos_pending_first_queued(&(server->pending));
+    entry = paxos_pending_get(&(server->pending), index);
+    if (__batch_add(server, index, &(entry->value)))
+      break;
+  }
+}
+
+/* The batches in flight are dropped, their clients retry */
+static void __batch_abort_proposed (struct server *server) {
+  struct batch *batch;
+  uint32_t i;
+  int b;
+
+  for (b = 0; b < NPENDING_BATCHES; ++b) {
+    batch = &(server->batches[b]);
+    if (batch->state != BATCH_PROPOSED)
+      continue;
+
+    for (i = 0; i < batch->num_items; ++i)
+      paxos_pending_remove(&(server->pending), batch->items[i]);
+    batch->state = BATCH_FREE;
+  }
+  __batch_drain(server);
+}
+
+/* Its instance went to another value: the requests are queued again */
+static void __batch_requeue (struct server *server, struct batch *batch) {
+  paxos_value_t value;
+  const uint8_t *item;
+  uint32_t offset;
+  uint32_t size;
+  uint32_t i;
+
+  offset = BATCH_HEADER_SIZE;
+  for (i = 0; i < batch->num_items &&
+              paxos_value_next_item(&(batch->value), &offset, &item, &size) > 0; ++i)
+  {
+    /* Out of memory, forgotten: the client retries */
+    paxos_value_wrap(&value, item, size);
+    if (paxos_pending_queue(&(server->pending), batch->items[i], &value))
+      paxos_pending_remove(&(server->pending), batch->items[i]);
+  }
+
+  batch->state = BATCH_FREE;
+  __batch_drain(server);
+}
+
+/* Our batch the learned value is, by its header */
+static struct batch *__batch_find (struct server *server,
+                                   const struct batch_header *header)
+{
+  int i;
+
+  if (header->node_id != server->paxos.node_id)
+    return(NULL);
+
+  for (i = 0; i < NPENDING_BATCHES; ++i) {
+    struct batch *batch = &(server->batches[i]);
+    if (batch->state == BATCH_PROPOSED && batch->seqid == header->seqid)
+      return(batch);
+  }
+  return(NULL);
+}
+
+/* The result goes to the client, the request is no longer ours */
+static void __reply_pending (struct server *server,
+                             uint32_t index,
+                             uint64_t paxos_id,
+                             const paxos_value_t *result)
+{
+  paxos_pending_entry_t *entry = paxos_pending_get(&(server->pending), index);
+  struct request request;
+
+  memcpy(&(request.client), &(entry->client), sizeof(udp_client_t));
+  request.request_id = entry->request_id;
+  __send_value(server, &request, paxos_id, result);
+  paxos_pending_remove(&(server->pending), index);
+}
+
+/*
+ * Apply a command of a learned value, once per request: if the request
+ * is in the sessions the command was applied already, result and paxos_id
+ * become the ones of the first time.
+ */
+static const paxos_value_t *__session_apply (struct server *server,
+                                             const struct batch_item *request,
+                                             const paxos_kv_command_t *command,
+                                             uint64_t *paxos_id)
+{
+  paxos_pending_entry_t *entry;
+  udp_client_t client;
+  uint32_t index;
+
+  memset(&client, 0, sizeof(udp_client_t));
+  client.addr.sin_family = AF_INET;
+  client.addr.sin_addr.s_addr = request->addr;
+  client.addr.sin_port = request->port;
+  client.addrlen = sizeof(struct sockaddr_in);
+
+  index = paxos_pending_lookup(&(server->sessions), &client, request->request_id);
+  if (index != PAXOS_PENDING_NONE) {
+    entry = paxos_pending_get(&(server->sessions), index);
+    server->num_reapplied++;
+    *paxos_id = entry->paxos_id;
+    return(&(entry->value));
+  }
+
+  /* Out of memory, not in the sessions: a retry would apply it again */
+  paxos_kv_apply(&(server->kv), command, &(server->result));
+  index = paxos_pending_insert(&(server->sessions), &client, request->request_id);
+  if (index != PAXOS_PENDING_NONE)
+    paxos_pending_done(&(server->sessions), index, *paxos_id,
+                       &(server->result), server->session_time);
+  return(&(server->result));
+}
+
+/*
+ * Apply the commands of a learned value, in order. If the value is one of
+ * our batches each client gets the result of its own command.
+ */
+static void __batch_learned (struct server *server,
+                             uint64_t paxos_id,
+                             const paxos_value_t *value)
+{
+  const paxos_value_t *result;
+  struct batch_header header;
+  struct batch_item request;
+  paxos_kv_command_t command;
+  const uint8_t *item;
+  struct batch *batch;
+  uint64_t result_id;
+  uint32_t offset;
+  uint32_t size;
+  uint32_t i;
+
+  /* A noop (empty) has no header, nor commands */
+  batch = NULL;
+  offset = value->size;
+  if (value->size >= BATCH_HEADER_SIZE) {
+    memcpy(&header, value->data, BATCH_HEADER_SIZE);
+    batch = __batch_find(server, &header);
+    offset = BATCH_HEADER_SIZE;
+
+    if (header.time > server->session_time)
+      server->session_time = header.time;
+    paxos_pending_expire(&(server->sessions), server->session_time, SESSION_TTL);
+  }
+
+  for (i = 0; paxos_value_next_item(value, &offset, &item, &size) > 0; ++i) {
+    /* Validated before being batched, but every replica must skip the same */
+    if (size < BATCH_ITEM_SIZE ||
+        paxos_kv_command_decode(&command, item + BATCH_ITEM_SIZE, size - BATCH_ITEM_SIZE))
+    {
+      continue;
+    }
+
+    memcpy(&request, item, BATCH_ITEM_SIZE);
+    result_id = paxos_id;
+    result = __session_apply(server, &request, &command, &result_id);
+    if (batch != NULL && i < batch->num_items)
+      __reply_pending(server, batch->items[i], result_id, result);
+  }
+  server->kv.applied_id = paxos_id;
+
+  if (batch != NULL) {
+    batch->state = BATCH_FREE;
+    __batch_drain(server);
+  }
+
+  /* Something left the window, make room for the batches waiting */
+  __batch_propose_ready(server);
+}
+
+/* ============================================================================
+ *  Reads
+ */
+static void __read_add (struct server *server,
+                        const struct request *request,
+                        const paxos_value_t *command)
+{
+  struct pending_read *pending;
+
+  /* No room for it, the client knows at once instead of timing out */
+  pending = &(server->reads[(server->read_head + server->num_reads) % NPENDING_READS]);
+  if (server->num_reads == NPENDING_READS ||
+      paxos_value_copy(&(pending->command), command))
+  {
+    __send_result(server, request, server->kv.applied_id, PAXOS_KV_NO_MEMORY);
+    return;
+  }
+  memcpy(&(pending->request), request, sizeof(struct request));
+  pending->seq = paxos_read_index(&(server->paxos));
+  server->num_reads++;
+}
+
+/* The table has everything the confirmed rounds have to see */
+static void __reads_ready (struct server *server) {
+  struct pending_read *pending;
+  paxos_kv_command_t command;
+
+  while (server->num_reads > 0) {
+    pending = &(server->reads[server->read_head]);
+    if (pending->seq > server->paxos.reader.ready_seq)
+      break;
+
+    if (!paxos_kv_command_decode(&command, pending->command.data, pending->command.size)) {
+      paxos_kv_apply(&(server->kv), &command, &(server->result));
+      __send_value(server, &(pending->request), server->kv.applied_id, &(server->result));
+    }
+    server->read_head = (server->read_head + 1) % NPENDING_READS;
+    server->num_reads--;
+  }
+}
+
+/* ============================================================================
+ *  Paxos Context
+ */
+static void __paxos_send (void *arg,
+                          uint64_t node_id,
+                          const void *frame,
+                          uint32_t size)
+{
   struct server *server = (struct server *)arg;
-  fprintf(stderr, "send: to %lu message %u:%s node %lu\n",
-          node_id, message->type, paxos_message_to_string(message), message->node_id);
-  udp_send_to("127.0.0.1", (unsigned int)(8080 + (node_id & 0xffff)), message);
+  udp_transport_send(&(server->worker->transport), node_id, frame, size);
   server->num_send++;
 }
 
-static void __paxos_broadcast (void *arg, const paxos_message_t *message) {
+static void __paxos_broadcast (void *arg, const void *frame, uint32_t size) {
   struct server *server = (struct server *)arg;
-  int i;
-  fprintf(stderr, "bcst: message %u:%s\n", message->type, paxos_message_to_string(message));
-  for (i = 0; i < 10; ++i) {
-    udp_broadcast("127.255.255.255", 8080 + i, message);
-  }
+  udp_transport_broadcast(&(server->worker->transport), frame, size);
   server->num_broadcast++;
 }
 
 static void __paxos_learned_value (void *arg) {
   struct server *server = (struct server *)arg;
-  fprintf(stderr, "Hey paxos told me a new value! paxos_id: %lu value: %lu\n",
-                  server->paxos.learner.paxos_id, server->paxos.learner.learned_value);
+  const paxos_value_t *value = &(server->paxos.learner.learned_value);
+
+  paxos_trace_event(PAXOS_TRACE_LEARNED, 0, server->paxos.group_id,
+                    server->paxos.node_id, server->paxos.learner.learned_paxos_id,
+                    0, value->size);
+  __batch_learned(server, server->paxos.learner.learned_paxos_id, value);
+}
 
-  while (server->num_clients > 0) {
-    udp_client_t *client = &(server->clients[--(server->num_clients)]);
-    __send_learned_value(server, client);
+static void __paxos_read_ready (void *arg) {
+  __reads_ready((struct server *)arg);
+}
+
+/* Still proposed once its instance is delivered: the value learned wasn't it */
+static void __paxos_proposal_decided (void *arg) {
+  struct server *server = (struct server *)arg;
+  uint64_t paxos_id = server->paxos.proposer.decided_paxos_id;
+  int i;
+
+  for (i = 0; i < NPENDING_BATCHES; ++i) {
+    struct batch *batch = &(server->batches[i]);
+    if (batch->state == BATCH_PROPOSED && batch->paxos_id == paxos_id) {
+      __batch_requeue(server, batch);
+      return;
+    }
   }
 }
 
-int main (int argc, char **argv) {
-  paxos_timeout_t *timeout;
+static int __paxos_take_snapshot (void *arg, paxos_snapshot_t *snapshot) {
+  struct server *server = (struct server *)arg;
+  struct snapshot_header header;
+  uint64_t size;
+
+  header.kv_size = paxos_kv_dump_size(&(server->kv));
+  header.session_time = server->session_time;
+  size = SNAPSHOT_HEADER_SIZE + header.kv_size + paxos_pending_dump_size(&(server->sessions));
+  if (paxos_snapshot_reserve(snapshot, size) == NULL)
+    return(-1);
+
+  memcpy(snapshot->data, &header, SNAPSHOT_HEADER_SIZE);
+  paxos_kv_dump(&(server->kv), snapshot->data + SNAPSHOT_HEADER_SIZE);
+  paxos_pending_dump(&(server->sessions),
+                     snapshot->data + SNAPSHOT_HEADER_SIZE + header.kv_size);
+  snapshot->size = size;
+  return(0);
+}
+
+/* All or nothing: the sessions are loaded aside, the kv is left as it is on failure */
+static int __paxos_install_snapshot (void *arg, const paxos_snapshot_t *snapshot) {
+  struct server *server = (struct server *)arg;
+  struct snapshot_header header;
+  paxos_pending_t sessions;
+  const uint8_t *sessions_dump;
+
+  if (snapshot->size < SNAPSHOT_HEADER_SIZE)
+    return(-1);
+  memcpy(&header, snapshot->data, SNAPSHOT_HEADER_SIZE);
+  if (header.kv_size > snapshot->size - SNAPSHOT_HEADER_SIZE)
+    return(-1);
+
+  if (paxos_pending_open(&sessions, 0))
+    return(-1);
+
+  sessions_dump = snapshot->data + SNAPSHOT_HEADER_SIZE + header.kv_size;
+  if (paxos_pending_load(&sessions, sessions_dump,
+                         snapshot->size - SNAPSHOT_HEADER_SIZE - header.kv_size) ||
+      paxos_kv_load(&(server->kv), snapshot->data + SNAPSHOT_HEADER_SIZE, header.kv_size))
+  {
+    paxos_pending_close(&sessions);
+    return(-1);
+  }
+
+  paxos_pending_close(&(server->sessions));
+  memcpy(&(server->sessions), &sessions, sizeof(paxos_pending_t));
+  server->session_time = header.session_time;
+  server->kv.applied_id = snapshot->paxos_id;
+
+  /* Our proposals may be gone with the rounds we skipped, the clients retry */
+  __batch_abort_proposed(server);
+  return(0);
+}
+
+/* The command after its request, as it goes in a batch */
+static int __write_item (struct server *server,
+                         const struct request *request,
+                         const paxos_value_t *command)
+{
+  paxos_value_t *item = &(server->item);
+  struct batch_item header;
+
+  if (paxos_value_reserve(item, BATCH_ITEM_SIZE + command->size))
+    return(-1);
+
+  header.request_id = request->request_id;
+  header.addr = request->client.addr.sin_addr.s_addr;
+  header.port = request->client.addr.sin_port;
+  header.__pad = 0;
+  memcpy(item->data, &header, BATCH_ITEM_SIZE);
+  memcpy(item->data + BATCH_ITEM_SIZE, command->data, command->size);
+  item->size = BATCH_ITEM_SIZE + command->size;
+  return(0);
+}
+
+/*
+ * A write is proposed once per (client, request id) by this node: a retry
+ * of a write still in flight here is dropped, the reply is on its way; a
+ * retry of a write in the sessions gets the same result again. A command
+ * proposed twice anyway (a batch requeued, a retry to another node) is
+ * applied once, see __batch_learned().
+ */
+static void __write_add (struct server *server,
+                         const struct request *request,
+                         const paxos_value_t *command)
+{
+  paxos_pending_t *pending = &(server->pending);
+  paxos_pending_entry_t *entry;
+  uint32_t index;
+
+  if (paxos_pending_lookup(pending, &(request->client), request->request_id) !=
+                                                          PAXOS_PENDING_NONE)
+  {
+    server->num_duplicates++;
+    return;
+  }
+
+  index = paxos_pending_lookup(&(server->sessions), &(request->client), request->request_id);
+  if (index != PAXOS_PENDING_NONE) {
+    entry = paxos_pending_get(&(server->sessions), index);
+    server->num_duplicates++;
+    __send_value(server, request, entry->paxos_id, &(entry->value));
+    return;
+  }
+
+  index = PAXOS_PENDING_NONE;
+  if (!__write_item(server, request, command))
+    index = paxos_pending_insert(pending, &(request->client), request->request_id);
+  if (index == PAXOS_PENDING_NONE) {
+    __send_result(server, request, server->kv.applied_id, PAXOS_KV_NO_MEMORY);
+    return;
+  }
+
+  /* Behind the queued ones, if any */
+  if (!paxos_pending_has_queued(pending) && !__batch_add(server, index, &(server->item)))
+    return;
+
+  if (paxos_pending_queue(pending, index, &(server->item))) {
+    paxos_pending_remove(pending, index);
+    __send_result(server, request, server->kv.applied_id, PAXOS_KV_NO_MEMORY);
+  }
+}
+
+/*
+ * The leader holding the lease reads from the local table, any other replica
+ * waits for a ReadIndex round: its table may be behind. Writes go through paxos.
+ */
+static void __process_command (struct server *server,
+                               const struct request *request,
+                               const paxos_value_t *value)
+{
+  paxos_kv_command_t command;
+
+  if (paxos_kv_command_decode(&command, value->data, value->size) ||
+      command.op < PAXOS_KV_GET || command.op > PAXOS_KV_CAS ||
+      BATCH_HEADER_SIZE + sizeof(uint32_t) + BATCH_ITEM_SIZE + value->size >
+                                                  PAXOS_VALUE_MAX_SIZE)
+  {
+    __send_result(server, request, server->kv.applied_id, PAXOS_KV_INVALID);
+    return;
+  }
+
+  if (command.op == PAXOS_KV_GET) {
+    if (paxos_has_lease(&(server->paxos))) {
+      paxos_kv_apply(&(server->kv), &command, &(server->result));
+      __send_value(server, request, server->kv.applied_id, &(server->result));
+    } else {
+      __read_add(server, request, value);
+    }
+    return;
+  }
+
+  __write_add(server, request, value);
+}
+
+static void __process_message (struct server *server,
+                               const udp_client_t *client,
+                               const paxos_message_t *message)
+{
+  struct request request;
+
+  paxos_trace_message(PAXOS_TRACE_RECV, message, message->node_id);
+
+  switch (message->type) {
+    case PAXOS_USER_PROPOSE_VALUE:
+      memcpy(&(request.client), client, sizeof(udp_client_t));
+      request.request_id = message->request_id;
+      __process_command(server, &request, &(message->value));
+      break;
+    case PAXOS_USER_STATS:
+      memcpy(&(request.client), client, sizeof(udp_client_t));
+      request.request_id = message->request_id;
+      __send_stats(server, &request);
+      break;
+    default:
+      paxos_process_message(&(server->paxos), message);
+      break;
+  }
+}
+
+/* Handle every datagram the transport picked up on this wakeup */
+static void __process_datagrams (struct worker *worker) {
+  struct node *node = worker->node;
   paxos_message_t message;
-  paxos_context_t context;
-  struct server server;
+  const uint8_t *frame;
   udp_client_t client;
+  struct server *server;
+  uint32_t size;
+  int i, n;
 
-  /* Initialize signals */
-  signal(SIGINT, __signal_handler);
+  n = udp_transport_recv(&(worker->transport));
+  for (i = 0; i < n; ++i) {
+    frame = udp_transport_datagram(&(worker->transport), i, &client, &size);
+    if (paxos_message_decode(&message, frame, size))
+      continue;
 
-  /* Initialize paxos context */
-  context.send = __paxos_send;
-  context.broadcast = __paxos_broadcast;
-  context.learned_value = __paxos_learned_value;
-  context.arg = &server;
+    /* Steered by the kernel, a group of another worker is not ours to touch */
+    if (message.group_id >= node->num_groups)
+      continue;
+    server = &(node->groups[message.group_id]);
+    if (server->worker == worker)
+      __process_message(server, &client, &message);
+  }
+}
 
-  /* Initialize server */
-  memset(&server, 0, sizeof(struct server));
+/* ============================================================================
+ *  Event Handlers
+ */
+static void __on_net_ready (void *arg) {
+  __process_datagrams((struct worker *)arg);
+}
+
+/* The disk is done with a batch, send out the responses */
+static void __on_storage_ready (void *arg) {
+  struct server *server = (struct server *)arg;
+  paxos_storage_complete(&(server->paxos));
+}
+
+static int __add_handler (paxos_eloop_t *eloop,
+                          paxos_eloop_handler_t *handler,
+                          int fd,
+                          paxos_callback_t callback,
+                          void *arg)
+{
+  handler->fd = fd;
+  handler->callback = callback;
+  handler->arg = arg;
+  return(paxos_eloop_add(eloop, handler));
+}
+
+/* ============================================================================
+ *  Groups & Workers
+ */
+/* The first group keeps the file names of a single group node */
+static void __group_path (char *path,
+                          size_t size,
+                          const struct node *node,
+                          uint16_t group_id,
+                          const char *ext)
+{
+  if (group_id == 0) {
+    snprintf(path, size, "paxos-%lu.%s", node->node_id, ext);
+  } else {
+    snprintf(path, size, "paxos-%lu.%u.%s", node->node_id, group_id, ext);
+  }
+}
+
+static int __server_open (struct node *node, struct server *server, uint16_t group_id) {
+  struct worker *worker = &(node->workers[group_id % node->num_workers]);
+  struct timespec now;
+  char path[64];
+
+  server->worker = worker;
+  if (paxos_kv_open(&(server->kv), 0)) {
+    perror("paxos_kv_open()");
+    return(-1);
+  }
+
+  if (paxos_pending_open(&(server->pending), 0) ||
+      paxos_pending_open(&(server->sessions), 0))
+  {
+    perror("paxos_pending_open()");
+    return(-1);
+  }
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  server->batch_seqid = now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+
+  paxos_timeout_init(&(server->batch_timeout), PAXOS_BATCH_DELAY,
+                     __on_batch_timeout, server);
+  paxos_timeout_attach(&(server->batch_timeout), paxos_eloop_timers(&(worker->eloop)));
+
+  /* Initialize paxos context */
+  server->context.send = __paxos_send;
+  server->context.broadcast = __paxos_broadcast;
+  server->context.learned_value = __paxos_learned_value;
+  server->context.take_snapshot = __paxos_take_snapshot;
+  server->context.install_snapshot = __paxos_install_snapshot;
+  server->context.read_ready = __paxos_read_ready;
+  server->context.proposal_decided = __paxos_proposal_decided;
+  server->context.timers = paxos_eloop_timers(&(worker->eloop));
+  server->context.arg = server;
 
   /* Initialize paxos */
-  paxos_open(&(server.paxos), &context, argc, 3);
+  if (paxos_open(&(server->paxos), &(server->context), group_id, node->node_id,
+                 node->membership.num_members, PAXOS_DEFAULT_WINDOW_SIZE))
+  {
+    perror("paxos_open()");
+    return(-1);
+  }
 
-  fprintf(stderr, "PAXOS %lu MESSAGE %lu -> NODE ID: %lu -> PORT %lu\n",
-    sizeof(paxos_t), sizeof(paxos_message_t),
-    server.paxos.node_id, 8080 + server.paxos.node_id);
+  paxos_open_lease(&(server->paxos), node->lease_duration);
 
-  /* Initialize UDP Server */
-  if ((server.sock = udp_bind(8080 + server.paxos.node_id)) < 0) {
-    perror("udp_bind()");
-    return(1);
+  /* The state comes back from the snapshot, then the acceptor from the WAL */
+  __group_path(path, sizeof(path), node, group_id, "snap");
+  if (paxos_open_snapshot(&(server->paxos), path, node->snapshot_interval)) {
+    perror("paxos_open_snapshot()");
+    return(-1);
+  }
+
+  __group_path(path, sizeof(path), node, group_id, "wal");
+  if (paxos_open_wal(&(server->paxos), path, PAXOS_WAL_BATCH_DELAY)) {
+    perror("paxos_open_wal()");
+    return(-1);
+  }
+
+  if (__add_handler(&(worker->eloop), &(server->storage_handler),
+                    paxos_storage_fd(&(server->paxos)), __on_storage_ready, server))
+  {
+    perror("paxos_eloop_add()");
+    return(-1);
   }
+  return(0);
+}
+
+static void __server_close (struct server *server) {
+  int i;
+
+  /* Restart from here, without waiting for the peers to send it back */
+  paxos_snapshot(&(server->paxos));
+  for (i = 0; i < NPENDING_BATCHES; ++i)
+    paxos_value_free(&(server->batches[i].value));
+  for (i = 0; i < NPENDING_READS; ++i)
+    paxos_value_free(&(server->reads[i].command));
+  paxos_value_free(&(server->result));
+  paxos_value_free(&(server->item));
+  paxos_pending_close(&(server->pending));
+  paxos_pending_close(&(server->sessions));
+  paxos_kv_close(&(server->kv));
+  paxos_close(&(server->paxos));
+}
+
+static int __worker_open (struct node *node, struct worker *worker, unsigned int id) {
+  const paxos_member_t *member;
+  uint32_t i;
+
+  worker->id = id;
+  worker->node = node;
+  if (paxos_eloop_open(&(worker->eloop))) {
+    perror("paxos_eloop_open()");
+    return(-1);
+  }
+
+  /* Initialize UDP Server, bound in worker order: the steering relies on it */
+  member = paxos_membership_get(&(node->membership), node->node_id);
+  if (udp_transport_open(&(worker->transport), member->port,
+                         SERVER_BATCH_IO | UDP_TRANSPORT_REUSEPORT))
+  {
+    perror("udp_transport_open()");
+    return(-1);
+  }
+
+  /* Broadcasts go to each member, ourself included */
+  for (i = 0; i < node->membership.num_members; ++i) {
+    member = &(node->membership.members[i]);
+    if (udp_transport_add_peer(&(worker->transport), member->node_id,
+                               member->host, member->port))
+    {
+      fprintf(stderr, "unable to resolve %s\n", member->host);
+      return(-1);
+    }
+  }
+
+  if (__add_handler(&(worker->eloop), &(worker->net_handler),
+                    udp_transport_fd(&(worker->transport)), __on_net_ready, worker))
+  {
+    perror("paxos_eloop_add()");
+    return(-1);
+  }
+  return(0);
+}
+
+static void __worker_close (struct worker *worker) {
+  udp_transport_close(&(worker->transport));
+  paxos_eloop_close(&(worker->eloop));
+}
+
+/* Keep each worker on its own core */
+static void __worker_pin (struct worker *worker) {
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t cpus;
+
+  if (ncpus <= 1)
+    return;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(worker->id % ncpus, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+}
+
+static void *__worker_run (void *arg) {
+  struct worker *worker = (struct worker *)arg;
+  struct node *node = worker->node;
+  uint64_t last_recv;
+  time_t next_stats;
+  uint32_t g;
+
+  __worker_pin(worker);
+
+  /* The first worker runs on the main thread, its ring is already there */
+  if (worker->id > 0 && node->trace_events > 0)
+    paxos_trace_attach(worker->id, node->trace_events);
 
   /* Bootstrap paxos */
-  paxos_bootstrap(&(server.paxos));
+  for (g = worker->id; g < node->num_groups; g += node->num_workers)
+    paxos_bootstrap(&(node->groups[g].paxos));
+  udp_transport_flush(&(worker->transport));
 
   /* Start spinning... */
+  last_recv = 0;
+  next_stats = time(NULL) + SERVER_STATS_INTERVAL;
   while (__is_running) {
-    timeout = paxos_timeout(&(server.paxos));
-    if (udp_recv(server.sock, &client, &message, paxos_timeout_remaining(timeout)) < 0) {
-      paxos_timeout_trigger(timeout);
-    } else {
-      printf("recv: %s:%d -> %u:%s from %lu (send: %lu broadcast: %lu)\n",
-             inet_ntoa(client.addr.sin_addr), ntohs(client.addr.sin_port),
-             message.type, paxos_message_to_string(&message), message.node_id,
-             server.num_send, server.num_broadcast);
-
-      switch (message.type) {
-        case PAXOS_USER_PROPOSE_VALUE:
-          fprintf(stderr, "USER PROPOSE VALUE %lu\n", message.value);
-          paxos_propose(&(server.paxos), message.value);
-          __wait_proposed(&server, &client);
-          break;
-        case PAXOS_USER_LEARN_VALUE:
-          fprintf(stderr, "USER LEARN VALUE\n");
-          __send_proposed(&server, &client);
-          break;
-        default:
-          paxos_process_message(&(server.paxos), &message);
-          break;
+    paxos_eloop_run_once(&(worker->eloop), SERVER_STOP_CHECK);
+
+    /* Everything sent during this iteration goes out together */
+    udp_transport_flush(&(worker->transport));
+
+    if (time(NULL) >= next_stats) {
+      if (worker->transport.stats.recv_datagrams != last_recv) {
+        fprintf(stderr, "worker %u: ", worker->id);
+        udp_transport_dump_stats(&(worker->transport), stderr);
+        last_recv = worker->transport.stats.recv_datagrams;
       }
+      next_stats = time(NULL) + SERVER_STATS_INTERVAL;
+    }
+  }
+
+  fprintf(stderr, "worker %u: ", worker->id);
+  udp_transport_dump_stats(&(worker->transport), stderr);
+  return(NULL);
+}
+
+static void __usage (void) {
+  fprintf(stderr, "usage: paxos-server [-g groups] [-t threads] [-s snapshot interval] "
+                  "[-l lease msec] [-T trace events] <node id> [config (%s)]\n",
+                  PAXOS_DEFAULT_CONFIG);
+}
+
+int main (int argc, char **argv) {
+  const paxos_member_t *member;
+  const char *config_path;
+  struct node node;
+  sigset_t sigmask;
+  uint32_t i;
+  int opt;
+
+  memset(&node, 0, sizeof(struct node));
+  node.num_groups = 1;
+  node.num_workers = 1;
+  node.snapshot_interval = PAXOS_SNAPSHOT_INTERVAL;
+  node.lease_duration = PAXOS_LEASE_DURATION;
+  node.trace_events = PAXOS_TRACE_DEFAULT_EVENTS;
+  while ((opt = getopt(argc, argv, "g:t:s:l:T:")) != -1) {
+    switch (opt) {
+      case 'g': node.num_groups = strtoul(optarg, NULL, 10); break;
+      case 't': node.num_workers = strtoul(optarg, NULL, 10); break;
+      case 's': node.snapshot_interval = strtoul(optarg, NULL, 10); break;
+      case 'l': node.lease_duration = strtoul(optarg, NULL, 10); break;
+      case 'T': node.trace_events = strtoul(optarg, NULL, 10); break;
+      default: __usage(); return(1);
     }
   }
 
+  if (optind >= argc || argc - optind > 2 ||
+      node.num_groups == 0 || node.num_groups > SERVER_MAX_GROUPS ||
+      node.num_workers == 0)
+  {
+    __usage();
+    return(1);
+  }
+
+  /* A worker with no groups would be idle */
+  if (node.num_workers > node.num_groups)
+    node.num_workers = node.num_groups;
+
+  /* Initialize signals */
+  signal(SIGINT, __signal_handler);
+
+  /* Load the cluster members */
+  node.node_id = strtoull(argv[optind], NULL, 10);
+  config_path = (argc - optind > 1) ? argv[optind + 1] : PAXOS_DEFAULT_CONFIG;
+  if (paxos_membership_load(&(node.membership), config_path)) {
+    fprintf(stderr, "unable to load the members from %s\n", config_path);
+    return(1);
+  }
+
+  if ((member = paxos_membership_get(&(node.membership), node.node_id)) == NULL) {
+    fprintf(stderr, "node %lu is not a member in %s\n", node.node_id, config_path);
+    return(1);
+  }
+
+  fprintf(stderr, "PAXOS %lu MESSAGE %lu -> NODE ID: %lu -> %s:%u (%u nodes) "
+                  "%u groups %u workers\n",
+    sizeof(paxos_t), sizeof(paxos_message_t), node.node_id,
+    member->host, member->port, node.membership.num_members,
+    node.num_groups, node.num_workers);
+
+  /* Dumped on SIGUSR1 or on a crash, decode it with paxos-trace */
+  if (node.trace_events > 0) {
+    char path[64];
+    __group_path(path, sizeof(path), &node, 0, "trace");
+    if (paxos_trace_attach(0, node.trace_events) || paxos_trace_install(path)) {
+      fprintf(stderr, "unable to set up the trace %s\n", path);
+      return(1);
+    }
+  }
+
+  /* Initialize servers */
+  node.workers = (struct worker *) calloc(node.num_workers, sizeof(struct worker));
+  node.groups = (struct server *) calloc(node.num_groups, sizeof(struct server));
+  if (node.workers == NULL || node.groups == NULL) {
+    perror("calloc()");
+    return(1);
+  }
+
+  for (i = 0; i < node.num_workers; ++i) {
+    if (__worker_open(&node, &(node.workers[i]), i))
+      return(1);
+  }
+
+  if (node.num_workers > 1 &&
+      udp_transport_steer_by_group(&(node.workers[0].transport), node.num_workers))
+  {
+    perror("udp_transport_steer_by_group()");
+    return(1);
+  }
+
+  for (i = 0; i < node.num_groups; ++i) {
+    if (__server_open(&node, &(node.groups[i]), i))
+      return(1);
+  }
+
+  /* The first worker runs here, it gets the signals */
+  sigemptyset(&sigmask);
+  sigaddset(&sigmask, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+  for (i = 1; i < node.num_workers; ++i) {
+    if (pthread_create(&(node.workers[i].thread), NULL, __worker_run, &(node.workers[i]))) {
+      perror("pthread_create()");
+      return(1);
+    }
+  }
+  pthread_sigmask(SIG_UNBLOCK, &sigmask, NULL);
+  __worker_run(&(node.workers[0]));
+  for (i = 1; i < node.num_workers; ++i)
+    pthread_join(node.workers[i].thread, NULL);
+
   /* ...and we're done */
-  paxos_close(&(server.paxos));
-  close(server.sock);
+  for (i = 0; i < node.num_groups; ++i)
+    __server_close(&(node.groups[i]));
+  for (i = 0; i < node.num_workers; ++i)
+    __worker_close(&(node.workers[i]));
+  free(node.groups);
+  free(node.workers);
   return(0);
 }
-
@@ -0,0 +1,652 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Deterministic cluster simulator: N replicas in one process, on a virtual
+ * clock. paxos_t only sees the context callbacks and its timeouts, here the
+ * frames go through a seeded scheduler instead of sockets: each link has
+ * its latency (plus jitter) and drops, duplicates or delays (reorders)
+ * datagrams with the given probabilities. Same seed, same run.
+ *
+ * A closed-loop client keeps -c values out on the target node, a value not
+ * learned within the retry timeout is proposed again. At the end it
+ * reports the committed values per simulated second, the messages and
+ * the propose->learn latency, and checks that every replica learned the
+ * same value for each paxos_id. It fails on a safety violation, and with
+ * -m on a committed rate below the minimum (a stall): see sim-test.sh.
+ *
+ *   usage: paxos-sim [options]
+ */
+
+#include <sys/time.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "histogram.h"
+#include "paxos.h"
+
+#define SIM_MAX_NODES           (PAXOS_MAX_NODES - 1)   /* node_id 1..N */
+#define SIM_START_TIME          (1000000ull)            /* usec */
+#define SIM_SELF_LATENCY        (5)                     /* usec, loopback */
+#define SIM_REORDER_DELAY       (4)                     /* x the link latency */
+#define SIM_MIN_VALUE_SIZE      (sizeof(uint64_t))
+
+struct sim_event {
+  uint64_t time;                        /* usec, of the delivery */
+  uint64_t seq;                         /* Ties go in scheduling order */
+  uint32_t from;
+  uint32_t to;
+  uint32_t size;
+  uint8_t *frame;
+};
+
+struct sim_node {
+  struct sim *sim;
+  paxos_t paxos;
+  paxos_context_t context;
+  paxos_timer_wheel_t timers;
+  uint64_t node_id;
+  uint64_t num_learned;
+};
+
+struct sim_request {
+  struct sim *sim;
+  paxos_timeout_t retry_timeout;
+  uint64_t seq;                         /* seq % outstanding is the slot */
+  uint64_t submit_time;                 /* usec, of the first proposal */
+  uint8_t in_use;
+  uint8_t queued;
+};
+
+struct sim_stats {
+  uint64_t sent;
+  uint64_t delivered;
+  uint64_t dropped;
+  uint64_t duplicated;
+  uint64_t reordered;
+  uint64_t by_type[256];
+};
+
+struct sim {
+  struct sim_node nodes[SIM_MAX_NODES + 1];
+  uint32_t link_latency[SIM_MAX_NODES + 1][SIM_MAX_NODES + 1];  /* usec */
+  uint32_t num_nodes;
+  uint32_t jitter;                      /* usec */
+  double loss;                          /* % */
+  double duplicate;                     /* % */
+  double reorder;                       /* % */
+  uint64_t seed;
+  uint64_t now;                         /* usec */
+  uint64_t end_time;
+
+  /* Pending deliveries, a binary heap on (time, seq) */
+  struct sim_event *events;
+  uint32_t num_events;
+  uint32_t max_events;
+  uint64_t next_event_seq;
+  uint64_t num_steps;
+
+  /* Client */
+  struct sim_request *requests;
+  uint32_t *proposals;                  /* Requests waiting for the window */
+  uint32_t proposal_head;
+  uint32_t num_proposals;
+  uint32_t outstanding;
+  uint32_t target;
+  uint32_t value_size;
+  uint32_t retry_timeout;               /* msec */
+  uint32_t window_size;
+  uint32_t lease_duration;              /* msec */
+  uint8_t *value_buffer;
+
+  /* Results */
+  paxos_histogram_t latency;
+  uint64_t num_committed;
+  uint64_t num_retries;
+  uint64_t *chosen;                     /* Value hash | 1 by paxos_id, 0 unknown */
+  uint64_t max_chosen;
+  uint64_t num_violations;
+  double min_rate;                      /* Committed/simulated sec, 0 any */
+  struct sim_stats stats;
+};
+
+static uint64_t __random (struct sim *sim) {
+  /* xorshift64* */
+  sim->seed ^= sim->seed >> 12;
+  sim->seed ^= sim->seed << 25;
+  sim->seed ^= sim->seed >> 27;
+  return(sim->seed * 2685821657736338717ull);
+}
+
+/* 1 with probability percent% */
+static int __chance (struct sim *sim, double percent) {
+  return(percent > 0 && (__random(sim) % 1000000) < (uint64_t)(percent * 10000));
+}
+
+static uint64_t __hash (const uint8_t *data, uint32_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  while (size--) {
+    hash ^= *data++;
+    hash *= 1099511628211ull;
+  }
+  return(hash);
+}
+
+/* ============================================================================
+ *  Event queue
+ */
+#define __event_before(a, b)                                                \
+  ((a)->time < (b)->time || ((a)->time == (b)->time && (a)->seq < (b)->seq))
+
+static int __event_push (struct sim *sim, struct sim_event *event) {
+  struct sim_event *events;
+  uint32_t i, parent;
+
+  if (sim->num_events == sim->max_events) {
+    uint32_t capacity = sim->max_events ? sim->max_events * 2 : 1024;
+    events = (struct sim_event *) realloc(sim->events, capacity * sizeof(struct sim_event));
+    if (events == NULL)
+      return(-1);
+    sim->events = events;
+    sim->max_events = capacity;
+  }
+
+  event->seq = sim->next_event_seq++;
+  for (i = sim->num_events++; i > 0; i = parent) {
+    parent = (i - 1) / 2;
+    if (!__event_before(event, &(sim->events[parent])))
+      break;
+    sim->events[i] = sim->events[parent];
+  }
+  sim->events[i] = *event;
+  return(0);
+}
+
+static void __event_pop (struct sim *sim, struct sim_event *event) {
+  struct sim_event *last;
+  uint32_t i, child;
+
+  *event = sim->events[0];
+  last = &(sim->events[--sim->num_events]);
+  for (i = 0; (child = 2 * i + 1) < sim->num_events; i = child) {
+    if (child + 1 < sim->num_events &&
+        __event_before(&(sim->events[child + 1]), &(sim->events[child])))
+    {
+      child++;
+    }
+    if (!__event_before(&(sim->events[child]), last))
+      break;
+    sim->events[i] = sim->events[child];
+  }
+  sim->events[i] = *last;
+}
+
+/* ============================================================================
+ *  Network
+ */
+static void __schedule (struct sim *sim,
+                        uint32_t from,
+                        uint32_t to,
+                        const void *frame,
+                        uint32_t size,
+                        uint64_t delay)
+{
+  struct sim_event event;
+
+  if ((event.frame = (uint8_t *) malloc(size)) == NULL)
+    return;
+  memcpy(event.frame, frame, size);
+  event.time = sim->now + delay;
+  event.from = from;
+  event.to = to;
+  event.size = size;
+  if (__event_push(sim, &event))
+    free(event.frame);
+}
+
+static uint64_t __link_delay (struct sim *sim, uint32_t from, uint32_t to) {
+  uint64_t delay = sim->link_latency[from][to];
+  if (from != to && sim->jitter > 0)
+    delay += __random(sim) % (sim->jitter + 1);
+  return(delay);
+}
+
+/* A datagram on the link from -> to: the loopback never fails */
+static void __link_send (struct sim *sim,
+                         uint32_t from,
+                         uint32_t to,
+                         const void *frame,
+                         uint32_t size)
+{
+  uint64_t delay;
+
+  sim->stats.sent++;
+  if (size > 1)
+    sim->stats.by_type[((const uint8_t *)frame)[1]]++;
+
+  if (from != to && __chance(sim, sim->loss)) {
+    sim->stats.dropped++;
+    return;
+  }
+
+  delay = __link_delay(sim, from, to);
+  if (from != to && __chance(sim, sim->reorder)) {
+    delay += SIM_REORDER_DELAY * (uint64_t)sim->link_latency[from][to];
+    sim->stats.reordered++;
+  }
+  __schedule(sim, from, to, frame, size, delay);
+
+  if (from != to && __chance(sim, sim->duplicate)) {
+    sim->stats.duplicated++;
+    __schedule(sim, from, to, frame, size, __link_delay(sim, from, to));
+  }
+}
+
+static void __deliver (struct sim *sim, const struct sim_event *event) {
+  paxos_message_t message;
+
+  if (paxos_message_decode(&message, event->frame, event->size))
+    return;
+  sim->stats.delivered++;
+  paxos_process_message(&(sim->nodes[event->to].paxos), &message);
+}
+
+/* ============================================================================
+ *  Client
+ */
+static void __propose_ready (struct sim *sim) {
+  paxos_t *paxos = &(sim->nodes[sim->target].paxos);
+  struct sim_request *request;
+  paxos_value_t value;
+
+  while (sim->num_proposals > 0) {
+    request = &(sim->requests[sim->proposals[sim->proposal_head]]);
+    memcpy(sim->value_buffer, &(request->seq), sizeof(uint64_t));
+    paxos_value_wrap(&value, sim->value_buffer, sim->value_size);
+    if (paxos_propose(paxos, &value) < 0)
+      break;
+
+    paxos_timeout_start(&(request->retry_timeout));
+    request->queued = 0;
+    sim->proposal_head = (sim->proposal_head + 1) % sim->outstanding;
+    sim->num_proposals--;
+  }
+}
+
+/* Proposed with its current seq, once there's room in the window */
+static void __request_queue (struct sim *sim, struct sim_request *request) {
+  uint32_t index = request - sim->requests;
+
+  if (request->queued)
+    return;
+  request->queued = 1;
+  sim->proposals[(sim->proposal_head + sim->num_proposals) % sim->outstanding] = index;
+  sim->num_proposals++;
+}
+
+static void __request_start (struct sim *sim, struct sim_request *request) {
+  request->submit_time = sim->now;
+  request->in_use = 1;
+  __request_queue(sim, request);
+}
+
+/* Lost with a round we skipped, or never chosen: propose it again */
+static void __on_retry_timeout (void *arg) {
+  struct sim_request *request = (struct sim_request *)arg;
+  struct sim *sim = request->sim;
+
+  sim->num_retries++;
+  __request_queue(sim, request);
+}
+
+static void __request_learned (struct sim *sim, uint64_t seq) {
+  struct sim_request *request = &(sim->requests[seq % sim->outstanding]);
+
+  /* A retry chosen too: the first one counts */
+  if (!request->in_use || request->seq != seq)
+    return;
+
+  paxos_timeout_stop(&(request->retry_timeout));
+  paxos_histogram_add(&(sim->latency), sim->now - request->submit_time);
+  sim->num_committed++;
+  request->in_use = 0;
+
+  /* Closed loop, the next value of this slot */
+  request->seq += sim->outstanding;
+  if (sim->now < sim->end_time)
+    __request_start(sim, request);
+}
+
+/* ============================================================================
+ *  Paxos Context
+ */
+static void __paxos_send (void *arg, uint64_t node_id, const void *frame, uint32_t size) {
+  struct sim_node *node = (struct sim_node *)arg;
+  if (node_id >= 1 && node_id <= node->sim->num_nodes)
+    __link_send(node->sim, node->node_id, node_id, frame, size);
+}
+
+static void __paxos_broadcast (void *arg, const void *frame, uint32_t size) {
+  struct sim_node *node = (struct sim_node *)arg;
+  uint32_t i;
+
+  for (i = 1; i <= node->sim->num_nodes; ++i)
+    __link_send(node->sim, node->node_id, i, frame, size);
+}
+
+/* Every replica must learn the same value for a paxos_id */
+static void __paxos_learned_value (void *arg) {
+  struct sim_node *node = (struct sim_node *)arg;
+  struct sim *sim = node->sim;
+  const paxos_value_t *value = &(node->paxos.learner.learned_value);
+  uint64_t paxos_id = node->paxos.learner.learned_paxos_id;
+  uint64_t hash;
+  uint64_t seq;
+
+  node->num_learned++;
+  hash = __hash(value->data, value->size) | 1;
+  if (paxos_id >= sim->max_chosen) {
+    uint64_t capacity = (paxos_id + 1) * 2;
+    uint64_t *chosen = (uint64_t *) realloc(sim->chosen, capacity * sizeof(uint64_t));
+    if (chosen != NULL) {
+      memset(chosen + sim->max_chosen, 0, (capacity - sim->max_chosen) * sizeof(uint64_t));
+      sim->chosen = chosen;
+      sim->max_chosen = capacity;
+    }
+  }
+  if (paxos_id < sim->max_chosen) {
+    if (sim->chosen[paxos_id] == 0) {
+      sim->chosen[paxos_id] = hash;
+    } else if (sim->chosen[paxos_id] != hash) {
+      fprintf(stderr, "node %lu learned a different value for paxos_id %lu\n",
+              node->node_id, paxos_id);
+      sim->num_violations++;
+    }
+  }
+
+  if (node->node_id == sim->target && value->size >= SIM_MIN_VALUE_SIZE) {
+    memcpy(&seq, value->data, sizeof(uint64_t));
+    __request_learned(sim, seq);
+  }
+}
+
+/* ============================================================================
+ *  Simulation
+ */
+static int __sim_open (struct sim *sim) {
+  struct sim_node *node;
+  uint32_t i;
+
+  /* The proposers seed their backoff from the clock: the seed moves it */
+  sim->now = SIM_START_TIME + (sim->seed & 0xffff) * 1000;
+  sim->end_time += sim->now;
+  paxos_clock_set(sim->now);
+
+  for (i = 1; i <= sim->num_nodes; ++i) {
+    node = &(sim->nodes[i]);
+    node->sim = sim;
+    node->node_id = i;
+    paxos_timer_wheel_init(&(node->timers), sim->now / 1000);
+
+    node->context.send = __paxos_send;
+    node->context.broadcast = __paxos_broadcast;
+    node->context.learned_value = __paxos_learned_value;
+    node->context.timers = &(node->timers);
+    node->context.arg = node;
+    if (paxos_open(&(node->paxos), &(node->context), 0, i, sim->num_nodes, sim->window_size)) {
+      perror("paxos_open()");
+      return(-1);
+    }
+    paxos_open_lease(&(node->paxos), sim->lease_duration);
+  }
+
+  paxos_histogram_reset(&(sim->latency));
+  sim->requests = (struct sim_request *) calloc(sim->outstanding, sizeof(struct sim_request));
+  sim->proposals = (uint32_t *) calloc(sim->outstanding, sizeof(uint32_t));
+  sim->value_buffer = (uint8_t *) calloc(1, sim->value_size);
+  if (sim->requests == NULL || sim->proposals == NULL || sim->value_buffer == NULL) {
+    perror("calloc()");
+    return(-1);
+  }
+
+  /* The retries run on the wheel of the target node */
+  for (i = 0; i < sim->outstanding; ++i) {
+    struct sim_request *request = &(sim->requests[i]);
+    request->sim = sim;
+    request->seq = i;
+    paxos_timeout_init(&(request->retry_timeout), sim->retry_timeout,
+                       __on_retry_timeout, request);
+    paxos_timeout_attach(&(request->retry_timeout), &(sim->nodes[sim->target].timers));
+  }
+  return(0);
+}
+
+static void __sim_close (struct sim *sim) {
+  struct sim_event event;
+  uint32_t i;
+
+  for (i = 0; i < sim->outstanding; ++i)
+    paxos_timeout_stop(&(sim->requests[i].retry_timeout));
+  for (i = 1; i <= sim->num_nodes; ++i)
+    paxos_close(&(sim->nodes[i].paxos));
+
+  while (sim->num_events > 0) {
+    __event_pop(sim, &event);
+    free(event.frame);
+  }
+  free(sim->events);
+  free(sim->requests);
+  free(sim->proposals);
+  free(sim->value_buffer);
+  free(sim->chosen);
+}
+
+/* The earliest of the next delivery and the next tick of a timer wheel */
+static uint64_t __sim_next_time (struct sim *sim) {
+  uint64_t next = UINT64_MAX;
+  uint64_t now_msec = sim->now / 1000;
+  uint64_t when;
+  uint32_t i;
+  int wait;
+
+  if (sim->num_events > 0)
+    next = sim->events[0].time;
+
+  for (i = 1; i <= sim->num_nodes; ++i) {
+    if ((wait = paxos_timer_wheel_next(&(sim->nodes[i].timers), now_msec)) < 0)
+      continue;
+    when = (now_msec + wait) * 1000;
+    if (when < next)
+      next = when;
+  }
+  return(next < sim->now ? sim->now : next);
+}
+
+static void __sim_run (struct sim *sim) {
+  struct sim_event event;
+  uint64_t next;
+  uint32_t i;
+
+  for (i = 1; i <= sim->num_nodes; ++i)
+    paxos_bootstrap(&(sim->nodes[i].paxos));
+
+  for (i = 0; i < sim->outstanding; ++i)
+    __request_start(sim, &(sim->requests[i]));
+  __propose_ready(sim);
+
+  while ((next = __sim_next_time(sim)) <= sim->end_time) {
+    sim->now = next;
+    paxos_clock_set(next);
+    sim->num_steps++;
+
+    while (sim->num_events > 0 && sim->events[0].time <= sim->now) {
+      __event_pop(sim, &event);
+      __deliver(sim, &event);
+      free(event.frame);
+    }
+
+    for (i = 1; i <= sim->num_nodes; ++i)
+      paxos_timer_wheel_advance(&(sim->nodes[i].timers), sim->now / 1000);
+
+    /* Something may have left the window */
+    __propose_ready(sim);
+  }
+  sim->now = sim->end_time;
+}
+
+static const char *__type_name (uint8_t type) {
+  paxos_message_t message;
+  message.type = type;
+  return(paxos_message_to_string(&message));
+}
+
+static void __sim_report (const struct sim *sim, uint64_t elapsed, uint64_t wall_usec) {
+  const struct sim_stats *stats = &(sim->stats);
+  uint32_t i;
+
+  printf("%u nodes, %u values out on node %u, %u bytes values, window %u, lease %ums\n",
+         sim->num_nodes, sim->outstanding, sim->target, sim->value_size,
+         sim->window_size, sim->lease_duration);
+  printf("simulated %.3f sec in %.3f sec (%lu steps)\n",
+         elapsed / 1000000.0, wall_usec / 1000000.0, sim->num_steps);
+  printf("committed: %lu values, %.1f/simulated sec, %lu retries\n",
+         sim->num_committed, sim->num_committed * 1000000.0 / elapsed, sim->num_retries);
+  paxos_histogram_dump(&(sim->latency), stdout, "propose->learn usec");
+
+  printf("learned:");
+  for (i = 1; i <= sim->num_nodes; ++i)
+    printf(" %u:%lu", i, sim->nodes[i].num_learned);
+  printf("\n");
+
+  printf("messages: %lu sent %lu delivered %lu dropped %lu duplicated %lu reordered"
+         " (%.1f/committed value)\n",
+         stats->sent, stats->delivered, stats->dropped, stats->duplicated,
+         stats->reordered, sim->num_committed ? (double)stats->sent / sim->num_committed : 0.0);
+  for (i = 0; i < 256; ++i) {
+    if (stats->by_type[i] > 0)
+      printf("  %-28s %lu\n", __type_name(i), stats->by_type[i]);
+  }
+  printf("safety: %lu violations\n", sim->num_violations);
+}
+
+static void __usage (void) {
+  fprintf(stderr, "usage: paxos-sim [-n nodes] [-s seed] [-d simulated sec] "
+                  "[-c values out] [-v value size] [-w window] [-e lease msec]\n"
+                  "                 [-l latency usec] [-j jitter usec] "
+                  "[-L from:to:usec]... [-p loss %%] [-u duplicate %%] "
+                  "[-r reorder %%] [-t retry msec] [-T target node]\n"
+                  "                 [-m min committed/sec]\n");
+}
+
+int main (int argc, char **argv) {
+  uint32_t latency, from, to, i, j;
+  struct timeval t0, t1;
+  uint64_t violations;
+  uint64_t elapsed;
+  double rate;
+  struct sim *sim;
+  int stalled;
+  int opt;
+
+  if ((sim = (struct sim *) calloc(1, sizeof(struct sim))) == NULL) {
+    perror("calloc()");
+    return(1);
+  }
+
+  sim->num_nodes = 3;
+  sim->seed = 1;
+  sim->end_time = 10 * 1000000ull;
+  sim->outstanding = 64;
+  sim->value_size = 64;
+  sim->window_size = PAXOS_DEFAULT_WINDOW_SIZE;
+  sim->lease_duration = 0;
+  sim->retry_timeout = 2000;
+  sim->target = 1;
+  latency = 100;
+
+  /* -L needs the default latency first */
+  while ((opt = getopt(argc, argv, "n:s:d:c:v:w:e:l:j:L:p:u:r:t:T:m:")) != -1) {
+    switch (opt) {
+      case 'n': sim->num_nodes = strtoul(optarg, NULL, 10); break;
+      case 's': sim->seed = strtoull(optarg, NULL, 10); break;
+      case 'd': sim->end_time = strtod(optarg, NULL) * 1000000; break;
+      case 'c': sim->outstanding = strtoul(optarg, NULL, 10); break;
+      case 'v': sim->value_size = strtoul(optarg, NULL, 10); break;
+      case 'w': sim->window_size = strtoul(optarg, NULL, 10); break;
+      case 'e': sim->lease_duration = strtoul(optarg, NULL, 10); break;
+      case 'l': latency = strtoul(optarg, NULL, 10); break;
+      case 'j': sim->jitter = strtoul(optarg, NULL, 10); break;
+      case 'L': break;
+      case 'p': sim->loss = strtod(optarg, NULL); break;
+      case 'u': sim->duplicate = strtod(optarg, NULL); break;
+      case 'r': sim->reorder = strtod(optarg, NULL); break;
+      case 't': sim->retry_timeout = strtoul(optarg, NULL, 10); break;
+      case 'T': sim->target = strtoul(optarg, NULL, 10); break;
+      case 'm': sim->min_rate = strtod(optarg, NULL); break;
+      default: __usage(); return(1);
+    }
+  }
+
+  if (optind != argc || sim->num_nodes == 0 || sim->num_nodes > SIM_MAX_NODES ||
+      sim->outstanding == 0 || sim->window_size == 0 || sim->seed == 0 ||
+      sim->target == 0 || sim->target > sim->num_nodes ||
+      sim->value_size < SIM_MIN_VALUE_SIZE || sim->value_size > PAXOS_VALUE_MAX_SIZE)
+  {
+    __usage();
+    return(1);
+  }
+
+  for (i = 1; i <= sim->num_nodes; ++i) {
+    for (j = 1; j <= sim->num_nodes; ++j)
+      sim->link_latency[i][j] = (i == j) ? SIM_SELF_LATENCY : latency;
+  }
+
+  /* The links that differ from the default one */
+  optind = 1;
+  while ((opt = getopt(argc, argv, "n:s:d:c:v:w:e:l:j:L:p:u:r:t:T:m:")) != -1) {
+    if (opt != 'L')
+      continue;
+    if (sscanf(optarg, "%u:%u:%u", &from, &to, &latency) != 3 ||
+        from == 0 || from > sim->num_nodes || to == 0 || to > sim->num_nodes)
+    {
+      __usage();
+      return(1);
+    }
+    sim->link_latency[from][to] = latency;
+  }
+
+  if (__sim_open(sim))
+    return(1);
+
+  gettimeofday(&t0, NULL);
+  elapsed = sim->now;
+  __sim_run(sim);
+  elapsed = sim->now - elapsed;
+  gettimeofday(&t1, NULL);
+
+  __sim_report(sim, elapsed, (t1.tv_sec - t0.tv_sec) * 1000000ull + (t1.tv_usec - t0.tv_usec));
+  violations = sim->num_violations;
+  rate = elapsed ? sim->num_committed * 1000000.0 / elapsed : 0.0;
+  stalled = rate < sim->min_rate;
+  if (stalled)
+    printf("stalled: %.1f committed/simulated sec, below %.1f\n", rate, sim->min_rate);
+  __sim_close(sim);
+  free(sim);
+  return(violations > 0 || stalled);
+}
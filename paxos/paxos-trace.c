@@ -0,0 +1,197 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "trace.h"
+
+/*
+ * Decode a trace dump: the events of every ring merged in time order,
+ * a line per event. The filters keep a single worker, group or paxos_id.
+ */
+struct record {
+  paxos_trace_event_t event;
+  uint32_t ring_id;
+  uint64_t seq;                         /* Recording order, ties on the time */
+};
+
+struct filter {
+  int64_t ring_id;
+  int64_t group_id;
+  int64_t paxos_id;
+};
+
+static const char *__kind_to_string (uint8_t kind) {
+  switch (kind) {
+    case PAXOS_TRACE_RECV:      return("recv");
+    case PAXOS_TRACE_SEND:      return("send");
+    case PAXOS_TRACE_BROADCAST: return("bcst");
+    case PAXOS_TRACE_LEARNED:   return("learned");
+  }
+  return("?");
+}
+
+static int __record_compare (const void *a, const void *b) {
+  const struct record *ra = (const struct record *)a;
+  const struct record *rb = (const struct record *)b;
+
+  if (ra->event.time != rb->event.time)
+    return(ra->event.time < rb->event.time ? -1 : 1);
+  if (ra->ring_id != rb->ring_id)
+    return(ra->ring_id < rb->ring_id ? -1 : 1);
+  return(ra->seq < rb->seq ? -1 : (ra->seq > rb->seq));
+}
+
+static int __record_match (const struct record *record, const struct filter *filter) {
+  if (filter->ring_id >= 0 && record->ring_id != filter->ring_id)
+    return(0);
+  if (filter->group_id >= 0 && record->event.group_id != filter->group_id)
+    return(0);
+  if (filter->paxos_id >= 0 && record->event.paxos_id != (uint64_t)filter->paxos_id)
+    return(0);
+  return(1);
+}
+
+/* Every event of the file, NULL if it's not a trace dump */
+static struct record *__load (FILE *stream, uint64_t *num_records) {
+  struct record *records = NULL;
+  uint64_t count = 0;
+  uint64_t recorded;
+  uint64_t magic;
+  uint32_t header[2];
+  uint32_t num_rings;
+  uint32_t capacity;
+  uint32_t ring_id;
+  uint64_t n, i;
+  uint32_t r;
+
+  if (fread(&magic, sizeof(magic), 1, stream) != 1 || magic != PAXOS_TRACE_MAGIC ||
+      fread(header, sizeof(header), 1, stream) != 1 || header[0] != PAXOS_TRACE_VERSION)
+  {
+    return(NULL);
+  }
+
+  num_rings = header[1];
+  for (r = 0; r < num_rings; ++r) {
+    if (fread(header, sizeof(header), 1, stream) != 1 ||
+        fread(&recorded, sizeof(recorded), 1, stream) != 1)
+    {
+      break;
+    }
+    ring_id = header[0];
+    capacity = header[1];
+    n = (recorded < capacity) ? recorded : capacity;
+
+    records = (struct record *) realloc(records, (count + n) * sizeof(struct record));
+    if (records == NULL)
+      return(NULL);
+
+    for (i = 0; i < n; ++i) {
+      struct record *record = &(records[count]);
+      if (fread(&(record->event), sizeof(paxos_trace_event_t), 1, stream) != 1)
+        break;
+      record->ring_id = ring_id;
+      record->seq = recorded - n + i;
+      count++;
+    }
+
+    if (recorded > capacity) {
+      fprintf(stderr, "worker %u: %lu events, the first %lu were overwritten\n",
+              ring_id, recorded, recorded - capacity);
+    }
+  }
+
+  *num_records = count;
+  return(records != NULL ? records : (struct record *) calloc(1, sizeof(struct record)));
+}
+
+static void __dump (const struct record *records,
+                    uint64_t count,
+                    const struct filter *filter)
+{
+  const paxos_trace_event_t *event;
+  paxos_message_t message;
+  uint64_t start;
+  uint64_t i;
+
+  start = (count > 0) ? records[0].event.time : 0;
+  memset(&message, 0, sizeof(paxos_message_t));
+  for (i = 0; i < count; ++i) {
+    if (!__record_match(&(records[i]), filter))
+      continue;
+
+    event = &(records[i].event);
+    message.type = event->type;
+    printf("%12.6f w%-2u %-7s %-28s g%-4u node %-3u paxos_id %-8lu "
+           "proposal_id %-10lu size %u\n",
+           (event->time - start) / 1000000.0, records[i].ring_id,
+           __kind_to_string(event->kind),
+           event->type ? paxos_message_to_string(&message) : "-",
+           event->group_id, event->node_id, event->paxos_id,
+           event->proposal_id, event->size);
+  }
+}
+
+static void __usage (void) {
+  fprintf(stderr, "usage: paxos-trace [-w worker] [-g group] [-p paxos_id] <trace file>\n");
+}
+
+int main (int argc, char **argv) {
+  struct record *records;
+  struct filter filter;
+  uint64_t count;
+  FILE *stream;
+  int opt;
+
+  filter.ring_id = -1;
+  filter.group_id = -1;
+  filter.paxos_id = -1;
+  while ((opt = getopt(argc, argv, "w:g:p:")) != -1) {
+    switch (opt) {
+      case 'w': filter.ring_id = strtoll(optarg, NULL, 10); break;
+      case 'g': filter.group_id = strtoll(optarg, NULL, 10); break;
+      case 'p': filter.paxos_id = strtoll(optarg, NULL, 10); break;
+      default: __usage(); return(1);
+    }
+  }
+
+  if (optind + 1 != argc) {
+    __usage();
+    return(1);
+  }
+
+  if ((stream = fopen(argv[optind], "rb")) == NULL) {
+    perror(argv[optind]);
+    return(1);
+  }
+
+  records = __load(stream, &count);
+  fclose(stream);
+  if (records == NULL) {
+    fprintf(stderr, "%s: not a trace dump (version %u)\n", argv[optind],
+            PAXOS_TRACE_VERSION);
+    return(1);
+  }
+
+  qsort(records, count, sizeof(struct record), __record_compare);
+  __dump(records, count, &filter);
+  free(records);
+  return(0);
+}
@@ -26,20 +26,49 @@
  *      |         |          |  |  |       |  |
  */
 
-#include <sys/time.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 #include "paxos.h"
+#include "trace.h"
 
 #define ASSERT(cond)                                                        \
   if (!(cond)) fprintf(stderr, "ASSERT %s\n", #cond)
 
+/* Upper bounds (msec), the actual timeouts follow the RTT of the peers */
 #define PAXOS_ROUND_TIMEOUT     (5000)
-#define PAXOS_CHOSEN_TIMEOUT    (PAXOS_ROUND_TIMEOUT + 1000)
 #define PAXOS_RESTART_TIMEOUT   (1000)
+#define PAXOS_MIN_TIMEOUT       (10)
+
+/* Chunk requests left unanswered before a snapshot transfer is given up */
+#define PAXOS_SNAPSHOT_RETRIES  (3)
+
+#if PAXOS_SNAPSHOT_CHUNK_SIZE > PAXOS_VALUE_MAX_SIZE
+  #error "a snapshot chunk must fit in a message value"
+#endif
+
+/*
+ * Catch-up flow control: a request asks for up to PAXOS_CATCHUP_MAX_RANGE
+ * values, answered with at most PAXOS_CATCHUP_MAX_PACKETS packets of values
+ * (PAXOS_CATCHUP_PACKET_SIZE bytes each), not to overrun the receive buffer.
+ */
+#define PAXOS_CATCHUP_MAX_RANGE     (2048)
+#define PAXOS_CATCHUP_MAX_PACKETS   (4)
+#define PAXOS_CATCHUP_PACKET_SIZE   (32 << 10)
+#define PAXOS_CATCHUP_RETRIES       (3)
+
+/*
+ * A lease is granted with the promise and renewed every 1/4 of its duration.
+ * The holder counts it from when it asked, and 1/PAXOS_LEASE_DRIFT_RATIO
+ * shorter: the clocks of the acceptors may run at a slightly different rate.
+ */
+#define PAXOS_LEASE_DRIFT_RATIO     (10)
+
+#if PAXOS_CATCHUP_PACKET_SIZE > PAXOS_VALUE_MAX_SIZE
+  #error "a catch-up packet must fit in a message value"
+#endif
 
 #define PAXOS_IS_DEBUG_ENABLED  0
 #if PAXOS_IS_DEBUG_ENABLED
@@ -55,68 +84,6 @@
   #define LOG_FUNC_TRACE
 #endif
 
-static void paxos_proposer_state_reset (paxos_proposer_state_t *self) {
-  self->preparing = 0;
-  self->proposing = 0;
-  self->learn_sent = 0;
-  self->proposal_id = 0;
-  self->highest_received_proposal_id = 0;
-  self->highest_promised_proposal_id = 0;
-  self->proposed_value = 0;
-}
-
-static void paxos_acceptor_state_reset (paxos_acceptor_state_t *self) {
-  self->promised_proposal_id = 0;
-  self->accepted = 0;
-  self->accepted_proposal_id = 0;
-  self->accepted_value = 0;
-}
-
-/* ============================================================================
- *  Paxos Timer
- */
-static uint64_t paxos_time_now (void) {
-  struct timeval now;
-  gettimeofday(&now, NULL);
-  return(now.tv_sec * 1000 + (now.tv_usec / 1000));
-}
-
-void paxos_timeout_init (paxos_timeout_t *self,
-                         unsigned int timeout,
-                         paxos_callback_t callback,
-                         void *arg)
-{
-  self->arg = arg;
-  self->callback = callback;
-  self->active = 0;
-  self->timeout = timeout;
-  self->expire_time = 0;
-}
-
-void paxos_timeout_start (paxos_timeout_t *self) {
-  self->active = 1;
-  self->expire_time = paxos_time_now() + self->timeout;
-}
-
-void paxos_timeout_stop (paxos_timeout_t *self) {
-  self->active = 0;
-}
-
-unsigned int paxos_timeout_remaining (paxos_timeout_t *self) {
-  int timeout = -1;
-  if (self != NULL && self->active) {
-    timeout = paxos_time_now() - self->expire_time;
-  }
-  return(timeout < 0 ? 1000 : timeout);
-}
-
-void paxos_timeout_trigger(paxos_timeout_t *self) {
-  if (self != NULL && self->active) {
-    self->active = 0;
-    self->callback(self->arg);
-  }
-}
-
 /* ============================================================================
  *  Paxos Message
  */
@@ -147,15 +114,23 @@ static void __paxos_message_proposal_id (paxos_message_t *message,
 #define paxos_message_request_chosen(msg, paxos_id, node_id)                \
   __paxos_message_paxos_id(msg, PAXOS_REQUEST_CHOSEN, paxos_id, node_id)
 
+#define paxos_message_lease_renew(msg, seq, node_id, proposal_id)           \
+  __paxos_message_proposal_id(msg, PAXOS_LEASE_RENEW,                       \
+                              seq, node_id, proposal_id)
+
+#define paxos_message_lease_granted(msg, seq, node_id, proposal_id)         \
+  __paxos_message_proposal_id(msg, PAXOS_LEASE_GRANTED,                     \
+                              seq, node_id, proposal_id)
+
+#define paxos_message_read_index(msg, seq, node_id)                         \
+  __paxos_message_paxos_id(msg, PAXOS_READ_INDEX, seq, node_id)
+
 #define paxos_message_bootstrap(msg, node_id)                               \
   __paxos_message_paxos_id(msg, PAXOS_BOOTSTRAP, 0, node_id)
 
 #define paxos_message_catchup_start(msg, paxos_id, node_id)                 \
   __paxos_message_paxos_id(msg, PAXOS_CATCHUP_START, paxos_id, node_id)
 
-#define paxos_message_catchup_request(msg, paxos_id, node_id)               \
-  __paxos_message_paxos_id(msg, PAXOS_CATCHUP_REQUEST, paxos_id, node_id)
-
 
 #define paxos_message_prepare_request(msg, paxos_id, node_id, proposal_id)  \
   __paxos_message_proposal_id(msg, PAXOS_PREPARE_REQUEST,                   \
@@ -177,42 +152,109 @@ static void __paxos_message_proposal_id (paxos_message_t *message,
   __paxos_message_proposal_id(msg, PAXOS_LEARN_PROPOSAL,                      \
                               paxos_id, node_id, proposal_id)
 
+/* The values in [from, to) */
+void paxos_message_catchup_request (paxos_message_t *message,
+                                    uint64_t from,
+                                    uint64_t to,
+                                    uint64_t node_id)
+{
+  memset(message, 0, sizeof(paxos_message_t));
+  message->type = PAXOS_CATCHUP_REQUEST;
+  message->paxos_id = from;
+  message->node_id = node_id;
+  message->count = (uint16_t)(to - from);
+}
+
+/* count values from paxos_id on, packed in the batch */
 void paxos_message_catchup_response (paxos_message_t *message,
                                      uint64_t paxos_id,
                                      uint64_t node_id,
-                                     uint64_t value)
+                                     uint16_t count,
+                                     const paxos_value_t *batch)
 {
   memset(message, 0, sizeof(paxos_message_t));
   message->type = PAXOS_CATCHUP_RESPONSE;
   message->paxos_id = paxos_id;
   message->node_id = node_id;
-  message->value = value;
+  message->count = count;
+  paxos_value_ref(&(message->value), batch);
+}
+
+void paxos_message_snapshot_request (paxos_message_t *message,
+                                     uint64_t paxos_id,
+                                     uint64_t node_id,
+                                     uint64_t offset)
+{
+  memset(message, 0, sizeof(paxos_message_t));
+  message->type = PAXOS_SNAPSHOT_REQUEST;
+  message->paxos_id = paxos_id;
+  message->node_id = node_id;
+  message->offset = offset;
+}
+
+void paxos_message_snapshot_chunk (paxos_message_t *message,
+                                   uint64_t node_id,
+                                   const paxos_snapshot_t *snapshot,
+                                   uint64_t offset,
+                                   uint32_t size)
+{
+  memset(message, 0, sizeof(paxos_message_t));
+  message->type = PAXOS_SNAPSHOT_CHUNK;
+  message->paxos_id = snapshot->paxos_id;
+  message->node_id = node_id;
+  message->offset = offset;
+  if (offset + size == snapshot->size)
+    message->flags = PAXOS_MESSAGE_LAST_CHUNK;
+  paxos_value_wrap(&(message->value), snapshot->data + offset, size);
+}
+
+void paxos_message_forward_value (paxos_message_t *message,
+                                  uint64_t node_id,
+                                  const paxos_value_t *value)
+{
+  memset(message, 0, sizeof(paxos_message_t));
+  message->type = PAXOS_FORWARD_VALUE;
+  message->node_id = node_id;
+  paxos_value_ref(&(message->value), value);
+}
+
+/* Our highest accepted paxos_id + 1, for the read round seq */
+void paxos_message_read_index_reply (paxos_message_t *message,
+                                     uint64_t seq,
+                                     uint64_t node_id,
+                                     uint64_t index)
+{
+  memset(message, 0, sizeof(paxos_message_t));
+  message->type = PAXOS_READ_INDEX_REPLY;
+  message->paxos_id = seq;
+  message->node_id = node_id;
+  message->offset = index;
 }
 
 void paxos_message_learn_value (paxos_message_t *message,
                                 uint64_t paxos_id,
                                 uint64_t node_id,
-                                uint64_t value)
+                                const paxos_value_t *value)
 {
   memset(message, 0, sizeof(paxos_message_t));
-  message->type = PAXOS_CATCHUP_START;
+  message->type = PAXOS_LEARN_VALUE;
   message->paxos_id = paxos_id;
   message->node_id = node_id;
-  message->value = value;
+  paxos_value_ref(&(message->value), value);
 }
 
 void paxos_message_propose_request (paxos_message_t *message,
                                     uint64_t paxos_id,
                                     uint64_t node_id,
                                     uint64_t proposal_id,
-                                    uint64_t value)
+                                    const paxos_value_t *value)
 {
   memset(message, 0, sizeof(paxos_message_t));
   message->type = PAXOS_PROPOSE_REQUEST;
   message->paxos_id = paxos_id;
   message->node_id = node_id;
   message->proposal_id = proposal_id;
-  message->value = value;
+  paxos_value_ref(&(message->value), value);
 }
 
 void paxos_message_prepare_previously_accepted (paxos_message_t *message,
@@ -220,7 +262,7 @@ void paxos_message_prepare_previously_accepted (paxos_message_t *message,
                                                 uint64_t node_id,
                                                 uint64_t proposal_id,
                                                 uint64_t accepted_proposal_id,
-                                                uint64_t value)
+                                                const paxos_value_t *value)
 {
   memset(message, 0, sizeof(paxos_message_t));
   message->type = PAXOS_PREPARE_PREVIOUSLY_ACCEPTED;
@@ -228,7 +270,7 @@ void paxos_message_prepare_previously_accepted (paxos_message_t *message,
   message->node_id = node_id;
   message->proposal_id = proposal_id;
   message->accepted_proposal_id = accepted_proposal_id;
-  message->value = value;
+  paxos_value_ref(&(message->value), value);
 }
 
 void paxos_message_prepare_rejected (paxos_message_t *message,
@@ -245,43 +287,34 @@ void paxos_message_prepare_rejected (paxos_message_t *message,
   message->promised_proposal_id = promised_proposal_id;
 }
 
-const char *paxos_message_to_string (const paxos_message_t *message) {
-  switch (message->type) {
-    case PAXOS_PREPARE_REQUEST: return("prepare-request");
-    case PAXOS_PREPARE_REJECTED: return("prepare-rejected");
-    case PAXOS_PREPARE_PREVIOUSLY_ACCEPTED: return("prepared-previously-accepted");
-    case PAXOS_PREPARE_CURRENTLY_OPEN: return("prepare-currently-open");
-    case PAXOS_PROPOSE_REQUEST: return("propose-request");
-    case PAXOS_PROPOSE_REJECTED: return("propose-rejected");
-    case PAXOS_PROPOSE_ACCEPTED: return("propose-accepted");
-    case PAXOS_LEARN_PROPOSAL: return("learn-proposal");
-    case PAXOS_LEARN_VALUE: return("learn-value");
-    case PAXOS_REQUEST_CHOSEN: return("request-chosen");
-    case PAXOS_BOOTSTRAP: return("bootstrap");
-    case PAXOS_CATCHUP_START: return("start-catchup");
-    case PAXOS_CATCHUP_REQUEST: return("catchup-request");
-    case PAXOS_CATCHUP_RESPONSE: return("catchup-response");
-    case PAXOS_USER_PROPOSE_VALUE: return("user-propoe-value");
-    case PAXOS_USER_LEARN_VALUE: return("user-learn-value");
-  }
-  return("");
-}
-
 /* ============================================================================
  *  Paxos Quorum
  */
 #define __math_ceil(a, b)    ((a) + (b) - 1) / (b)
 #define __math_max(a, b)     ((a) > (b) ? (a) : (b))
+#define __math_min(a, b)     ((a) < (b) ? (a) : (b))
 
 #define paxos_quorum_vote_reset(self)                                     \
-  (self)->num_rejected = (self)->num_accepted = 0
-
+  do {                                                                    \
+    (self)->num_rejected = (self)->num_accepted = 0;                      \
+    (self)->voters = 0;                                                   \
+  } while (0)
+
+/* A node votes once, a duplicated datagram doesn't count again */
+#define __paxos_quorum_vote(self, node_id, counter)                       \
+  do {                                                                    \
+    uint32_t __voter = 1u << ((node_id) % PAXOS_MAX_NODES);               \
+    if (!((self)->voters & __voter)) {                                    \
+      (self)->voters |= __voter;                                          \
+      (self)->counter++;                                                  \
+    }                                                                     \
+  } while (0)
 
 #define paxos_quorum_vote_accepted(self, node_id)                         \
-  (self)->num_accepted++
+  __paxos_quorum_vote(self, node_id, num_accepted)
 
 #define paxos_quorum_vote_rejected(self, node_id)                         \
-  (self)->num_rejected++
+  __paxos_quorum_vote(self, node_id, num_rejected)
 
 #define paxos_quorum_vote_is_rejected(self)                               \
   ((self)->num_rejected >= __math_ceil((self)->num_nodes, 2))
@@ -293,61 +326,254 @@ const char *paxos_message_to_string (const paxos_message_t *message) {
   (((self)->num_accepted + (self)->num_rejected) >= (self)->num_nodes)
 
 /* ============================================================================
- *  Paxos Context
+ *  Paxos RTT
+ */
+#define paxos_rtt_get(proposer, node_id)                                  \
+  (&((proposer)->rtt[(node_id) % PAXOS_MAX_NODES]))
+
+/* Retransmission timeout of the peer, usec */
+#define paxos_rtt_timeout(rtt)                                            \
+  ((uint64_t)(rtt)->srtt + 4 * (uint64_t)(rtt)->rttvar)
+
+/* RFC 6298: srtt += (r - srtt) / 8, rttvar += (|r - srtt| - rttvar) / 4 */
+static void paxos_rtt_sample (paxos_rtt_t *rtt, uint64_t sent_time) {
+  uint64_t now = paxos_time_now_usec();
+  uint32_t r, delta;
+
+  r = (now > sent_time) ? (uint32_t)__math_min(now - sent_time, 0xffffffffull) : 1;
+  if (rtt->srtt == 0) {
+    rtt->srtt = r;
+    rtt->rttvar = r / 2;
+    return;
+  }
+
+  delta = (r > rtt->srtt) ? (r - rtt->srtt) : (rtt->srtt - r);
+  rtt->rttvar = (3 * (uint64_t)rtt->rttvar + delta) / 4;
+  rtt->srtt = (7 * (uint64_t)rtt->srtt + r) / 8;
+}
+
+/*
+ * msec to wait for a quorum: the timeout of the slowest peer among the
+ * fastest ones forming a quorum. Until there are enough samples, max.
  */
-#define paxos_context_send(self, node_id, message)                        \
-  (self)->send((self)->arg, node_id, message)
+static unsigned int paxos_round_timeout (paxos_t *self, unsigned int max) {
+  uint64_t rto[PAXOS_MAX_NODES];
+  uint32_t quorum, n, i, j;
+  uint64_t r, msec;
+
+  n = 0;
+  for (i = 0; i < PAXOS_MAX_NODES; ++i) {
+    if (self->proposer.rtt[i].srtt == 0)
+      continue;
+
+    r = paxos_rtt_timeout(&(self->proposer.rtt[i]));
+    for (j = n++; j > 0 && rto[j - 1] > r; --j)
+      rto[j] = rto[j - 1];
+    rto[j] = r;
+  }
+
+  quorum = __math_ceil(self->quorum.num_nodes + 1, 2);
+  if (quorum == 0 || n < quorum)
+    return(max);
+
+  msec = __math_ceil(rto[quorum - 1], 1000);
+  return(__math_max(PAXOS_MIN_TIMEOUT, __math_min(msec, max)));
+}
+
+/* Up to +50% of jitter, competing proposers don't keep preempting each other */
+static void paxos_round_timeout_start (paxos_t *self,
+                                       paxos_timeout_t *timeout,
+                                       unsigned int max)
+{
+  unsigned int msec = paxos_round_timeout(self, max);
+  timeout->timeout = msec + rand_r(&(self->proposer.seed)) % (msec / 2 + 1);
+  paxos_timeout_start(timeout);
+}
 
-#define paxos_context_broadcast(self, message)                            \
-  (self)->broadcast((self)->arg, message)
+/* A single peer: its own retransmission timeout, max until it has samples */
+static void paxos_peer_timeout_start (paxos_t *self,
+                                      paxos_timeout_t *timeout,
+                                      uint64_t node_id,
+                                      unsigned int max)
+{
+  const paxos_rtt_t *rtt = paxos_rtt_get(&(self->proposer), node_id);
+  uint64_t msec = max;
+
+  if (rtt->srtt > 0) {
+    msec = __math_ceil(paxos_rtt_timeout(rtt), 1000);
+    msec = __math_max(PAXOS_MIN_TIMEOUT, __math_min(msec, max));
+  }
+  timeout->timeout = msec;
+  paxos_timeout_start(timeout);
+}
 
+/* ============================================================================
+ *  Paxos Context
+ */
 #define paxos_context_learned_value(self)                                 \
   if ((self)->learned_value != NULL) (self)->learned_value((self)->arg)
 
+#define paxos_context_proposal_decided(self)                              \
+  if ((self)->proposal_decided != NULL) (self)->proposal_decided((self)->arg)
+
+/*
+ * The frame is built in front of the value, if it has room for the header.
+ * Every message leaving this paxos is stamped with its group.
+ */
+static void paxos_send (paxos_t *self,
+                        uint64_t node_id,
+                        paxos_message_t *message)
+{
+  const uint8_t *frame;
+  uint32_t size;
+
+  message->group_id = self->group_id;
+  paxos_trace_message(PAXOS_TRACE_SEND, message, node_id);
+  if ((frame = paxos_message_frame(message, self->send_buffer, &size)) != NULL)
+    self->context->send(self->context->arg, node_id, frame, size);
+}
+
+static void paxos_broadcast (paxos_t *self, paxos_message_t *message) {
+  const uint8_t *frame;
+  uint32_t size;
+
+  message->group_id = self->group_id;
+  paxos_trace_message(PAXOS_TRACE_BROADCAST, message, 0);
+  if ((frame = paxos_message_frame(message, self->send_buffer, &size)) != NULL)
+    self->context->broadcast(self->context->arg, frame, size);
+}
+
 /* ============================================================================
  *  Paxos Helpers
  */
-static void paxos_commit (paxos_t *self, paxos_callback_t callback, void *arg) {
-  LOG_DEBUG("TODO: DO COMMIT");
-  /* TODO: write to WAL */
-  callback(arg);
+#define paxos_window_end(self)                                              \
+  ((self)->learner.paxos_id + (self)->window_size)
+
+#define paxos_instance_is_in_window(self, id)                               \
+  ((id) >= (self)->learner.paxos_id && (id) < paxos_window_end(self))
+
+static paxos_instance_t *paxos_instance_get (paxos_t *self, uint64_t paxos_id) {
+  if (!paxos_instance_is_in_window(self, paxos_id))
+    return(NULL);
+  return(&(self->instances[paxos_id % self->window_size]));
+}
+
+/* Clear the proposer state, the value buffer is kept for the next round */
+static void paxos_proposer_state_reset (paxos_proposer_state_t *state) {
+  paxos_value_t value;
+
+  paxos_value_ref(&value, &(state->proposed_value));
+  memset(state, 0, sizeof(paxos_proposer_state_t));
+  paxos_value_ref(&(state->proposed_value), &value);
+  paxos_value_clear(&(state->proposed_value));
+}
+
+static void paxos_instance_reset (paxos_t *self,
+                                  paxos_instance_t *instance,
+                                  uint64_t paxos_id)
+{
+  paxos_value_t value;
+
+  paxos_proposer_state_reset(&(instance->proposer));
+  paxos_value_ref(&value, &(instance->acceptor.accepted_value));
+  memset(&(instance->acceptor), 0, sizeof(paxos_acceptor_state_t));
+  paxos_value_ref(&(instance->acceptor.accepted_value), &value);
+  paxos_value_clear(&(instance->acceptor.accepted_value));
+
+  memset(&(instance->quorum), 0, sizeof(paxos_quorum_t));
+  instance->quorum.num_nodes = self->quorum.num_nodes;
+  instance->paxos_id = paxos_id;
+  instance->chosen = 0;
+}
+
+static void paxos_window_reset (paxos_t *self, uint64_t paxos_id) {
+  paxos_instance_t *instance;
+  uint64_t i;
+
+  /* Keep what the acceptor has accepted for the instances still in the window */
+  self->learner.paxos_id = paxos_id;
+  for (i = paxos_id; i < paxos_window_end(self); ++i) {
+    instance = &(self->instances[i % self->window_size]);
+    if (instance->paxos_id != i) {
+      paxos_instance_reset(self, instance, i);
+    } else {
+      paxos_proposer_state_reset(&(instance->proposer));
+      paxos_quorum_vote_reset(&(instance->quorum));
+    }
+  }
+
+  self->proposer.num_proposing = 0;
+  if (self->proposer.next_paxos_id < paxos_id)
+    self->proposer.next_paxos_id = paxos_id;
 }
 
 static int paxos_get_accepted_value (paxos_t *self,
                                      uint64_t paxos_id,
-                                     uint64_t *value)
+                                     const paxos_value_t **value,
+                                     uint8_t *flags)
 {
-  if (self->learner.paxos_id == paxos_id) {
-    *value = self->learner.learned_value;
+  const paxos_log_entry_t *entry;
+  paxos_instance_t *instance;
+
+  if ((instance = paxos_instance_get(self, paxos_id)) != NULL) {
+    if (!instance->chosen)
+      return(0);
+    *value = &(instance->acceptor.accepted_value);
+    *flags = instance->acceptor.accepted_flags;
+    return(1);
+  }
+
+  if ((entry = paxos_log_get(&(self->learner.log), paxos_id)) != NULL) {
+    *value = &(entry->value);
+    *flags = entry->flags;
     return(1);
   }
   return(0);
 }
 
 static void paxos_start_new_round (paxos_t *self) {
-  self->learner.paxos_id++;
-  paxos_proposer_state_reset(&(self->proposer.state));
-  paxos_acceptor_state_reset(&(self->acceptor.state));
+  paxos_instance_t *instance;
+  uint64_t paxos_id;
+
+  /* Recycle the slot of the delivered instance for the new window tail */
+  paxos_id = self->learner.paxos_id++;
+  instance = &(self->instances[paxos_id % self->window_size]);
+  if (instance->proposer.proposing && --(self->proposer.num_proposing) == 0)
+    paxos_timeout_stop(&(self->proposer.propose_timeout));
+  paxos_instance_reset(self, instance, paxos_id + self->window_size);
+
+  if (self->proposer.next_paxos_id < self->learner.paxos_id)
+    self->proposer.next_paxos_id = self->learner.paxos_id;
 }
 
 #define __paxos_learned_timeout(self)                                       \
   (paxos_time_now() - (self)->learner.last_request_chosen_time)
 
 #define paxos_is_blocked(self)                                              \
-  (__paxos_learned_timeout(self) > PAXOS_CHOSEN_TIMEOUT)
+  (__paxos_learned_timeout(self) >                                          \
+   paxos_round_timeout(self, PAXOS_ROUND_TIMEOUT) +                         \
+   paxos_round_timeout(self, PAXOS_RESTART_TIMEOUT))
 
 /* ============================================================================
  *  Paxos Learner
  */
-static void paxos_learner_learn_value (paxos_t *self, uint64_t value) {
-  /* Update the learned value */
-  self->learner.learned_value = value;
+static void paxos_learner_learn_value (paxos_t *self,
+                                       uint64_t paxos_id,
+                                       const paxos_value_t *value)
+{
+  /* Update the learned value, a view on the log entry */
+  paxos_value_ref(&(self->learner.learned_value), value);
+  self->learner.learned_paxos_id = paxos_id;
   self->learner.has_learned_value = 1;
 
+  /* Applying it to an outdated state is pointless, a snapshot will replace it */
+  if (self->learner.stale)
+    return;
+
 #if PAXOS_IS_DEBUG_ENABLED
   fprintf(stderr, "========================================================\n");
-  fprintf(stderr, "%lu: LEARNED VALUE %lu PAXOS %lu\n", paxos_time_now(),
-          self->learner.learned_value, self->learner.paxos_id);
+  fprintf(stderr, "%lu: LEARNED VALUE %u bytes PAXOS %lu\n", paxos_time_now(),
+          self->learner.learned_value.size, paxos_id);
   fprintf(stderr, "========================================================\n");
 #endif
 
@@ -355,222 +581,915 @@ static void paxos_learner_learn_value (paxos_t *self, uint64_t value) {
   paxos_context_learned_value(self->context);
 }
 
-static void __on_request_chosen (paxos_t *self, const paxos_message_t *message)
+static int paxos_learner_snapshot (paxos_t *self);
+static void paxos_reader_check (paxos_t *self);
+
+#define paxos_learner_is_catching_up(learner)                               \
+  ((learner)->catchup_timeout.active)
+
+#define paxos_learner_needs_snapshot(learner)                               \
+  ((learner)->snapshot_interval > 0 && !(learner)->stale &&                 \
+   (learner)->paxos_id - ((learner)->snapshot.valid ?                       \
+                          (learner)->snapshot.paxos_id + 1 : 0) >=          \
+   (learner)->snapshot_interval)
+
+/* Deliver the chosen instances, strictly in paxos_id order */
+static void paxos_learner_deliver (paxos_t *self) {
+  const paxos_log_entry_t *entry;
+  paxos_instance_t *instance;
+
+  while ((instance = paxos_instance_get(self, self->learner.paxos_id)) != NULL) {
+    if (!instance->chosen)
+      break;
+
+    paxos_stats_inc(&(self->stats), PAXOS_STATS_LEARNED);
+    paxos_stats_time(&(self->stats), PAXOS_STATS_LEARN_TIME,
+                     instance->proposer.propose_time, paxos_time_now_usec());
+
+    /* The value buffer moves to the log, the slot is recycled anyway */
+    paxos_log_append(&(self->learner.log), instance->paxos_id,
+                     &(instance->acceptor.accepted_value),
+                     instance->acceptor.accepted_flags);
+    entry = paxos_log_get(&(self->learner.log), instance->paxos_id);
+    if (entry != NULL && !(entry->flags & PAXOS_MESSAGE_NOOP))
+      paxos_learner_learn_value(self, instance->paxos_id, &(entry->value));
+
+    /* A value of ours was in there: a forwarded one may still be chosen elsewhere */
+    if (instance->proposer.own) {
+      self->proposer.decided_paxos_id = instance->paxos_id;
+      paxos_context_proposal_decided(self->context);
+    }
+    paxos_start_new_round(self);
+  }
+
+  if (paxos_learner_needs_snapshot(&(self->learner)))
+    paxos_learner_snapshot(self);
+
+  paxos_reader_check(self);
+}
+
+static void __request_chosen (paxos_t *paxos,
+                              paxos_learner_t *learner,
+                              uint64_t paxos_id,
+                              uint64_t node_id)
 {
   paxos_message_t omsg;
-  uint64_t value;
+  learner->last_request_chosen_time = paxos_time_now();
+  paxos_message_request_chosen(&omsg, paxos_id, paxos->node_id);
+  paxos_send(paxos, node_id, &omsg);
+}
 
-  if (message->paxos_id >= self->learner.paxos_id)
-    return;
+/* Send back what we know starting from paxos_id, up to a window of values */
+static void __on_request_chosen (paxos_t *self, const paxos_message_t *message)
+{
+  const paxos_value_t *value;
+  paxos_message_t omsg;
+  uint64_t paxos_id;
+  uint8_t flags;
 
-  if (paxos_get_accepted_value(self, message->paxos_id, &value)) {
-      LOG_TRACE("Sending PaxosID %lu to node %lu",
-                message->paxos_id, message->node_id);
-      paxos_message_learn_value(&omsg, message->paxos_id, self->node_id, value);
-  } else {
+  paxos_id = message->paxos_id;
+  if (!paxos_get_accepted_value(self, paxos_id, &value, &flags)) {
+    if (paxos_id < self->learner.paxos_id) {
       LOG_TRACE("PaxosID not found, start catchup!");
-      paxos_message_catchup_start(&omsg, self->learner.paxos_id, self->node_id);
+      paxos_message_catchup_start(&omsg, self->learner.paxos_id - 1, self->node_id);
+      paxos_send(self, message->node_id, &omsg);
+    }
+    return;
   }
 
-  paxos_context_send(self->context, message->node_id, &omsg);
+  do {
+    LOG_TRACE("Sending PaxosID %lu to node %lu", paxos_id, message->node_id);
+    paxos_message_learn_value(&omsg, paxos_id, self->node_id, value);
+    omsg.flags = flags;
+    paxos_send(self, message->node_id, &omsg);
+  } while (++paxos_id < message->paxos_id + self->window_size &&
+           paxos_get_accepted_value(self, paxos_id, &value, &flags));
+
+  /* More than a window behind, the rest is faster with a range catch-up */
+  if (paxos_id == message->paxos_id + self->window_size &&
+      paxos_id < self->learner.paxos_id)
+  {
+    paxos_message_catchup_start(&omsg, self->learner.paxos_id - 1, self->node_id);
+    paxos_send(self, message->node_id, &omsg);
+  }
 }
 
+static void __on_snapshot_timeout (void *arg);
+static void __on_catchup_timeout (void *arg);
+
 static void paxos_learner_init (paxos_t *paxos, paxos_learner_t *learner) {
   learner->paxos_id = 0;
+  paxos_value_init(&(learner->learned_value));
+  learner->learned_paxos_id = 0;
   learner->has_learned_value = 0;
+  learner->stale = 0;
   learner->last_request_chosen_time = 0;
+  paxos_log_open(&(learner->log));
+
+  paxos_snapshot_init(&(learner->snapshot));
+  learner->snapshot_interval = 0;
+  learner->snapshot_path = NULL;
+  paxos_snapshot_init(&(learner->incoming));
+  learner->incoming_node_id = 0;
+  learner->incoming_retries = 0;
+  paxos_timeout_init(&(learner->snapshot_timeout), PAXOS_ROUND_TIMEOUT,
+                     __on_snapshot_timeout, paxos);
+
+  learner->catchup_node_id = 0;
+  learner->catchup_end = 0;
+  learner->catchup_retries = 0;
+  paxos_timeout_init(&(learner->catchup_timeout), PAXOS_ROUND_TIMEOUT,
+                     __on_catchup_timeout, paxos);
+  paxos_value_init(&(learner->catchup_batch));
 }
 
 /* ============================================================================
- *  Paxos Acceptor
+ *  Paxos ReadIndex
  */
-struct paxos_commit_info {
-  paxos_t *paxos;
-  const paxos_message_t *message;
-};
-
-static void __on_state_written (void *arg) {
-  struct paxos_commit_info *commit_info = (struct paxos_commit_info *)arg;
-  paxos_t *paxos = commit_info->paxos;
+static void __on_read_timeout (void *arg);
+
+static void paxos_reader_init (paxos_t *paxos, paxos_reader_t *reader) {
+  reader->seq = 0;
+  reader->index = 0;
+  reader->index_node_id = 0;
+  reader->votes = 0;
+  reader->quorum.num_nodes = paxos->quorum.num_nodes;
+  paxos_quorum_vote_reset(&(reader->quorum));
+  reader->queued = 0;
+  reader->in_flight = 0;
+  reader->confirmed_seq = 0;
+  reader->confirmed_index = 0;
+  reader->ready_seq = 0;
+  paxos_timeout_init(&(reader->timeout), PAXOS_ROUND_TIMEOUT,
+                     __on_read_timeout, paxos);
+}
 
-  LOG_FUNC_TRACE
-  paxos->acceptor.is_committing = 0;
+/* One past the highest paxos_id we have accepted, what's below is chosen */
+static uint64_t paxos_acceptor_read_index (paxos_t *self) {
+  paxos_instance_t *instance;
+  uint64_t paxos_id;
 
-  if (paxos->acceptor.written_paxos_id == paxos->learner.paxos_id) {
-    paxos_context_send(paxos->context,
-                       paxos->acceptor.sender_id,
-                       commit_info->message);
+  for (paxos_id = paxos_window_end(self); paxos_id > self->learner.paxos_id; --paxos_id) {
+    instance = paxos_instance_get(self, paxos_id - 1);
+    if (instance != NULL && instance->acceptor.accepted)
+      return(paxos_id);
   }
+  return(self->learner.paxos_id);
 }
 
-static void __commit (paxos_t *paxos,
-                      paxos_acceptor_t *acceptor,
-                      const paxos_message_t *message)
-{
-  struct paxos_commit_info commit_info;
-
-  LOG_FUNC_TRACE
-  ASSERT(!acceptor->is_committing);
+/* The reads of the rounds confirmed can go, once we have learned the index */
+static void paxos_reader_check (paxos_t *self) {
+  paxos_reader_t *reader = &(self->reader);
 
-  acceptor->written_paxos_id = paxos->learner.paxos_id;
-  acceptor->is_committing = 1;
+  if (reader->ready_seq == reader->confirmed_seq ||
+      self->learner.paxos_id < reader->confirmed_index || self->learner.stale)
+  {
+    return;
+  }
 
-  commit_info.paxos = paxos;
-  commit_info.message = message;
-  paxos_commit(paxos, __on_state_written, &commit_info);
+  reader->ready_seq = reader->confirmed_seq;
+  if (!reader->in_flight)
+    paxos_timeout_stop(&(reader->timeout));
+  if (self->context->read_ready != NULL)
+    self->context->read_ready(self->context->arg);
 }
 
-static void __accept_prepare_request (paxos_t *paxos,
-                                      paxos_acceptor_t *acceptor,
-                                      const paxos_message_t *message)
-{
+static void __start_read_round (paxos_t *paxos, paxos_reader_t *reader) {
   paxos_message_t omsg;
 
-  LOG_FUNC_TRACE
+  paxos_quorum_vote_reset(&(reader->quorum));
+  reader->votes = 0;
+  reader->index = 0;
+  reader->queued = 0;
+  reader->in_flight = 1;
+  paxos_message_read_index(&omsg, ++(reader->seq), paxos->node_id);
+  paxos_broadcast(paxos, &omsg);
+  paxos_round_timeout_start(paxos, &(reader->timeout), PAXOS_ROUND_TIMEOUT);
+}
 
-  acceptor->state.promised_proposal_id = message->proposal_id;
+/*
+ * A reply may be lost: the round goes out again, with the same seq.
+ * Once confirmed, we ask the values up to the index to the node that has them.
+ */
+static void __on_read_timeout (void *arg) {
+  paxos_t *paxos = (paxos_t *)arg;
+  paxos_reader_t *reader = &(paxos->reader);
+  paxos_message_t omsg;
 
-  acceptor->sender_id = message->node_id;
-  if (!acceptor->state.accepted) {
-    paxos_message_prepare_currently_open(&omsg, message->paxos_id,
-                                         paxos->node_id,
-                                         message->proposal_id);
-  } else {
-    paxos_message_prepare_previously_accepted(&omsg,
-                                          message->paxos_id,
-                                          paxos->node_id,
-                                          message->proposal_id,
-                                          acceptor->state.accepted_proposal_id,
-                                          acceptor->state.accepted_value);
+  if (reader->in_flight) {
+    paxos_message_read_index(&omsg, reader->seq, paxos->node_id);
+    paxos_broadcast(paxos, &omsg);
+  } else if (reader->ready_seq == reader->confirmed_seq) {
+    return;
+  } else if (!paxos_learner_is_catching_up(&(paxos->learner))) {
+    __request_chosen(paxos, &(paxos->learner),
+                     paxos->learner.paxos_id, reader->index_node_id);
   }
+  paxos_round_timeout_start(paxos, &(reader->timeout), PAXOS_ROUND_TIMEOUT);
+}
 
-  __commit(paxos, acceptor, &omsg);
+static void __on_read_index (paxos_t *paxos, const paxos_message_t *message) {
+  paxos_message_t omsg;
+  paxos_message_read_index_reply(&omsg, message->paxos_id, paxos->node_id,
+                                 paxos_acceptor_read_index(paxos));
+  paxos_send(paxos, message->node_id, &omsg);
 }
 
-static void __accept_propose_request (paxos_t *paxos,
-                                      paxos_acceptor_t *acceptor,
-                                      const paxos_message_t *message)
+static void __on_read_index_reply (paxos_t *paxos,
+                                   paxos_reader_t *reader,
+                                   const paxos_message_t *message)
 {
-  paxos_message_t omsg;
+  uint32_t vote = 1u << (message->node_id % PAXOS_MAX_NODES);
 
-  LOG_FUNC_TRACE
+  if (!reader->in_flight || message->paxos_id != reader->seq ||
+      (reader->votes & vote))
+  {
+    return;
+  }
 
-  acceptor->state.accepted = 1;
-  acceptor->state.accepted_proposal_id = message->proposal_id;
-  acceptor->state.accepted_value = message->value;
-  LOG_TRACE("proposal_id=%lu value=%lu",
-            acceptor->state.accepted_proposal_id,
-            acceptor->state.accepted_value);
+  reader->votes |= vote;
+  if (message->offset > reader->index) {
+    reader->index = message->offset;
+    reader->index_node_id = message->node_id;
+  }
 
-  acceptor->sender_id = message->node_id;
-  paxos_message_propose_accepted(&omsg, message->paxos_id,
-                                 paxos->node_id,
-                                 message->proposal_id);
+  paxos_quorum_vote_accepted(&(reader->quorum), message->node_id);
+  if (!paxos_quorum_vote_is_accepted(&(reader->quorum)))
+    return;
+
+  /* Every write completed before the round is at or below the index */
+  reader->in_flight = 0;
+  reader->confirmed_seq = reader->seq;
+  reader->confirmed_index = reader->index;
+  if (paxos->learner.paxos_id < reader->index) {
+    if (!paxos_learner_is_catching_up(&(paxos->learner))) {
+      __request_chosen(paxos, &(paxos->learner),
+                       paxos->learner.paxos_id, reader->index_node_id);
+    }
+    paxos_round_timeout_start(paxos, &(reader->timeout), PAXOS_ROUND_TIMEOUT);
+  }
+  paxos_reader_check(paxos);
 
-  __commit(paxos, acceptor, &omsg);
+  if (reader->queued)
+    __start_read_round(paxos, reader);
 }
 
-static int __can_accept_request (paxos_t *paxos,
-                                 paxos_acceptor_t *acceptor,
-                                 const paxos_message_t *message)
-{
-  LOG_FUNC_TRACE
+/* ============================================================================
+ *  Paxos Lease
+ */
+/*
+ * msec, read from the clock: the cached one is as old as the loop iteration
+ * (a whole batch of messages), a lease can't start or end on it.
+ */
+#define paxos_lease_now()       (paxos_clock_update() / 1000)
 
-  if (message->paxos_id != paxos->learner.paxos_id)
-    return(0);
+/* Until the lease we granted expires, no one else gets a promise from us */
+#define paxos_lease_is_held_by_other(self, node)                            \
+  ((self)->acceptor.lease_expire > paxos_lease_now() &&                     \
+   (self)->acceptor.lease_node_id != (node))
 
-  if (message->proposal_id < acceptor->state.promised_proposal_id)
-    return(0);
+#define paxos_proposer_has_lease(self)                                      \
+  ((self)->proposer.is_leader &&                                            \
+   (self)->proposer.lease_expire > paxos_lease_now())
 
-  if (acceptor->is_committing)
-    return(0);
+static void __grant_lease (paxos_t *paxos,
+                           paxos_acceptor_t *acceptor,
+                           uint64_t node_id)
+{
+  if (paxos->lease_duration == 0)
+    return;
+  acceptor->lease_node_id = node_id;
+  acceptor->lease_expire = paxos_lease_now() + paxos->lease_duration;
+}
 
-  return(1);
+/* The acceptors count the lease from when they got the request, we from when we sent it */
+static void __extend_lease (paxos_t *paxos, paxos_proposer_t *proposer, uint64_t start) {
+  uint64_t expire = start + paxos->lease_duration -
+                    paxos->lease_duration / PAXOS_LEASE_DRIFT_RATIO;
+  if (expire > proposer->lease_expire)
+    proposer->lease_expire = expire;
 }
 
-static void __on_prepare_request (paxos_t *paxos,
-                                  paxos_acceptor_t *acceptor,
-                                  const paxos_message_t *message)
-{
-  LOG_FUNC_TRACE
+static void __renew_lease (paxos_t *paxos, paxos_proposer_t *proposer) {
+  paxos_message_t omsg;
 
-  if (__can_accept_request(paxos, acceptor, message)) {
-    __accept_prepare_request(paxos, acceptor, message);
-  } else {
-    paxos_message_t omsg;
-    paxos_message_prepare_rejected(&omsg, message->paxos_id,
-                                   paxos->node_id,
-                                   message->proposal_id,
-                                   acceptor->state.promised_proposal_id);
-    paxos_context_send(paxos->context, message->node_id, &omsg);
-  }
+  paxos_quorum_vote_reset(&(proposer->lease_quorum));
+  proposer->lease_votes = 0;
+  proposer->lease_renew_time = paxos_time_now();
+  paxos_message_lease_renew(&omsg, ++(proposer->lease_seq),
+                            paxos->node_id, proposer->proposal_id);
+  paxos_broadcast(paxos, &omsg);
+  paxos_timeout_start(&(proposer->lease_timeout));
 }
 
-static void __on_propose_request (paxos_t *paxos,
-                                  paxos_acceptor_t *acceptor,
-                                  const paxos_message_t *message)
-{
-  LOG_FUNC_TRACE
+/* The promises of the prepare were the grants, keep it alive from now on */
+static void __start_lease (paxos_t *paxos, paxos_proposer_t *proposer) {
+  if (paxos->lease_duration == 0)
+    return;
+  __extend_lease(paxos, proposer, proposer->prepare_time / 1000);
+  paxos_timeout_start(&(proposer->lease_timeout));
+}
 
-  if (__can_accept_request(paxos, acceptor, message)) {
-    __accept_propose_request(paxos, acceptor, message);
-  } else {
-    paxos_message_t omsg;
-    paxos_message_propose_rejected(&omsg, message->paxos_id,
-                                   paxos->node_id,
-                                   message->proposal_id);
-    paxos_context_send(paxos->context, message->node_id, &omsg);
-  }
+static void __on_lease_timeout (void *arg) {
+  paxos_t *paxos = (paxos_t *)arg;
+
+  if (paxos->proposer.is_leader)
+    __renew_lease(paxos, &(paxos->proposer));
 }
 
-static void __request_chosen (paxos_t *paxos,
-                              paxos_learner_t *learner,
-                              uint64_t node_id)
+static void __forward_value (paxos_t *paxos,
+                             uint64_t node_id,
+                             const paxos_value_t *value)
 {
   paxos_message_t omsg;
-  learner->last_request_chosen_time = paxos_time_now();
-  paxos_message_request_chosen(&omsg, learner->paxos_id, paxos->node_id);
-  paxos_context_send(paxos->context, node_id, &omsg);
+  paxos_message_forward_value(&omsg, paxos->node_id, value);
+  paxos_send(paxos, node_id, &omsg);
 }
 
-static void __on_learn_chosen (paxos_t *paxos,
-                               paxos_acceptor_t *acceptor,
-                               const paxos_message_t *message)
-{
-  LOG_FUNC_TRACE
+/*
+ * No prepare of ours gets through until the lease expires, the holder
+ * proposes our values (once). They stay here: if it's gone, we propose them.
+ */
+static void __forward_pending (paxos_t *paxos, paxos_proposer_t *proposer) {
+  paxos_instance_t *instance;
+  uint64_t i;
+
+  for (i = paxos->learner.paxos_id; i < proposer->next_paxos_id; ++i) {
+    instance = paxos_instance_get(paxos, i);
+
+    /* Only ours: not a value from a prepare response, nor a noop */
+    if (instance == NULL || instance->chosen ||
+        !instance->proposer.has_value || instance->proposer.forwarded ||
+        instance->proposer.highest_received_proposal_id > 0 ||
+        (instance->proposer.proposed_flags & PAXOS_MESSAGE_NOOP))
+    {
+      continue;
+    }
+
+    __forward_value(paxos, paxos->acceptor.lease_node_id,
+                    &(instance->proposer.proposed_value));
+    instance->proposer.forwarded = 1;
+  }
 
-  if (acceptor->is_committing)
-    return;
+  if (proposer->next_paxos_id > paxos->learner.paxos_id &&
+      !proposer->preparing && proposer->num_proposing == 0 &&
+      !proposer->restart_timeout.active)
+  {
+    paxos_round_timeout_start(paxos, &(proposer->restart_timeout),
+                              PAXOS_RESTART_TIMEOUT);
+  }
+}
+
+static void __on_lease_granted (paxos_t *paxos,
+                                paxos_proposer_t *proposer,
+                                const paxos_message_t *message)
+{
+  uint32_t vote = 1u << (message->node_id % PAXOS_MAX_NODES);
+
+  if (!proposer->is_leader ||
+      message->proposal_id != proposer->proposal_id ||
+      message->paxos_id != proposer->lease_seq ||
+      (proposer->lease_votes & vote))
+  {
+    return;
+  }
+
+  proposer->lease_votes |= vote;
+  paxos_quorum_vote_accepted(&(proposer->lease_quorum), message->node_id);
+  if (paxos_quorum_vote_is_accepted(&(proposer->lease_quorum)))
+    __extend_lease(paxos, proposer, proposer->lease_renew_time);
+}
+
+/* ============================================================================
+ *  Paxos Acceptor
+ */
+static void __on_state_written (paxos_t *paxos, paxos_commit_t *commit) {
+  LOG_FUNC_TRACE
+
+  /* A lease grant carries the renewal seq, not an instance */
+  if (commit->message.type == PAXOS_LEASE_GRANTED ||
+      commit->message.paxos_id >= paxos->learner.paxos_id)
+  {
+    paxos_send(paxos, commit->node_id, &(commit->message));
+  }
+}
+
+static void paxos_acceptor_compact (paxos_t *paxos);
+
+/* Send the responses of the batches that are now durable */
+static void paxos_commit_complete (paxos_t *paxos) {
+  paxos_acceptor_t *acceptor = &(paxos->acceptor);
+  paxos_wal_completion_t completion;
+  paxos_commit_t *commits;
+  uint32_t i;
+
+  while (paxos_wal_complete(&(acceptor->wal), &completion, 0) > 0) {
+    if (completion.batch == PAXOS_WAL_COMPACTION) {
+      /* Not fatal, the old log is still there */
+      if (completion.status != 0)
+        fprintf(stderr, "paxos: unable to compact the wal %s\n", acceptor->wal.path);
+      else
+        paxos_stats_inc(&(paxos->stats), PAXOS_STATS_WAL_COMPACTIONS);
+      continue;
+    }
+
+    commits = acceptor->commits[completion.batch];
+    if (completion.status != 0) {
+      /* Nothing is durable, nor will anything after it be: no response */
+      if (completion.status != PAXOS_WAL_FAILED)
+        fprintf(stderr, "paxos: wal write failed %d, no longer answering\n",
+                completion.status);
+      paxos_stats_inc(&(paxos->stats), PAXOS_STATS_WAL_ERRORS);
+      continue;
+    }
+
+    paxos_stats_inc(&(paxos->stats), PAXOS_STATS_WAL_SYNCS);
+    paxos_stats_add(&(paxos->stats), PAXOS_STATS_WAL_RECORDS, completion.num_records);
+    paxos_stats_time(&(paxos->stats), PAXOS_STATS_COMMIT_TIME,
+                     acceptor->commit_start[completion.batch], paxos_time_now_usec());
+
+    for (i = 0; i < completion.num_records; ++i)
+      __on_state_written(paxos, &(commits[i]));
+  }
+
+  /* A compaction waiting for the writer goes first, it's rare */
+  paxos_acceptor_compact(paxos);
+
+  /* The records that came in meanwhile have waited enough, send them down */
+  if (paxos_wal_pending(&(acceptor->wal)) > 0 &&
+      !paxos_wal_is_in_flight(&(acceptor->wal)))
+  {
+    paxos_timeout_stop(&(acceptor->commit_timeout));
+    paxos_wal_submit(&(acceptor->wal));
+  }
+}
+
+static void __on_commit_timeout (void *arg) {
+  paxos_t *paxos = (paxos_t *)arg;
+  paxos_wal_submit(&(paxos->acceptor.wal));
+}
+
+/*
+ * The snapshot on disk covers everything up to compact_paxos_id: the WAL is
+ * cut down to our promise and what the window has accepted after it. The
+ * writer thread does it, once it's done with the batch in flight; the
+ * records in the active batch go after, they may repeat the state.
+ */
+static void paxos_acceptor_compact (paxos_t *paxos) {
+  paxos_acceptor_t *acceptor = &(paxos->acceptor);
+  paxos_wal_t *wal = &(acceptor->wal);
+  const paxos_instance_t *instance;
+  paxos_wal_record_t record;
+  uint64_t i;
+
+  if (!acceptor->compact_wanted || paxos_wal_is_in_flight(wal))
+    return;
+
+  acceptor->compact_wanted = 0;
+  if (paxos_wal_has_failed(wal))
+    return;
+
+  memset(&record, 0, sizeof(paxos_wal_record_t));
+  record.promised_proposal_id = acceptor->promised_proposal_id;
+  record.flags = PAXOS_WAL_PROMISE;
+  if (paxos_wal_compact_append(wal, &record, NULL)) {
+    paxos_wal_compact_abort(wal);
+    return;
+  }
+
+  for (i = paxos->learner.paxos_id; i < paxos_window_end(paxos); ++i) {
+    instance = &(paxos->instances[i % paxos->window_size]);
+    if (i <= acceptor->compact_paxos_id || instance->paxos_id != i ||
+        !instance->acceptor.accepted)
+    {
+      continue;
+    }
+
+    record.paxos_id = i;
+    record.accepted_proposal_id = instance->acceptor.accepted_proposal_id;
+    record.value_size = instance->acceptor.accepted_value.size;
+    record.flags = PAXOS_WAL_ACCEPTED;
+    record.value_flags = instance->acceptor.accepted_flags;
+    if (paxos_wal_compact_append(wal, &record, instance->acceptor.accepted_value.data)) {
+      paxos_wal_compact_abort(wal);
+      return;
+    }
+  }
+
+  paxos_wal_compact(wal);
+}
+
+/* A snapshot up to paxos_id is on disk, compact if the WAL is big enough */
+static void paxos_acceptor_snapshot_saved (paxos_t *paxos, uint64_t paxos_id) {
+  paxos_acceptor_t *acceptor = &(paxos->acceptor);
+
+  if (!paxos_wal_is_open(&(acceptor->wal)) ||
+      !paxos_wal_needs_compaction(&(acceptor->wal)))
+  {
+    return;
+  }
+
+  acceptor->compact_paxos_id = paxos_id;
+  acceptor->compact_wanted = 1;
+  paxos_acceptor_compact(paxos);
+}
+
+/* Out of memory, the response is not sent: the proposer retries */
+static void __commit_drop (paxos_t *paxos, paxos_commit_t *commit) {
+  memset(&(commit->message), 0, sizeof(paxos_message_t));
+  paxos_value_clear(&(commit->value));
+  paxos_stats_inc(&(paxos->stats), PAXOS_STATS_WAL_ERRORS);
+}
+
+/* The state of the instance with our promise, or the promise alone if NULL */
+static void __commit (paxos_t *paxos,
+                      paxos_acceptor_t *acceptor,
+                      const paxos_instance_t *instance,
+                      uint64_t node_id,
+                      paxos_message_t *message)
+{
+  paxos_wal_t *wal = &(acceptor->wal);
+  paxos_wal_record_t record;
+  paxos_commit_t *commit;
+  const void *value;
+
+  LOG_FUNC_TRACE
+
+  /* No WAL, there is nothing to wait for */
+  if (!paxos_wal_is_open(wal)) {
+    paxos_send(paxos, node_id, message);
+    return;
+  }
+
+  /* The promise or the accept can't be made durable, stay silent */
+  if (paxos_wal_has_failed(wal))
+    return;
+
+  /* Both batches are busy, the event loop doesn't wait: the proposer retries */
+  if (paxos_wal_is_full(wal)) {
+    paxos_stats_inc(&(paxos->stats), PAXOS_STATS_WAL_FULL);
+    return;
+  }
+
+  /*
+   * The response outlives this call, the instance may accept something else
+   * before the batch is durable: keep our own copy of the value (prepare only).
+   */
+  if (paxos_wal_pending(wal) == 0)
+    acceptor->commit_start[wal->active] = paxos_time_now_usec();
+
+  commit = &(acceptor->commits[wal->active][paxos_wal_pending(wal)]);
+  commit->node_id = node_id;
+  memcpy(&(commit->message), message, sizeof(paxos_message_t));
+  if (!paxos_value_is_empty(&(message->value))) {
+    if (paxos_value_copy(&(commit->value), &(message->value))) {
+      __commit_drop(paxos, commit);
+      return;
+    }
+    paxos_value_ref(&(commit->message.value), &(commit->value));
+  }
+
+  if (instance != NULL) {
+    record.paxos_id = message->paxos_id;
+    record.promised_proposal_id = acceptor->promised_proposal_id;
+    record.accepted_proposal_id = instance->acceptor.accepted_proposal_id;
+    record.value_size = instance->acceptor.accepted_value.size;
+    record.flags = instance->acceptor.accepted ? PAXOS_WAL_ACCEPTED : 0;
+    record.value_flags = instance->acceptor.accepted_flags;
+    value = instance->acceptor.accepted_value.data;
+  } else {
+    memset(&record, 0, sizeof(paxos_wal_record_t));
+    record.promised_proposal_id = acceptor->promised_proposal_id;
+    record.flags = PAXOS_WAL_PROMISE;
+    value = NULL;
+  }
+
+  /* Not in the batch, the slot goes to the next commit */
+  if (paxos_wal_append(wal, &record, value)) {
+    __commit_drop(paxos, commit);
+    return;
+  }
+
+  /*
+   * With a batch in flight the completion will submit this one.
+   * Otherwise wait a bit for other records to share the sync.
+   */
+  if (paxos_wal_is_in_flight(wal))
+    return;
+
+  if (paxos_wal_is_full(wal)) {
+    paxos_timeout_stop(&(acceptor->commit_timeout));
+    paxos_wal_submit(wal);
+  } else if (!acceptor->commit_timeout.active) {
+    paxos_timeout_start(&(acceptor->commit_timeout));
+  }
+}
+
+static void __accept_prepare_request (paxos_t *paxos,
+                                      paxos_acceptor_t *acceptor,
+                                      const paxos_message_t *message)
+{
+  paxos_instance_t *instance;
+  paxos_message_t omsg;
+  uint16_t count;
+  uint64_t i;
+
+  LOG_FUNC_TRACE
+
+  acceptor->promised_proposal_id = message->proposal_id;
+  __grant_lease(paxos, acceptor, message->node_id);
+
+  /* Someone else has a newer ballot, we're no longer the leader */
+  if (message->node_id != paxos->node_id)
+    paxos->proposer.is_leader = 0;
+
+  /*
+   * The promise covers every paxos_id >= message->paxos_id, so report
+   * everything we've accepted in the window. The values are already on disk,
+   * only the base response waits for the promise to be written.
+   */
+  count = 0;
+  for (i = message->paxos_id + 1; i < paxos_window_end(paxos); ++i) {
+    instance = paxos_instance_get(paxos, i);
+    if (!instance->acceptor.accepted)
+      continue;
+
+    paxos_message_prepare_previously_accepted(&omsg, i,
+                                          paxos->node_id,
+                                          message->proposal_id,
+                                          instance->acceptor.accepted_proposal_id,
+                                          &(instance->acceptor.accepted_value));
+    omsg.flags = instance->acceptor.accepted_flags;
+    paxos_send(paxos, message->node_id, &omsg);
+    count++;
+  }
+
+  instance = paxos_instance_get(paxos, message->paxos_id);
+  if (!instance->acceptor.accepted) {
+    paxos_message_prepare_currently_open(&omsg, message->paxos_id,
+                                         paxos->node_id,
+                                         message->proposal_id);
+  } else {
+    paxos_message_prepare_previously_accepted(&omsg,
+                                          message->paxos_id,
+                                          paxos->node_id,
+                                          message->proposal_id,
+                                          instance->acceptor.accepted_proposal_id,
+                                          &(instance->acceptor.accepted_value));
+    omsg.flags = instance->acceptor.accepted_flags;
+  }
+  omsg.count = count;
+
+  __commit(paxos, acceptor, instance, message->node_id, &omsg);
+}
+
+static void __accept_propose_request (paxos_t *paxos,
+                                      paxos_acceptor_t *acceptor,
+                                      const paxos_message_t *message)
+{
+  paxos_instance_t *instance;
+  paxos_message_t omsg;
+
+  LOG_FUNC_TRACE
+
+  instance = paxos_instance_get(paxos, message->paxos_id);
+  instance->acceptor.accepted = 1;
+  instance->acceptor.accepted_proposal_id = message->proposal_id;
+  paxos_value_copy(&(instance->acceptor.accepted_value), &(message->value));
+  instance->acceptor.accepted_flags = message->flags;
+  LOG_TRACE("paxos_id=%lu proposal_id=%lu size=%u", message->paxos_id,
+            instance->acceptor.accepted_proposal_id,
+            instance->acceptor.accepted_value.size);
+
+  paxos_message_propose_accepted(&omsg, message->paxos_id,
+                                 paxos->node_id,
+                                 message->proposal_id);
+
+  __commit(paxos, acceptor, instance, message->node_id, &omsg);
+}
+
+static int __can_accept_request (paxos_t *paxos,
+                                 paxos_acceptor_t *acceptor,
+                                 const paxos_message_t *message)
+{
+  LOG_FUNC_TRACE
+
+  if (!paxos_instance_is_in_window(paxos, message->paxos_id))
+    return(0);
 
-  if (message->paxos_id > paxos->learner.paxos_id) {
-    __request_chosen(paxos, &(paxos->learner), message->node_id);
+  if (message->proposal_id < acceptor->promised_proposal_id)
+    return(0);
+
+  return(1);
+}
+
+/* The reason a request was rejected, the lease is checked last */
+static void __count_rejection (paxos_t *paxos,
+                               paxos_acceptor_t *acceptor,
+                               const paxos_message_t *message)
+{
+  if (!paxos_instance_is_in_window(paxos, message->paxos_id))
+    paxos_stats_inc(&(paxos->stats), PAXOS_STATS_REJECT_WINDOW);
+  else if (message->proposal_id < acceptor->promised_proposal_id)
+    paxos_stats_inc(&(paxos->stats), PAXOS_STATS_REJECT_BALLOT);
+  else
+    paxos_stats_inc(&(paxos->stats), PAXOS_STATS_REJECT_LEASE);
+}
+
+/*
+ * A request past our window: the sender has chosen what we're missing,
+ * every request of it would be rejected until we ask (once per msec).
+ */
+static void __catchup_sender (paxos_t *paxos, const paxos_message_t *message) {
+  paxos_learner_t *learner = &(paxos->learner);
+
+  if (message->paxos_id >= paxos_window_end(paxos) &&
+      !paxos_learner_is_catching_up(learner) &&
+      learner->last_request_chosen_time != paxos_time_now())
+  {
+    __request_chosen(paxos, learner, learner->paxos_id, message->node_id);
+  }
+}
+
+static void __on_prepare_request (paxos_t *paxos,
+                                  paxos_acceptor_t *acceptor,
+                                  const paxos_message_t *message)
+{
+  LOG_FUNC_TRACE
+
+  if (__can_accept_request(paxos, acceptor, message) &&
+      !paxos_lease_is_held_by_other(paxos, message->node_id))
+  {
+    __accept_prepare_request(paxos, acceptor, message);
+  } else {
+    paxos_message_t omsg;
+    __count_rejection(paxos, acceptor, message);
+    __catchup_sender(paxos, message);
+    paxos_message_prepare_rejected(&omsg, message->paxos_id,
+                                   paxos->node_id,
+                                   message->proposal_id,
+                                   acceptor->promised_proposal_id);
+    paxos_send(paxos, message->node_id, &omsg);
+  }
+}
+
+static void __on_propose_request (paxos_t *paxos,
+                                  paxos_acceptor_t *acceptor,
+                                  const paxos_message_t *message)
+{
+  LOG_FUNC_TRACE
+
+  if (__can_accept_request(paxos, acceptor, message)) {
+    __accept_propose_request(paxos, acceptor, message);
+  } else {
+    paxos_message_t omsg;
+    __count_rejection(paxos, acceptor, message);
+    __catchup_sender(paxos, message);
+    paxos_message_propose_rejected(&omsg, message->paxos_id,
+                                   paxos->node_id,
+                                   message->proposal_id);
+    paxos_send(paxos, message->node_id, &omsg);
+  }
+}
+
+/*
+ * Renewed to the node holding our promise, or a newer one: that is promised
+ * as if it was prepared, and logged before the grant goes out.
+ */
+static void __on_lease_renew (paxos_t *paxos,
+                              paxos_acceptor_t *acceptor,
+                              const paxos_message_t *message)
+{
+  paxos_message_t omsg;
+
+  /* A higher promise made to our own failed prepare doesn't stop the grant,
+   * no quorum is going to use that ballot.
+   */
+  if (paxos->lease_duration == 0 ||
+      (message->proposal_id < acceptor->promised_proposal_id &&
+       (acceptor->promised_proposal_id != paxos->proposer.proposal_id ||
+        paxos->proposer.preparing || paxos->proposer.is_leader)))
+  {
+    return;
+  }
+
+  __grant_lease(paxos, acceptor, message->node_id);
+  paxos_message_lease_granted(&omsg, message->paxos_id, paxos->node_id,
+                              message->proposal_id);
+  if (message->proposal_id > acceptor->promised_proposal_id) {
+    acceptor->promised_proposal_id = message->proposal_id;
+    __commit(paxos, acceptor, NULL, message->node_id, &omsg);
+  } else {
+    paxos_send(paxos, message->node_id, &omsg);
+  }
+
+  if (message->node_id != paxos->node_id) {
+    paxos->proposer.is_leader = 0;
+    __forward_pending(paxos, &(paxos->proposer));
+  }
+}
+
+static void __on_learn_chosen (paxos_t *paxos,
+                               paxos_acceptor_t *acceptor,
+                               const paxos_message_t *message)
+{
+  paxos_instance_t *instance;
+
+  LOG_FUNC_TRACE
+
+  /* Too far behind, unless a catch-up is already filling the gap */
+  if (message->paxos_id >= paxos_window_end(paxos)) {
+    if (!paxos_learner_is_catching_up(&(paxos->learner))) {
+      __request_chosen(paxos, &(paxos->learner),
+                       paxos->learner.paxos_id, message->node_id);
+    }
     return;
   }
 
-  if (message->paxos_id < paxos->learner.paxos_id)
+  if ((instance = paxos_instance_get(paxos, message->paxos_id)) == NULL)
+    return;
+
+  if (instance->chosen)
     return;
 
   if (message->type == PAXOS_LEARN_VALUE) {
-    acceptor->state.accepted = 1;
-    acceptor->state.accepted_value = message->value;
+    instance->acceptor.accepted = 1;
+    paxos_value_copy(&(instance->acceptor.accepted_value), &(message->value));
+    instance->acceptor.accepted_flags = message->flags;
   } else if (!(message->type == PAXOS_LEARN_PROPOSAL &&
-               acceptor->state.accepted &&
-               acceptor->state.accepted_proposal_id == message->proposal_id))
+               instance->acceptor.accepted &&
+               instance->acceptor.accepted_proposal_id == message->proposal_id))
   {
-    __request_chosen(paxos, &(paxos->learner), message->node_id);
+    __request_chosen(paxos, &(paxos->learner),
+                     message->paxos_id, message->node_id);
     return;
   }
 
-  /* Set learned value and start new paxos round */
-  paxos_learner_learn_value(paxos, acceptor->state.accepted_value);
-  paxos_start_new_round(paxos);
+  /* Mark the instance as chosen and deliver what is now in order */
+  instance->chosen = 1;
+  paxos_learner_deliver(paxos);
 }
 
 static void paxos_acceptor_init (paxos_t *paxos, paxos_acceptor_t *acceptor) {
-  acceptor->is_committing = 0;
-  acceptor->sender_id = 0;
-  acceptor->written_paxos_id = 0;
-  paxos_acceptor_state_reset(&(acceptor->state));
+  acceptor->promised_proposal_id = 0;
+  acceptor->lease_node_id = 0;
+  acceptor->lease_expire = 0;
+  memset(acceptor->commits, 0, sizeof(acceptor->commits));
+  memset(acceptor->commit_start, 0, sizeof(acceptor->commit_start));
+  paxos_wal_init(&(acceptor->wal));
+  paxos_timeout_init(&(acceptor->commit_timeout), 0, __on_commit_timeout, paxos);
+  acceptor->compact_paxos_id = 0;
+  acceptor->compact_wanted = 0;
+}
+
+/*
+ * Recovery: anything older than a window behind the last record was already
+ * delivered when that record was written, so the window restarts from there.
+ */
+struct paxos_recovery {
+  paxos_t *paxos;
+  uint64_t max_paxos_id;
+  uint8_t  has_records;
+};
+
+static void __wal_scan (void *arg,
+                        const paxos_wal_record_t *record,
+                        const uint8_t *value)
+{
+  struct paxos_recovery *recovery = (struct paxos_recovery *)arg;
+  paxos_acceptor_t *acceptor = &(recovery->paxos->acceptor);
+
+  if (record->promised_proposal_id > acceptor->promised_proposal_id)
+    acceptor->promised_proposal_id = record->promised_proposal_id;
+
+  recovery->has_records = 1;
+  if (record->flags & PAXOS_WAL_PROMISE)
+    return;
+
+  if (record->paxos_id > recovery->max_paxos_id)
+    recovery->max_paxos_id = record->paxos_id;
+}
+
+static void __wal_restore (void *arg,
+                           const paxos_wal_record_t *record,
+                           const uint8_t *value)
+{
+  struct paxos_recovery *recovery = (struct paxos_recovery *)arg;
+  paxos_instance_t *instance;
+
+  if (!(record->flags & PAXOS_WAL_ACCEPTED))
+    return;
+
+  if ((instance = paxos_instance_get(recovery->paxos, record->paxos_id)) != NULL) {
+    instance->acceptor.accepted = 1;
+    instance->acceptor.accepted_proposal_id = record->accepted_proposal_id;
+    paxos_value_set(&(instance->acceptor.accepted_value), value, record->value_size);
+    instance->acceptor.accepted_flags = record->value_flags;
+
+    /* New proposals go after it, this one is re-proposed on the next prepare */
+    if (recovery->paxos->proposer.next_paxos_id <= record->paxos_id)
+      recovery->paxos->proposer.next_paxos_id = record->paxos_id + 1;
+  }
 }
 
 /* ============================================================================
@@ -578,93 +1497,212 @@ static void paxos_acceptor_init (paxos_t *paxos, paxos_acceptor_t *acceptor) {
  */
 static void __stop_preparing (paxos_t *paxos, paxos_proposer_t *proposer) {
   LOG_FUNC_TRACE
-  proposer->state.preparing = 0;
+  proposer->preparing = 0;
   paxos_timeout_stop(&(proposer->prepare_timeout));
 }
 
-static void __start_proposing (paxos_t *paxos, paxos_proposer_t *proposer) {
+static void __send_propose_request (paxos_t *paxos,
+                                    paxos_proposer_t *proposer,
+                                    paxos_instance_t *instance)
+{
   paxos_message_t omsg;
 
+  paxos_message_propose_request(&omsg, instance->paxos_id,
+                                paxos->node_id,
+                                proposer->proposal_id,
+                                &(instance->proposer.proposed_value));
+  omsg.flags = instance->proposer.proposed_flags;
+  paxos_broadcast(paxos, &omsg);
+}
+
+static void __propose_instance (paxos_t *paxos,
+                                paxos_proposer_t *proposer,
+                                paxos_instance_t *instance)
+{
+  if (!instance->proposer.proposing)
+    proposer->num_proposing++;
+
+  paxos_quorum_vote_reset(&(instance->quorum));
+  instance->proposer.proposing = 1;
+  instance->proposer.retransmitted = 0;
+  instance->proposer.propose_time = paxos_time_now_usec();
+  paxos_stats_inc(&(paxos->stats), PAXOS_STATS_PROPOSALS);
+
+  __send_propose_request(paxos, proposer, instance);
+
+  if (!proposer->propose_timeout.active)
+    paxos_round_timeout_start(paxos, &(proposer->propose_timeout),
+                              PAXOS_ROUND_TIMEOUT);
+}
+
+static void __start_proposing (paxos_t *paxos, paxos_proposer_t *proposer) {
+  paxos_instance_t *instance;
+  uint64_t i;
+
   LOG_FUNC_TRACE
   __stop_preparing(paxos, proposer);
 
-  paxos_quorum_vote_reset(&(paxos->quorum));
-  proposer->state.proposing = 1;
-
-  paxos_message_propose_request(&omsg, paxos->learner.paxos_id,
-                                paxos->node_id,
-                                proposer->state.proposal_id,
-                                proposer->state.proposed_value);
-  paxos_context_broadcast(paxos->context, &omsg);
+  /*
+   * Propose every instance we know about: the ones holding a previously
+   * accepted value must keep it, the holes between them are filled with noops.
+   */
+  for (i = paxos->learner.paxos_id; i < proposer->next_paxos_id; ++i) {
+    instance = paxos_instance_get(paxos, i);
+    if (instance->chosen)
+      continue;
+
+    if (!instance->proposer.has_value) {
+      instance->proposer.has_value = 1;
+      paxos_value_clear(&(instance->proposer.proposed_value));
+      instance->proposer.proposed_flags = PAXOS_MESSAGE_NOOP;
+    }
+    __propose_instance(paxos, proposer, instance);
+  }
 
+  /* Anything chosen before us is in there, the local reads wait for it */
+  proposer->read_paxos_id = __math_max(proposer->read_paxos_id,
+                                       proposer->next_paxos_id);
   paxos_timeout_stop(&(proposer->restart_timeout));
-  paxos_timeout_start(&(proposer->propose_timeout));
 }
 
 static void __stop_proposing (paxos_t *paxos, paxos_proposer_t *proposer) {
+  paxos_instance_t *instance;
+  uint64_t i;
+
   LOG_FUNC_TRACE
-  proposer->state.proposing = 0;
+  for (i = paxos->learner.paxos_id; i < paxos_window_end(paxos); ++i) {
+    instance = paxos_instance_get(paxos, i);
+    instance->proposer.proposing = 0;
+  }
+  proposer->num_proposing = 0;
   paxos_timeout_stop(&(proposer->propose_timeout));
 }
 
+/*
+ * Proposal ids are (round << 16 | node_id), two proposers never share a ballot.
+ * This matters once a leader keeps using the same ballot for many rounds.
+ */
+#define PAXOS_PROPOSAL_NODE_BITS    (16)
+#define PAXOS_PROPOSAL_NODE_MASK    ((1 << PAXOS_PROPOSAL_NODE_BITS) - 1)
+
 static uint64_t __next_proposal_id (paxos_t *self, paxos_proposer_t *proposer) {
-  return(1 + __math_max(proposer->state.proposal_id,
-                        proposer->state.highest_promised_proposal_id));
+  uint64_t round = __math_max(proposer->proposal_id,
+                              proposer->highest_promised_proposal_id);
+  round = 1 + (round >> PAXOS_PROPOSAL_NODE_BITS);
+  return((round << PAXOS_PROPOSAL_NODE_BITS) |
+         (self->node_id & PAXOS_PROPOSAL_NODE_MASK));
 }
 
 static void __start_preparing (paxos_t *paxos, paxos_proposer_t *proposer) {
   paxos_message_t omsg;
+  uint64_t i;
 
   LOG_FUNC_TRACE
 
   __stop_proposing(paxos, proposer);
 
   paxos_quorum_vote_reset(&(paxos->quorum));
-  proposer->state.preparing = 1;
-  proposer->state.proposal_id = __next_proposal_id(paxos, proposer);
-  proposer->state.highest_received_proposal_id = 0;
-
-  paxos_message_prepare_request(&omsg, paxos->learner.paxos_id,
-                                paxos->node_id, proposer->state.proposal_id);
-  paxos_context_broadcast(paxos->context, &omsg);
+  memset(proposer->votes, 0, sizeof(proposer->votes));
+  for (i = paxos->learner.paxos_id; i < paxos_window_end(paxos); ++i)
+    paxos_instance_get(paxos, i)->proposer.reported = 0;
+  proposer->is_leader = 0;
+  proposer->lease_expire = 0;
+  proposer->preparing = 1;
+  proposer->proposal_id = __next_proposal_id(paxos, proposer);
+  proposer->prepare_paxos_id = paxos->learner.paxos_id;
+  proposer->prepare_time = paxos_time_now_usec();
+  proposer->prepare_retransmitted = 0;
+  paxos_stats_inc(&(paxos->stats), PAXOS_STATS_PREPARES);
+
+  paxos_message_prepare_request(&omsg, proposer->prepare_paxos_id,
+                                paxos->node_id, proposer->proposal_id);
+  paxos_broadcast(paxos, &omsg);
 
   paxos_timeout_stop(&(proposer->restart_timeout));
-  paxos_timeout_start(&(proposer->prepare_timeout));
+  paxos_round_timeout_start(paxos, &(proposer->prepare_timeout),
+                            PAXOS_ROUND_TIMEOUT);
 }
 
 static void __on_prepare_response (paxos_t *paxos,
                                    paxos_proposer_t *proposer,
                                    const paxos_message_t *message)
 {
+  uint32_t node_bit = 1u << (message->node_id % PAXOS_MAX_NODES);
+  paxos_prepare_vote_t *vote;
+  paxos_instance_t *instance;
+
   LOG_FUNC_TRACE
 
-  if (!proposer->state.preparing ||
-      message->proposal_id != proposer->state.proposal_id)
-  {
+  if (!proposer->preparing || message->proposal_id != proposer->proposal_id)
     return;
+
+  /* Already voted, the response is complete */
+  vote = &(proposer->votes[message->node_id % PAXOS_MAX_NODES]);
+  if (vote->replied && vote->received >= vote->expected)
+    return;
+
+  /* The first reply of the node to this prepare */
+  if (!vote->replied && !proposer->prepare_retransmitted &&
+      (message->type == PAXOS_PREPARE_REJECTED ||
+       message->paxos_id == proposer->prepare_paxos_id))
+  {
+    paxos_rtt_sample(paxos_rtt_get(proposer, message->node_id),
+                     proposer->prepare_time);
   }
 
   if (message->type == PAXOS_PREPARE_REJECTED) {
+    paxos_stats_inc(&(paxos->stats), PAXOS_STATS_PREPARE_REJECTED);
+    if (message->promised_proposal_id > proposer->highest_promised_proposal_id)
+        proposer->highest_promised_proposal_id = message->promised_proposal_id;
+    vote->replied = 1;
     paxos_quorum_vote_rejected(&(paxos->quorum), message->node_id);
   } else {
-    paxos_quorum_vote_accepted(&(paxos->quorum), message->node_id);
-  }
+    instance = paxos_instance_get(paxos, message->paxos_id);
+
+    /* A report sent again (prepare retransmitted, duplicate) counts once */
+    if (instance != NULL && message->paxos_id != proposer->prepare_paxos_id) {
+      if (instance->proposer.reported & node_bit)
+        return;
+      instance->proposer.reported |= node_bit;
+    }
+
+    if (instance != NULL &&
+        message->type == PAXOS_PREPARE_PREVIOUSLY_ACCEPTED &&
+        message->accepted_proposal_id >= instance->proposer.highest_received_proposal_id)
+    {
+      instance->proposer.highest_received_proposal_id = message->accepted_proposal_id;
+      paxos_value_copy(&(instance->proposer.proposed_value), &(message->value));
+      instance->proposer.proposed_flags = message->flags;
+      instance->proposer.has_value = 1;
+      if (proposer->next_paxos_id <= message->paxos_id)
+        proposer->next_paxos_id = message->paxos_id + 1;
+    }
+
+    /* The base response tells us how many accepted instances to expect */
+    if (message->paxos_id == proposer->prepare_paxos_id) {
+      vote->expected = message->count;
+      vote->replied = 1;
+    } else {
+      vote->received++;
+    }
+
+    if (!vote->replied || vote->received < vote->expected)
+      return;
 
-  if (message->type == PAXOS_PREPARE_PREVIOUSLY_ACCEPTED &&
-      message->accepted_proposal_id >= proposer->state.highest_received_proposal_id)
-  {
-    proposer->state.highest_received_proposal_id = message->accepted_proposal_id;
-    proposer->state.proposed_value = message->value;
-  } else if (message->type == PAXOS_PREPARE_REJECTED) {
-    if (message->promised_proposal_id > proposer->state.highest_promised_proposal_id)
-        proposer->state.highest_promised_proposal_id = message->promised_proposal_id;
+    paxos_quorum_vote_accepted(&(paxos->quorum), message->node_id);
   }
 
   if (paxos_quorum_vote_is_accepted(&(paxos->quorum))) {
+    /* The promise covers all the next paxos_ids, until someone preempts us */
+    paxos_stats_time(&(paxos->stats), PAXOS_STATS_PREPARE_TIME,
+                     proposer->prepare_time, paxos_time_now_usec());
+    proposer->is_leader = 1;
+    __start_lease(paxos, proposer);
     __start_proposing(paxos, proposer);
   } else if (paxos_quorum_vote_is_rejected(&(paxos->quorum))) {
     __stop_preparing(paxos, proposer);
-    paxos_timeout_start(&(proposer->restart_timeout));
+    paxos_round_timeout_start(paxos, &(proposer->restart_timeout),
+                              PAXOS_RESTART_TIMEOUT);
   }
 }
 
@@ -672,114 +1710,463 @@ static void __on_propose_response (paxos_t *paxos,
                                    paxos_proposer_t *proposer,
                                    const paxos_message_t *message)
 {
+  paxos_instance_t *instance;
   paxos_message_t omsg;
 
   LOG_FUNC_TRACE
 
-  if (!proposer->state.proposing || message->proposal_id != proposer->state.proposal_id)
+  if (message->proposal_id != proposer->proposal_id)
+    return;
+
+  instance = paxos_instance_get(paxos, message->paxos_id);
+  if (instance == NULL || !instance->proposer.proposing)
     return;
 
+  if (!instance->proposer.retransmitted) {
+    paxos_rtt_sample(paxos_rtt_get(proposer, message->node_id),
+                     instance->proposer.propose_time);
+  }
+
   if (message->type == PAXOS_PROPOSE_REJECTED) {
-    paxos_quorum_vote_rejected(&(paxos->quorum), message->node_id);
+    paxos_stats_inc(&(paxos->stats), PAXOS_STATS_PROPOSE_REJECTED);
+    paxos_quorum_vote_rejected(&(instance->quorum), message->node_id);
   } else {
-    paxos_quorum_vote_accepted(&(paxos->quorum), message->node_id);
+    paxos_quorum_vote_accepted(&(instance->quorum), message->node_id);
   }
 
-  if (paxos_quorum_vote_is_accepted(&(paxos->quorum))) {
-    __stop_proposing(paxos, proposer);
-    paxos_message_learn_proposal(&omsg, paxos->learner.paxos_id,
+  if (paxos_quorum_vote_is_accepted(&(instance->quorum))) {
+    paxos_stats_time(&(paxos->stats), PAXOS_STATS_PROPOSE_TIME,
+                     instance->proposer.propose_time, paxos_time_now_usec());
+    instance->proposer.proposing = 0;
+    instance->proposer.learn_sent = 1;
+    proposer->num_proposing--;
+
+    paxos_message_learn_proposal(&omsg, instance->paxos_id,
                                  paxos->node_id,
-                                 proposer->state.proposal_id);
-    paxos_context_broadcast(paxos->context, &omsg);
-    proposer->state.learn_sent = 1;
-  } else if (paxos_quorum_vote_is_rejected(&(paxos->quorum))) {
+                                 proposer->proposal_id);
+    paxos_broadcast(paxos, &omsg);
+
+    /* We're making progress, give the rest of the window a full round */
+    if (proposer->num_proposing > 0) {
+      paxos_round_timeout_start(paxos, &(proposer->propose_timeout),
+                                PAXOS_ROUND_TIMEOUT);
+    } else {
+      paxos_timeout_stop(&(proposer->propose_timeout));
+    }
+
+    /* It's chosen: learn it now if we've accepted it, the local reads wait for it */
+    proposer->read_paxos_id = __math_max(proposer->read_paxos_id,
+                                         instance->paxos_id + 1);
+    if (instance->acceptor.accepted &&
+        instance->acceptor.accepted_proposal_id == proposer->proposal_id)
+    {
+      instance->chosen = 1;
+      paxos_learner_deliver(paxos);
+    }
+  } else if (paxos_quorum_vote_is_rejected(&(instance->quorum))) {
     __stop_proposing(paxos, proposer);
-    paxos_timeout_start(&(proposer->restart_timeout));
+    proposer->is_leader = 0;
+    paxos_round_timeout_start(paxos, &(proposer->restart_timeout),
+                              PAXOS_RESTART_TIMEOUT);
   }
 }
 
 static void __on_prepare_timeout (void *arg) {
   paxos_t *paxos = (paxos_t *)arg;
-  int is_blocked;
+  paxos_proposer_t *proposer = &(paxos->proposer);
+  paxos_message_t omsg;
 
   LOG_FUNC_TRACE
-  ASSERT(paxos->proposer.state.preparing);
+  ASSERT(proposer->preparing);
+  paxos_stats_inc(&(paxos->stats), PAXOS_STATS_PREPARE_TIMEOUTS);
 
-  is_blocked = paxos_is_blocked(paxos);
-  if (is_blocked || paxos_quorum_vote_is_rejected(&(paxos->quorum))) {
-    __start_preparing(paxos, &(paxos->proposer));
-  } else {
-    paxos_timeout_start(&(paxos->proposer.prepare_timeout));
+  /* Someone has a newer ballot: back off, the restart decides if it's gone */
+  if (paxos_quorum_vote_is_rejected(&(paxos->quorum)) ||
+      proposer->highest_promised_proposal_id > proposer->proposal_id ||
+      paxos->acceptor.promised_proposal_id > proposer->proposal_id)
+  {
+    __stop_preparing(paxos, proposer);
+    paxos_round_timeout_start(paxos, &(proposer->restart_timeout),
+                              PAXOS_RESTART_TIMEOUT);
+    return;
   }
+
+  /*
+   * The prepare, a response or some of the accepted reports got lost:
+   * ask again with the same ballot. The nodes answer everything again,
+   * what we already have is counted once.
+   */
+  proposer->prepare_retransmitted = 1;
+  paxos_message_prepare_request(&omsg, proposer->prepare_paxos_id,
+                                paxos->node_id, proposer->proposal_id);
+  paxos_broadcast(paxos, &omsg);
+  paxos_round_timeout_start(paxos, &(proposer->prepare_timeout),
+                            PAXOS_ROUND_TIMEOUT);
 }
 
 static void __on_propose_timeout (void *arg) {
   paxos_t *paxos = (paxos_t *)arg;
-  int is_blocked;
+  paxos_instance_t *instance;
+  uint64_t i;
 
   LOG_FUNC_TRACE
-  ASSERT(paxos->proposer.state.proposing);
+  ASSERT(paxos->proposer.num_proposing > 0);
+  paxos_stats_inc(&(paxos->stats), PAXOS_STATS_PROPOSE_TIMEOUTS);
 
-  is_blocked = paxos_is_blocked(paxos);
-  if (is_blocked || paxos_quorum_vote_is_rejected(&(paxos->quorum))) {
+  if (!paxos->proposer.is_leader) {
     __start_preparing(paxos, &(paxos->proposer));
-  } else {
-    paxos_timeout_start(&(paxos->proposer.propose_timeout));
+    return;
   }
+
+  /*
+   * Still the leader: an accept or its reply got lost, resend it with the
+   * same ballot. The votes already in are kept, an acceptor answers a
+   * repeated accept again. Only a rejection makes us prepare again.
+   */
+  for (i = paxos->learner.paxos_id; i < paxos_window_end(paxos); ++i) {
+    instance = paxos_instance_get(paxos, i);
+    if (!instance->proposer.proposing || instance->chosen)
+      continue;
+
+    instance->proposer.retransmitted = 1;
+    __send_propose_request(paxos, &(paxos->proposer), instance);
+  }
+  paxos_round_timeout_start(paxos, &(paxos->proposer.propose_timeout),
+                            PAXOS_ROUND_TIMEOUT);
 }
 
+#define paxos_proposer_has_pending(self)                                    \
+  ((self)->proposer.next_paxos_id > (self)->learner.paxos_id)
+
 static void __on_restart_timeout (void *arg) {
   paxos_t *paxos = (paxos_t *)arg;
 
   LOG_FUNC_TRACE
   LOG_DEBUG("OnRestart_timeout");
 
-  ASSERT(!paxos->proposer.state.preparing);
-  ASSERT(!paxos->proposer.state.proposing);
+  ASSERT(!paxos->proposer.preparing);
+  ASSERT(!paxos->proposer.num_proposing);
+
+  if (!paxos_proposer_has_pending(paxos))
+    return;
+
+  paxos_stats_inc(&(paxos->stats), PAXOS_STATS_RESTARTS);
 
-  if (paxos_is_blocked(paxos)) {
+  /* The lease holder has our values, it's replaced only once it's gone */
+  if (paxos_is_blocked(paxos) &&
+      !paxos_lease_is_held_by_other(paxos, paxos->node_id))
+  {
     __start_preparing(paxos, &(paxos->proposer));
   } else {
-    paxos_timeout_start(&(paxos->proposer.restart_timeout));
+    paxos_round_timeout_start(paxos, &(paxos->proposer.restart_timeout),
+                              PAXOS_RESTART_TIMEOUT);
   }
 }
 
 static void paxos_proposer_init (paxos_t *paxos, paxos_proposer_t *proposer) {
-  paxos_proposer_state_reset(&(proposer->state));
+  memset(proposer, 0, sizeof(paxos_proposer_t));
+  proposer->seed = (unsigned int)(paxos->node_id ^ paxos_clock_update());
   paxos_timeout_init(&(proposer->prepare_timeout),
                      PAXOS_ROUND_TIMEOUT, __on_prepare_timeout, paxos);
   paxos_timeout_init(&(proposer->propose_timeout),
                      PAXOS_ROUND_TIMEOUT, __on_propose_timeout, paxos);
   paxos_timeout_init(&(proposer->restart_timeout),
                      PAXOS_RESTART_TIMEOUT, __on_restart_timeout, paxos);
+  paxos_timeout_init(&(proposer->lease_timeout),
+                     0, __on_lease_timeout, paxos);
+  proposer->lease_quorum.num_nodes = paxos->quorum.num_nodes;
 }
 
 static void paxos_proposer_stop (paxos_proposer_t *proposer) {
-  paxos_proposer_state_reset(&(proposer->state));
+  proposer->preparing = 0;
+  proposer->is_leader = 0;
+  proposer->num_proposing = 0;
   paxos_timeout_stop(&(proposer->prepare_timeout));
   paxos_timeout_stop(&(proposer->propose_timeout));
   paxos_timeout_stop(&(proposer->restart_timeout));
+  paxos_timeout_stop(&(proposer->lease_timeout));
 }
 
-#define paxos_proposer_is_active(proposer)                                  \
-  ((self)->state.preparing ||                                               \
-   (self)->state.proposing ||                                               \
-   (self)->restart_timeout.active)
+static int paxos_proposer_propose (paxos_t *paxos,
+                                   paxos_proposer_t *proposer,
+                                   const paxos_value_t *value)
+{
+  paxos_instance_t *instance;
 
-#define paxos_proposer_is_learn_sent(proposer)                              \
-  ((proposer)->state.learn_sent)
+  /* The window is full, the caller must wait for something to be learned */
+  if ((instance = paxos_instance_get(paxos, proposer->next_paxos_id)) == NULL)
+    return(-1);
 
-static void paxos_proposer_propose (paxos_t *paxos,
-                                    paxos_proposer_t *proposer,
-                                    uint64_t value)
-{
-  proposer->state.proposed_value = value;
-#if 1
-    __start_preparing(paxos, proposer);
-#else
+  proposer->next_paxos_id++;
+  instance->proposer.has_value = 1;
+  paxos_value_copy(&(instance->proposer.proposed_value), value);
+  instance->proposer.proposed_flags = 0;
+  instance->proposer.forwarded = 0;
+  instance->proposer.own = 1;
+
+  if (proposer->is_leader) {
     /* Multi Paxos, skip the preparing and go directly with the proposal */
-    __start_proposing(proposer);
-#endif
+    __propose_instance(paxos, proposer, instance);
+  } else if (paxos_lease_is_held_by_other(paxos, paxos->node_id)) {
+    __forward_pending(paxos, proposer);
+  } else if (!proposer->preparing) {
+    __start_preparing(paxos, proposer);
+  }
+  return(0);
+}
+
+static void __on_forward_value (paxos_t *paxos,
+                                paxos_proposer_t *proposer,
+                                const paxos_message_t *message)
+{
+  /* Not (or no longer) the leader, the sender proposes it once our lease is gone */
+  if (proposer->is_leader)
+    paxos_proposer_propose(paxos, proposer, &(message->value));
+}
+
+/* ============================================================================
+ *  Paxos Snapshot
+ */
+/*
+ * Not fatal if it can't be saved, after a restart the peers fill the gap
+ * from the older one. Once saved, the WAL before it can go.
+ */
+static void paxos_learner_save_snapshot (paxos_t *self, const paxos_snapshot_t *snapshot) {
+  const char *path = self->learner.snapshot_path;
+
+  if (path == NULL)
+    return;
+
+  if (paxos_snapshot_save(snapshot, path)) {
+    fprintf(stderr, "paxos: unable to save the snapshot %s\n", path);
+    return;
+  }
+  paxos_acceptor_snapshot_saved(self, snapshot->paxos_id);
+}
+
+/* Take a snapshot of the user state, the log before it is no longer needed */
+static int paxos_learner_snapshot (paxos_t *self) {
+  paxos_learner_t *learner = &(self->learner);
+  paxos_snapshot_t *snapshot = &(learner->snapshot);
+
+  if (self->context->take_snapshot == NULL || learner->stale || learner->paxos_id == 0)
+    return(-1);
+
+  if (snapshot->valid && snapshot->paxos_id + 1 == learner->paxos_id)
+    return(0);
+
+  paxos_snapshot_reset(snapshot, learner->paxos_id - 1);
+  if (self->context->take_snapshot(self->context->arg, snapshot))
+    return(-2);
+  snapshot->valid = 1;
+  paxos_stats_inc(&(self->stats), PAXOS_STATS_SNAPSHOTS_TAKEN);
+
+  paxos_learner_save_snapshot(self, snapshot);
+
+  /* The learned value was the last entry, it's gone with the log */
+  paxos_log_truncate(&(learner->log), snapshot->paxos_id + 1);
+  paxos_value_init(&(learner->learned_value));
+  return(0);
+}
+
+/*
+ * The oldest snapshot worth receiving: one past what we have learned,
+ * or with a stale user state, anything our log can take it from.
+ */
+static uint64_t __snapshot_min_paxos_id (const paxos_learner_t *learner) {
+  if (!learner->stale)
+    return(learner->paxos_id);
+  if (paxos_log_is_empty(&(learner->log)))
+    return(learner->paxos_id - 1);
+  return(learner->log.first_paxos_id - 1);
+}
+
+#define paxos_learner_is_receiving(learner)                                \
+  ((learner)->snapshot_timeout.active)
+
+static void __send_snapshot_chunk (paxos_t *self, uint64_t node_id, uint64_t offset) {
+  const paxos_snapshot_t *snapshot = &(self->learner.snapshot);
+  paxos_message_t omsg;
+
+  if (offset > snapshot->size)
+    return;
+
+  paxos_message_snapshot_chunk(&omsg, self->node_id, snapshot, offset,
+                               __math_min(snapshot->size - offset,
+                                          PAXOS_SNAPSHOT_CHUNK_SIZE));
+  paxos_send(self, node_id, &omsg);
+  paxos_stats_add(&(self->stats), PAXOS_STATS_SNAPSHOT_SENT_BYTES, omsg.value.size);
+}
+
+/*
+ * Send a chunk of the snapshot. A new transfer (offset 0) gets a snapshot
+ * of at least paxos_id, a fresh one if ours is older: otherwise paxos_id is
+ * the snapshot in transfer and if it was replaced meanwhile, we start over.
+ */
+static void __serve_snapshot (paxos_t *self,
+                              uint64_t node_id,
+                              uint64_t paxos_id,
+                              uint64_t offset)
+{
+  paxos_snapshot_t *snapshot = &(self->learner.snapshot);
+
+  if (self->learner.stale)
+    return;
+
+  if (offset > 0 && snapshot->valid && snapshot->paxos_id == paxos_id) {
+    __send_snapshot_chunk(self, node_id, offset);
+    return;
+  }
+
+  if (!snapshot->valid || snapshot->paxos_id < paxos_id) {
+    if (self->learner.paxos_id <= paxos_id || paxos_learner_snapshot(self))
+      return;
+  }
+  __send_snapshot_chunk(self, node_id, 0);
+}
+
+/* Ask for the next chunk, the timeout asks again if it gets lost */
+static void __request_snapshot (paxos_t *self) {
+  paxos_learner_t *learner = &(self->learner);
+  paxos_message_t omsg;
+
+  if (learner->incoming.size > 0) {
+    paxos_message_snapshot_request(&omsg, learner->incoming.paxos_id,
+                                   self->node_id, learner->incoming.size);
+  } else {
+    paxos_message_snapshot_request(&omsg, __snapshot_min_paxos_id(learner),
+                                   self->node_id, 0);
+  }
+  paxos_send(self, learner->incoming_node_id, &omsg);
+  paxos_round_timeout_start(self, &(learner->snapshot_timeout), PAXOS_ROUND_TIMEOUT);
+}
+
+static void __start_snapshot_transfer (paxos_t *self,
+                                       paxos_learner_t *learner,
+                                       uint64_t node_id)
+{
+  /* The values we were catching up are in the snapshot, the tail follows */
+  paxos_timeout_stop(&(learner->catchup_timeout));
+  paxos_snapshot_reset(&(learner->incoming), 0);
+  learner->incoming_node_id = node_id;
+  learner->incoming_retries = 0;
+}
+
+static void __stop_snapshot_transfer (paxos_t *self, paxos_learner_t *learner) {
+  paxos_timeout_stop(&(learner->snapshot_timeout));
+  paxos_snapshot_reset(&(learner->incoming), 0);
+}
+
+static void __on_snapshot_timeout (void *arg) {
+  paxos_t *paxos = (paxos_t *)arg;
+  paxos_learner_t *learner = &(paxos->learner);
+
+  /* The node is gone, the next catch-up will find another one */
+  if (++(learner->incoming_retries) > PAXOS_SNAPSHOT_RETRIES) {
+    __stop_snapshot_transfer(paxos, learner);
+    return;
+  }
+  __request_snapshot(paxos);
+}
+
+/*
+ * Replace the user state with the snapshot received. If it is ahead of us
+ * the window jumps after it, and the log tail comes from the sender.
+ * If it is behind (a stale state) the values in our log are applied again.
+ */
+static void paxos_learner_install (paxos_t *self,
+                                   paxos_learner_t *learner,
+                                   uint64_t node_id)
+{
+  const paxos_log_entry_t *entry;
+  paxos_snapshot_t *snapshot;
+  uint64_t paxos_id;
+
+  if (learner->incoming.paxos_id < __snapshot_min_paxos_id(learner) ||
+      self->context->install_snapshot == NULL ||
+      self->context->install_snapshot(self->context->arg, &(learner->incoming)))
+  {
+    paxos_snapshot_reset(&(learner->incoming), 0);
+    return;
+  }
+
+  paxos_snapshot_swap(&(learner->snapshot), &(learner->incoming));
+  paxos_snapshot_reset(&(learner->incoming), 0);
+  snapshot = &(learner->snapshot);
+  learner->stale = 0;
+  paxos_stats_inc(&(self->stats), PAXOS_STATS_SNAPSHOTS_INSTALLED);
+
+  paxos_learner_save_snapshot(self, snapshot);
+
+  if (snapshot->paxos_id >= learner->paxos_id) {
+    /* We've missed some rounds, our ballot may be stale (the promise is not) */
+    paxos_proposer_stop(&(self->proposer));
+    paxos_log_reset(&(learner->log), snapshot->paxos_id + 1);
+    paxos_value_init(&(learner->learned_value));
+    paxos_window_reset(self, snapshot->paxos_id + 1);
+    paxos_learner_deliver(self);
+    __request_chosen(self, learner, learner->paxos_id, node_id);
+    return;
+  }
+
+  for (paxos_id = snapshot->paxos_id + 1; paxos_id < learner->paxos_id; ++paxos_id) {
+    entry = paxos_log_get(&(learner->log), paxos_id);
+    if (!(entry->flags & PAXOS_MESSAGE_NOOP))
+      paxos_learner_learn_value(self, paxos_id, &(entry->value));
+  }
+  paxos_log_truncate(&(learner->log), snapshot->paxos_id + 1);
+  paxos_reader_check(self);
+}
+
+static void __on_snapshot_request (paxos_t *self, const paxos_message_t *message) {
+  if (self->node_id == message->node_id)
+    return;
+
+  __serve_snapshot(self, message->node_id, message->paxos_id, message->offset);
+}
+
+/* Chunks arrive in order, the first one of a useful snapshot starts a transfer */
+static void __on_snapshot_chunk (paxos_t *self,
+                                 paxos_learner_t *learner,
+                                 const paxos_message_t *message)
+{
+  paxos_snapshot_t *incoming = &(learner->incoming);
+
+  if (paxos_learner_is_receiving(learner)) {
+    if (message->node_id != learner->incoming_node_id)
+      return;
+  } else if (message->offset > 0 ||
+             message->paxos_id < __snapshot_min_paxos_id(learner)) {
+    return;
+  } else {
+    __start_snapshot_transfer(self, learner, message->node_id);
+  }
+
+  if (message->offset == 0) {
+    /* A duplicate of the first chunk, or the sender has a new snapshot */
+    if (incoming->size > 0 && incoming->paxos_id == message->paxos_id)
+      return;
+    paxos_snapshot_reset(incoming, message->paxos_id);
+  } else if (message->paxos_id != incoming->paxos_id ||
+             message->offset != incoming->size) {
+    return;
+  }
+
+  if (paxos_snapshot_append(incoming, message->value.data, message->value.size)) {
+    __stop_snapshot_transfer(self, learner);
+    return;
+  }
+  learner->incoming_retries = 0;
+  paxos_stats_add(&(self->stats), PAXOS_STATS_SNAPSHOT_RECV_BYTES, message->value.size);
+
+  if (!(message->flags & PAXOS_MESSAGE_LAST_CHUNK)) {
+    __request_snapshot(self);
+    return;
+  }
+
+  paxos_timeout_stop(&(learner->snapshot_timeout));
+  incoming->valid = 1;
+  paxos_learner_install(self, learner, message->node_id);
 }
 
 /* ============================================================================
@@ -787,84 +2174,436 @@ static void paxos_proposer_propose (paxos_t *paxos,
  */
 static void __on_bootstrap (paxos_t *self, const paxos_message_t *message) {
   paxos_message_t omsg;
-  uint64_t value;
 
-  if (!self->learner.has_learned_value)
+  if (self->node_id == message->node_id || self->learner.paxos_id == 0)
     return;
 
+  /* Tell the node how far we are, it asks for what it is missing */
   fprintf(stderr, "bootstrap\n");
-  if (paxos_get_accepted_value(self, self->learner.paxos_id, &value)) {
-    paxos_message_catchup_response(&omsg, self->learner.paxos_id, self->node_id, value);
-    paxos_context_send(self->context, message->node_id, &omsg);
+  paxos_message_catchup_start(&omsg, self->learner.paxos_id - 1, self->node_id);
+  paxos_send(self, message->node_id, &omsg);
+}
+
+/*
+ * Ask for the next range of values, the timeout asks again if the response
+ * gets lost. Once at the end, the values chosen meanwhile are the log tail.
+ */
+static void __request_catchup (paxos_t *self) {
+  paxos_learner_t *learner = &(self->learner);
+  paxos_message_t omsg;
+
+  if (learner->paxos_id >= learner->catchup_end) {
+    paxos_timeout_stop(&(learner->catchup_timeout));
+    __request_chosen(self, learner, learner->paxos_id, learner->catchup_node_id);
+    return;
   }
+
+  paxos_message_catchup_request(&omsg, learner->paxos_id,
+                                __math_min(learner->catchup_end,
+                                           learner->paxos_id + PAXOS_CATCHUP_MAX_RANGE),
+                                self->node_id);
+  paxos_send(self, learner->catchup_node_id, &omsg);
+  learner->catchup_time = learner->catchup_retries ? 0 : paxos_time_now_usec();
+  paxos_peer_timeout_start(self, &(learner->catchup_timeout),
+                           learner->catchup_node_id, PAXOS_RESTART_TIMEOUT);
+}
+
+static void __on_catchup_timeout (void *arg) {
+  paxos_t *paxos = (paxos_t *)arg;
+  paxos_learner_t *learner = &(paxos->learner);
+
+  /* The node is gone, the next catch-up will find another one */
+  if (++(learner->catchup_retries) > PAXOS_CATCHUP_RETRIES)
+    return;
+  __request_catchup(paxos);
 }
 
+/* A node is at paxos_id, catch up what we are missing from it */
 static void __on_catchup_start (paxos_t *self, const paxos_message_t *message) {
-  paxos_message_t omsg;
+  paxos_learner_t *learner = &(self->learner);
 
   if (self->node_id == message->node_id)
     return;
 
   LOG_DEBUG("paxos_id: %lu node: %lu\n",
             message->paxos_id, message->node_id);
-  paxos_message_catchup_request(&omsg, message->paxos_id, self->node_id);
-  paxos_context_send(self->context, message->node_id, &omsg);
+
+  /* Our state is outdated, only a snapshot brings it back */
+  if (learner->stale) {
+    if (!paxos_learner_is_receiving(learner) &&
+        message->paxos_id >= __snapshot_min_paxos_id(learner))
+    {
+      __start_snapshot_transfer(self, learner, message->node_id);
+      __request_snapshot(self);
+    }
+    return;
+  }
+
+  if (paxos_learner_is_receiving(learner) || message->paxos_id < learner->paxos_id)
+    return;
+
+  /* Already catching up from it, there is just more to get */
+  if (paxos_learner_is_catching_up(learner)) {
+    if (message->node_id == learner->catchup_node_id)
+      learner->catchup_end = __math_max(learner->catchup_end, message->paxos_id + 1);
+    return;
+  }
+
+  learner->catchup_node_id = message->node_id;
+  learner->catchup_end = message->paxos_id + 1;
+  learner->catchup_retries = 0;
+  __request_catchup(self);
+}
+
+static void __send_catchup_batch (paxos_t *self,
+                                  uint64_t node_id,
+                                  uint64_t paxos_id,
+                                  uint16_t count,
+                                  uint8_t flags)
+{
+  paxos_value_t *batch = &(self->learner.catchup_batch);
+  paxos_message_t omsg;
+
+  paxos_message_catchup_response(&omsg, paxos_id, self->node_id, count, batch);
+  omsg.flags = flags;
+  paxos_send(self, node_id, &omsg);
+  paxos_stats_add(&(self->stats), PAXOS_STATS_CATCHUP_SENT_VALUES, count);
+  paxos_stats_add(&(self->stats), PAXOS_STATS_CATCHUP_SENT_BYTES, batch->size);
+  paxos_value_clear(batch);
 }
 
+/*
+ * Stream the values in [from, to) we have, packed in size-capped packets.
+ * The last one is flagged, the node asks for more once it got it.
+ * If the first value was truncated from the log, the snapshot covering it.
+ */
 static void __on_catchup_request (paxos_t *self, const paxos_message_t *message) {
+  paxos_value_t *batch = &(self->learner.catchup_batch);
+  const paxos_value_t *value;
   paxos_message_t omsg;
-  uint64_t value;
+  uint64_t paxos_id, first_id, to;
+  uint32_t packets;
+  uint16_t count;
+  uint8_t flags;
+
+  LOG_DEBUG("paxos_id: %lu count: %u node: %lu\n",
+            message->paxos_id, message->count, message->node_id);
 
-  LOG_DEBUG("paxos_id: %lu node: %lu\n", message->paxos_id, message->node_id);
-  if (paxos_get_accepted_value(self, message->paxos_id, &value)) {
-    paxos_message_catchup_response(&omsg, message->paxos_id, self->node_id, value);
-    paxos_context_send(self->context, message->node_id, &omsg);
+  if (!paxos_get_accepted_value(self, message->paxos_id, &value, &flags)) {
+    if (message->paxos_id < self->learner.paxos_id)
+      __serve_snapshot(self, message->node_id, message->paxos_id, 0);
+    return;
   }
+
+  to = message->paxos_id + __math_min(message->count, PAXOS_CATCHUP_MAX_RANGE);
+  paxos_value_clear(batch);
+  first_id = message->paxos_id;
+  packets = 0;
+  count = 0;
+  for (paxos_id = first_id; paxos_id < to; ++paxos_id) {
+    if (!paxos_get_accepted_value(self, paxos_id, &value, &flags))
+      break;
+
+    if (paxos_message_entry_add(batch, flags, value, PAXOS_CATCHUP_PACKET_SIZE)) {
+      /* The packet is full, the last one if we are out of packets */
+      if (count > 0) {
+        if (++packets == PAXOS_CATCHUP_MAX_PACKETS) {
+          __send_catchup_batch(self, message->node_id, first_id, count,
+                               PAXOS_MESSAGE_LAST_CHUNK);
+          return;
+        }
+        __send_catchup_batch(self, message->node_id, first_id, count, 0);
+        first_id = paxos_id;
+        count = 0;
+      }
+
+      /* Too big to be packed, it goes on its own */
+      if (paxos_message_entry_add(batch, flags, value, PAXOS_CATCHUP_PACKET_SIZE)) {
+        paxos_message_learn_value(&omsg, paxos_id, self->node_id, value);
+        omsg.flags = flags;
+        paxos_send(self, message->node_id, &omsg);
+        paxos_stats_inc(&(self->stats), PAXOS_STATS_CATCHUP_SENT_VALUES);
+        paxos_stats_add(&(self->stats), PAXOS_STATS_CATCHUP_SENT_BYTES, value->size);
+        first_id = paxos_id + 1;
+        continue;
+      }
+    }
+    count++;
+  }
+
+  /* An empty last packet, if the last value went on its own */
+  __send_catchup_batch(self, message->node_id, first_id, count,
+                       PAXOS_MESSAGE_LAST_CHUNK);
 }
 
+/* Values are applied in order, as if they were learned one by one */
 static void __on_catchup_response (paxos_t *self,
                                    paxos_learner_t *learner,
                                    const paxos_message_t *message)
 {
-  if (learner->has_learned_value && learner->paxos_id >= message->paxos_id)
+  paxos_instance_t *instance;
+  paxos_value_t value;
+  uint64_t paxos_id;
+  uint32_t offset;
+  uint8_t flags;
+  uint16_t i;
+
+  if (!paxos_learner_is_catching_up(learner) ||
+      message->node_id != learner->catchup_node_id)
+  {
     return;
+  }
 
-  LOG_DEBUG("paxos_id: %lu node: %lu\n", message->paxos_id, message->node_id);
-  learner->paxos_id = message->paxos_id;
-  paxos_learner_learn_value(self, message->value);
+  LOG_DEBUG("paxos_id: %lu count: %u node: %lu\n",
+            message->paxos_id, message->count, message->node_id);
 
-  paxos_proposer_state_reset(&(self->proposer.state));
-  paxos_acceptor_state_reset(&(self->acceptor.state));
+  /* The first packet answering a request sent once, the others queued behind it */
+  if (learner->catchup_time > 0) {
+    paxos_rtt_sample(paxos_rtt_get(&(self->proposer), message->node_id),
+                     learner->catchup_time);
+    learner->catchup_time = 0;
+  }
+
+  paxos_stats_add(&(self->stats), PAXOS_STATS_CATCHUP_RECV_VALUES, message->count);
+  paxos_stats_add(&(self->stats), PAXOS_STATS_CATCHUP_RECV_BYTES, message->value.size);
+
+  offset = 0;
+  paxos_id = message->paxos_id;
+  for (i = 0; i < message->count; ++i, ++paxos_id) {
+    if (paxos_message_entry_next(&(message->value), &offset, &flags, &value) <= 0)
+      break;
+
+    /* Already delivered, or too far ahead for the window: asked again later */
+    if ((instance = paxos_instance_get(self, paxos_id)) == NULL || instance->chosen)
+      continue;
+
+    instance->acceptor.accepted = 1;
+    paxos_value_copy(&(instance->acceptor.accepted_value), &value);
+    instance->acceptor.accepted_flags = flags;
+    instance->chosen = 1;
+    paxos_learner_deliver(self);
+  }
+
+  learner->catchup_retries = 0;
+  if (message->flags & PAXOS_MESSAGE_LAST_CHUNK)
+    __request_catchup(self);
 }
 
 /* ============================================================================
  *  Paxos
  */
-void paxos_open (paxos_t *self,
-                 paxos_context_t *context,
-                 uint64_t node_id,
-                 uint64_t num_nodes)
+static void paxos_attach_timeouts (paxos_t *self, paxos_timer_wheel_t *timers) {
+  paxos_timeout_attach(&(self->proposer.prepare_timeout), timers);
+  paxos_timeout_attach(&(self->proposer.propose_timeout), timers);
+  paxos_timeout_attach(&(self->proposer.restart_timeout), timers);
+  paxos_timeout_attach(&(self->proposer.lease_timeout), timers);
+  paxos_timeout_attach(&(self->acceptor.commit_timeout), timers);
+  paxos_timeout_attach(&(self->learner.snapshot_timeout), timers);
+  paxos_timeout_attach(&(self->learner.catchup_timeout), timers);
+  paxos_timeout_attach(&(self->reader.timeout), timers);
+}
+
+int paxos_open (paxos_t *self,
+                paxos_context_t *context,
+                uint16_t group_id,
+                uint64_t node_id,
+                uint64_t num_nodes,
+                uint32_t window_size)
 {
+  uint32_t i;
+
+  self->instances = (paxos_instance_t *) calloc(window_size, sizeof(paxos_instance_t));
+  if (self->instances == NULL)
+    return(-1);
+
+  if ((self->send_buffer = (uint8_t *) malloc(PAXOS_MESSAGE_MAX_SIZE)) == NULL) {
+    free(self->instances);
+    return(-1);
+  }
+
   self->context = context;
+  self->group_id = group_id;
   self->quorum.num_nodes = num_nodes;
+  self->window_size = window_size;
+  self->lease_duration = 0;
   self->node_id = node_id;
+  paxos_stats_reset(&(self->stats));
   paxos_proposer_init(self, &(self->proposer));
   paxos_acceptor_init(self, &(self->acceptor));
   paxos_learner_init(self, &(self->learner));
+  paxos_reader_init(self, &(self->reader));
+  for (i = 0; i < window_size; ++i)
+    paxos_instance_reset(self, &(self->instances[i]), i);
+  paxos_window_reset(self, 0);
+  paxos_attach_timeouts(self, context->timers);
+  return(0);
+}
+
+/*
+ * Restore the user state from the snapshot at path (if any), and keep the
+ * next ones there. Every interval values learned a new snapshot is taken
+ * and the log before it is dropped. Goes before paxos_open_wal().
+ */
+int paxos_open_snapshot (paxos_t *self, const char *path, uint32_t interval) {
+  paxos_learner_t *learner = &(self->learner);
+  paxos_snapshot_t *snapshot = &(learner->snapshot);
+  int status;
+
+  learner->snapshot_interval = interval;
+  if (path == NULL)
+    return(0);
+
+  if ((learner->snapshot_path = strdup(path)) == NULL)
+    return(-1);
+
+  if ((status = paxos_snapshot_load(snapshot, path)) < 0)
+    return(-2);
+
+  /* Nothing there yet */
+  if (status > 0)
+    return(0);
+
+  if (self->context->install_snapshot == NULL ||
+      self->context->install_snapshot(self->context->arg, snapshot))
+  {
+    paxos_snapshot_reset(snapshot, 0);
+    return(-3);
+  }
+
+  paxos_log_reset(&(learner->log), snapshot->paxos_id + 1);
+  paxos_window_reset(self, snapshot->paxos_id + 1);
+  return(0);
+}
+
+/*
+ * Make the acceptor state durable: replay the WAL at path, then every promise
+ * and accept is appended to it, and the responses wait for the group commit.
+ */
+int paxos_open_wal (paxos_t *self, const char *path, unsigned int max_batch_delay) {
+  struct paxos_recovery recovery;
+  paxos_wal_t *wal = &(self->acceptor.wal);
+
+  recovery.paxos = self;
+  recovery.max_paxos_id = 0;
+  recovery.has_records = 0;
+  if (paxos_wal_open(wal, path, __wal_scan, &recovery))
+    return(-1);
+
+  if (recovery.has_records) {
+    /*
+     * The window can't go back, the acceptor would forget what it has
+     * accepted after it. If it moves past the snapshot, the values in
+     * between are lost for the user state: it waits for a newer snapshot.
+     */
+    if (recovery.max_paxos_id >= self->window_size &&
+        recovery.max_paxos_id + 1 - self->window_size > self->learner.paxos_id)
+    {
+      if (self->context->install_snapshot != NULL)
+        self->learner.stale = 1;
+      paxos_window_reset(self, recovery.max_paxos_id + 1 - self->window_size);
+    }
+    paxos_wal_replay(wal, __wal_restore, &recovery);
+    self->proposer.highest_promised_proposal_id = self->acceptor.promised_proposal_id;
+
+    /* Grants are not logged, the last one we may have given went with the promise */
+    if (self->acceptor.promised_proposal_id > 0) {
+      __grant_lease(self, &(self->acceptor),
+                    self->acceptor.promised_proposal_id & PAXOS_PROPOSAL_NODE_MASK);
+    }
+  }
+
+  self->acceptor.commit_timeout.timeout = max_batch_delay;
+  return(0);
+}
+
+/*
+ * Grant and take leader leases of duration msec: while the leader holds one
+ * no one else can be promised, so it can read its own state.
+ * Goes before paxos_open_wal().
+ */
+void paxos_open_lease (paxos_t *self, unsigned int duration) {
+  self->lease_duration = duration;
+  self->proposer.lease_timeout.timeout = duration / 4;
 }
 
 void paxos_close (paxos_t *self) {
+  uint32_t i;
+
+  paxos_timeout_stop(&(self->acceptor.commit_timeout));
+  paxos_attach_timeouts(self, NULL);
+  paxos_wal_close(&(self->acceptor.wal));
   paxos_proposer_stop(&(self->proposer));
+  paxos_log_close(&(self->learner.log));
+  paxos_snapshot_free(&(self->learner.snapshot));
+  paxos_snapshot_free(&(self->learner.incoming));
+  free(self->learner.snapshot_path);
+  self->learner.snapshot_path = NULL;
+  paxos_value_free(&(self->learner.catchup_batch));
+
+  for (i = 0; i < PAXOS_WAL_MAX_BATCH; ++i) {
+    paxos_value_free(&(self->acceptor.commits[0][i].value));
+    paxos_value_free(&(self->acceptor.commits[1][i].value));
+  }
+  for (i = 0; i < self->window_size; ++i) {
+    paxos_value_free(&(self->instances[i].proposer.proposed_value));
+    paxos_value_free(&(self->instances[i].acceptor.accepted_value));
+  }
+  free(self->instances);
+  free(self->send_buffer);
+  self->instances = NULL;
+  self->send_buffer = NULL;
 }
 
 void paxos_bootstrap (paxos_t *self) {
   paxos_message_t omsg;
   paxos_message_bootstrap(&omsg, self->node_id);
-  paxos_context_broadcast(self->context, &omsg);
+  paxos_broadcast(self, &omsg);
+}
+
+int paxos_propose (paxos_t *self, const paxos_value_t *value) {
+  return(paxos_proposer_propose(self, &(self->proposer), value));
+}
+
+/*
+ * 1 if we are the leader, hold a valid lease and have learned everything
+ * chosen so far: a read of the local state is linearizable.
+ */
+int paxos_has_lease (paxos_t *self) {
+  return(paxos_proposer_has_lease(self) &&
+         self->learner.paxos_id >= self->proposer.read_paxos_id);
 }
 
-void paxos_propose (paxos_t *self, uint64_t value) {
-  paxos_proposer_propose(self, &(self->proposer), value);
+/*
+ * Start (or join) a read round, the value returned is its seq: the reads
+ * can go once reader.ready_seq gets there, context->read_ready tells when.
+ */
+uint64_t paxos_read_index (paxos_t *self) {
+  paxos_reader_t *reader = &(self->reader);
+
+  /* The round out may have been answered before the read arrived */
+  if (reader->in_flight) {
+    reader->queued = 1;
+    return(reader->seq + 1);
+  }
+
+  __start_read_round(self, reader);
+  return(reader->seq);
+}
+
+/* Snapshot the user state now, e.g. before a clean shutdown */
+int paxos_snapshot (paxos_t *self) {
+  return(paxos_learner_snapshot(self));
+}
+
+/* The event loop waits on this fd to pick up the storage completions */
+int paxos_storage_fd (paxos_t *self) {
+  if (!paxos_wal_is_open(&(self->acceptor.wal)))
+    return(-1);
+  return(paxos_wal_completion_fd(&(self->acceptor.wal)));
+}
+
+void paxos_storage_complete (paxos_t *self) {
+  paxos_commit_complete(self);
 }
 
 paxos_timeout_t *paxos_timeout (paxos_t *self) {
@@ -878,12 +2617,29 @@ paxos_timeout_t *paxos_timeout (paxos_t *self) {
   __select_min_timeout(&(self->proposer.prepare_timeout));
   __select_min_timeout(&(self->proposer.propose_timeout));
   __select_min_timeout(&(self->proposer.restart_timeout));
+  __select_min_timeout(&(self->proposer.lease_timeout));
+  __select_min_timeout(&(self->acceptor.commit_timeout));
+  __select_min_timeout(&(self->learner.snapshot_timeout));
+  __select_min_timeout(&(self->learner.catchup_timeout));
+  __select_min_timeout(&(self->reader.timeout));
   return(min_timeout);
 }
 
+/* Fire the timeouts already expired, even if the caller never went idle */
+void paxos_timeout_expire (paxos_t *self) {
+  paxos_timeout_t *timeout;
+  uint64_t now = paxos_clock_update();
+
+  while ((timeout = paxos_timeout(self)) != NULL && timeout->expire_time <= now)
+    paxos_timeout_trigger(timeout);
+}
+
 void paxos_process_message (paxos_t *paxos, const paxos_message_t *message) {
   LOG_FUNC_TRACE
 
+  if (message->group_id != paxos->group_id)
+    return;
+
   switch (message->type) {
     /* Prepare Request */
     case PAXOS_PREPARE_REQUEST:
@@ -913,6 +2669,23 @@ void paxos_process_message (paxos_t *paxos, const paxos_message_t *message) {
     case PAXOS_REQUEST_CHOSEN:
       __on_request_chosen(paxos, message);
       break;
+    /* Lease */
+    case PAXOS_LEASE_RENEW:
+      __on_lease_renew(paxos, &(paxos->acceptor), message);
+      break;
+    case PAXOS_LEASE_GRANTED:
+      __on_lease_granted(paxos, &(paxos->proposer), message);
+      break;
+    case PAXOS_FORWARD_VALUE:
+      __on_forward_value(paxos, &(paxos->proposer), message);
+      break;
+    /* ReadIndex */
+    case PAXOS_READ_INDEX:
+      __on_read_index(paxos, message);
+      break;
+    case PAXOS_READ_INDEX_REPLY:
+      __on_read_index_reply(paxos, &(paxos->reader), message);
+      break;
     /* Catch-up */
     case PAXOS_BOOTSTRAP:
       __on_bootstrap(paxos, message);
@@ -926,6 +2699,12 @@ void paxos_process_message (paxos_t *paxos, const paxos_message_t *message) {
     case PAXOS_CATCHUP_RESPONSE:
       __on_catchup_response(paxos, &(paxos->learner), message);
       break;
+    case PAXOS_SNAPSHOT_REQUEST:
+      __on_snapshot_request(paxos, message);
+      break;
+    case PAXOS_SNAPSHOT_CHUNK:
+      __on_snapshot_chunk(paxos, &(paxos->learner), message);
+      break;
     /* Invalid message */
     default:
       fprintf(stderr, "paxos: invalid message %u\n", message->type);
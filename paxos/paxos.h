@@ -17,114 +17,205 @@
 #ifndef _PAXOS_H_
 #define _PAXOS_H_
 
+#include "message.h"
+#include "value.h"
+#include "log.h"
+#include "wal.h"
+#include "timer.h"
+#include "snapshot.h"
+#include "stats.h"
+
 typedef struct paxos_proposer_state paxos_proposer_state_t;
 typedef struct paxos_acceptor_state paxos_acceptor_state_t;
 typedef struct paxos_acceptor paxos_acceptor_t;
 typedef struct paxos_proposer paxos_proposer_t;
 typedef struct paxos_learner paxos_learner_t;
+typedef struct paxos_reader paxos_reader_t;
 typedef struct paxos_context paxos_context_t;
-typedef struct paxos_message paxos_message_t;
-typedef struct paxos_timeout paxos_timeout_t;
 typedef struct paxos_quorum paxos_quorum_t;
+typedef struct paxos_commit paxos_commit_t;
+typedef struct paxos_prepare_vote paxos_prepare_vote_t;
+typedef struct paxos_rtt paxos_rtt_t;
+typedef struct paxos_instance paxos_instance_t;
 typedef struct paxos paxos_t;
 
-typedef void (*paxos_callback_t)  (void *arg);
+#define PAXOS_MAX_NODES                 (32)
+#define PAXOS_DEFAULT_WINDOW_SIZE       (16)
+
 typedef void (*paxos_send_t)      (void *arg,
                                    uint64_t node_id,
-                                   const paxos_message_t *message);
+                                   const void *frame,
+                                   uint32_t size);
 typedef void (*paxos_broadcast_t) (void *arg,
-                                   const paxos_message_t *message);
-
-enum paxos_message_type {
-  /* Paxos */
-  PAXOS_PREPARE_REQUEST             =  1,
-  PAXOS_PREPARE_REJECTED            =  2,
-  PAXOS_PREPARE_PREVIOUSLY_ACCEPTED =  3,
-  PAXOS_PREPARE_CURRENTLY_OPEN      =  4,
-  PAXOS_PROPOSE_REQUEST             =  5,
-  PAXOS_PROPOSE_REJECTED            =  6,
-  PAXOS_PROPOSE_ACCEPTED            =  7,
-  PAXOS_LEARN_PROPOSAL              =  8,
-  PAXOS_LEARN_VALUE                 =  9,
-  PAXOS_REQUEST_CHOSEN              = 10,
-  /* System */
-  PAXOS_BOOTSTRAP                   = 21,
-  PAXOS_CATCHUP_START               = 22,
-  PAXOS_CATCHUP_REQUEST             = 23,
-  PAXOS_CATCHUP_RESPONSE            = 24,
-  /* User */
-  PAXOS_USER_PROPOSE_VALUE          = 31,
-  PAXOS_USER_LEARN_VALUE            = 32,
+                                   const void *frame,
+                                   uint32_t size);
+
+/* Serialize the state (up to snapshot->paxos_id) in the snapshot data */
+typedef int  (*paxos_snapshot_take_t)     (void *arg,
+                                           paxos_snapshot_t *snapshot);
+/* Replace the state with the one in the snapshot */
+typedef int  (*paxos_snapshot_install_t)  (void *arg,
+                                           const paxos_snapshot_t *snapshot);
+
+struct paxos_quorum {
+  uint16_t num_accepted;
+  uint16_t num_rejected;
+  uint32_t num_nodes;
+  uint32_t voters;                    /* Nodes that voted, by bit */
 };
 
+/* Per-instance proposer state */
 struct paxos_proposer_state {
-  uint64_t proposal_id;
   uint64_t highest_received_proposal_id;
-  uint64_t highest_promised_proposal_id;
-  uint64_t proposed_value;
-  uint8_t  preparing;
+  paxos_value_t proposed_value;
+  uint8_t  proposed_flags;
+  uint8_t  has_value;
   uint8_t  proposing;
   uint8_t  learn_sent;
+  uint8_t  forwarded;                 /* To the lease holder */
+  uint8_t  own;                       /* The value came from paxos_propose() */
+  uint8_t  retransmitted;             /* No RTT sample, the reply is ambiguous */
+  uint64_t propose_time;              /* usec, for the RTT sample */
+  uint32_t reported;                  /* Prepare reports counted, by node bit */
 };
 
+/* Per-instance acceptor state */
 struct paxos_acceptor_state {
-  uint64_t promised_proposal_id;
   uint64_t accepted_proposal_id;
-  uint64_t accepted_value;
+  paxos_value_t accepted_value;
+  uint8_t  accepted_flags;
   uint8_t  accepted;
 };
 
-struct paxos_timeout {
-  void *arg;
-  paxos_callback_t callback;
-  uint8_t active;
-  uint32_t timeout;
-  uint64_t expire_time;
+/* A commit request, owns the response sent once its record is durable */
+struct paxos_commit {
+  uint64_t        node_id;
+  paxos_message_t message;
+  paxos_value_t   value;                  /* The message value, if any */
 };
 
-struct paxos_message {
-    uint8_t  type;
-    uint8_t  __pad[3];
-    uint64_t paxos_id;
-    uint64_t node_id;
-    uint64_t proposal_id;
-    uint64_t accepted_proposal_id;
-    uint64_t promised_proposal_id;
-    uint64_t value;
+struct paxos_acceptor {
+  uint64_t        promised_proposal_id;   /* Covers every paxos_id >= base */
+  uint64_t        lease_node_id;          /* Last lease granted, to... */
+  uint64_t        lease_expire;           /* ...until (msec) */
+  paxos_wal_t     wal;
+  paxos_commit_t  commits[2][PAXOS_WAL_MAX_BATCH]; /* One per WAL batch */
+  uint64_t        commit_start[2];        /* usec, of the first record of a batch */
+  paxos_timeout_t commit_timeout;         /* Max delay of a group commit */
+  uint64_t        compact_paxos_id;       /* Snapshot on disk, the WAL before it... */
+  uint8_t         compact_wanted;         /* ...goes once nothing is in flight */
 };
 
-struct paxos_acceptor {
-  paxos_acceptor_state_t state;
-  uint64_t        sender_id;
-  uint64_t        written_paxos_id;
-  uint8_t         is_committing;
+struct paxos_prepare_vote {
+  uint16_t received;
+  uint16_t expected;
+  uint8_t  replied;
+};
+
+/* Smoothed round trip time to a peer and its variation (RFC 6298), usec */
+struct paxos_rtt {
+  uint32_t srtt;
+  uint32_t rttvar;
 };
 
 struct paxos_proposer {
-  paxos_proposer_state_t state;
+  uint64_t        proposal_id;
+  uint64_t        highest_promised_proposal_id;
+  uint64_t        prepare_paxos_id;
+  uint64_t        next_paxos_id;
+  uint32_t        num_proposing;
+  uint8_t         preparing;
+  uint8_t         is_leader;
+  paxos_prepare_vote_t votes[PAXOS_MAX_NODES];
+  paxos_rtt_t     rtt[PAXOS_MAX_NODES];
+  uint64_t        prepare_time;           /* usec, for the RTT samples */
+  uint8_t         prepare_retransmitted;  /* No RTT samples, ambiguous replies */
+  unsigned int    seed;                   /* Timeout jitter */
   paxos_timeout_t prepare_timeout;
   paxos_timeout_t propose_timeout;
   paxos_timeout_t restart_timeout;
+
+  /* Leader lease, the local reads are fine until it expires */
+  uint64_t        lease_expire;           /* msec */
+  uint64_t        lease_renew_time;       /* msec, of the last renewal sent */
+  uint64_t        lease_seq;              /* Renewals sent, matches the grants */
+  uint32_t        lease_votes;            /* Grants received, by node */
+  paxos_quorum_t  lease_quorum;
+  uint64_t        read_paxos_id;          /* To learn before reading locally */
+  paxos_timeout_t lease_timeout;          /* Renewal heartbeat */
+
+  uint64_t        decided_paxos_id;       /* See context->proposal_decided */
 };
 
 struct paxos_learner {
   uint64_t paxos_id;
-  uint64_t learned_value;             /* TODO: store more than one value */
+  paxos_value_t learned_value;        /* Last value delivered, in the log */
+  uint64_t learned_paxos_id;          /* paxos_id of the learned value */
   uint8_t  has_learned_value;
+  uint8_t  stale;                     /* The user state is behind the log */
   uint64_t last_request_chosen_time;
+  paxos_log_t log;                    /* Chosen values, by paxos_id */
+
+  /* The log is truncated below the last snapshot */
+  paxos_snapshot_t snapshot;
+  uint32_t snapshot_interval;         /* Values between snapshots, 0 never */
+  char *   snapshot_path;             /* NULL if not persisted */
+
+  /* Snapshot being received, chunk by chunk */
+  paxos_snapshot_t incoming;
+  uint64_t incoming_node_id;
+  uint8_t  incoming_retries;
+  paxos_timeout_t snapshot_timeout;
+
+  /* Range being caught up from a peer, a request at a time */
+  uint64_t catchup_node_id;
+  uint64_t catchup_end;               /* One past the peer's last paxos_id */
+  uint8_t  catchup_retries;
+  uint64_t catchup_time;              /* usec, of the request, 0 if retransmitted */
+  paxos_timeout_t catchup_timeout;
+  paxos_value_t catchup_batch;        /* Values packed for a response */
+};
+
+/*
+ * ReadIndex: the reads queued while a round is out share the next one.
+ * A quorum tells the highest paxos_id it has accepted, once we have
+ * learned up to it the reads of the round see every write completed.
+ */
+struct paxos_reader {
+  uint64_t seq;                       /* Rounds started */
+  uint64_t index;                     /* Highest paxos_id + 1 of the replies */
+  uint64_t index_node_id;             /* The node that has it */
+  uint32_t votes;                     /* Replies received, by node */
+  paxos_quorum_t quorum;
+  uint8_t  queued;                    /* Reads waiting for the next round */
+  uint8_t  in_flight;
+  uint64_t confirmed_seq;             /* Last round with a quorum... */
+  uint64_t confirmed_index;           /* ...and the paxos_id to learn first */
+  uint64_t ready_seq;                 /* The reads up to this round can go */
+  paxos_timeout_t timeout;            /* Resend the round, or ask the values */
 };
 
 struct paxos_context {
   paxos_send_t send;
   paxos_broadcast_t broadcast;
   paxos_callback_t learned_value;
+  paxos_snapshot_take_t take_snapshot;
+  paxos_snapshot_install_t install_snapshot;
+  paxos_callback_t read_ready;        /* reader.ready_seq moved */
+  /* proposer.decided_paxos_id, proposed by paxos_propose() here, is
+   * delivered: if that's not the value learned, it wasn't chosen there (a
+   * forwarded one may be in another instance, before or after it) */
+  paxos_callback_t proposal_decided;
+  paxos_timer_wheel_t *timers;        /* NULL to poll with paxos_timeout() */
   void *arg;
 };
 
-struct paxos_quorum {
-  uint16_t num_accepted;
-  uint16_t num_rejected;
-  uint32_t num_nodes;
+struct paxos_instance {
+  uint64_t paxos_id;
+  paxos_proposer_state_t proposer;
+  paxos_acceptor_state_t acceptor;
+  paxos_quorum_t   quorum;
+  uint8_t  chosen;                    /* The accepted value is the chosen one */
 };
 
 struct paxos {
@@ -132,24 +223,42 @@ struct paxos {
   paxos_proposer_t proposer;
   paxos_acceptor_t acceptor;
   paxos_learner_t  learner;
+  paxos_reader_t   reader;
   paxos_quorum_t   quorum;
+  paxos_instance_t *instances;        /* Ring of in-flight instances */
+  uint8_t *send_buffer;               /* Frames of values without headroom */
+  uint32_t window_size;
+  uint32_t lease_duration;            /* msec, 0 without leases */
   uint64_t node_id;
+  uint16_t group_id;                  /* Each group has its own paxos_ids */
+  paxos_stats_t stats;
 };
 
-const char *      paxos_message_to_string   (const paxos_message_t *message);
-
-unsigned int      paxos_timeout_remaining   (paxos_timeout_t *self);
-void              paxos_timeout_trigger     (paxos_timeout_t *self);
-
-void              paxos_open                (paxos_t *self,
+int               paxos_open                (paxos_t *self,
                                              paxos_context_t *context,
+                                             uint16_t group_id,
                                              uint64_t node_id,
-                                             uint64_t num_nodes);
+                                             uint64_t num_nodes,
+                                             uint32_t window_size);
+int               paxos_open_snapshot       (paxos_t *self,
+                                             const char *path,
+                                             uint32_t interval);
+int               paxos_open_wal            (paxos_t *self,
+                                             const char *path,
+                                             unsigned int max_batch_delay);
+void              paxos_open_lease          (paxos_t *self,
+                                             unsigned int duration);
 void              paxos_close               (paxos_t *paxos);
 void              paxos_bootstrap           (paxos_t *paxos);
-void              paxos_propose             (paxos_t *self,
-                                             uint64_t value);
+int               paxos_propose             (paxos_t *self,
+                                             const paxos_value_t *value);
+int               paxos_snapshot            (paxos_t *self);
+int               paxos_has_lease           (paxos_t *self);
+uint64_t          paxos_read_index          (paxos_t *self);
+int               paxos_storage_fd          (paxos_t *paxos);
+void              paxos_storage_complete    (paxos_t *paxos);
 paxos_timeout_t * paxos_timeout             (paxos_t *paxos);
+void              paxos_timeout_expire      (paxos_t *paxos);
 void              paxos_process_message     (paxos_t *paxos,
                                              const paxos_message_t *message);
 
@@ -0,0 +1,396 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "pending.h"
+
+#define PENDING_MIN_CAPACITY      (64)
+#define PENDING_DUMP_HEADER_SIZE  (4)
+#define PENDING_DUMP_ENTRY_SIZE   (4 + 2 + 8 + 8 + 8 + 4)
+
+#define __bucket(self, hash)      ((hash) & ((self)->capacity - 1))
+
+static uint32_t __request_hash (const udp_client_t *client, uint64_t request_id) {
+  uint64_t h;
+
+  h = ((uint64_t)client->addr.sin_addr.s_addr << 16) ^ client->addr.sin_port;
+  h ^= request_id * 0x9e3779b97f4a7c15ull;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  return((uint32_t)h);
+}
+
+static int __request_equals (const paxos_pending_entry_t *entry,
+                             const udp_client_t *client,
+                             uint64_t request_id)
+{
+  return(entry->request_id == request_id &&
+         entry->client.addr.sin_addr.s_addr == client->addr.sin_addr.s_addr &&
+         entry->client.addr.sin_port == client->addr.sin_port);
+}
+
+/* ============================================================================
+ *  Lists, linked by index
+ */
+static void __list_init (paxos_pending_list_t *list) {
+  list->head = PAXOS_PENDING_NONE;
+  list->tail = PAXOS_PENDING_NONE;
+  list->count = 0;
+}
+
+static void __list_append (paxos_pending_t *self,
+                           paxos_pending_list_t *list,
+                           uint32_t index)
+{
+  paxos_pending_entry_t *entry = &(self->entries[index]);
+
+  entry->prev = list->tail;
+  entry->next = PAXOS_PENDING_NONE;
+  if (list->tail != PAXOS_PENDING_NONE)
+    self->entries[list->tail].next = index;
+  else
+    list->head = index;
+  list->tail = index;
+  list->count++;
+}
+
+static void __list_remove (paxos_pending_t *self,
+                           paxos_pending_list_t *list,
+                           uint32_t index)
+{
+  paxos_pending_entry_t *entry = &(self->entries[index]);
+
+  if (entry->prev != PAXOS_PENDING_NONE)
+    self->entries[entry->prev].next = entry->next;
+  else
+    list->head = entry->next;
+
+  if (entry->next != PAXOS_PENDING_NONE)
+    self->entries[entry->next].prev = entry->prev;
+  else
+    list->tail = entry->prev;
+  list->count--;
+}
+
+static paxos_pending_list_t *__entry_list (paxos_pending_t *self,
+                                           const paxos_pending_entry_t *entry)
+{
+  switch (entry->state) {
+    case PAXOS_PENDING_QUEUED:  return(&(self->queued));
+    case PAXOS_PENDING_DONE:    return(&(self->done));
+  }
+  return(NULL);
+}
+
+/* ============================================================================
+ *  Table
+ */
+static void __free_range (paxos_pending_t *self, uint32_t from, uint32_t to) {
+  paxos_pending_entry_t *entry;
+  uint32_t i;
+
+  /* Pushed backwards, the lowest index goes out first */
+  for (i = to; i > from; --i) {
+    entry = &(self->entries[i - 1]);
+    memset(entry, 0, sizeof(paxos_pending_entry_t));
+    paxos_value_init(&(entry->value));
+    entry->chain = self->free_head;
+    self->free_head = i - 1;
+  }
+}
+
+/* Double the entries and the buckets, the chains are rebuilt */
+static int __table_grow (paxos_pending_t *self) {
+  paxos_pending_entry_t *entries;
+  uint32_t *buckets;
+  uint32_t capacity;
+  uint32_t i;
+
+  capacity = self->capacity << 1;
+  entries = (paxos_pending_entry_t *) realloc(self->entries,
+                                              capacity * sizeof(paxos_pending_entry_t));
+  if (entries == NULL)
+    return(-1);
+  self->entries = entries;
+
+  if ((buckets = (uint32_t *) realloc(self->buckets, capacity * sizeof(uint32_t))) == NULL)
+    return(-2);
+  self->buckets = buckets;
+
+  __free_range(self, self->capacity, capacity);
+  self->capacity = capacity;
+
+  memset(self->buckets, 0xff, capacity * sizeof(uint32_t));
+  for (i = 0; i < capacity; ++i) {
+    paxos_pending_entry_t *entry = &(self->entries[i]);
+    if (entry->state == PAXOS_PENDING_FREE)
+      continue;
+    entry->chain = self->buckets[__bucket(self, entry->hash)];
+    self->buckets[__bucket(self, entry->hash)] = i;
+  }
+  return(0);
+}
+
+int paxos_pending_open (paxos_pending_t *self, uint32_t capacity) {
+  memset(self, 0, sizeof(paxos_pending_t));
+
+  self->capacity = PENDING_MIN_CAPACITY;
+  while (self->capacity < capacity)
+    self->capacity <<= 1;
+
+  self->entries = (paxos_pending_entry_t *) malloc(self->capacity *
+                                                   sizeof(paxos_pending_entry_t));
+  self->buckets = (uint32_t *) malloc(self->capacity * sizeof(uint32_t));
+  if (self->entries == NULL || self->buckets == NULL) {
+    paxos_pending_close(self);
+    return(-1);
+  }
+
+  self->free_head = PAXOS_PENDING_NONE;
+  __free_range(self, 0, self->capacity);
+  memset(self->buckets, 0xff, self->capacity * sizeof(uint32_t));
+  __list_init(&(self->queued));
+  __list_init(&(self->done));
+  return(0);
+}
+
+void paxos_pending_close (paxos_pending_t *self) {
+  uint32_t i;
+
+  if (self->entries != NULL) {
+    for (i = 0; i < self->capacity; ++i)
+      paxos_value_free(&(self->entries[i].value));
+    free(self->entries);
+    self->entries = NULL;
+  }
+
+  if (self->buckets != NULL) {
+    free(self->buckets);
+    self->buckets = NULL;
+  }
+}
+
+uint32_t paxos_pending_lookup (const paxos_pending_t *self,
+                               const udp_client_t *client,
+                               uint64_t request_id)
+{
+  uint32_t hash = __request_hash(client, request_id);
+  uint32_t index;
+
+  index = self->buckets[__bucket(self, hash)];
+  while (index != PAXOS_PENDING_NONE) {
+    const paxos_pending_entry_t *entry = &(self->entries[index]);
+    if (entry->hash == hash && __request_equals(entry, client, request_id))
+      return(index);
+    index = entry->chain;
+  }
+  return(PAXOS_PENDING_NONE);
+}
+
+/* A new request, not in the table yet. PAXOS_PENDING_NONE if out of memory */
+uint32_t paxos_pending_insert (paxos_pending_t *self,
+                               const udp_client_t *client,
+                               uint64_t request_id)
+{
+  paxos_pending_entry_t *entry;
+  uint32_t index;
+
+  if (self->free_head == PAXOS_PENDING_NONE && __table_grow(self))
+    return(PAXOS_PENDING_NONE);
+
+  index = self->free_head;
+  entry = &(self->entries[index]);
+  self->free_head = entry->chain;
+
+  memcpy(&(entry->client), client, sizeof(udp_client_t));
+  entry->request_id = request_id;
+  entry->paxos_id = 0;
+  entry->done_time = 0;
+  entry->hash = __request_hash(client, request_id);
+  entry->state = PAXOS_PENDING_PROPOSED;
+  paxos_value_clear(&(entry->value));
+
+  entry->chain = self->buckets[__bucket(self, entry->hash)];
+  self->buckets[__bucket(self, entry->hash)] = index;
+  self->count++;
+  return(index);
+}
+
+/* The value buffer is kept, for the next request using the entry */
+void paxos_pending_remove (paxos_pending_t *self, uint32_t index) {
+  paxos_pending_entry_t *entry = &(self->entries[index]);
+  paxos_pending_list_t *list;
+  uint32_t *link;
+
+  if ((list = __entry_list(self, entry)) != NULL)
+    __list_remove(self, list, index);
+
+  link = &(self->buckets[__bucket(self, entry->hash)]);
+  while (*link != index)
+    link = &(self->entries[*link].chain);
+  *link = entry->chain;
+
+  paxos_value_clear(&(entry->value));
+  entry->state = PAXOS_PENDING_FREE;
+  entry->chain = self->free_head;
+  self->free_head = index;
+  self->count--;
+}
+
+/* No room to propose it yet, keep a copy of the command */
+int paxos_pending_queue (paxos_pending_t *self,
+                         uint32_t index,
+                         const paxos_value_t *command)
+{
+  paxos_pending_entry_t *entry = &(self->entries[index]);
+
+  if (paxos_value_copy(&(entry->value), command))
+    return(-1);
+  entry->state = PAXOS_PENDING_QUEUED;
+  __list_append(self, &(self->queued), index);
+  return(0);
+}
+
+void paxos_pending_propose (paxos_pending_t *self, uint32_t index) {
+  paxos_pending_entry_t *entry = &(self->entries[index]);
+
+  if (entry->state == PAXOS_PENDING_QUEUED)
+    __list_remove(self, &(self->queued), index);
+  entry->state = PAXOS_PENDING_PROPOSED;
+}
+
+/* Applied, the result is kept for the retries until it expires */
+int paxos_pending_done (paxos_pending_t *self,
+                        uint32_t index,
+                        uint64_t paxos_id,
+                        const paxos_value_t *result,
+                        uint64_t now)
+{
+  paxos_pending_entry_t *entry = &(self->entries[index]);
+
+  if (paxos_value_copy(&(entry->value), result)) {
+    paxos_pending_remove(self, index);
+    return(-1);
+  }
+
+  paxos_pending_propose(self, index);
+  entry->paxos_id = paxos_id;
+  entry->done_time = now;
+  entry->state = PAXOS_PENDING_DONE;
+  __list_append(self, &(self->done), index);
+  return(0);
+}
+
+/* Forget the results older than ttl msec, the done list is in time order */
+void paxos_pending_expire (paxos_pending_t *self, uint64_t now, uint32_t ttl) {
+  uint32_t index;
+
+  while ((index = self->done.head) != PAXOS_PENDING_NONE &&
+         self->entries[index].done_time + ttl <= now)
+  {
+    paxos_pending_remove(self, index);
+  }
+}
+
+/* ============================================================================
+ *  Dump of the done entries
+ */
+#define __put(p, v)       (memcpy(p, &(v), sizeof(v)), (p) + sizeof(v))
+#define __get(p, v)       (memcpy(&(v), p, sizeof(v)), (p) + sizeof(v))
+
+uint64_t paxos_pending_dump_size (const paxos_pending_t *self) {
+  uint64_t size = PENDING_DUMP_HEADER_SIZE;
+  uint32_t index;
+
+  for (index = self->done.head; index != PAXOS_PENDING_NONE;
+       index = self->entries[index].next)
+  {
+    size += PENDING_DUMP_ENTRY_SIZE + self->entries[index].value.size;
+  }
+  return(size);
+}
+
+/* buffer has room for paxos_pending_dump_size() bytes */
+void paxos_pending_dump (const paxos_pending_t *self, uint8_t *buffer) {
+  const paxos_pending_entry_t *entry;
+  uint8_t *p = buffer;
+  uint32_t index;
+
+  p = __put(p, self->done.count);
+  for (index = self->done.head; index != PAXOS_PENDING_NONE; index = entry->next) {
+    entry = &(self->entries[index]);
+    p = __put(p, entry->client.addr.sin_addr.s_addr);
+    p = __put(p, entry->client.addr.sin_port);
+    p = __put(p, entry->request_id);
+    p = __put(p, entry->paxos_id);
+    p = __put(p, entry->done_time);
+    p = __put(p, entry->value.size);
+    memcpy(p, entry->value.data, entry->value.size);
+    p += entry->value.size;
+  }
+}
+
+/*
+ * Fill an empty table with the dump. On failure the table has a part of
+ * it, the caller closes it.
+ */
+int paxos_pending_load (paxos_pending_t *self, const uint8_t *buffer, uint64_t size) {
+  const uint8_t *end = buffer + size;
+  const uint8_t *p = buffer;
+  udp_client_t client;
+  uint64_t request_id;
+  uint64_t paxos_id;
+  uint64_t done_time;
+  paxos_value_t result;
+  uint32_t count;
+  uint32_t index;
+
+  if (size < PENDING_DUMP_HEADER_SIZE)
+    return(-1);
+
+  memset(&client, 0, sizeof(udp_client_t));
+  client.addr.sin_family = AF_INET;
+  client.addrlen = sizeof(struct sockaddr_in);
+
+  p = __get(p, count);
+  while (count--) {
+    if ((uint64_t)(end - p) < PENDING_DUMP_ENTRY_SIZE)
+      return(-1);
+
+    p = __get(p, client.addr.sin_addr.s_addr);
+    p = __get(p, client.addr.sin_port);
+    p = __get(p, request_id);
+    p = __get(p, paxos_id);
+    p = __get(p, done_time);
+    p = __get(p, result.size);
+    if ((uint64_t)(end - p) < result.size)
+      return(-1);
+    paxos_value_wrap(&result, p, result.size);
+    p += result.size;
+
+    index = paxos_pending_insert(self, &client, request_id);
+    if (index == PAXOS_PENDING_NONE ||
+        paxos_pending_done(self, index, paxos_id, &result, done_time))
+    {
+      return(-2);
+    }
+  }
+  return((p == end) ? 0 : -1);
+}
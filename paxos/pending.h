@@ -0,0 +1,114 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef _PAXOS_PENDING_H_
+#define _PAXOS_PENDING_H_
+
+#include <stdint.h>
+
+#include "value.h"
+#include "net.h"
+
+/*
+ * Client requests keyed by (client address, request id). A server keeps
+ * two tables: the requests it is working on, queued (waiting for room in a
+ * batch) then proposed; and the sessions, the requests applied (done) with
+ * their result. The sessions are part of the replicated state: the same on
+ * every replica, they expire by the time of the values learned, and go in
+ * the snapshot as a dump of the done entries, oldest first
+ *    count:32 | count * (addr:32 | port:16 | request_id:64 | paxos_id:64 |
+ *                        done_time:64 | result_size:32 | result)
+ * (native byte order, like the batch headers).
+ *
+ * The entries are an array addressed by index, the batches refer to them
+ * by index: growing the table (doubling, with a rehash of the bucket
+ * chains) moves the entries, never changes their index.
+ */
+#define PAXOS_PENDING_NONE        (0xffffffff)
+
+typedef struct paxos_pending_entry paxos_pending_entry_t;
+typedef struct paxos_pending_list paxos_pending_list_t;
+typedef struct paxos_pending paxos_pending_t;
+
+enum paxos_pending_state {
+  PAXOS_PENDING_FREE      = 0,
+  PAXOS_PENDING_QUEUED    = 1,        /* value is the command */
+  PAXOS_PENDING_PROPOSED  = 2,        /* In a batch */
+  PAXOS_PENDING_DONE      = 3,        /* value is the result */
+};
+
+struct paxos_pending_entry {
+  udp_client_t client;
+  uint64_t request_id;
+  uint64_t paxos_id;                  /* Of the command, once applied */
+  uint64_t done_time;                 /* msec */
+  paxos_value_t value;
+  uint32_t hash;
+  uint32_t chain;                     /* Next in the bucket, or in the free list */
+  uint32_t prev;                      /* In the queued or the done list */
+  uint32_t next;
+  uint8_t  state;
+};
+
+struct paxos_pending_list {
+  uint32_t head;
+  uint32_t tail;
+  uint32_t count;
+};
+
+struct paxos_pending {
+  paxos_pending_entry_t *entries;
+  uint32_t *buckets;
+  uint32_t capacity;                  /* Power of 2, entries and buckets */
+  uint32_t count;                     /* Entries in use */
+  uint32_t free_head;
+  paxos_pending_list_t queued;        /* Oldest first */
+  paxos_pending_list_t done;          /* Oldest first */
+};
+
+#define paxos_pending_get(self, index)      (&((self)->entries[index]))
+#define paxos_pending_has_queued(self)      ((self)->queued.count > 0)
+#define paxos_pending_first_queued(self)    ((self)->queued.head)
+
+int       paxos_pending_open    (paxos_pending_t *self, uint32_t capacity);
+void      paxos_pending_close   (paxos_pending_t *self);
+uint32_t  paxos_pending_lookup  (const paxos_pending_t *self,
+                                 const udp_client_t *client,
+                                 uint64_t request_id);
+uint32_t  paxos_pending_insert  (paxos_pending_t *self,
+                                 const udp_client_t *client,
+                                 uint64_t request_id);
+void      paxos_pending_remove  (paxos_pending_t *self, uint32_t index);
+int       paxos_pending_queue   (paxos_pending_t *self,
+                                 uint32_t index,
+                                 const paxos_value_t *command);
+void      paxos_pending_propose (paxos_pending_t *self, uint32_t index);
+int       paxos_pending_done    (paxos_pending_t *self,
+                                 uint32_t index,
+                                 uint64_t paxos_id,
+                                 const paxos_value_t *result,
+                                 uint64_t now);
+void      paxos_pending_expire  (paxos_pending_t *self,
+                                 uint64_t now,
+                                 uint32_t ttl);
+
+uint64_t  paxos_pending_dump_size (const paxos_pending_t *self);
+void      paxos_pending_dump      (const paxos_pending_t *self, uint8_t *buffer);
+int       paxos_pending_load      (paxos_pending_t *self,
+                                   const uint8_t *buffer,
+                                   uint64_t size);
+
+#endif /* !_PAXOS_PENDING_H_ */
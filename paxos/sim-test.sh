@@ -0,0 +1,37 @@
+#!/bin/bash
+#
+# Regression runs, after ./build.sh. The WAL recovery test first, then the
+# simulator: each run fails on a safety violation or when the committed
+# rate falls below its floor (a stall). Same seed, same run: a failure is
+# reproduced by the printed command.
+
+SIM=./paxos-sim
+failed=0
+
+if ! ./wal-test; then
+  echo "FAIL: ./wal-test"
+  failed=1
+fi
+
+run() {
+  if ! $SIM -d 5 "$@" > /dev/null 2>&1; then
+    echo "FAIL: $SIM -d 5 $*"
+    failed=1
+  else
+    echo "ok:   $SIM -d 5 $*"
+  fi
+}
+
+run -s 1 -m 50000
+# A follower a window behind must catch up from the leader's requests
+run -s 7 -p 0.1 -m 20000
+run -s 1 -p 0.1 -m 20000
+# Lost accepts are retransmitted, not re-prepared
+run -s 7 -p 1 -m 5000
+# Duplicated votes count once
+run -s 7 -u 5 -m 50000
+run -s 7 -r 5 -m 3000
+run -s 42 -n 5 -p 0.5 -m 8000
+run -s 7 -e 500 -p 0.1 -m 20000
+
+exit $failed
@@ -0,0 +1,196 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "snapshot.h"
+
+#define PAXOS_SNAPSHOT_MAGIC    (0x50585331)      /* PXS1 */
+
+struct paxos_snapshot_header {
+  uint32_t magic;
+  uint32_t checksum;                  /* Of the data */
+  uint64_t paxos_id;
+  uint64_t size;
+};
+
+/* FNV-1a, the same used by the WAL records */
+static uint32_t __fnv1a (const uint8_t *p, uint64_t size) {
+  uint32_t hash = 2166136261u;
+  while (size--) {
+    hash ^= *p++;
+    hash *= 16777619u;
+  }
+  return(hash);
+}
+
+static int __read_full (int fd, void *buffer, uint64_t size) {
+  uint8_t *p = (uint8_t *)buffer;
+  ssize_t rd;
+
+  while (size > 0) {
+    if ((rd = read(fd, p, size)) <= 0) {
+      if (rd < 0 && errno == EINTR)
+        continue;
+      return(-1);
+    }
+    p += rd;
+    size -= rd;
+  }
+  return(0);
+}
+
+static int __write_full (int fd, const void *buffer, uint64_t size) {
+  const uint8_t *p = (const uint8_t *)buffer;
+  ssize_t wr;
+
+  while (size > 0) {
+    if ((wr = write(fd, p, size)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return(-1);
+    }
+    p += wr;
+    size -= wr;
+  }
+  return(0);
+}
+
+void paxos_snapshot_init (paxos_snapshot_t *self) {
+  self->paxos_id = 0;
+  self->data = NULL;
+  self->size = 0;
+  self->capacity = 0;
+  self->valid = 0;
+}
+
+void paxos_snapshot_free (paxos_snapshot_t *self) {
+  free(self->data);
+  paxos_snapshot_init(self);
+}
+
+/* Start over with an empty (not yet valid) snapshot, the buffer is kept */
+void paxos_snapshot_reset (paxos_snapshot_t *self, uint64_t paxos_id) {
+  self->paxos_id = paxos_id;
+  self->size = 0;
+  self->valid = 0;
+}
+
+void paxos_snapshot_swap (paxos_snapshot_t *self, paxos_snapshot_t *other) {
+  paxos_snapshot_t tmp;
+  memcpy(&tmp, self, sizeof(paxos_snapshot_t));
+  memcpy(self, other, sizeof(paxos_snapshot_t));
+  memcpy(other, &tmp, sizeof(paxos_snapshot_t));
+}
+
+/* Room for size bytes of data, the current ones are preserved */
+uint8_t *paxos_snapshot_reserve (paxos_snapshot_t *self, uint64_t size) {
+  uint64_t capacity;
+  uint8_t *data;
+
+  if (size <= self->capacity)
+    return(self->data);
+
+  capacity = (self->capacity > 0) ? self->capacity : 4096;
+  while (capacity < size)
+    capacity <<= 1;
+
+  if ((data = (uint8_t *) realloc(self->data, capacity)) == NULL)
+    return(NULL);
+
+  self->data = data;
+  self->capacity = capacity;
+  return(data);
+}
+
+int paxos_snapshot_append (paxos_snapshot_t *self, const void *data, uint64_t size) {
+  if (paxos_snapshot_reserve(self, self->size + size) == NULL)
+    return(-1);
+
+  if (size > 0)
+    memcpy(self->data + self->size, data, size);
+  self->size += size;
+  return(0);
+}
+
+/* Returns 0 if the snapshot is loaded, 1 if there is none at path */
+int paxos_snapshot_load (paxos_snapshot_t *self, const char *path) {
+  struct paxos_snapshot_header header;
+  int fd;
+
+  paxos_snapshot_reset(self, 0);
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return((errno == ENOENT) ? 1 : -1);
+
+  if (__read_full(fd, &header, sizeof(header)) ||
+      header.magic != PAXOS_SNAPSHOT_MAGIC ||
+      paxos_snapshot_reserve(self, header.size) == NULL ||
+      __read_full(fd, self->data, header.size))
+  {
+    close(fd);
+    return(-2);
+  }
+  close(fd);
+
+  if (header.checksum != __fnv1a(self->data, header.size))
+    return(-3);
+
+  self->paxos_id = header.paxos_id;
+  self->size = header.size;
+  self->valid = 1;
+  return(0);
+}
+
+int paxos_snapshot_save (const paxos_snapshot_t *self, const char *path) {
+  struct paxos_snapshot_header header;
+  char tmp_path[256];
+  int fd;
+
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path))
+    return(-1);
+
+  if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    return(-1);
+
+  header.magic = PAXOS_SNAPSHOT_MAGIC;
+  header.checksum = __fnv1a(self->data, self->size);
+  header.paxos_id = self->paxos_id;
+  header.size = self->size;
+  if (__write_full(fd, &header, sizeof(header)) ||
+      __write_full(fd, self->data, self->size) ||
+      fdatasync(fd) < 0)
+  {
+    close(fd);
+    unlink(tmp_path);
+    return(-2);
+  }
+  close(fd);
+
+  if (rename(tmp_path, path) < 0) {
+    unlink(tmp_path);
+    return(-3);
+  }
+  return(0);
+}
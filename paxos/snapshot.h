@@ -0,0 +1,62 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+
+#ifndef _PAXOS_SNAPSHOT_H_
+#define _PAXOS_SNAPSHOT_H_
+
+#include <stdint.h>
+
+/*
+ * A snapshot is the serialized state machine after applying every value
+ * up to paxos_id, the log below it is no longer needed.
+ *
+ * On disk it is a fixed header followed by the data, written to a temporary
+ * file and renamed over the old one: a crash leaves either snapshot intact.
+ * Over the network it moves in chunks of PAXOS_SNAPSHOT_CHUNK_SIZE bytes,
+ * appended in order on the receiving side.
+ */
+#define PAXOS_SNAPSHOT_CHUNK_SIZE   (32 << 10)
+
+typedef struct paxos_snapshot paxos_snapshot_t;
+
+struct paxos_snapshot {
+  uint64_t paxos_id;                  /* Last paxos_id in the state */
+  uint8_t *data;
+  uint64_t size;
+  uint64_t capacity;
+  uint8_t  valid;
+};
+
+#define paxos_snapshot_is_valid(self)     ((self)->valid)
+
+void      paxos_snapshot_init     (paxos_snapshot_t *self);
+void      paxos_snapshot_free     (paxos_snapshot_t *self);
+void      paxos_snapshot_reset    (paxos_snapshot_t *self,
+                                   uint64_t paxos_id);
+void      paxos_snapshot_swap     (paxos_snapshot_t *self,
+                                   paxos_snapshot_t *other);
+uint8_t * paxos_snapshot_reserve  (paxos_snapshot_t *self,
+                                   uint64_t size);
+int       paxos_snapshot_append   (paxos_snapshot_t *self,
+                                   const void *data,
+                                   uint64_t size);
+int       paxos_snapshot_load     (paxos_snapshot_t *self,
+                                   const char *path);
+int       paxos_snapshot_save     (const paxos_snapshot_t *self,
+                                   const char *path);
+
+#endif /* !_PAXOS_SNAPSHOT_H_ */
@@ -0,0 +1,109 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <string.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+static const char *__counter_names[PAXOS_STATS_COUNTERS] = {
+  "prepares",
+  "proposals",
+  "restarts",
+  "prepare_timeouts",
+  "propose_timeouts",
+  "prepare_rejected",
+  "propose_rejected",
+  "reject_window",
+  "reject_ballot",
+  "reject_lease",
+  "wal_syncs",
+  "wal_records",
+  "wal_errors",
+  "wal_full",
+  "wal_compactions",
+  "learned",
+  "catchup_sent_values",
+  "catchup_sent_bytes",
+  "catchup_recv_values",
+  "catchup_recv_bytes",
+  "snapshot_sent_bytes",
+  "snapshot_recv_bytes",
+  "snapshots_taken",
+  "snapshots_installed",
+};
+
+static const char *__histogram_names[PAXOS_STATS_HISTOGRAMS] = {
+  "prepare_usec",
+  "propose_usec",
+  "learn_usec",
+  "commit_usec",
+};
+
+/* snprintf() returns what it wanted to write, keep the length in the buffer */
+static uint32_t __clamp (int n, uint32_t size) {
+  if (n < 0)
+    return(0);
+  return(((uint32_t)n < size) ? (uint32_t)n : size - 1);
+}
+
+void paxos_stats_reset (paxos_stats_t *self) {
+  uint32_t i;
+
+  memset(self->counters, 0, sizeof(self->counters));
+  for (i = 0; i < PAXOS_STATS_HISTOGRAMS; ++i)
+    paxos_histogram_reset(&(self->histograms[i]));
+}
+
+uint32_t paxos_stats_format_counter (char *buffer,
+                                     uint32_t size,
+                                     const char *name,
+                                     uint64_t value)
+{
+  if (size == 0)
+    return(0);
+  return(__clamp(snprintf(buffer, size, "%s %lu\n", name, value), size));
+}
+
+/* A "name value" line per counter, then a line per histogram */
+uint32_t paxos_stats_format (const paxos_stats_t *self,
+                             char *buffer,
+                             uint32_t size)
+{
+  const paxos_histogram_t *histogram;
+  uint32_t length = 0;
+  uint32_t i;
+
+  for (i = 0; i < PAXOS_STATS_COUNTERS && length + 1 < size; ++i) {
+    length += paxos_stats_format_counter(buffer + length, size - length,
+                                         __counter_names[i],
+                                         paxos_stats_get(self, i));
+  }
+
+  for (i = 0; i < PAXOS_STATS_HISTOGRAMS && length + 1 < size; ++i) {
+    histogram = &(self->histograms[i]);
+    length += __clamp(snprintf(buffer + length, size - length,
+                               "%s count %lu min %lu mean %.1f p50 %lu p99 %lu p999 %lu max %lu\n",
+                               __histogram_names[i], histogram->count,
+                               histogram->count ? histogram->min : 0,
+                               paxos_histogram_mean(histogram),
+                               paxos_histogram_percentile(histogram, 50.0),
+                               paxos_histogram_percentile(histogram, 99.0),
+                               paxos_histogram_percentile(histogram, 99.9),
+                               histogram->max), size - length);
+  }
+  return(length);
+}
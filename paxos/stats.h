@@ -0,0 +1,105 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef _PAXOS_STATS_H_
+#define _PAXOS_STATS_H_
+
+#include <stdint.h>
+
+#include "histogram.h"
+
+/*
+ * Protocol counters and per-phase latencies (usec) of a paxos group.
+ *
+ * A group is driven by a single thread, the only writer: a counter is
+ * bumped with a relaxed load and store, no lock prefix, and any other
+ * thread can read it without tearing. The histograms are read by the
+ * owner thread only (e.g. to answer a PAXOS_USER_STATS message).
+ */
+enum paxos_stats_counter {
+  /* Proposer */
+  PAXOS_STATS_PREPARES,               /* Prepare rounds started */
+  PAXOS_STATS_PROPOSALS,              /* Instances proposed, retries included */
+  PAXOS_STATS_RESTARTS,               /* Restart timeouts fired */
+  PAXOS_STATS_PREPARE_TIMEOUTS,
+  PAXOS_STATS_PROPOSE_TIMEOUTS,
+  PAXOS_STATS_PREPARE_REJECTED,       /* Rejections received... */
+  PAXOS_STATS_PROPOSE_REJECTED,
+  /* Acceptor, rejections sent by reason */
+  PAXOS_STATS_REJECT_WINDOW,          /* paxos_id outside the window */
+  PAXOS_STATS_REJECT_BALLOT,          /* Lower than the promised proposal_id */
+  PAXOS_STATS_REJECT_LEASE,           /* Lease held by another node */
+  PAXOS_STATS_WAL_SYNCS,
+  PAXOS_STATS_WAL_RECORDS,
+  PAXOS_STATS_WAL_ERRORS,
+  PAXOS_STATS_WAL_FULL,               /* Responses dropped, both batches busy */
+  PAXOS_STATS_WAL_COMPACTIONS,
+  /* Learner */
+  PAXOS_STATS_LEARNED,                /* Instances delivered, noops included */
+  PAXOS_STATS_CATCHUP_SENT_VALUES,
+  PAXOS_STATS_CATCHUP_SENT_BYTES,
+  PAXOS_STATS_CATCHUP_RECV_VALUES,
+  PAXOS_STATS_CATCHUP_RECV_BYTES,
+  PAXOS_STATS_SNAPSHOT_SENT_BYTES,
+  PAXOS_STATS_SNAPSHOT_RECV_BYTES,
+  PAXOS_STATS_SNAPSHOTS_TAKEN,
+  PAXOS_STATS_SNAPSHOTS_INSTALLED,
+  PAXOS_STATS_COUNTERS,
+};
+
+enum paxos_stats_histogram {
+  PAXOS_STATS_PREPARE_TIME,           /* Prepare sent -> quorum of promises */
+  PAXOS_STATS_PROPOSE_TIME,           /* Propose sent -> quorum of accepts */
+  PAXOS_STATS_LEARN_TIME,             /* Propose sent -> delivered, in order */
+  PAXOS_STATS_COMMIT_TIME,            /* First WAL record -> batch durable */
+  PAXOS_STATS_HISTOGRAMS,
+};
+
+typedef struct paxos_stats paxos_stats_t;
+
+struct paxos_stats {
+  uint64_t counters[PAXOS_STATS_COUNTERS];
+  paxos_histogram_t histograms[PAXOS_STATS_HISTOGRAMS];
+};
+
+#define paxos_stats_add(self, counter, delta)                               \
+  __atomic_store_n(&((self)->counters[counter]),                            \
+                   __atomic_load_n(&((self)->counters[counter]),            \
+                                   __ATOMIC_RELAXED) + (delta),             \
+                   __ATOMIC_RELAXED)
+
+#define paxos_stats_inc(self, counter)    paxos_stats_add(self, counter, 1)
+
+#define paxos_stats_get(self, counter)                                      \
+  __atomic_load_n(&((self)->counters[counter]), __ATOMIC_RELAXED)
+
+/* The time elapsed since start (usec), if it was ever set */
+#define paxos_stats_time(self, histogram, start, now)                       \
+  do {                                                                      \
+    if ((start) > 0 && (now) >= (start))                                    \
+      paxos_histogram_add(&((self)->histograms[histogram]), (now) - (start));\
+  } while (0)
+
+void      paxos_stats_reset           (paxos_stats_t *self);
+uint32_t  paxos_stats_format          (const paxos_stats_t *self,
+                                       char *buffer,
+                                       uint32_t size);
+uint32_t  paxos_stats_format_counter  (char *buffer,
+                                       uint32_t size,
+                                       const char *name,
+                                       uint64_t value);
+
+#endif /* !_PAXOS_STATS_H_ */
@@ -0,0 +1,254 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "timer.h"
+
+#define __SLOT_MASK           (PAXOS_TIMER_SLOTS - 1)
+#define __SLOT_NONE           (0xffff)
+#define __SLOT_EXPIRING       (PAXOS_TIMER_LEVELS * PAXOS_TIMER_SLOTS)
+#define __WHEEL_SPAN          (1ull << (PAXOS_TIMER_SLOT_BITS * PAXOS_TIMER_LEVELS))
+
+#define __level_shift(level)  ((level) * PAXOS_TIMER_SLOT_BITS)
+
+/* ============================================================================
+ *  Timer Wheel
+ */
+static void __wheel_link (paxos_timer_wheel_t *self,
+                          paxos_timeout_t *timeout,
+                          uint16_t slot)
+{
+  paxos_timeout_t **head = &(self->slots[slot]);
+
+  timeout->slot = slot;
+  timeout->prev = NULL;
+  timeout->next = *head;
+  if (*head != NULL)
+    (*head)->prev = timeout;
+  *head = timeout;
+
+  if (slot != __SLOT_EXPIRING)
+    self->bitmap[slot >> PAXOS_TIMER_SLOT_BITS] |= (1ull << (slot & __SLOT_MASK));
+  self->count++;
+}
+
+static void __wheel_unlink (paxos_timer_wheel_t *self, paxos_timeout_t *timeout) {
+  uint16_t slot = timeout->slot;
+
+  if (slot == __SLOT_NONE)
+    return;
+
+  if (timeout->prev != NULL)
+    timeout->prev->next = timeout->next;
+  else
+    self->slots[slot] = timeout->next;
+  if (timeout->next != NULL)
+    timeout->next->prev = timeout->prev;
+
+  if (slot != __SLOT_EXPIRING && self->slots[slot] == NULL)
+    self->bitmap[slot >> PAXOS_TIMER_SLOT_BITS] &= ~(1ull << (slot & __SLOT_MASK));
+
+  timeout->slot = __SLOT_NONE;
+  timeout->next = NULL;
+  timeout->prev = NULL;
+  self->count--;
+}
+
+/* Pick the level by distance, the slot by the expire time bits of that level */
+static void __wheel_insert (paxos_timer_wheel_t *self, paxos_timeout_t *timeout) {
+  uint64_t expire, delta;
+  unsigned int level;
+
+  /* Round up to the tick, a timeout never fires early */
+  expire = (timeout->expire_time + 999) / 1000;
+  if (expire < self->current)
+    expire = self->current;
+  delta = expire - self->current;
+  if (delta >= __WHEEL_SPAN) {
+    /* Too far away, park it at the end: it'll cascade back with the real time */
+    expire = self->current + __WHEEL_SPAN - 1;
+    delta = __WHEEL_SPAN - 1;
+  }
+
+  for (level = 0; level < PAXOS_TIMER_LEVELS - 1; ++level) {
+    if (delta < (1ull << __level_shift(level + 1)))
+      break;
+  }
+
+  __wheel_link(self, timeout,
+               (level << PAXOS_TIMER_SLOT_BITS) |
+               ((expire >> __level_shift(level)) & __SLOT_MASK));
+}
+
+static void __wheel_cascade (paxos_timer_wheel_t *self, unsigned int level) {
+  unsigned int slot;
+  paxos_timeout_t *timeout;
+
+  slot = (level << PAXOS_TIMER_SLOT_BITS) |
+         ((self->current >> __level_shift(level)) & __SLOT_MASK);
+  while ((timeout = self->slots[slot]) != NULL) {
+    __wheel_unlink(self, timeout);
+    __wheel_insert(self, timeout);
+  }
+}
+
+void paxos_timer_wheel_init (paxos_timer_wheel_t *self, uint64_t now) {
+  memset(self, 0, sizeof(paxos_timer_wheel_t));
+  self->current = now;
+}
+
+/*
+ * Fire every timeout expired up to now. The callbacks may start and stop
+ * any timeout, the ones about to fire included.
+ */
+void paxos_timer_wheel_advance (paxos_timer_wheel_t *self, uint64_t now) {
+  paxos_timeout_t *timeout;
+  unsigned int level;
+  unsigned int slot;
+
+  while (self->current <= now) {
+    if (self->count == 0) {
+      self->current = now + 1;
+      break;
+    }
+
+    /* Entering a new block of an upper level, bring its timeouts closer */
+    for (level = 1; level < PAXOS_TIMER_LEVELS; ++level) {
+      if (self->current & ((1ull << __level_shift(level)) - 1))
+        break;
+    }
+    while (--level > 0)
+      __wheel_cascade(self, level);
+
+    /* Move the expired ones aside, a restart in a callback lands in the future */
+    slot = self->current & __SLOT_MASK;
+    while ((timeout = self->slots[slot]) != NULL) {
+      __wheel_unlink(self, timeout);
+      __wheel_link(self, timeout, __SLOT_EXPIRING);
+    }
+    self->current++;
+
+    while ((timeout = self->slots[__SLOT_EXPIRING]) != NULL) {
+      __wheel_unlink(self, timeout);
+      paxos_timeout_trigger(timeout);
+    }
+  }
+}
+
+static uint64_t __rotate_right (uint64_t bitmap, unsigned int n) {
+  return(n ? (bitmap >> n) | (bitmap << (64 - n)) : bitmap);
+}
+
+/* msec until the wheel needs to advance, -1 if there's nothing to wait for */
+int paxos_timer_wheel_next (const paxos_timer_wheel_t *self, uint64_t now) {
+  uint64_t next, when, bitmap;
+  unsigned int level, shift;
+  unsigned int distance;
+
+  if (self->count == 0)
+    return(-1);
+
+  next = UINT64_MAX;
+  for (level = 0; level < PAXOS_TIMER_LEVELS; ++level) {
+    if (!self->bitmap[level])
+      continue;
+
+    shift = __level_shift(level);
+    bitmap = __rotate_right(self->bitmap[level],
+                            (self->current >> shift) & __SLOT_MASK);
+
+    /* The upper level slot of the current block was already cascaded */
+    if (level > 0 && (self->current & ((1ull << shift) - 1)))
+      bitmap &= ~1ull;
+
+    distance = bitmap ? __builtin_ctzll(bitmap) : PAXOS_TIMER_SLOTS;
+    when = ((self->current >> shift) + distance) << shift;
+    if (when < next)
+      next = when;
+  }
+
+  if (next <= now)
+    return(0);
+  return((next - now) > 0x7fffffff ? 0x7fffffff : (int)(next - now));
+}
+
+/* ============================================================================
+ *  Timeout
+ */
+void paxos_timeout_init (paxos_timeout_t *self,
+                         unsigned int timeout,
+                         paxos_callback_t callback,
+                         void *arg)
+{
+  self->arg = arg;
+  self->callback = callback;
+  self->active = 0;
+  self->timeout = timeout;
+  self->expire_time = 0;
+  self->wheel = NULL;
+  self->next = NULL;
+  self->prev = NULL;
+  self->slot = __SLOT_NONE;
+}
+
+/* From now on the wheel fires this timeout */
+void paxos_timeout_attach (paxos_timeout_t *self, paxos_timer_wheel_t *wheel) {
+  if (self->wheel != NULL)
+    __wheel_unlink(self->wheel, self);
+
+  self->wheel = wheel;
+  if (wheel != NULL && self->active)
+    __wheel_insert(wheel, self);
+}
+
+void paxos_timeout_start (paxos_timeout_t *self) {
+  self->active = 1;
+  self->expire_time = paxos_time_now_usec() + self->timeout * 1000ull;
+  if (self->wheel != NULL) {
+    __wheel_unlink(self->wheel, self);
+    __wheel_insert(self->wheel, self);
+  }
+}
+
+void paxos_timeout_stop (paxos_timeout_t *self) {
+  self->active = 0;
+  if (self->wheel != NULL)
+    __wheel_unlink(self->wheel, self);
+}
+
+/* msec left (rounded up, 0 if expired), 1000 if there's nothing to wait */
+unsigned int paxos_timeout_remaining (paxos_timeout_t *self) {
+  uint64_t now;
+  if (self == NULL || !self->active)
+    return(1000);
+  now = paxos_time_now_usec();
+  return(self->expire_time > now ? (self->expire_time - now + 999) / 1000 : 0);
+}
+
+int paxos_timeout_is_expired (paxos_timeout_t *self) {
+  return(self != NULL && self->active && self->expire_time <= paxos_time_now_usec());
+}
+
+void paxos_timeout_trigger (paxos_timeout_t *self) {
+  if (self != NULL && self->active) {
+    if (self->wheel != NULL)
+      __wheel_unlink(self->wheel, self);
+    self->active = 0;
+    self->callback(self->arg);
+  }
+}
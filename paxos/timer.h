@@ -0,0 +1,87 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef _PAXOS_TIMER_H_
+#define _PAXOS_TIMER_H_
+
+#include <stdint.h>
+
+#include "clock.h"
+
+/*
+ * A timeout is a one-shot timer, restarted by its owner when needed.
+ *
+ * Standalone timeouts just keep their expire time, the owner polls them.
+ * Once attached to a timer wheel, start and stop also link the timeout
+ * into the wheel, and paxos_timer_wheel_advance() fires it: any number of
+ * timeouts in O(1) per start/stop/expire.
+ *
+ * The wheel is hierarchical, PAXOS_TIMER_LEVELS levels of 64 slots:
+ * 1ms slots in the first one, 64ms in the second and so on. A timeout sits
+ * in the level matching its distance and moves down (cascades) as the
+ * time gets closer.
+ */
+#define PAXOS_TIMER_LEVELS        (4)
+#define PAXOS_TIMER_SLOT_BITS     (6)
+#define PAXOS_TIMER_SLOTS         (1 << PAXOS_TIMER_SLOT_BITS)
+
+typedef struct paxos_timer_wheel paxos_timer_wheel_t;
+typedef struct paxos_timeout paxos_timeout_t;
+
+typedef void (*paxos_callback_t)  (void *arg);
+
+struct paxos_timeout {
+  void *arg;
+  paxos_callback_t callback;
+  uint8_t active;
+  uint32_t timeout;                     /* msec */
+  uint64_t expire_time;                 /* usec, see paxos_time_now_usec() */
+
+  /* Timer wheel */
+  paxos_timer_wheel_t *wheel;
+  paxos_timeout_t *next;
+  paxos_timeout_t *prev;
+  uint16_t slot;                        /* level * PAXOS_TIMER_SLOTS + index */
+};
+
+struct paxos_timer_wheel {
+  /* The slots of every level, plus the list of the ones being fired */
+  paxos_timeout_t *slots[PAXOS_TIMER_LEVELS * PAXOS_TIMER_SLOTS + 1];
+  uint64_t bitmap[PAXOS_TIMER_LEVELS];  /* Non-empty slots */
+  uint64_t current;                     /* Next tick (msec) to process */
+  uint32_t count;
+};
+
+void          paxos_timeout_init        (paxos_timeout_t *self,
+                                         unsigned int timeout,
+                                         paxos_callback_t callback,
+                                         void *arg);
+void          paxos_timeout_attach      (paxos_timeout_t *self,
+                                         paxos_timer_wheel_t *wheel);
+void          paxos_timeout_start       (paxos_timeout_t *self);
+void          paxos_timeout_stop        (paxos_timeout_t *self);
+unsigned int  paxos_timeout_remaining   (paxos_timeout_t *self);
+int           paxos_timeout_is_expired  (paxos_timeout_t *self);
+void          paxos_timeout_trigger     (paxos_timeout_t *self);
+
+void          paxos_timer_wheel_init    (paxos_timer_wheel_t *self,
+                                         uint64_t now);
+void          paxos_timer_wheel_advance (paxos_timer_wheel_t *self,
+                                         uint64_t now);
+int           paxos_timer_wheel_next    (const paxos_timer_wheel_t *self,
+                                         uint64_t now);
+
+#endif /* !_PAXOS_TIMER_H_ */
@@ -0,0 +1,189 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "trace.h"
+
+__thread paxos_trace_ring_t *paxos_trace_current = NULL;
+
+/* Registered once per thread, read by the dump from any thread */
+static paxos_trace_ring_t *__rings[PAXOS_TRACE_MAX_RINGS];
+static volatile uint32_t __num_rings = 0;
+static pthread_mutex_t __rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char __dump_path[256];
+
+/* A ring for the calling thread, capacity is rounded up to a power of 2 */
+int paxos_trace_attach (uint32_t id, uint32_t capacity) {
+  paxos_trace_ring_t *ring;
+  uint32_t size;
+
+  if (paxos_trace_current != NULL || capacity == 0)
+    return(-1);
+
+  size = 1;
+  while (size < capacity)
+    size <<= 1;
+
+  if ((ring = (paxos_trace_ring_t *) calloc(1, sizeof(paxos_trace_ring_t))) == NULL)
+    return(-2);
+
+  if ((ring->events = (paxos_trace_event_t *) calloc(size, sizeof(paxos_trace_event_t))) == NULL) {
+    free(ring);
+    return(-2);
+  }
+  ring->mask = size - 1;
+  ring->id = id;
+
+  pthread_mutex_lock(&__rings_lock);
+  if (__num_rings == PAXOS_TRACE_MAX_RINGS) {
+    pthread_mutex_unlock(&__rings_lock);
+    free(ring->events);
+    free(ring);
+    return(-3);
+  }
+  __rings[__num_rings] = ring;
+  __sync_synchronize();
+  __num_rings++;
+  pthread_mutex_unlock(&__rings_lock);
+
+  paxos_trace_current = ring;
+  return(0);
+}
+
+static int __write_all (int fd, const void *buffer, size_t size) {
+  const uint8_t *p = (const uint8_t *)buffer;
+  ssize_t n;
+
+  while (size > 0) {
+    if ((n = write(fd, p, size)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return(-1);
+    }
+    p += n;
+    size -= n;
+  }
+  return(0);
+}
+
+/*
+ * Write every ring, oldest event first. Only write(), callable from a
+ * signal handler: the owners keep recording meanwhile, the events that
+ * wrap during the dump are the only ones that may be torn.
+ */
+int paxos_trace_dump (int fd) {
+  const paxos_trace_ring_t *ring;
+  uint32_t header[2];
+  uint64_t recorded;
+  uint64_t magic;
+  uint32_t capacity;
+  uint32_t first;
+  uint32_t num_rings;
+  uint32_t i;
+
+  num_rings = __num_rings;
+  magic = PAXOS_TRACE_MAGIC;
+  header[0] = PAXOS_TRACE_VERSION;
+  header[1] = num_rings;
+  if (__write_all(fd, &magic, sizeof(magic)) ||
+      __write_all(fd, header, sizeof(header)))
+  {
+    return(-1);
+  }
+
+  for (i = 0; i < num_rings; ++i) {
+    ring = __rings[i];
+    recorded = ring->recorded;
+    capacity = ring->mask + 1;
+
+    header[0] = ring->id;
+    header[1] = capacity;
+    if (__write_all(fd, header, sizeof(header)) ||
+        __write_all(fd, &recorded, sizeof(recorded)))
+    {
+      return(-1);
+    }
+
+    if (recorded < capacity) {
+      if (__write_all(fd, ring->events, recorded * sizeof(paxos_trace_event_t)))
+        return(-1);
+      continue;
+    }
+
+    /* Full: from the slot about to be overwritten, around to the one before */
+    first = (uint32_t)(recorded & ring->mask);
+    if (__write_all(fd, ring->events + first,
+                    (capacity - first) * sizeof(paxos_trace_event_t)) ||
+        __write_all(fd, ring->events, first * sizeof(paxos_trace_event_t)))
+    {
+      return(-1);
+    }
+  }
+  return(0);
+}
+
+static void __dump_to_path (void) {
+  int fd;
+
+  if ((fd = open(__dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    return;
+  paxos_trace_dump(fd);
+  close(fd);
+}
+
+static void __on_dump_signal (int signum) {
+  __dump_to_path();
+}
+
+/* Dump, then let the default action kill us (SA_RESETHAND) */
+static void __on_crash_signal (int signum) {
+  __dump_to_path();
+  raise(signum);
+}
+
+/* Dump the rings to path on SIGUSR1, and on a crash */
+int paxos_trace_install (const char *path) {
+  static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+  struct sigaction action;
+  uint32_t i;
+
+  if (strlen(path) >= sizeof(__dump_path))
+    return(-1);
+  strcpy(__dump_path, path);
+
+  memset(&action, 0, sizeof(struct sigaction));
+  sigemptyset(&(action.sa_mask));
+  action.sa_handler = __on_dump_signal;
+  action.sa_flags = SA_RESTART;
+  if (sigaction(SIGUSR1, &action, NULL))
+    return(-2);
+
+  action.sa_handler = __on_crash_signal;
+  action.sa_flags = SA_RESETHAND;
+  for (i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); ++i) {
+    if (sigaction(crash_signals[i], &action, NULL))
+      return(-2);
+  }
+  return(0);
+}
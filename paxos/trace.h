@@ -0,0 +1,111 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef _PAXOS_TRACE_H_
+#define _PAXOS_TRACE_H_
+
+#include <stdint.h>
+
+#include "message.h"
+#include "clock.h"
+
+/*
+ * Always-on tracing: each thread records fixed-size binary events in its
+ * own ring, the oldest are overwritten. Recording is a few stores, no lock
+ * and no stdio; the time is the thread cached clock (see clock.h).
+ * A thread without a ring (paxos_trace_attach() never called) records nothing.
+ *
+ * The rings are written out raw by paxos_trace_dump(), using only
+ * async-signal-safe calls: paxos_trace_install() dumps them to a file on
+ * SIGUSR1 and on a crash. paxos-trace decodes the file.
+ *
+ * Dump format (native byte order):
+ *    magic:64 | version:32 | num_rings:32
+ *    num_rings * (id:32 | capacity:32 | recorded:64 | events, oldest first)
+ */
+#define PAXOS_TRACE_MAGIC           (0x31454341525458ull)   /* "XTRACE1" */
+#define PAXOS_TRACE_VERSION         (1)
+#define PAXOS_TRACE_MAX_RINGS       (64)
+#define PAXOS_TRACE_DEFAULT_EVENTS  (1 << 16)
+
+typedef struct paxos_trace_event paxos_trace_event_t;
+typedef struct paxos_trace_ring paxos_trace_ring_t;
+
+enum paxos_trace_kind {
+  PAXOS_TRACE_RECV        = 1,
+  PAXOS_TRACE_SEND        = 2,
+  PAXOS_TRACE_BROADCAST   = 3,
+  PAXOS_TRACE_LEARNED     = 4,        /* A value delivered to the state machine */
+};
+
+struct paxos_trace_event {
+  uint64_t time;                      /* usec */
+  uint64_t paxos_id;
+  uint64_t proposal_id;               /* The request id of the user messages */
+  uint16_t node_id;                   /* Sender or destination */
+  uint16_t group_id;
+  uint16_t size;                      /* Of the value, saturated */
+  uint8_t  kind;
+  uint8_t  type;                      /* Of the message */
+};
+
+struct paxos_trace_ring {
+  paxos_trace_event_t *events;
+  uint64_t recorded;                  /* The next event goes at recorded & mask */
+  uint32_t mask;
+  uint32_t id;
+};
+
+extern __thread paxos_trace_ring_t *paxos_trace_current;
+
+static inline void paxos_trace_event (uint8_t kind,
+                                      uint8_t type,
+                                      uint16_t group_id,
+                                      uint64_t node_id,
+                                      uint64_t paxos_id,
+                                      uint64_t proposal_id,
+                                      uint32_t size)
+{
+  paxos_trace_ring_t *ring = paxos_trace_current;
+  paxos_trace_event_t *event;
+
+  if (ring == NULL)
+    return;
+
+  event = &(ring->events[ring->recorded & ring->mask]);
+  event->time = paxos_time_now_usec();
+  event->paxos_id = paxos_id;
+  event->proposal_id = proposal_id;
+  event->node_id = (uint16_t)node_id;
+  event->group_id = group_id;
+  event->size = size < 0xffff ? size : 0xffff;
+  event->kind = kind;
+  event->type = type;
+  ring->recorded++;
+}
+
+#define paxos_trace_message(kind, message, node_id)                         \
+  paxos_trace_event(kind, (message)->type, (message)->group_id, node_id,    \
+                    (message)->paxos_id,                                    \
+                    (message)->type >= PAXOS_USER_PROPOSE_VALUE ?           \
+                      (message)->request_id : (message)->proposal_id,       \
+                    (message)->value.size)
+
+int   paxos_trace_attach  (uint32_t id, uint32_t capacity);
+int   paxos_trace_dump    (int fd);
+int   paxos_trace_install (const char *path);
+
+#endif /* !_PAXOS_TRACE_H_ */
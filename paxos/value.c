@@ -0,0 +1,123 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "value.h"
+
+#define __value_buffer(self)    ((self)->data - PAXOS_VALUE_HEADROOM)
+#define __align_up(x, align)    (((x) + (align) - 1) & ~((align) - 1))
+
+/* Make room for size bytes, the current data is preserved */
+int paxos_value_reserve (paxos_value_t *self, uint32_t size) {
+  uint8_t *buffer;
+  uint32_t capacity;
+
+  if (size > PAXOS_VALUE_MAX_SIZE)
+    return(-1);
+
+  if (size <= self->capacity)
+    return(0);
+
+  capacity = __align_up(size, 256);
+  if (self->capacity > 0) {
+    buffer = (uint8_t *) realloc(__value_buffer(self),
+                                 PAXOS_VALUE_HEADROOM + capacity);
+  } else {
+    /* A view, the data is still someone else's */
+    buffer = (uint8_t *) malloc(PAXOS_VALUE_HEADROOM + capacity);
+    if (buffer != NULL && self->size > 0)
+      memcpy(buffer + PAXOS_VALUE_HEADROOM, self->data, self->size);
+  }
+
+  if (buffer == NULL)
+    return(-2);
+
+  self->data = buffer + PAXOS_VALUE_HEADROOM;
+  self->capacity = capacity;
+  return(0);
+}
+
+int paxos_value_set (paxos_value_t *self, const void *data, uint32_t size) {
+  if (self->data == data && self->size == size)
+    return(0);
+
+  /* Don't drag the old content along, it is going to be replaced */
+  self->size = 0;
+  if (paxos_value_reserve(self, size))
+    return(-1);
+
+  if (size > 0)
+    memcpy(self->data, data, size);
+  self->size = size;
+  return(0);
+}
+
+/* Exchange the buffers, ownership moves without touching the data */
+void paxos_value_swap (paxos_value_t *self, paxos_value_t *other) {
+  paxos_value_t tmp;
+  memcpy(&tmp, self, sizeof(paxos_value_t));
+  memcpy(self, other, sizeof(paxos_value_t));
+  memcpy(other, &tmp, sizeof(paxos_value_t));
+}
+
+void paxos_value_free (paxos_value_t *self) {
+  if (self->capacity > 0)
+    free(__value_buffer(self));
+  paxos_value_init(self);
+}
+
+/* ============================================================================
+ *  Command batches
+ */
+int paxos_value_add_item (paxos_value_t *self, const void *item, uint32_t size) {
+  uint32_t offset = self->size;
+
+  if (paxos_value_reserve(self, offset + sizeof(uint32_t) + size))
+    return(-1);
+
+  memcpy(self->data + offset, &size, sizeof(uint32_t));
+  memcpy(self->data + offset + sizeof(uint32_t), item, size);
+  self->size = offset + sizeof(uint32_t) + size;
+  return(0);
+}
+
+/*
+ * Walk the commands of a batch: returns 1 and points item at the next one,
+ * 0 at the end of the batch and -1 if the framing is broken.
+ */
+int paxos_value_next_item (const paxos_value_t *self,
+                           uint32_t *offset,
+                           const uint8_t **item,
+                           uint32_t *size)
+{
+  if (*offset >= self->size)
+    return(0);
+
+  if (self->size - *offset < sizeof(uint32_t))
+    return(-1);
+
+  memcpy(size, self->data + *offset, sizeof(uint32_t));
+  *offset += sizeof(uint32_t);
+  if (*size > self->size - *offset)
+    return(-1);
+
+  *item = self->data + *offset;
+  *offset += *size;
+  return(1);
+}
@@ -0,0 +1,95 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef _PAXOS_VALUE_H_
+#define _PAXOS_VALUE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A value is an opaque blob of up to PAXOS_VALUE_MAX_SIZE bytes.
+ *
+ * A value either owns its buffer (capacity > 0) or is a view on someone
+ * else's memory, like the receive buffer a message was parsed from.
+ * Owned buffers keep PAXOS_VALUE_HEADROOM bytes in front of the data, so a
+ * message header can be written right before the payload and the whole
+ * frame goes out without copying the value.
+ *
+ * The server packs a batch of client commands in a single value,
+ * each command is framed as a 32bit size followed by its bytes.
+ */
+#define PAXOS_VALUE_HEADROOM        (64)
+#define PAXOS_VALUE_MAX_SIZE        (60 << 10)
+
+typedef struct paxos_value paxos_value_t;
+
+struct paxos_value {
+  uint8_t *data;
+  uint32_t size;
+  uint32_t capacity;                  /* 0 if data is not ours */
+};
+
+#define paxos_value_init(self)                                              \
+  do {                                                                      \
+    (self)->data = NULL;                                                    \
+    (self)->size = 0;                                                       \
+    (self)->capacity = 0;                                                   \
+  } while (0)
+
+#define paxos_value_wrap(self, buf, len)                                    \
+  do {                                                                      \
+    (self)->data = (uint8_t *)(buf);                                        \
+    (self)->size = (len);                                                   \
+    (self)->capacity = 0;                                                   \
+  } while (0)
+
+/* A view on other, the headroom comes along if other has one */
+#define paxos_value_ref(self, other)                                        \
+  memcpy(self, other, sizeof(paxos_value_t))
+
+#define paxos_value_clear(self)                                             \
+  (self)->size = 0
+
+#define paxos_value_is_empty(self)                                          \
+  ((self)->size == 0)
+
+#define paxos_value_has_headroom(self)                                      \
+  ((self)->capacity > 0)
+
+#define paxos_value_copy(self, other)                                       \
+  paxos_value_set(self, (other)->data, (other)->size)
+
+#define paxos_value_equals(self, other)                                     \
+  ((self)->size == (other)->size &&                                         \
+   ((self)->size == 0 || !memcmp((self)->data, (other)->data, (self)->size)))
+
+int   paxos_value_reserve     (paxos_value_t *self, uint32_t size);
+int   paxos_value_set         (paxos_value_t *self,
+                               const void *data,
+                               uint32_t size);
+void  paxos_value_swap        (paxos_value_t *self, paxos_value_t *other);
+void  paxos_value_free        (paxos_value_t *self);
+
+int   paxos_value_add_item    (paxos_value_t *self,
+                               const void *item,
+                               uint32_t size);
+int   paxos_value_next_item   (const paxos_value_t *self,
+                               uint32_t *offset,
+                               const uint8_t **item,
+                               uint32_t *size);
+
+#endif /* !_PAXOS_VALUE_H_ */
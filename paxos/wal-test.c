@@ -0,0 +1,162 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+
+#include "wal.h"
+
+/*
+ * WAL recovery: a batch whose write fails is cut away, nothing is written
+ * after it, and a restart replays up to the last durable batch and appends
+ * after it. The write fails on RLIMIT_FSIZE (EFBIG, SIGXFSZ ignored) part
+ * way through a batch, leaving a torn record to cut.
+ */
+#define WAL_TEST_PATH         "wal-test.wal"
+#define WAL_TEST_FILE_LIMIT   (10000)         /* bytes, a few batches */
+#define RECORDS_PER_BATCH     (16)
+#define VALUE_SIZE            (100)
+
+#define CHECK(cond)                                                         \
+  if (!(cond)) {                                                            \
+    fprintf(stderr, "wal-test:%d: FAILED %s\n", __LINE__, #cond);           \
+    return(1);                                                              \
+  }
+
+struct replayed {
+  uint64_t count;
+  uint64_t next_paxos_id;
+  int bad;
+};
+
+/* Records come back in order, each value filled with its paxos_id */
+static void __replay_record (void *arg,
+                             const paxos_wal_record_t *record,
+                             const uint8_t *value)
+{
+  struct replayed *replayed = (struct replayed *)arg;
+  uint32_t i;
+
+  if (record->paxos_id != replayed->next_paxos_id || record->value_size != VALUE_SIZE)
+    replayed->bad = 1;
+  for (i = 0; i < record->value_size; ++i) {
+    if (value[i] != (uint8_t)record->paxos_id)
+      replayed->bad = 1;
+  }
+  replayed->next_paxos_id++;
+  replayed->count++;
+}
+
+/* A batch of records from paxos_id on, the status of its completion */
+static int __write_batch (paxos_wal_t *wal, uint64_t paxos_id) {
+  paxos_wal_completion_t completion;
+  paxos_wal_record_t record;
+  uint8_t value[VALUE_SIZE];
+  uint32_t i;
+
+  for (i = 0; i < RECORDS_PER_BATCH; ++i) {
+    memset(&record, 0, sizeof(paxos_wal_record_t));
+    record.paxos_id = paxos_id + i;
+    record.promised_proposal_id = 1;
+    record.accepted_proposal_id = 1;
+    record.value_size = VALUE_SIZE;
+    record.flags = PAXOS_WAL_ACCEPTED;
+    memset(value, (uint8_t)record.paxos_id, VALUE_SIZE);
+    if (paxos_wal_append(wal, &record, value))
+      return(-100);
+  }
+
+  if (paxos_wal_submit(wal) || paxos_wal_complete(wal, &completion, 1) != 1)
+    return(-101);
+  return(completion.status);
+}
+
+static int __reopen (paxos_wal_t *wal, struct replayed *replayed) {
+  memset(replayed, 0, sizeof(struct replayed));
+  if (paxos_wal_open(wal, WAL_TEST_PATH, __replay_record, replayed))
+    return(-1);
+  return(replayed->bad);
+}
+
+static off_t __file_size (const char *path) {
+  struct stat st;
+  return(stat(path, &st) < 0 ? -1 : st.st_size);
+}
+
+int main (int argc, char **argv) {
+  static const uint8_t garbage[] = "a record cut by a crash";
+  struct replayed replayed;
+  struct rlimit limit;
+  struct rlimit saved;
+  paxos_wal_t wal;
+  uint64_t durable;
+  off_t size;
+  int status;
+  int fd;
+
+  signal(SIGXFSZ, SIG_IGN);
+  unlink(WAL_TEST_PATH);
+  CHECK(__reopen(&wal, &replayed) == 0 && replayed.count == 0);
+
+  /* Durable batches until one doesn't fit under the file size limit */
+  CHECK(getrlimit(RLIMIT_FSIZE, &saved) == 0);
+  limit.rlim_cur = WAL_TEST_FILE_LIMIT;
+  limit.rlim_max = saved.rlim_max;
+  CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+
+  durable = 0;
+  while ((status = __write_batch(&wal, durable)) == 0)
+    durable += RECORDS_PER_BATCH;
+
+  CHECK(status == PAXOS_WAL_WRITE_FAILED);
+  CHECK(paxos_wal_has_failed(&wal));
+  CHECK(durable > 0);
+
+  /* The torn batch is gone, and the next one is refused */
+  size = __file_size(WAL_TEST_PATH);
+  CHECK(size == wal.offset);
+  CHECK(__write_batch(&wal, durable) == PAXOS_WAL_FAILED);
+  CHECK(__file_size(WAL_TEST_PATH) == size);
+  paxos_wal_close(&wal);
+  CHECK(setrlimit(RLIMIT_FSIZE, &saved) == 0);
+
+  /* Restart: the durable batches come back, the new ones go after them */
+  CHECK(__reopen(&wal, &replayed) == 0 && replayed.count == durable);
+  CHECK(__write_batch(&wal, durable) == 0);
+  durable += RECORDS_PER_BATCH;
+  paxos_wal_close(&wal);
+  CHECK(__reopen(&wal, &replayed) == 0 && replayed.count == durable);
+  size = wal.offset;
+  paxos_wal_close(&wal);
+
+  /* A crash in the middle of a write: the partial record is cut on replay */
+  CHECK((fd = open(WAL_TEST_PATH, O_WRONLY | O_APPEND)) >= 0);
+  CHECK(write(fd, garbage, sizeof(garbage)) == sizeof(garbage));
+  close(fd);
+  CHECK(__reopen(&wal, &replayed) == 0 && replayed.count == durable);
+  CHECK(__file_size(WAL_TEST_PATH) == size);
+  paxos_wal_close(&wal);
+
+  unlink(WAL_TEST_PATH);
+  printf("wal-test: ok, %lu records\n", durable);
+  return(0);
+}
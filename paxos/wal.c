@@ -0,0 +1,495 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "wal.h"
+
+#define __align8(x)           (((x) + 7) & ~7)
+#define __record_size(vsize)  (sizeof(paxos_wal_record_t) + __align8(vsize))
+
+/* FNV-1a, enough to detect a torn write at the tail of the log */
+static uint32_t __fnv1a (uint32_t hash, const uint8_t *p, uint32_t size) {
+  uint32_t i;
+  for (i = 0; i < size; ++i) {
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+  return(hash);
+}
+
+/* The checksum field is zero while hashing */
+static uint32_t __record_checksum (const paxos_wal_record_t *record,
+                                   const uint8_t *value)
+{
+  paxos_wal_record_t header;
+
+  memcpy(&header, record, sizeof(paxos_wal_record_t));
+  header.checksum = 0;
+  return(__fnv1a(__fnv1a(2166136261u, (const uint8_t *)&header,
+                         sizeof(paxos_wal_record_t)),
+                 value, record->value_size));
+}
+
+static int __batch_reserve (paxos_wal_batch_t *batch, uint32_t size) {
+  uint32_t capacity;
+  uint8_t *buffer;
+
+  if (batch->size + size <= batch->capacity)
+    return(0);
+
+  capacity = (batch->capacity > 0) ? batch->capacity : 4096;
+  while (capacity < batch->size + size)
+    capacity <<= 1;
+
+  if ((buffer = (uint8_t *) realloc(batch->buffer, capacity)) == NULL)
+    return(-1);
+
+  batch->buffer = buffer;
+  batch->capacity = capacity;
+  return(0);
+}
+
+static int __write_at (int fd, const uint8_t *buffer, uint32_t size, off_t offset) {
+  ssize_t wr;
+
+  while (size > 0) {
+    if ((wr = pwrite(fd, buffer, size, offset)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return(-1);
+    }
+    buffer += wr;
+    offset += wr;
+    size -= wr;
+  }
+  return(0);
+}
+
+/*
+ * Append the batch after the durable records. On failure the torn bytes
+ * are cut away and the batch goes again, the next one can't end up after
+ * a partial record. Once that can't be done the WAL stays failed.
+ */
+static int __write_batch (paxos_wal_t *self, const paxos_wal_batch_t *batch) {
+  int retries;
+  int status;
+
+  if (self->failed)
+    return(PAXOS_WAL_FAILED);
+
+  for (retries = 0; retries <= PAXOS_WAL_WRITE_RETRIES; ++retries) {
+    if (retries > 0)
+      usleep(retries * 10000);
+
+    if (__write_at(self->fd, batch->buffer, batch->size, self->offset))
+      status = PAXOS_WAL_WRITE_FAILED;
+    else if (fdatasync(self->fd) < 0)
+      status = PAXOS_WAL_SYNC_FAILED;
+    else {
+      self->offset += batch->size;
+      return(0);
+    }
+
+    if (ftruncate(self->fd, self->offset) < 0)
+      break;
+  }
+
+  self->failed = 1;
+  return(status);
+}
+
+/* The rename is durable once the directory is */
+static int __sync_parent (const char *path) {
+  char dir_path[256];
+  char *slash;
+  int status;
+  int fd;
+
+  if (snprintf(dir_path, sizeof(dir_path), "%s", path) >= (int)sizeof(dir_path))
+    return(-1);
+
+  if ((slash = strrchr(dir_path, '/')) == NULL)
+    strcpy(dir_path, ".");
+  else
+    slash[slash == dir_path] = '\0';
+
+  if ((fd = open(dir_path, O_RDONLY)) < 0)
+    return(-1);
+  status = fsync(fd);
+  close(fd);
+  return(status);
+}
+
+static int __compact_write (paxos_wal_t *self, const paxos_wal_batch_t *batch) {
+  char tmp_path[256];
+  int fd;
+
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", self->path) >= (int)sizeof(tmp_path))
+    return(-1);
+
+  if ((fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    return(-1);
+
+  if (__write_at(fd, batch->buffer, batch->size, 0) || fdatasync(fd) < 0) {
+    close(fd);
+    unlink(tmp_path);
+    return(-2);
+  }
+
+  if (rename(tmp_path, self->path) < 0) {
+    close(fd);
+    unlink(tmp_path);
+    return(-3);
+  }
+
+  /* The old log is gone, a record appended to the new one may be lost */
+  if (__sync_parent(self->path))
+    self->failed = 1;
+
+  close(self->fd);
+  self->fd = fd;
+  self->offset = batch->size;
+  if (self->compact_offset < 2 * self->offset)
+    self->compact_offset = 2 * self->offset;
+  return(0);
+}
+
+static void *__writer_thread (void *arg) {
+  paxos_wal_t *self = (paxos_wal_t *)arg;
+  paxos_wal_completion_t completion;
+  paxos_wal_batch_t *batch;
+
+  while (1) {
+    pthread_mutex_lock(&(self->lock));
+    while (!self->stop && self->submitted == NULL)
+      pthread_cond_wait(&(self->cond), &(self->lock));
+    batch = self->submitted;
+    pthread_mutex_unlock(&(self->lock));
+
+    if (batch == NULL)
+      break;
+
+    if (batch == &(self->compacted)) {
+      completion.batch = PAXOS_WAL_COMPACTION;
+      completion.num_records = 0;
+      completion.status = __compact_write(self, batch);
+    } else {
+      completion.batch = batch - self->batches;
+      completion.num_records = batch->num_records;
+      completion.status = __write_batch(self, batch);
+    }
+
+    pthread_mutex_lock(&(self->lock));
+    self->submitted = NULL;
+    pthread_mutex_unlock(&(self->lock));
+
+    /* Queue the completion, the event loop is waiting on the other end */
+    while (write(self->completion[1], &completion, sizeof(completion)) < 0 &&
+           errno == EINTR);
+  }
+  return(NULL);
+}
+
+void paxos_wal_init (paxos_wal_t *self) {
+  memset(self->batches, 0, sizeof(self->batches));
+  self->active = 0;
+  self->in_flight = 0;
+  self->failed = 0;
+  self->num_syncs = 0;
+  memset(&(self->compacted), 0, sizeof(paxos_wal_batch_t));
+  self->offset = 0;
+  self->compact_offset = PAXOS_WAL_COMPACT_SIZE;
+  self->path = NULL;
+  self->fd = -1;
+  self->submitted = NULL;
+  self->stop = 0;
+  self->completion[0] = -1;
+  self->completion[1] = -1;
+}
+
+int paxos_wal_open (paxos_wal_t *self,
+                    const char *path,
+                    paxos_wal_replay_t replay,
+                    void *arg)
+{
+  paxos_wal_init(self);
+
+  if ((self->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+    return(-1);
+
+  if (paxos_wal_replay(self, replay, arg) < 0) {
+    close(self->fd);
+    self->fd = -1;
+    return(-2);
+  }
+
+  if (pipe(self->completion) < 0 || (self->path = strdup(path)) == NULL) {
+    close(self->fd);
+    self->fd = -1;
+    return(-3);
+  }
+  fcntl(self->completion[0], F_SETFL, O_NONBLOCK);
+
+  pthread_mutex_init(&(self->lock), NULL);
+  pthread_cond_init(&(self->cond), NULL);
+  if (pthread_create(&(self->writer), NULL, __writer_thread, self)) {
+    pthread_mutex_destroy(&(self->lock));
+    pthread_cond_destroy(&(self->cond));
+    close(self->completion[0]);
+    close(self->completion[1]);
+    close(self->fd);
+    free(self->path);
+    paxos_wal_init(self);
+    return(-4);
+  }
+  return(0);
+}
+
+void paxos_wal_close (paxos_wal_t *self) {
+  paxos_wal_completion_t completion;
+
+  if (self->fd < 0)
+    return;
+
+  /* Wait for the batch in flight, then stop the writer */
+  while (self->in_flight && paxos_wal_complete(self, &completion, 1) >= 0);
+
+  pthread_mutex_lock(&(self->lock));
+  self->stop = 1;
+  pthread_cond_signal(&(self->cond));
+  pthread_mutex_unlock(&(self->lock));
+  pthread_join(self->writer, NULL);
+  pthread_mutex_destroy(&(self->lock));
+  pthread_cond_destroy(&(self->cond));
+
+  paxos_wal_sync(self);
+  close(self->completion[0]);
+  close(self->completion[1]);
+  close(self->fd);
+  free(self->batches[0].buffer);
+  free(self->batches[1].buffer);
+  free(self->compacted.buffer);
+  free(self->path);
+  paxos_wal_init(self);
+}
+
+/*
+ * Read back every valid record, the first short or corrupted record marks
+ * the end of the log: everything after it is cut away.
+ */
+int paxos_wal_replay (paxos_wal_t *self, paxos_wal_replay_t replay, void *arg) {
+  paxos_wal_record_t record;
+  uint8_t *value;
+  uint32_t vsize;
+  off_t offset;
+  ssize_t rd;
+
+  if (lseek(self->fd, 0, SEEK_SET) < 0)
+    return(-1);
+
+  if ((value = (uint8_t *) malloc(__align8(PAXOS_VALUE_MAX_SIZE))) == NULL)
+    return(-1);
+
+  offset = 0;
+  while ((rd = read(self->fd, &record, sizeof(paxos_wal_record_t))) ==
+                                              sizeof(paxos_wal_record_t))
+  {
+    if (record.value_size > PAXOS_VALUE_MAX_SIZE)
+      break;
+
+    vsize = __align8(record.value_size);
+    if (vsize > 0 && (rd = read(self->fd, value, vsize)) != vsize)
+      break;
+
+    if (record.checksum != __record_checksum(&record, value))
+      break;
+
+    if (replay != NULL)
+      replay(arg, &record, value);
+    offset += __record_size(record.value_size);
+  }
+  free(value);
+
+  if (rd < 0 || ftruncate(self->fd, offset) < 0)
+    return(-1);
+
+  self->offset = offset;
+  return(0);
+}
+
+static int __batch_append (paxos_wal_batch_t *batch,
+                           const paxos_wal_record_t *record,
+                           const void *value)
+{
+  paxos_wal_record_t *entry;
+  uint8_t *data;
+
+  if (__batch_reserve(batch, __record_size(record->value_size)))
+    return(-1);
+
+  entry = (paxos_wal_record_t *)(batch->buffer + batch->size);
+  data = (uint8_t *)(entry + 1);
+  memcpy(entry, record, sizeof(paxos_wal_record_t));
+  entry->__pad = 0;
+  if (record->value_size > 0)
+    memcpy(data, value, record->value_size);
+  memset(data + record->value_size, 0,
+         __align8(record->value_size) - record->value_size);
+  entry->checksum = __record_checksum(entry, data);
+
+  batch->size += __record_size(record->value_size);
+  batch->num_records++;
+  return(0);
+}
+
+int paxos_wal_append (paxos_wal_t *self,
+                      const paxos_wal_record_t *record,
+                      const void *value)
+{
+  paxos_wal_batch_t *batch = paxos_wal_active(self);
+
+  if (batch->num_records == PAXOS_WAL_MAX_BATCH)
+    return(-1);
+
+  if (__batch_append(batch, record, value))
+    return(-2);
+  return(0);
+}
+
+/*
+ * Hand the active batch to the writer thread.
+ * Returns 1 if there is already a batch in flight, the caller will submit
+ * again once its completion is in.
+ */
+int paxos_wal_submit (paxos_wal_t *self) {
+  paxos_wal_batch_t *batch = paxos_wal_active(self);
+
+  if (self->in_flight)
+    return(1);
+
+  if (batch->num_records == 0)
+    return(0);
+
+  pthread_mutex_lock(&(self->lock));
+  self->submitted = batch;
+  pthread_cond_signal(&(self->cond));
+  pthread_mutex_unlock(&(self->lock));
+
+  self->in_flight = 1;
+  self->active ^= 1;
+  return(0);
+}
+
+/*
+ * Pop a completion from the queue: returns 1 and fills completion if a batch
+ * is durable (or failed), 0 if there's nothing there yet.
+ */
+int paxos_wal_complete (paxos_wal_t *self,
+                        paxos_wal_completion_t *completion,
+                        int wait)
+{
+  struct pollfd pfd;
+  ssize_t rd;
+
+  if (!self->in_flight)
+    return(0);
+
+  if (wait) {
+    pfd.fd = self->completion[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, -1) < 0)
+      return(-1);
+  }
+
+  rd = read(self->completion[0], completion, sizeof(paxos_wal_completion_t));
+  if (rd != sizeof(paxos_wal_completion_t))
+    return((rd < 0 && errno == EAGAIN) ? 0 : -1);
+
+  self->in_flight = 0;
+  if (completion->batch == PAXOS_WAL_COMPACTION) {
+    paxos_wal_compact_abort(self);
+    return(1);
+  }
+
+  self->batches[completion->batch].num_records = 0;
+  self->batches[completion->batch].size = 0;
+  if (completion->status == 0)
+    self->num_syncs++;
+  return(1);
+}
+
+/* Synchronous flush of the active batch, only when nothing is in flight */
+int paxos_wal_sync (paxos_wal_t *self) {
+  paxos_wal_batch_t *batch = paxos_wal_active(self);
+  int status;
+
+  if (self->in_flight || batch->num_records == 0)
+    return(0);
+
+  if ((status = __write_batch(self, batch)) == 0) {
+    batch->num_records = 0;
+    batch->size = 0;
+    self->num_syncs++;
+  }
+  return(status);
+}
+
+/* A record for the next paxos_wal_compact() */
+int paxos_wal_compact_append (paxos_wal_t *self,
+                              const paxos_wal_record_t *record,
+                              const void *value)
+{
+  return(__batch_append(&(self->compacted), record, value));
+}
+
+/*
+ * Hand the records given to paxos_wal_compact_append() to the writer
+ * thread, the log is replaced by them: its completion has batch
+ * PAXOS_WAL_COMPACTION. Nothing may be in flight, the active batch goes
+ * after them. If the new log is not in place the old one is kept, it
+ * still has everything.
+ */
+int paxos_wal_compact (paxos_wal_t *self) {
+  if (self->in_flight || self->failed) {
+    paxos_wal_compact_abort(self);
+    return(-1);
+  }
+
+  pthread_mutex_lock(&(self->lock));
+  self->submitted = &(self->compacted);
+  pthread_cond_signal(&(self->cond));
+  pthread_mutex_unlock(&(self->lock));
+
+  self->in_flight = 1;
+  return(0);
+}
+
+/* Drop the records given so far, the log stays as it is */
+void paxos_wal_compact_abort (paxos_wal_t *self) {
+  self->compacted.num_records = 0;
+  self->compacted.size = 0;
+}
@@ -0,0 +1,151 @@
+/*
+ *   Copyright 2013 Matteo Bertozzi
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef _PAXOS_WAL_H_
+#define _PAXOS_WAL_H_
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "value.h"
+
+/*
+ * Write-ahead log of the acceptor state.
+ * Records are buffered by paxos_wal_append() and paxos_wal_submit() hands the
+ * batch to the writer thread, that makes it durable with one write() and one
+ * fdatasync(). While a batch is in flight the next one keeps filling up.
+ * Completions are queued on a pipe, so the event loop can wait on it together
+ * with the sockets, and are picked up by paxos_wal_complete().
+ *
+ * On disk a record is a fixed header followed by the accepted value, padded
+ * to 8 bytes. The checksum covers both.
+ *
+ * A batch goes at the end of the durable records. If the write or the sync
+ * fails, the file is cut back there and the batch written again; after
+ * PAXOS_WAL_WRITE_RETRIES the WAL is failed: that batch and every later one
+ * complete with an error, nothing after a torn record is ever durable.
+ *
+ * Compaction replaces the log with the records still needed (see
+ * paxos_wal_compact()): the writer thread writes them aside, syncs them and
+ * renames them over it. It is
+ * worth it once the log has doubled, and is past PAXOS_WAL_COMPACT_SIZE.
+ */
+#define PAXOS_WAL_MAX_BATCH         (64)
+#define PAXOS_WAL_WRITE_RETRIES     (3)
+#define PAXOS_WAL_COMPACT_SIZE      (4 << 20)
+
+/* completion.batch of a compaction */
+#define PAXOS_WAL_COMPACTION        (2)
+
+/* Completion status, besides 0 */
+#define PAXOS_WAL_WRITE_FAILED      (-1)
+#define PAXOS_WAL_SYNC_FAILED       (-2)
+#define PAXOS_WAL_FAILED            (-3)    /* Failed by an earlier batch */
+
+#define PAXOS_WAL_ACCEPTED          (1 << 0)
+#define PAXOS_WAL_PROMISE           (1 << 1)    /* Promise only, no instance */
+
+typedef struct paxos_wal_completion paxos_wal_completion_t;
+typedef struct paxos_wal_record paxos_wal_record_t;
+typedef struct paxos_wal_batch paxos_wal_batch_t;
+typedef struct paxos_wal paxos_wal_t;
+
+typedef void (*paxos_wal_replay_t) (void *arg,
+                                    const paxos_wal_record_t *record,
+                                    const uint8_t *value);
+
+struct paxos_wal_record {
+  uint64_t paxos_id;
+  uint64_t promised_proposal_id;
+  uint64_t accepted_proposal_id;
+  uint32_t value_size;
+  uint16_t flags;
+  uint16_t value_flags;
+  uint32_t checksum;
+  uint32_t __pad;
+};
+
+struct paxos_wal_batch {
+  uint8_t *buffer;                    /* Records, ready to be written */
+  uint32_t size;
+  uint32_t capacity;
+  uint32_t num_records;
+};
+
+struct paxos_wal_completion {
+  uint32_t batch;
+  uint32_t num_records;
+  int32_t  status;
+};
+
+struct paxos_wal {
+  paxos_wal_batch_t batches[2];
+  paxos_wal_batch_t compacted;        /* The records of the next compaction */
+  uint32_t active;                    /* Batch receiving the new records */
+  uint8_t  in_flight;                 /* The other batch, or a compaction */
+  volatile uint8_t failed;            /* Set by the writer, never cleared */
+  uint64_t num_syncs;
+  off_t offset;                       /* End of the durable records */
+  off_t compact_offset;               /* Compact once the log gets there */
+  char *path;
+  int fd;
+
+  /* Writer thread */
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  paxos_wal_batch_t *submitted;
+  uint8_t stop;
+
+  /* Completion queue */
+  int completion[2];
+};
+
+#define paxos_wal_is_open(self)         ((self)->fd >= 0)
+#define paxos_wal_has_failed(self)      ((self)->failed)
+#define paxos_wal_needs_compaction(self) ((self)->offset >= (self)->compact_offset)
+#define paxos_wal_active(self)          (&((self)->batches[(self)->active]))
+#define paxos_wal_pending(self)         (paxos_wal_active(self)->num_records)
+#define paxos_wal_is_full(self)         (paxos_wal_pending(self) == PAXOS_WAL_MAX_BATCH)
+#define paxos_wal_is_in_flight(self)    ((self)->in_flight)
+#define paxos_wal_completion_fd(self)   ((self)->completion[0])
+
+void  paxos_wal_init      (paxos_wal_t *self);
+int   paxos_wal_open      (paxos_wal_t *self,
+                           const char *path,
+                           paxos_wal_replay_t replay,
+                           void *arg);
+void  paxos_wal_close     (paxos_wal_t *self);
+int   paxos_wal_replay    (paxos_wal_t *self,
+                           paxos_wal_replay_t replay,
+                           void *arg);
+int   paxos_wal_append    (paxos_wal_t *self,
+                           const paxos_wal_record_t *record,
+                           const void *value);
+int   paxos_wal_submit    (paxos_wal_t *self);
+int   paxos_wal_complete  (paxos_wal_t *self,
+                           paxos_wal_completion_t *completion,
+                           int wait);
+int   paxos_wal_sync      (paxos_wal_t *self);
+
+int   paxos_wal_compact_append  (paxos_wal_t *self,
+                                 const paxos_wal_record_t *record,
+                                 const void *value);
+void  paxos_wal_compact_abort   (paxos_wal_t *self);
+int   paxos_wal_compact         (paxos_wal_t *self);
+
+#endif /* !_PAXOS_WAL_H_ */